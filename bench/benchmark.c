@@ -1,150 +1,864 @@
 /*
- * Simple benchmark client: connects to cachekit, runs SET/GET loops, reports ops/sec.
- * Usage: ./benchmark [host] [port] [n_requests] [payload_bytes]
- * Default: localhost 6380 10000 16
+ * Load generator: drives cachekit (or any server speaking RESP) from
+ * several threads with several connections each, keeping up to a
+ * pipeline's worth of requests in flight on every connection, and reports
+ * throughput over wall-clock time with latency percentiles per command.
+ *
+ * A request's latency runs from its write to the read of its reply, so
+ * with a pipeline it includes the wait behind the requests ahead of it,
+ * as a client would see it. Requests written during the warmup are sent
+ * but not counted.
+ *
+ * Keys follow one of the workload generators the simulator uses (-w), and
+ * sets can carry a TTL (-e). With -a, a GET that misses is followed by a
+ * SET of the key, as a cache-aside client fills its cache. -M and -E
+ * change the server's maxmemory and eviction policy before the run (with
+ * CONFIG SET, so they stay changed), and the server's keyspace hits and
+ * misses, evictions and expiries over the measured part of the run are
+ * read from INFO and reported with the throughput.
+ *
+ * Usage: ./benchmark [options]
+ *   -h host      server address (default 127.0.0.1)
+ *   -p port      server port (default 6380)
+ *   -t threads   client threads (default 1)
+ *   -c conns     connections per thread (default 4)
+ *   -P depth     requests in flight per connection (default 1)
+ *   -n count     requests to measure, over all connections (default 100000)
+ *   -d seconds   measure for this long instead of a request count
+ *   -W seconds   warmup before measuring (default 1)
+ *   -r mix       commands with relative weights, cmd[:weight],... from get,
+ *                set, del, exists, incr and ping (default set:1,get:1)
+ *   -k keys      keyspace size: key:0 .. key:<keys-1>, and counter:N for
+ *                incr (default 100000)
+ *   -w kind      key popularity: uniform (default), zipf, hotspot, latest
+ *                (sets add keys, the newest the most popular), loop or
+ *                scan (zipf with bursts of never-seen keys)
+ *   -z exp       zipf skew, for zipf, latest and scan (default 0.99)
+ *   -H frac:share  hotspot: share of the requests that go to the first
+ *                frac of the keys (default 0.2:0.8)
+ *   -e ttl       sets expire after ttl seconds, or uniformly in min-max
+ *   -a           cache-aside: SET the key after each GET that misses
+ *   -M bytes     CONFIG SET maxmemory first (kb/mb/gb suffixes)
+ *   -E policy    CONFIG SET eviction first
+ *   -v sizes     value sizes in bytes, size[-max][:weight],... e.g. 16,
+ *                16-4096 (uniform) or 100:9,4000:1 (default 16)
+ *   -o format    text (default), csv or json
+ *   -l label     names the run in csv and json output, to compare builds
+ *   -s seed      random seed (default 1)
  */
 #ifdef _WIN32
-#define WIN32_LEAN_AND_MEAN
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#pragma comment(lib, "ws2_32.lib")
-typedef SOCKET sock_t;
-#define close_sock(s) closesocket(s)
+#include <stdio.h>
+
+int main(void) {
+    fprintf(stderr, "benchmark needs poll() and pthreads and is not built for Windows\n");
+    return 1;
+}
+
 #else
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-#include <unistd.h>
-#endif
 
+#include "histogram.h"
+#include "protocol.h"
+#include "util.h"
+#include "workload.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
 
-static int connect_to(const char *host, int port) {
-#ifdef _WIN32
-    WSADATA wsa;
-    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return -1;
-#endif
-    int fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (fd < 0) return -1;
-#ifdef _WIN32
-    if (fd == (int)INVALID_SOCKET) return -1;
-#endif
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons((unsigned short)port);
-    if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0) {
-        close_sock(fd);
+#define READ_BUF 65536
+#define MAX_SPECS 32
+#define MAX_VALUE (16 * 1024 * 1024)
+#define POLL_MS 10   /* wakeups to notice the warmup or the run ending */
+
+typedef enum { OP_GET, OP_SET, OP_DEL, OP_EXISTS, OP_INCR, OP_PING, N_OPS } op_t;
+
+static const char *op_names[N_OPS] = { "get", "set", "del", "exists", "incr", "ping" };
+
+typedef struct {
+    uint64_t lo, hi;     /* value size, uniform in [lo, hi] */
+    uint64_t weight;
+} size_spec_t;
+
+typedef struct {
+    int fd;                /* -1: lost */
+    resp_buf_t in;         /* replies read but not yet complete */
+    resp_buf_t out;
+    size_t out_sent;
+    int64_t *sent_ns;      /* in flight, a ring of depth entries, oldest at head */
+    unsigned char *sent_op;
+    uint64_t *sent_key;
+    int head, len;
+    uint64_t quota;        /* measured requests still to send, without -d */
+} conn_t;
+
+typedef struct {
+    pthread_t thread;
+    conn_t *conns;
+    workload_t *keys;
+    hist_t *hist;          /* latency in ns, one per op */
+    uint64_t errors[N_OPS];
+    int64_t last_reply_ns;
+    int lost;              /* connections that failed mid-run */
+} worker_t;
+
+/* settings, read-only once the workers start */
+static const char *host = "127.0.0.1";
+static int port = 6380;
+static int n_threads = 1;
+static int conns_per_thread = 4;
+static int depth = 1;
+static uint64_t n_requests = 100000;
+static uint64_t n_keys = 100000;
+static uint64_t seed = 1;
+static double duration;
+static double warmup = 1;
+static const char *mix_spec = "set:1,get:1";
+static const char *size_spec = "16";
+static const char *ttl_spec;
+static const char *maxmemory_spec;
+static const char *policy_spec;
+static wl_kind_t key_kind = WL_UNIFORM;
+static double zipf_s = 0.99;
+static double hot_fraction = WL_HOT_FRACTION, hot_share = WL_HOT_SHARE;
+static uint64_t ttl_min, ttl_max;   /* 0: sets without a TTL */
+static int cache_aside;
+static uint64_t op_weight[N_OPS], op_total;
+static size_spec_t sizes[MAX_SPECS];
+static int n_sizes;
+static uint64_t size_total;
+static char *value_buf;
+static int64_t measure_ns;   /* requests written from here on are counted */
+static int64_t stop_ns;      /* with -d: no requests written from here on */
+static atomic_uint_fast64_t latest_id;  /* -w latest: the next key a set adds */
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* ---- options ---- */
+
+static int parse_uint(const char *s, uint64_t min, uint64_t max, uint64_t *out) {
+    int64_t v;
+    if (ck_str_to_int64(s, &v) != 0 || v < 0 || (uint64_t)v < min || (uint64_t)v > max) {
         return -1;
     }
-    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
-        close_sock(fd);
-        return -1;
+    *out = (uint64_t)v;
+    return 0;
+}
+
+static int parse_seconds(const char *s, double *out) {
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s || *end || v < 0 || v > 86400) return -1;
+    *out = v;
+    return 0;
+}
+
+/* splits "a[:w],b[:w]" in place; calls fn on each item and its weight */
+static int parse_weighted(char *list, int (*fn)(char *item, uint64_t weight)) {
+    for (char *item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+        uint64_t weight = 1;
+        char *colon = strchr(item, ':');
+        if (colon) {
+            *colon = '\0';
+            if (parse_uint(colon + 1, 0, 1000000, &weight) != 0) return -1;
+        }
+        if (fn(item, weight) != 0) return -1;
     }
+    return 0;
+}
+
+static int parse_range(const char *spec, uint64_t min, uint64_t max, uint64_t *lo,
+                       uint64_t *hi) {
+    char *copy = ck_strdup(spec);
+    char *dash = strchr(copy, '-');
+    if (dash) *dash = '\0';
+    int rc = parse_uint(copy, min, max, lo);
+    *hi = *lo;
+    if (rc == 0 && dash) rc = parse_uint(dash + 1, *lo, max, hi);
+    ck_free(copy);
+    return rc;
+}
+
+static int add_op(char *name, uint64_t weight) {
+    for (int i = 0; i < N_OPS; i++) {
+        if (strcmp(name, op_names[i]) == 0) {
+            op_weight[i] += weight;
+            op_total += weight;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int add_size(char *range, uint64_t weight) {
+    if (n_sizes == MAX_SPECS) return -1;
+    size_spec_t *s = &sizes[n_sizes];
+    if (parse_range(range, 1, MAX_VALUE, &s->lo, &s->hi) != 0) return -1;
+    s->weight = weight;
+    size_total += weight;
+    n_sizes++;
+    return 0;
+}
+
+static int parse_hotspot(const char *spec, double *fraction, double *share) {
+    char *end;
+    *fraction = strtod(spec, &end);
+    if (end == spec || *end != ':') return -1;
+    const char *rest = end + 1;
+    *share = strtod(rest, &end);
+    if (end == rest || *end) return -1;
+    return *fraction > 0 && *fraction <= 1 && *share >= 0 && *share <= 1 ? 0 : -1;
+}
+
+static int parse_list(const char *spec, int (*fn)(char *item, uint64_t weight)) {
+    char *copy = ck_strdup(spec);
+    int rc = parse_weighted(copy, fn);
+    ck_free(copy);
+    return rc;
+}
+
+/* ---- requests ---- */
+
+static op_t pick_op(workload_t *w) {
+    uint64_t r = workload_rand(w, op_total);
+    int op = 0;
+    while (r >= op_weight[op]) r -= op_weight[op++];
+    return (op_t)op;
+}
+
+static size_t pick_size(workload_t *w) {
+    uint64_t r = workload_rand(w, size_total);
+    const size_spec_t *s = sizes;
+    while (r >= s->weight) r -= (s++)->weight;
+    return (size_t)(s->lo + (s->hi > s->lo ? workload_rand(w, s->hi - s->lo + 1) : 0));
+}
+
+/* with -w latest, sets add keys and the other commands favour the newest,
+ * over every thread */
+static uint64_t pick_key(workload_t *w, op_t op) {
+    if (w->kind != WL_LATEST) return workload_next(w);
+    if (op == OP_SET) return atomic_fetch_add_explicit(&latest_id, 1, memory_order_relaxed);
+    w->next_new = atomic_load_explicit(&latest_id, memory_order_relaxed);
+    return workload_next(w);
+}
+
+static void write_request(workload_t *w, resp_buf_t *out, op_t op, uint64_t id) {
+    static const char *verbs[N_OPS] = { "GET", "SET", "DEL", "EXISTS", "INCR", "PING" };
+    char key[48], ttl[24];
+    int klen = snprintf(key, sizeof(key), "%s:%llu", op == OP_INCR ? "counter" : "key",
+                        (unsigned long long)id);
+    switch (op) {
+        case OP_SET:
+            resp_write_array_header(out, ttl_max ? 5 : 3);
+            resp_write_bulk_string(out, "SET", 3);
+            resp_write_bulk_string(out, key, (size_t)klen);
+            resp_write_bulk_string(out, value_buf, pick_size(w));
+            if (ttl_max) {
+                uint64_t t = ttl_min + (ttl_max > ttl_min ? workload_rand(w, ttl_max - ttl_min + 1) : 0);
+                int tlen = snprintf(ttl, sizeof(ttl), "%llu", (unsigned long long)t);
+                resp_write_bulk_string(out, "EX", 2);
+                resp_write_bulk_string(out, ttl, (size_t)tlen);
+            }
+            break;
+        case OP_PING:
+            resp_write_array_header(out, 1);
+            resp_write_bulk_string(out, "PING", 4);
+            break;
+        default:
+            resp_write_array_header(out, 2);
+            resp_write_bulk_string(out, verbs[op], strlen(verbs[op]));
+            resp_write_bulk_string(out, key, (size_t)klen);
+            break;
+    }
+}
+
+/* ---- connections ---- */
+
+static int connect_to(int nonblock) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char portstr[16];
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    if (getaddrinfo(host, portstr, &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (nonblock) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
     return fd;
 }
 
-static int send_all(int fd, const char *buf, size_t len) {
-    size_t sent = 0;
-    while (sent < len) {
-#ifdef _WIN32
-        int n = send((SOCKET)fd, buf + sent, (int)(len - sent), 0);
-#else
-        ssize_t n = send(fd, buf + sent, len - sent, 0);
-#endif
+static void conn_lost(worker_t *w, conn_t *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->len = 0;
+    w->lost++;
+}
+
+static int conn_may_send(const conn_t *c, int64_t now) {
+    if (now < measure_ns) return 1;
+    return duration > 0 ? now < stop_ns : c->quota > 0;
+}
+
+static void conn_push(worker_t *w, conn_t *c, op_t op, uint64_t id, int64_t now) {
+    int slot = (c->head + c->len) % depth;
+    write_request(w->keys, &c->out, op, id);
+    c->sent_op[slot] = (unsigned char)op;
+    c->sent_key[slot] = id;
+    c->sent_ns[slot] = now;
+    c->len++;
+}
+
+/* top the pipeline up to depth and write what the socket takes */
+static void conn_fill(worker_t *w, conn_t *c, int64_t now) {
+    while (c->len < depth && conn_may_send(c, now)) {
+        op_t op = pick_op(w->keys);
+        conn_push(w, c, op, pick_key(w->keys, op), now);
+        if (now >= measure_ns && duration <= 0) c->quota--;
+    }
+    if (c->out_sent >= c->out.len) return;
+    ssize_t n = send(c->fd, c->out.buf + c->out_sent, c->out.len - c->out_sent, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        conn_lost(w, c);
+        return;
+    }
+    c->out_sent += (size_t)n;
+    if (c->out_sent == c->out.len) c->out.len = c->out_sent = 0;
+}
+
+/* length of the whole reply at buf, 0 if it hasn't all arrived, -1 if it
+ * isn't RESP. the replies are only counted and timed, never decoded, and
+ * the worker threads don't share an allocator counter by parsing them */
+static long reply_len(const char *buf, size_t len, int *is_error) {
+    const char *cr = len ? memchr(buf, '\r', len) : NULL;
+    if (!cr || (size_t)(cr - buf) + 2 > len) return 0;
+    long line = (long)(cr - buf) + 2;
+    long n = buf[0] == '$' || buf[0] == '*' ? strtol(buf + 1, NULL, 10) : 0;
+    switch (buf[0]) {
+        case '-':
+            *is_error = 1;
+            return line;
+        case '+':
+        case ':':
+            return line;
+        case '$':
+            if (n < 0) return line;
+            return (size_t)line + (size_t)n + 2 <= len ? line + n + 2 : 0;
+        case '*': {
+            long pos = line;
+            int nested_error = 0;
+            for (long i = 0; i < n; i++) {
+                long r = reply_len(buf + pos, len - (size_t)pos, &nested_error);
+                if (r <= 0) return r;
+                pos += r;
+            }
+            return pos;
+        }
+        default:
+            return -1;
+    }
+}
+
+static void conn_read(worker_t *w, conn_t *c) {
+    char buf[READ_BUF];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    if (n <= 0) {
+        conn_lost(w, c);
+        return;
+    }
+    int64_t now = now_ns();
+    resp_buf_append(&c->in, buf, (size_t)n);
+    size_t pos = 0;
+    for (;;) {
+        int is_error = 0;
+        long r = reply_len(c->in.buf + pos, c->in.len - pos, &is_error);
+        if (r == 0) break;
+        if (r < 0 || c->len == 0) {
+            conn_lost(w, c);  /* garbage, or a reply nobody asked for */
+            return;
+        }
+        int nil = c->in.buf[pos] == '$' && c->in.buf[pos + 1] == '-';
+        pos += (size_t)r;
+        int op = c->sent_op[c->head];
+        uint64_t id = c->sent_key[c->head];
+        int64_t sent = c->sent_ns[c->head];
+        c->head = (c->head + 1) % depth;
+        c->len--;
+        if (sent >= measure_ns) {
+            hist_record(&w->hist[op], (uint64_t)(now - sent));
+            if (is_error) w->errors[op]++;
+            w->last_reply_ns = now;
+        }
+        /* cache-aside: a miss is filled from the "database", in the slot
+         * its GET just freed */
+        if (cache_aside && op == OP_GET && nil && (duration <= 0 || now < stop_ns)) {
+            conn_push(w, c, OP_SET, id, now);
+        }
+    }
+    memmove(c->in.buf, c->in.buf + pos, c->in.len - pos);
+    c->in.len -= pos;
+}
+
+static int conn_done(const conn_t *c, int64_t now) {
+    return c->fd < 0 || (c->len == 0 && !conn_may_send(c, now));
+}
+
+static void *worker_main(void *arg) {
+    worker_t *w = arg;
+    struct pollfd *pfds = ck_malloc(sizeof(struct pollfd) * (size_t)conns_per_thread);
+    int *owner = ck_malloc(sizeof(int) * (size_t)conns_per_thread);
+    for (;;) {
+        int64_t now = now_ns();
+        int n = 0;
+        for (int i = 0; i < conns_per_thread; i++) {
+            conn_t *c = &w->conns[i];
+            if (conn_done(c, now)) continue;
+            conn_fill(w, c, now);
+            if (c->fd < 0) continue;
+            pfds[n].fd = c->fd;
+            pfds[n].events = (short)(POLLIN | (c->out_sent < c->out.len ? POLLOUT : 0));
+            owner[n++] = i;
+        }
+        if (n == 0) break;
+        if (poll(pfds, (nfds_t)n, POLL_MS) < 0 && errno != EINTR) break;
+        for (int i = 0; i < n; i++) {
+            conn_t *c = &w->conns[owner[i]];
+            if (pfds[i].revents & (POLLIN | POLLERR | POLLHUP)) conn_read(w, c);
+        }
+    }
+    ck_free(owner);
+    ck_free(pfds);
+    return NULL;
+}
+
+/* ---- the server's side ---- */
+
+typedef struct {
+    int found;           /* the server reported keyspace_hits at all */
+    uint64_t hits, misses, evicted, expired;
+    uint64_t used_memory, maxmemory;
+} server_stats_t;
+
+/* one command on the blocking control connection; the reply, NUL
+ * terminated, is left in b. returns -1 if the connection failed */
+static int control(int fd, resp_buf_t *b, int argc, const char **argv) {
+    b->len = 0;
+    resp_write_array_header(b, argc);
+    for (int i = 0; i < argc; i++) resp_write_bulk_string(b, argv[i], strlen(argv[i]));
+    for (size_t sent = 0; sent < b->len;) {
+        ssize_t n = send(fd, b->buf + sent, b->len - sent, 0);
         if (n <= 0) return -1;
         sent += (size_t)n;
     }
+    b->len = 0;
+    int is_error = 0;
+    long r;
+    while ((r = reply_len(b->buf, b->len, &is_error)) == 0) {
+        char buf[READ_BUF];
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) return -1;
+        resp_buf_append(b, buf, (size_t)n);
+    }
+    if (r < 0) return -1;
+    b->len = (size_t)r;
+    resp_buf_append(b, "", 1);
     return 0;
 }
 
-/* Read until we see \r\n (simple string response) or skip bulk $N\r\n...\r\n */
-static int skip_response(int fd) {
-    char buf[4096];
-    int state = 0;
-    size_t bulk_remain = 0;
-    while (1) {
-#ifdef _WIN32
-        int n = recv((SOCKET)fd, buf, sizeof(buf), 0);
-#else
-        ssize_t n = recv(fd, buf, sizeof(buf), 0);
-#endif
-        if (n <= 0) return -1;
-        for (int i = 0; i < n; i++) {
-            char c = buf[i];
-            if (state == 0) {
-                if (c == '+') state = 1;
-                else if (c == '$') state = 2;
-                else if (c == '-') state = 1;
-                else if (c == ':') state = 1;
-            } else if (state == 1) {
-                if (c == '\r') state = 3;
-            } else if (state == 2) {
-                if (c >= '0' && c <= '9') bulk_remain = bulk_remain * 10 + (size_t)(c - '0');
-                else if (c == '\r') { bulk_remain += 2; state = 4; }
-            } else if (state == 3) {
-                if (c == '\n') return 0;
-                state = 1;
-            } else if (state == 4) {
-                if (bulk_remain > 0) bulk_remain--;
-                else if (c == '\r') state = 3;
-            }
+static int config_set(int fd, resp_buf_t *b, const char *name, const char *value) {
+    const char *argv[] = { "CONFIG", "SET", name, value };
+    if (control(fd, b, 4, argv) != 0) {
+        fprintf(stderr, "connection lost setting %s\n", name);
+        return -1;
+    }
+    if (b->buf[0] != '+') {
+        fprintf(stderr, "CONFIG SET %s %s: %s", name, value, b->buf + 1);
+        return -1;
+    }
+    return 0;
+}
+
+static uint64_t info_field(const char *info, const char *name, int *found) {
+    size_t len = strlen(name);
+    for (const char *p = strstr(info, name); p; p = strstr(p + 1, name)) {
+        if (p[-1] == '\n' && p[len] == ':') {
+            *found = 1;
+            return strtoull(p + len + 1, NULL, 10);
+        }
+    }
+    return 0;
+}
+
+static void read_stats(int fd, resp_buf_t *b, server_stats_t *st) {
+    const char *argv[] = { "INFO" };
+    memset(st, 0, sizeof(*st));
+    if (control(fd, b, 1, argv) != 0 || b->buf[0] != '$') return;
+    int unused = 0;
+    st->hits = info_field(b->buf, "keyspace_hits", &st->found);
+    st->misses = info_field(b->buf, "keyspace_misses", &unused);
+    st->evicted = info_field(b->buf, "evicted_keys", &unused);
+    st->expired = info_field(b->buf, "expired_keys", &unused);
+    st->used_memory = info_field(b->buf, "used_memory", &unused);
+    st->maxmemory = info_field(b->buf, "maxmemory", &unused);
+}
+
+/* ---- report ---- */
+
+typedef struct {
+    const char *name;
+    const hist_t *hist;
+    uint64_t errors;
+} row_t;
+
+static void json_string(const char *s) {
+    putchar('"');
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') putchar('\\');
+        if ((unsigned char)*s >= 0x20) putchar(*s);
+    }
+    putchar('"');
+}
+
+static double us(uint64_t ns) {
+    return (double)ns / 1000.0;
+}
+
+static void describe_workload(char *buf, size_t len) {
+    const char *kind = workload_kind_name(key_kind);
+    if (key_kind == WL_ZIPF || key_kind == WL_LATEST || key_kind == WL_SCAN) {
+        snprintf(buf, len, "%s s=%.2f", kind, zipf_s);
+    } else if (key_kind == WL_HOTSPOT) {
+        snprintf(buf, len, "%s %.0f%%:%.0f%%", kind, hot_fraction * 100, hot_share * 100);
+    } else {
+        snprintf(buf, len, "%s", kind);
+    }
+}
+
+static double hit_ratio(const server_stats_t *st) {
+    uint64_t lookups = st->hits + st->misses;
+    return lookups ? (double)st->hits / (double)lookups : 0.0;
+}
+
+static void report(const char *format, const char *label, const row_t *rows, int n_rows,
+                   double seconds, int lost, const server_stats_t *st) {
+    int conns = n_threads * conns_per_thread;
+    const row_t *all = &rows[n_rows - 1];
+    char workload[64];
+    describe_workload(workload, sizeof(workload));
+    if (strcmp(format, "csv") == 0) {
+        printf("label,command,threads,connections,pipeline,workload,requests,errors,seconds,"
+               "ops_per_sec,mean_us,p50_us,p99_us,p999_us,max_us,"
+               "hits,misses,hit_ratio,evicted,expired\n");
+        for (int i = 0; i < n_rows; i++) {
+            const hist_t *h = rows[i].hist;
+            printf("%s,%s,%d,%d,%d,%s,%llu,%llu,%.3f,%.0f,%.3f,%.3f,%.3f,%.3f,%.3f,"
+                   "%llu,%llu,%.4f,%llu,%llu\n",
+                   label, rows[i].name, n_threads, conns, depth, workload,
+                   (unsigned long long)h->total, (unsigned long long)rows[i].errors, seconds,
+                   (double)h->total / seconds, hist_mean(h) / 1000.0,
+                   us(hist_percentile(h, 50)), us(hist_percentile(h, 99)),
+                   us(hist_percentile(h, 99.9)), us(h->total ? h->max : 0),
+                   (unsigned long long)st->hits, (unsigned long long)st->misses,
+                   hit_ratio(st), (unsigned long long)st->evicted,
+                   (unsigned long long)st->expired);
+        }
+        return;
+    }
+    if (strcmp(format, "json") == 0) {
+        printf("{\"label\": ");
+        json_string(label);
+        printf(", \"host\": ");
+        json_string(host);
+        printf(", \"port\": %d, \"threads\": %d, \"connections\": %d, \"pipeline\": %d, "
+               "\"mix\": ", port, n_threads, conns, depth);
+        json_string(mix_spec);
+        printf(", \"keys\": %llu, \"workload\": ", (unsigned long long)n_keys);
+        json_string(workload);
+        printf(", \"values\": ");
+        json_string(size_spec);
+        printf(", \"ttl\": ");
+        if (ttl_spec) json_string(ttl_spec);
+        else printf("null");
+        printf(", \"cache_aside\": %s", cache_aside ? "true" : "false");
+        printf(", \"seconds\": %.3f, \"lost_connections\": %d, \"commands\": {", seconds, lost);
+        for (int i = 0; i < n_rows; i++) {
+            const hist_t *h = rows[i].hist;
+            printf("%s\"%s\": {\"requests\": %llu, \"errors\": %llu, \"ops_per_sec\": %.0f, "
+                   "\"latency_us\": {\"mean\": %.3f, \"p50\": %.3f, \"p99\": %.3f, "
+                   "\"p99.9\": %.3f, \"max\": %.3f}}",
+                   i ? ", " : "", rows[i].name, (unsigned long long)h->total,
+                   (unsigned long long)rows[i].errors, (double)h->total / seconds,
+                   hist_mean(h) / 1000.0, us(hist_percentile(h, 50)),
+                   us(hist_percentile(h, 99)), us(hist_percentile(h, 99.9)),
+                   us(h->total ? h->max : 0));
         }
+        printf("}, \"server\": {\"keyspace_hits\": %llu, \"keyspace_misses\": %llu, "
+               "\"hit_ratio\": %.4f, \"evicted_keys\": %llu, \"expired_keys\": %llu, "
+               "\"used_memory\": %llu, \"maxmemory\": %llu}}\n",
+               (unsigned long long)st->hits, (unsigned long long)st->misses, hit_ratio(st),
+               (unsigned long long)st->evicted, (unsigned long long)st->expired,
+               (unsigned long long)st->used_memory, (unsigned long long)st->maxmemory);
+        return;
+    }
+
+    printf("%s:%d, %d threads x %d connections, pipeline %d\n", host, port, n_threads,
+           conns_per_thread, depth);
+    printf("mix %s, %llu keys %s, values %s bytes", mix_spec, (unsigned long long)n_keys,
+           workload, size_spec);
+    if (ttl_spec) printf(", ttl %s s", ttl_spec);
+    if (cache_aside) printf(", cache-aside");
+    printf(", %.1f s warmup\n", warmup);
+    printf("%llu requests in %.3f s: %.0f ops/sec, %llu errors\n",
+           (unsigned long long)all->hist->total, seconds, (double)all->hist->total / seconds,
+           (unsigned long long)all->errors);
+    if (st->found) {
+        printf("server: %llu hits, %llu misses (%.1f%% hit ratio), %llu evicted, "
+               "%llu expired, used_memory %llu",
+               (unsigned long long)st->hits, (unsigned long long)st->misses,
+               hit_ratio(st) * 100, (unsigned long long)st->evicted,
+               (unsigned long long)st->expired, (unsigned long long)st->used_memory);
+        if (st->maxmemory) printf(" of %llu", (unsigned long long)st->maxmemory);
+        printf("\n");
     }
+    if (lost) printf("%d connections lost\n", lost);
+    printf("\n%-8s %10s %10s %9s %9s %9s %9s %9s\n", "command", "requests", "ops/sec",
+           "mean us", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int i = 0; i < n_rows; i++) {
+        const hist_t *h = rows[i].hist;
+        printf("%-8s %10llu %10.0f %9.1f %9.1f %9.1f %9.1f %9.1f\n", rows[i].name,
+               (unsigned long long)h->total, (double)h->total / seconds,
+               hist_mean(h) / 1000.0, us(hist_percentile(h, 50)), us(hist_percentile(h, 99)),
+               us(hist_percentile(h, 99.9)), us(h->total ? h->max : 0));
+    }
+}
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: benchmark [-h host] [-p port] [-t threads] [-c conns] [-P depth]\n"
+        "                 [-n requests | -d seconds] [-W warmup_seconds]\n"
+        "                 [-r cmd[:weight],...] [-k keys] [-v size[-max][:weight],...]\n"
+        "                 [-w uniform|zipf|hotspot|latest|loop|scan] [-z zipf_exp]\n"
+        "                 [-H frac:share] [-e ttl[-max]] [-a] [-M maxmemory] [-E policy]\n"
+        "                 [-o text|csv|json] [-l label] [-s seed]\n");
 }
 
 int main(int argc, char **argv) {
-    const char *host = argc > 1 ? argv[1] : "127.0.0.1";
-    int port = argc > 2 ? atoi(argv[2]) : 6380;
-    int n = argc > 3 ? atoi(argv[3]) : 10000;
-    int payload = argc > 4 ? atoi(argv[4]) : 16;
-    if (n <= 0 || payload <= 0 || payload > 1024) {
-        fprintf(stderr, "usage: benchmark [host] [port] [n_requests] [payload_bytes]\n");
+    const char *format = "text";
+    const char *label = "";
+    for (int i = 1; i < argc; i += 2) {
+        const char *opt = argv[i];
+        const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+        uint64_t v = 0;
+        if (strcmp(opt, "-a") == 0) {
+            cache_aside = 1;
+            i--;
+            continue;
+        }
+        int bad = !arg || opt[0] != '-' || opt[1] == '\0' || opt[2] != '\0';
+        if (!bad) {
+            switch (opt[1]) {
+                case 'h': host = arg; break;
+                case 'p': bad = parse_uint(arg, 1, 65535, &v); port = (int)v; break;
+                case 't': bad = parse_uint(arg, 1, 256, &v); n_threads = (int)v; break;
+                case 'c': bad = parse_uint(arg, 1, 10000, &v); conns_per_thread = (int)v; break;
+                case 'P': bad = parse_uint(arg, 1, 100000, &v); depth = (int)v; break;
+                case 'n': bad = parse_uint(arg, 1, UINT64_MAX >> 1, &n_requests); break;
+                case 'd': bad = parse_seconds(arg, &duration) || duration <= 0; break;
+                case 'W': bad = parse_seconds(arg, &warmup); break;
+                case 'r': mix_spec = arg; break;
+                case 'k': bad = parse_uint(arg, 1, UINT64_MAX >> 1, &n_keys); break;
+                case 'v': size_spec = arg; break;
+                case 'w': bad = workload_parse_kind(arg, &key_kind); break;
+                case 'z': zipf_s = strtod(arg, NULL); bad = zipf_s <= 0; break;
+                case 'H': bad = parse_hotspot(arg, &hot_fraction, &hot_share); break;
+                case 'e':
+                    ttl_spec = arg;
+                    bad = parse_range(arg, 1, 100000000, &ttl_min, &ttl_max);
+                    break;
+                case 'M': maxmemory_spec = arg; break;
+                case 'E': policy_spec = arg; break;
+                case 'o': format = arg; break;
+                case 'l': label = arg; break;
+                case 's': bad = parse_uint(arg, 0, UINT64_MAX >> 1, &seed); break;
+                default: bad = 1; break;
+            }
+        }
+        if (bad) {
+            usage();
+            return 1;
+        }
+    }
+    if (parse_list(mix_spec, add_op) != 0 || op_total == 0) {
+        fprintf(stderr, "invalid command mix '%s'\n", mix_spec);
         return 1;
     }
+    if (parse_list(size_spec, add_size) != 0 || size_total == 0) {
+        fprintf(stderr, "invalid value sizes '%s'\n", size_spec);
+        return 1;
+    }
+    if (strcmp(format, "text") != 0 && strcmp(format, "csv") != 0 &&
+        strcmp(format, "json") != 0) {
+        usage();
+        return 1;
+    }
+
+    uint64_t max_size = 0;
+    for (int i = 0; i < n_sizes; i++) {
+        if (sizes[i].hi > max_size) max_size = sizes[i].hi;
+    }
+    value_buf = ck_malloc((size_t)max_size);
+    memset(value_buf, 'x', (size_t)max_size);
 
-    int fd = connect_to(host, port);
-    if (fd < 0) {
-        fprintf(stderr, "connect failed\n");
+    signal(SIGPIPE, SIG_IGN);
+    int ctl = connect_to(0);
+    if (ctl < 0) {
+        fprintf(stderr, "can't connect to %s:%d\n", host, port);
+        return 1;
+    }
+    resp_buf_t reply;
+    resp_buf_init(&reply);
+    if ((maxmemory_spec && config_set(ctl, &reply, "maxmemory", maxmemory_spec) != 0) ||
+        (policy_spec && config_set(ctl, &reply, "eviction", policy_spec) != 0)) {
         return 1;
     }
+    atomic_store(&latest_id, n_keys);
 
-    char *val = malloc((size_t)payload + 1);
-    if (!val) { close_sock(fd); return 1; }
-    for (int i = 0; i < payload; i++) val[i] = 'x';
-    val[payload] = '\0';
-
-    size_t set_req_len = (size_t)(32 + payload * 2);
-    char *set_req = malloc(set_req_len);
-    if (!set_req) { free(val); close_sock(fd); return 1; }
-    int set_len = snprintf(set_req, set_req_len, "*3\r\n$3\r\nSET\r\n$4\r\nkey0\r\n$%d\r\n%s\r\n", payload, val);
-    if (set_len <= 0 || (size_t)set_len >= set_req_len) { free(set_req); free(val); close_sock(fd); return 1; }
-
-    const char *get_req = "*2\r\n$3\r\nGET\r\n$4\r\nkey0\r\n";
-
-    clock_t start = clock();
-    for (int i = 0; i < n; i++) {
-        if (send_all(fd, set_req, (size_t)set_len) != 0) break;
-        if (skip_response(fd) != 0) break;
-        if (send_all(fd, get_req, strlen(get_req)) != 0) break;
-        if (skip_response(fd) != 0) break;
-    }
-    clock_t end = clock();
-    double elapsed = (double)(end - start) / CLOCKS_PER_SEC;
-    unsigned long ops = (unsigned long)(n * 2);
-    printf("requests: %lu (SET+GET pairs: %d)\n", ops, n);
-    printf("payload: %d bytes\n", payload);
-    printf("elapsed: %.3f s\n", elapsed);
-    printf("ops/sec: %.0f\n", elapsed > 0 ? (double)ops / elapsed : 0);
-
-    free(set_req);
-    free(val);
-    close_sock(fd);
-#ifdef _WIN32
-    WSACleanup();
-#endif
-    return 0;
+    int total_conns = n_threads * conns_per_thread;
+    worker_t *workers = ck_calloc((size_t)n_threads, sizeof(worker_t));
+    for (int t = 0; t < n_threads; t++) {
+        worker_t *w = &workers[t];
+        w->conns = ck_calloc((size_t)conns_per_thread, sizeof(conn_t));
+        w->keys = workload_create(key_kind, n_keys, zipf_s,
+                                  seed * 0x9E3779B97F4A7C15ULL + (uint64_t)t + 1);
+        if (!w->keys) {
+            fprintf(stderr, "out of memory for %llu keys\n", (unsigned long long)n_keys);
+            return 1;
+        }
+        w->keys->hot_fraction = hot_fraction;
+        w->keys->hot_share = hot_share;
+        w->keys->insert_share = 0;  /* sets add the keys, see pick_key() */
+        w->keys->next_new += (uint64_t)t << 40;  /* scans of different threads don't meet */
+        w->hist = ck_malloc(sizeof(hist_t) * N_OPS);
+        for (int op = 0; op < N_OPS; op++) hist_init(&w->hist[op]);
+        for (int i = 0; i < conns_per_thread; i++) {
+            conn_t *c = &w->conns[i];
+            int k = t * conns_per_thread + i;
+            c->fd = connect_to(1);
+            if (c->fd < 0) {
+                fprintf(stderr, "can't connect to %s:%d (connection %d of %d)\n", host, port,
+                        k + 1, total_conns);
+                return 1;
+            }
+            resp_buf_init(&c->in);
+            resp_buf_init(&c->out);
+            c->sent_ns = ck_malloc(sizeof(int64_t) * (size_t)depth);
+            c->sent_op = ck_malloc((size_t)depth);
+            c->sent_key = ck_malloc(sizeof(uint64_t) * (size_t)depth);
+            c->quota = n_requests / (uint64_t)total_conns +
+                       ((uint64_t)k < n_requests % (uint64_t)total_conns);
+        }
+    }
+
+    measure_ns = now_ns() + (int64_t)(warmup * 1e9);
+    stop_ns = measure_ns + (int64_t)(duration * 1e9);
+    for (int t = 0; t < n_threads; t++) {
+        if (pthread_create(&workers[t].thread, NULL, worker_main, &workers[t]) != 0) {
+            fprintf(stderr, "can't start thread %d\n", t);
+            return 1;
+        }
+    }
+
+    /* the server's counters over the measured part of the run */
+    server_stats_t before, after;
+    int64_t wait = measure_ns - now_ns();
+    if (wait > 0) {
+        struct timespec ts = { (time_t)(wait / 1000000000), (long)(wait % 1000000000) };
+        nanosleep(&ts, NULL);
+    }
+    read_stats(ctl, &reply, &before);
+
+    hist_t *totals = ck_malloc(sizeof(hist_t) * (N_OPS + 1));
+    uint64_t errors[N_OPS + 1] = { 0 };
+    for (int op = 0; op <= N_OPS; op++) hist_init(&totals[op]);
+    int64_t end = measure_ns;
+    int lost = 0;
+    for (int t = 0; t < n_threads; t++) {
+        worker_t *w = &workers[t];
+        pthread_join(w->thread, NULL);
+        for (int op = 0; op < N_OPS; op++) {
+            hist_merge(&totals[op], &w->hist[op]);
+            hist_merge(&totals[N_OPS], &w->hist[op]);
+            errors[op] += w->errors[op];
+            errors[N_OPS] += w->errors[op];
+        }
+        if (w->last_reply_ns > end) end = w->last_reply_ns;
+        lost += w->lost;
+    }
+    double seconds = (double)(end - measure_ns) / 1e9;
+    if (seconds <= 0) seconds = 1e-9;
+    read_stats(ctl, &reply, &after);
+    if (!before.found) memset(&after, 0, sizeof(after));
+    after.hits -= before.hits;
+    after.misses -= before.misses;
+    after.evicted -= before.evicted;
+    after.expired -= before.expired;
+    close(ctl);
+    resp_buf_destroy(&reply);
+
+    /* the commands run (the mix, and sets filling misses with -a), then all
+     * of them together */
+    row_t rows[N_OPS + 1];
+    int n_rows = 0;
+    for (int op = 0; op < N_OPS; op++) {
+        if (op_weight[op] == 0 && totals[op].total == 0) continue;
+        rows[n_rows++] = (row_t){ op_names[op], &totals[op], errors[op] };
+    }
+    rows[n_rows++] = (row_t){ "all", &totals[N_OPS], errors[N_OPS] };
+    report(format, label, rows, n_rows, seconds, lost, &after);
+    if (lost) fprintf(stderr, "%d connections lost during the run\n", lost);
+
+    for (int t = 0; t < n_threads; t++) {
+        worker_t *w = &workers[t];
+        for (int i = 0; i < conns_per_thread; i++) {
+            conn_t *c = &w->conns[i];
+            if (c->fd >= 0) close(c->fd);
+            resp_buf_destroy(&c->in);
+            resp_buf_destroy(&c->out);
+            ck_free(c->sent_ns);
+            ck_free(c->sent_op);
+            ck_free(c->sent_key);
+        }
+        ck_free(w->conns);
+        ck_free(w->hist);
+        workload_destroy(w->keys);
+    }
+    ck_free(workers);
+    ck_free(totals);
+    ck_free(value_buf);
+    return lost ? 1 : 0;
 }
+
+#endif
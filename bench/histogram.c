@@ -0,0 +1,68 @@
+#include "histogram.h"
+#include <string.h>
+
+static int msb(uint64_t v) {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(v);
+#else
+    int n = 0;
+    while (v >>= 1) n++;
+    return n;
+#endif
+}
+
+/* bucket of a value: exact below 2 * HIST_SUB, then HIST_SUB buckets
+ * per power of two, each 2^shift wide */
+static int bucket_of(uint64_t v) {
+    if (v < 2 * HIST_SUB) return (int)v;
+    int shift = msb(v) - HIST_SUB_BITS;
+    return shift * HIST_SUB + (int)(v >> shift);
+}
+
+static uint64_t bucket_high(int i) {
+    if (i < 2 * HIST_SUB) return (uint64_t)i;
+    int shift = i / HIST_SUB - 1;
+    uint64_t top = (uint64_t)(i - shift * HIST_SUB);
+    return ((top + 1) << shift) - 1;
+}
+
+void hist_init(hist_t *h) {
+    memset(h, 0, sizeof(*h));
+    h->min = UINT64_MAX;
+}
+
+void hist_record(hist_t *h, uint64_t value) {
+    h->counts[bucket_of(value)]++;
+    h->total++;
+    h->sum += (double)value;
+    if (value < h->min) h->min = value;
+    if (value > h->max) h->max = value;
+}
+
+void hist_merge(hist_t *dst, const hist_t *src) {
+    for (int i = 0; i < HIST_BUCKETS; i++) dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->sum += src->sum;
+    if (src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t hist_percentile(const hist_t *h, double p) {
+    if (h->total == 0) return 0;
+    uint64_t rank = (uint64_t)((double)h->total * p / 100.0 + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > h->total) rank = h->total;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_high(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+double hist_mean(const hist_t *h) {
+    return h->total ? h->sum / (double)h->total : 0.0;
+}
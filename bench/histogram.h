@@ -0,0 +1,33 @@
+#ifndef CK_HISTOGRAM_H
+#define CK_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * log-linear latency histogram, after HdrHistogram: values below
+ * 2 * HIST_SUB are counted exactly, larger ones in buckets HIST_SUB to a
+ * power of two, so any recorded value is off by less than 1 / HIST_SUB
+ * (under 1%) whatever its magnitude. fixed size, no allocation while
+ * recording; histograms of several threads are added with hist_merge().
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) * HIST_SUB)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min, max;   /* exact */
+    double sum;
+} hist_t;
+
+void hist_init(hist_t *h);
+void hist_record(hist_t *h, uint64_t value);
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/* the value at percentile p (0..100]: the highest value of the bucket
+ * holding it, capped at the largest value seen; 0 when empty */
+uint64_t hist_percentile(const hist_t *h, double p);
+double hist_mean(const hist_t *h);
+
+#endif
@@ -0,0 +1,361 @@
+/*
+ * Offline cache-policy simulator: replays a key-access trace against the
+ * real store and eviction code, in-process, once per eviction policy, and
+ * reports hit ratio, evictions and the time eviction costs.
+ *
+ * Every access is a read-through cache lookup: GET, and on a miss SET the
+ * key with a value of the given size. Eviction runs ahead of each access
+ * the way the server runs it ahead of each command.
+ *
+ * Usage: ./simulator [options]
+ *   -f file      trace file, one key per line ('#' lines skipped)
+ *   -w kind      synthetic trace: zipf (default), uniform, loop, scan,
+ *                hotspot, latest
+ *   -n count     accesses (default 1000000)
+ *   -k keys      distinct keys (default 100000)
+ *   -s exp       zipf exponent (default 0.99)
+ *   -r ratio     cache size as a fraction of the working set (default 0.1)
+ *   -m bytes     cache size in bytes (kb/mb/gb suffixes), overrides -r
+ *   -v bytes     value size (default 32)
+ *   -S samples   maxmemory-samples (default 5)
+ *   -t           give every key a TTL, so volatile-* policies can evict
+ *   -p list      comma-separated policies, each optionally suffixed with
+ *                +tinylfu (default: every policy, plus LRU and LFU with
+ *                TinyLFU admission)
+ */
+#include "store.h"
+#include "eviction.h"
+#include "util.h"
+#include "workload.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#define DEFAULT_POLICIES \
+    "allkeys-lru,allkeys-lru-exact,allkeys-lfu,allkeys-random," \
+    "volatile-lru,volatile-lfu,volatile-ttl,noeviction," \
+    "allkeys-lru+tinylfu,allkeys-lfu+tinylfu"
+
+static const struct {
+    const char *name;
+    ck_evict_policy_t policy;
+} policies[] = {
+    { "allkeys-lru",       CK_EVICT_ALLKEYS_LRU },
+    { "allkeys-lru-exact", CK_EVICT_ALLKEYS_LRU_EXACT },
+    { "allkeys-lfu",       CK_EVICT_ALLKEYS_LFU },
+    { "allkeys-random",    CK_EVICT_ALLKEYS_RANDOM },
+    { "volatile-lru",      CK_EVICT_VOLATILE_LRU },
+    { "volatile-lfu",      CK_EVICT_VOLATILE_LFU },
+    { "volatile-ttl",      CK_EVICT_VOLATILE_TTL },
+    { "noeviction",        CK_EVICT_NOEVICTION },
+};
+
+#define N_POLICIES (sizeof(policies) / sizeof(policies[0]))
+
+typedef struct {
+    char **keys;        /* the trace, one key per access */
+    size_t len;
+    size_t distinct;
+    const char *desc;
+} trace_t;
+
+typedef struct {
+    uint64_t hits;
+    uint64_t evictions;
+    uint64_t rejected;
+    int64_t total_us;
+    int64_t evict_us;
+    size_t overhead;    /* keyspace table plus policy structures */
+} result_t;
+
+static void usage(void) {
+    fprintf(stderr,
+        "usage: simulator [-f trace] [-w zipf|uniform|loop|scan|hotspot|latest]\n"
+        "                 [-n accesses] [-k keys] [-s zipf_exp] [-r ratio | -m bytes]\n"
+        "                 [-v value_bytes] [-S samples] [-t] [-p policy[+tinylfu],...]\n");
+}
+
+static int parse_bytes(const char *s, size_t *out) {
+    char *end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (end == s) return -1;
+    if (strcasecmp(end, "kb") == 0) v *= 1024ULL;
+    else if (strcasecmp(end, "mb") == 0) v *= 1024ULL * 1024;
+    else if (strcasecmp(end, "gb") == 0) v *= 1024ULL * 1024 * 1024;
+    else if (*end) return -1;
+    *out = (size_t)v;
+    return 0;
+}
+
+/* trace memory comes from plain malloc: only the store is meant to show
+ * up in ck_mem_used(), which is what maxmemory is checked against */
+static char *dup_key(const char *s) {
+    size_t n = strlen(s) + 1;
+    char *p = malloc(n);
+    if (p) memcpy(p, s, n);
+    return p;
+}
+
+static int cmp_str(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static size_t count_distinct(char **keys, size_t len) {
+    char **sorted = malloc(sizeof(char *) * len);
+    if (!sorted) return len;
+    memcpy(sorted, keys, sizeof(char *) * len);
+    qsort(sorted, len, sizeof(char *), cmp_str);
+    size_t n = len ? 1 : 0;
+    for (size_t i = 1; i < len; i++) {
+        if (strcmp(sorted[i], sorted[i - 1]) != 0) n++;
+    }
+    free(sorted);
+    return n;
+}
+
+static int trace_load(trace_t *t, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "can't open trace %s\n", path);
+        return -1;
+    }
+    size_t cap = 1 << 16;
+    t->keys = malloc(sizeof(char *) * cap);
+    t->len = 0;
+    char line[1024];
+    while (t->keys && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') continue;
+        if (t->len == cap) {
+            cap *= 2;
+            t->keys = realloc(t->keys, sizeof(char *) * cap);
+            if (!t->keys) break;
+        }
+        t->keys[t->len++] = dup_key(line);
+    }
+    fclose(f);
+    if (!t->keys || t->len == 0) {
+        fprintf(stderr, "empty trace %s\n", path);
+        return -1;
+    }
+    t->distinct = count_distinct(t->keys, t->len);
+    return 0;
+}
+
+static int trace_generate(trace_t *t, wl_kind_t kind, size_t n, uint64_t keys, double s) {
+    workload_t *w = workload_create(kind, keys, s, 42);
+    t->keys = malloc(sizeof(char *) * n);
+    if (!w || !t->keys) return -1;
+
+    char key[32];
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "key:%llu", (unsigned long long)workload_next(w));
+        t->keys[i] = dup_key(key);
+    }
+    t->len = n;
+    t->distinct = count_distinct(t->keys, t->len);
+    workload_destroy(w);
+    return 0;
+}
+
+static void trace_free(trace_t *t) {
+    for (size_t i = 0; i < t->len; i++) free(t->keys[i]);
+    free(t->keys);
+}
+
+/* average allocator bytes per cached key, measured on a scratch store */
+static size_t bytes_per_key(const char *value) {
+    store_t *s = store_create();
+    size_t before = ck_mem_used();
+    char key[32];
+    for (int i = 0; i < 10000; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        store_set(s, key, value);
+    }
+    size_t per_key = (ck_mem_used() - before) / 10000;
+    store_destroy(s);
+    return per_key;
+}
+
+static void replay(const trace_t *t, ck_evict_policy_t policy, int admission,
+                   size_t budget, int samples, int ttl, const char *value,
+                   result_t *r) {
+    memset(r, 0, sizeof(*r));
+    store_t *s = store_create();
+    store_set_policy(s, policy);
+    store_set_admission(s, admission);
+    s->maxmemory_samples = samples;
+    s->maxmemory = ck_mem_used() + budget;
+
+    int64_t start = ck_time_us();
+    for (size_t i = 0; i < t->len; i++) {
+        /* as in command dispatch: make room first, and a write that
+         * can't get any is refused */
+        int oom = 0;
+        if (ck_mem_used() > s->maxmemory) {
+            int64_t e0 = ck_time_us();
+            oom = eviction_perform(s) == CK_EVICT_FAIL;
+            r->evict_us += ck_time_us() - e0;
+        }
+
+        const char *key = t->keys[i];
+        if (store_get(s, key)) {
+            r->hits++;
+        } else if (!oom) {
+            store_set(s, key, value);
+            if (ttl) store_expire(s, key, 3600);
+        }
+    }
+    r->total_us = ck_time_us() - start;
+    r->evictions = s->evicted_keys;
+    r->rejected = s->admission_rejected;
+    r->overhead = store_overhead(s);
+    store_destroy(s);
+}
+
+static int find_policy(const char *spec, ck_evict_policy_t *policy, int *admission) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s", spec);
+    *admission = 0;
+    char *plus = strchr(name, '+');
+    if (plus) {
+        if (strcmp(plus, "+tinylfu") != 0) return -1;
+        *plus = '\0';
+        *admission = 1;
+    }
+    for (size_t i = 0; i < N_POLICIES; i++) {
+        if (strcmp(name, policies[i].name) == 0) {
+            *policy = policies[i].policy;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    const char *trace_file = NULL;
+    wl_kind_t kind = WL_ZIPF;
+    size_t n = 1000000;
+    uint64_t keys = 100000;
+    double zipf_s = 0.99;
+    double ratio = 0.1;
+    size_t maxmemory = 0;
+    int value_size = 32;
+    int samples = CK_MAXMEMORY_SAMPLES;
+    int ttl = 0;
+    const char *policy_list = DEFAULT_POLICIES;
+
+    for (int i = 1; i < argc; i++) {
+        const char *opt = argv[i];
+        const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(opt, "-t") == 0) {
+            ttl = 1;
+            continue;
+        }
+        if (!arg || opt[0] != '-' || opt[1] == '\0' || opt[2] != '\0') {
+            usage();
+            return 1;
+        }
+        switch (opt[1]) {
+            case 'f': trace_file = arg; break;
+            case 'w':
+                if (workload_parse_kind(arg, &kind) != 0) {
+                    fprintf(stderr, "unknown workload '%s'\n", arg);
+                    return 1;
+                }
+                break;
+            case 'n': n = strtoull(arg, NULL, 10); break;
+            case 'k': keys = strtoull(arg, NULL, 10); break;
+            case 's': zipf_s = atof(arg); break;
+            case 'r': ratio = atof(arg); break;
+            case 'm':
+                if (parse_bytes(arg, &maxmemory) != 0) {
+                    fprintf(stderr, "invalid size '%s'\n", arg);
+                    return 1;
+                }
+                break;
+            case 'v': value_size = atoi(arg); break;
+            case 'S': samples = atoi(arg); break;
+            case 'p': policy_list = arg; break;
+            default:
+                usage();
+                return 1;
+        }
+        i++;
+    }
+    if (n == 0 || keys == 0 || value_size <= 0 || samples < 1 || samples > 64 ||
+        ratio <= 0) {
+        usage();
+        return 1;
+    }
+
+    /* check the whole list before spending time on the trace */
+    char *list = malloc(strlen(policy_list) + 1);
+    if (!list) return 1;
+    strcpy(list, policy_list);
+    char *specs[64];
+    ck_evict_policy_t chosen[64];
+    int admit[64];
+    int n_specs = 0;
+    for (char *spec = strtok(list, ","); spec && n_specs < 64; spec = strtok(NULL, ",")) {
+        if (find_policy(spec, &chosen[n_specs], &admit[n_specs]) != 0) {
+            fprintf(stderr, "unknown policy '%s'\n", spec);
+            free(list);
+            return 1;
+        }
+        specs[n_specs++] = spec;
+    }
+
+    ck_log_set_level(CK_LOG_WARN);
+
+    trace_t trace;
+    char desc[128];
+    if (trace_file) {
+        if (trace_load(&trace, trace_file) != 0) return 1;
+        snprintf(desc, sizeof(desc), "%s", trace_file);
+    } else {
+        if (trace_generate(&trace, kind, n, keys, zipf_s) != 0) {
+            fprintf(stderr, "out of memory generating trace\n");
+            return 1;
+        }
+        if (kind == WL_ZIPF || kind == WL_SCAN || kind == WL_LATEST) {
+            snprintf(desc, sizeof(desc), "%s s=%.2f", workload_kind_name(kind), zipf_s);
+        } else {
+            snprintf(desc, sizeof(desc), "%s", workload_kind_name(kind));
+        }
+    }
+
+    char *value = malloc((size_t)value_size + 1);
+    if (!value) return 1;
+    memset(value, 'x', (size_t)value_size);
+    value[value_size] = '\0';
+
+    size_t per_key = bytes_per_key(value);
+    if (maxmemory == 0) maxmemory = (size_t)((double)trace.distinct * (double)per_key * ratio);
+
+    printf("trace: %s, %zu accesses over %zu keys\n", desc, trace.len, trace.distinct);
+    printf("cache: %zu bytes (~%zu keys, %.1f%% of the working set), %d samples%s\n\n",
+           maxmemory, maxmemory / per_key,
+           100.0 * (double)maxmemory / ((double)trace.distinct * (double)per_key),
+           samples, ttl ? ", keys with TTL" : "");
+    printf("%-22s %9s %10s %9s %12s %9s %11s %10s\n", "policy", "hit ratio",
+           "evictions", "rejected", "evictions/s", "ns/access", "evict time", "overhead");
+
+    for (int i = 0; i < n_specs; i++) {
+        result_t r;
+        replay(&trace, chosen[i], admit[i], maxmemory, samples, ttl, value, &r);
+        printf("%-22s %9.4f %10llu %9llu %12.0f %9.0f %10.1f%% %10zu\n", specs[i],
+               (double)r.hits / (double)trace.len,
+               (unsigned long long)r.evictions, (unsigned long long)r.rejected,
+               r.evict_us ? (double)r.evictions * 1e6 / (double)r.evict_us : 0.0,
+               (double)r.total_us * 1000.0 / (double)trace.len,
+               r.total_us ? 100.0 * (double)r.evict_us / (double)r.total_us : 0.0,
+               r.overhead);
+    }
+
+    free(list);
+    free(value);
+    trace_free(&trace);
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "workload.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+static const char *kind_names[] = {
+    [WL_UNIFORM] = "uniform",
+    [WL_ZIPF]    = "zipf",
+    [WL_LOOP]    = "loop",
+    [WL_SCAN]    = "scan",
+    [WL_HOTSPOT] = "hotspot",
+    [WL_LATEST]  = "latest",
+};
+
+int workload_parse_kind(const char *name, wl_kind_t *kind) {
+    for (size_t i = 0; i < sizeof(kind_names) / sizeof(kind_names[0]); i++) {
+        if (strcmp(name, kind_names[i]) == 0) {
+            *kind = (wl_kind_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *workload_kind_name(wl_kind_t kind) {
+    return kind_names[kind];
+}
+
+static uint64_t xorshift64s(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+uint64_t workload_rand(workload_t *w, uint64_t n) {
+    return xorshift64s(&w->rng) % n;
+}
+
+static double rand_unit(workload_t *w) {
+    return (double)(xorshift64s(&w->rng) >> 11) / (double)(1ULL << 53);
+}
+
+workload_t *workload_create(wl_kind_t kind, uint64_t n_keys, double s, uint64_t seed) {
+    workload_t *w = calloc(1, sizeof(workload_t));
+    if (!w) return NULL;
+    w->kind = kind;
+    w->n_keys = n_keys ? n_keys : 1;
+    w->s = s;
+    w->rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    w->next_new = w->n_keys;
+    w->hot_fraction = WL_HOT_FRACTION;
+    w->hot_share = WL_HOT_SHARE;
+    w->insert_share = WL_INSERT_SHARE;
+
+    if (kind == WL_ZIPF || kind == WL_SCAN || kind == WL_LATEST) {
+        w->cdf = malloc(sizeof(double) * w->n_keys);
+        if (!w->cdf) {
+            free(w);
+            return NULL;
+        }
+        double sum = 0;
+        for (uint64_t i = 0; i < w->n_keys; i++) {
+            sum += 1.0 / pow((double)(i + 1), s);
+            w->cdf[i] = sum;
+        }
+        for (uint64_t i = 0; i < w->n_keys; i++) w->cdf[i] /= sum;
+    }
+    return w;
+}
+
+void workload_destroy(workload_t *w) {
+    if (!w) return;
+    free(w->cdf);
+    free(w);
+}
+
+/* first id whose cumulative probability reaches u */
+static uint64_t zipf_next(workload_t *w) {
+    double u = rand_unit(w);
+    uint64_t lo = 0, hi = w->n_keys - 1;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (w->cdf[mid] < u) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static uint64_t hotspot_next(workload_t *w) {
+    uint64_t hot = (uint64_t)((double)w->n_keys * w->hot_fraction);
+    if (hot < 1) hot = 1;
+    if (hot >= w->n_keys || rand_unit(w) < w->hot_share) return workload_rand(w, hot);
+    return hot + workload_rand(w, w->n_keys - hot);
+}
+
+/* ranked by age: the newest of the last n_keys ids is rank 0 */
+static uint64_t latest_next(workload_t *w) {
+    if (rand_unit(w) < w->insert_share) return w->next_new++;
+    return w->next_new - 1 - zipf_next(w);
+}
+
+uint64_t workload_next(workload_t *w) {
+    uint64_t pos = w->pos++;
+    switch (w->kind) {
+        case WL_UNIFORM:
+            return workload_rand(w, w->n_keys);
+        case WL_LOOP:
+            return pos % w->n_keys;
+        case WL_SCAN:
+            if ((pos / WL_SCAN_BLOCK) % 5 == 4) return w->next_new++;
+            return zipf_next(w);
+        case WL_HOTSPOT:
+            return hotspot_next(w);
+        case WL_LATEST:
+            return latest_next(w);
+        case WL_ZIPF:
+        default:
+            return zipf_next(w);
+    }
+}
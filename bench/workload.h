@@ -0,0 +1,52 @@
+#ifndef CK_WORKLOAD_H
+#define CK_WORKLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* synthetic key-access patterns, as key ids in [0, n_keys) unless noted */
+typedef enum {
+    WL_UNIFORM,  /* every key equally likely */
+    WL_ZIPF,     /* key i with probability proportional to 1 / (i+1)^s */
+    WL_LOOP,     /* 0, 1, ..., n-1, 0, 1, ... (worst case for LRU) */
+    WL_SCAN,     /* zipf, with a burst of never-seen keys (ids >= n_keys)
+                  * replacing every fifth block of accesses */
+    WL_HOTSPOT,  /* hot_share of the accesses go to the first hot_fraction
+                  * of the keys, the rest to the others, uniformly */
+    WL_LATEST    /* zipf by age, the newest key the most popular; a share
+                  * of the accesses add a key (next_new), which becomes the
+                  * newest */
+} wl_kind_t;
+
+typedef struct {
+    wl_kind_t kind;
+    uint64_t n_keys;
+    double s;          /* zipf exponent */
+    double *cdf;       /* zipf cumulative distribution, n_keys entries */
+    uint64_t rng;      /* xorshift64* state */
+    uint64_t pos;      /* accesses generated so far */
+    uint64_t next_new; /* next never-seen id, for scans and latest */
+    double hot_fraction;
+    double hot_share;
+    double insert_share; /* latest: accesses that add a key */
+} workload_t;
+
+#define WL_SCAN_BLOCK 1000
+#define WL_HOT_FRACTION 0.2
+#define WL_HOT_SHARE 0.8
+#define WL_INSERT_SHARE 0.05
+
+/* returns -1 for an unknown kind name */
+int workload_parse_kind(const char *name, wl_kind_t *kind);
+const char *workload_kind_name(wl_kind_t kind);
+
+workload_t *workload_create(wl_kind_t kind, uint64_t n_keys, double s, uint64_t seed);
+void workload_destroy(workload_t *w);
+
+/* next key id */
+uint64_t workload_next(workload_t *w);
+
+/* uniform random in [0, n), from the workload's own generator */
+uint64_t workload_rand(workload_t *w, uint64_t n);
+
+#endif
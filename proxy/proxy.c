@@ -0,0 +1,776 @@
+/*
+ * cachekit-proxy: a front for several cachekit servers. Clients connect
+ * to the proxy as to one server; each key is sent to the backend that owns
+ * it on a consistent hash ring (src/ring.c), over a few persistent
+ * connections per backend that carry the commands of every client. What
+ * arrives from many clients in one event loop turn goes out as one
+ * pipelined write per connection, and the replies come back in the same
+ * order, so a backend sees a handful of busy connections instead of
+ * thousands of idle ones.
+ *
+ * Usage: ./cachekit-proxy [-p port] [-c conns] [-v vnodes] [-m maxclients] host:port ...
+ * Default: port 6390, 2 connections per backend, 160 points per backend
+ *
+ * Commands on one key go to its backend. DEL, UNLINK and EXISTS are split
+ * by key and their counts added up; DBSIZE and FLUSHDB go to every
+ * backend. PING, ECHO, QUIT and INFO (the proxy's own counters) are
+ * answered here. Commands that don't name a key (KEYS, SAVE, CONFIG, ...)
+ * are refused, since no single backend can answer them.
+ */
+#ifdef _WIN32
+#include <stdio.h>
+
+int main(void) {
+    fprintf(stderr, "cachekit-proxy needs poll() and is not built for Windows\n");
+    return 1;
+}
+
+#else
+
+#include "protocol.h"
+#include "ring.h"
+#include "util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#define DEFAULT_PORT 6390
+#define DEFAULT_CONNS 2
+#define DEFAULT_MAX_CLIENTS 10000
+#define READ_BUF 16384
+#define MAX_INFLIGHT 1024          /* per client: stop reading it beyond this */
+#define MAX_CLIENT_OUT (1 << 20)   /* ... or with this much unsent */
+#define RECONNECT_MS 1000
+
+typedef enum { MERGE_PASS, MERGE_SUM, MERGE_OK } merge_t;
+
+/* a client's reply slot, filled in request order */
+typedef struct {
+    int remaining;   /* backend replies still to come */
+    merge_t merge;
+    int64_t sum;
+    char *data;      /* MERGE_PASS: the reply; others: the first error */
+    size_t len;
+} reply_t;
+
+/* a client's commands on one backend */
+typedef struct {
+    int conn;              /* the connection they last went on */
+    uint32_t inflight;     /* ... and how many of them are waiting there */
+} route_link_t;
+
+typedef struct {
+    int fd;                /* -1: free */
+    uint32_t gen;          /* tells a reused slot from the client before */
+    resp_parser_t parser;
+    resp_buf_t out;
+    size_t out_sent;
+    reply_t *replies;      /* [head, head + len), the oldest first */
+    size_t r_head, r_len, r_cap;
+    uint64_t r_seq;        /* sequence number of replies[r_head] */
+    uint64_t next_seq;
+    int closing;           /* QUIT: close once the replies are out */
+    route_link_t *links;   /* one per backend */
+} client_t;
+
+/* where a backend reply goes */
+typedef struct {
+    int client;
+    uint32_t gen;
+    uint64_t seq;
+} pending_t;
+
+typedef struct {
+    int fd;                /* -1: down, retried at retry_at */
+    int backend;
+    int connecting;
+    int64_t retry_at;
+    int warned;            /* logged as down, until it is back */
+    resp_parser_t parser;
+    resp_buf_t out;
+    size_t out_sent;
+    pending_t *queue;      /* [head, head + len), the oldest first */
+    size_t q_head, q_len, q_cap;
+} upstream_t;
+
+typedef struct {
+    char *addr;            /* host:port */
+    char host[256];
+    int port;
+} backend_t;
+
+static backend_t *backends;
+static int n_backends;
+static upstream_t *ups;    /* conns_per_backend per backend, in order */
+static int conns_per_backend = DEFAULT_CONNS;
+static ring_t *ring;
+static client_t *clients;
+static int max_clients = DEFAULT_MAX_CLIENTS;
+static int n_clients;
+static int listen_fd = -1;
+
+static uint64_t stat_commands;   /* commands taken from clients */
+static uint64_t stat_forwarded;  /* commands sent to backends */
+static uint64_t stat_writes;     /* writes to backends carrying them */
+static uint64_t stat_errors;     /* commands failed for a backend down */
+
+static void set_nonblock(int fd) {
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+/* ---- replies to clients ---- */
+
+static reply_t *reply_push(client_t *c) {
+    if (c->r_head + c->r_len == c->r_cap) {
+        if (c->r_head > 0) {
+            memmove(c->replies, c->replies + c->r_head, sizeof(reply_t) * c->r_len);
+            c->r_head = 0;
+        } else {
+            c->r_cap = c->r_cap ? c->r_cap * 2 : 16;
+            c->replies = ck_realloc(c->replies, sizeof(reply_t) * c->r_cap);
+        }
+    }
+    reply_t *r = &c->replies[c->r_head + c->r_len++];
+    memset(r, 0, sizeof(*r));
+    c->next_seq++;
+    return r;
+}
+
+static void reply_local(client_t *c, const char *data, size_t len) {
+    reply_t *r = reply_push(c);
+    r->data = ck_malloc(len ? len : 1);
+    memcpy(r->data, data, len);
+    r->len = len;
+}
+
+static void reply_error(client_t *c, const char *msg) {
+    char buf[300];
+    int n = snprintf(buf, sizeof(buf), "-%s\r\n", msg);
+    reply_local(c, buf, (size_t)n < sizeof(buf) ? (size_t)n : sizeof(buf) - 1);
+}
+
+/* move the replies that are complete, in order, to the output buffer */
+static void client_flush_replies(client_t *c) {
+    while (c->r_len > 0 && c->replies[c->r_head].remaining == 0) {
+        reply_t *r = &c->replies[c->r_head];
+        if (r->data) {
+            resp_buf_append(&c->out, r->data, r->len);
+        } else if (r->merge == MERGE_SUM) {
+            resp_write_integer(&c->out, r->sum);
+        } else {
+            resp_write_simple_string(&c->out, "OK");
+        }
+        ck_free(r->data);
+        c->r_head++;
+        c->r_len--;
+        c->r_seq++;
+    }
+    if (c->r_len == 0) c->r_head = 0;
+}
+
+/* a reply (raw RESP) from backend for request seq of client i */
+static void deliver(int backend, const pending_t *p, const char *raw, size_t len,
+                    int is_error, int64_t integer, int is_integer) {
+    client_t *c = &clients[p->client];
+    if (c->fd < 0 || c->gen != p->gen) return;  /* gone since */
+    c->links[backend].inflight--;
+    reply_t *r = &c->replies[c->r_head + (size_t)(p->seq - c->r_seq)];
+    if (r->merge == MERGE_PASS || (is_error && !r->data)) {
+        r->data = ck_malloc(len);
+        memcpy(r->data, raw, len);
+        r->len = len;
+    } else if (r->merge == MERGE_SUM && is_integer) {
+        r->sum += integer;
+    }
+    r->remaining--;
+    client_flush_replies(c);
+}
+
+/* ---- backend connections ---- */
+
+static void upstream_push(upstream_t *u, int client, uint64_t seq) {
+    if (u->q_head + u->q_len == u->q_cap) {
+        if (u->q_head > 0) {
+            memmove(u->queue, u->queue + u->q_head, sizeof(pending_t) * u->q_len);
+            u->q_head = 0;
+        } else {
+            u->q_cap = u->q_cap ? u->q_cap * 2 : 64;
+            u->queue = ck_realloc(u->queue, sizeof(pending_t) * u->q_cap);
+        }
+    }
+    pending_t *p = &u->queue[u->q_head + u->q_len++];
+    p->client = client;
+    p->gen = clients[client].gen;
+    p->seq = seq;
+}
+
+static void upstream_down(upstream_t *u, const char *why) {
+    backend_t *b = &backends[u->backend];
+    if (!u->warned) ck_log(CK_LOG_WARN, "backend %s: %s", b->addr, why);
+    u->warned = 1;
+    char err[320];
+    int n = snprintf(err, sizeof(err), "-ERR backend %s connection lost\r\n", b->addr);
+    for (size_t i = 0; i < u->q_len; i++) {
+        deliver(u->backend, &u->queue[u->q_head + i], err, (size_t)n, 1, 0, 0);
+    }
+    u->q_head = u->q_len = 0;
+    if (u->fd >= 0) close(u->fd);
+    u->fd = -1;
+    u->connecting = 0;
+    u->retry_at = ck_time_ms() + RECONNECT_MS;
+    u->out.len = 0;
+    u->out_sent = 0;
+    resp_parser_destroy(&u->parser);
+    resp_parser_init(&u->parser);
+}
+
+static void upstream_connect(upstream_t *u) {
+    backend_t *b = &backends[u->backend];
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", b->port);
+    u->retry_at = ck_time_ms() + RECONNECT_MS;
+    if (getaddrinfo(b->host, port, &hints, &res) != 0) return;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+        freeaddrinfo(res);
+        return;
+    }
+    set_nonblock(fd);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    int rc = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc != 0 && errno != EINPROGRESS) {
+        close(fd);
+        return;
+    }
+    u->fd = fd;
+    u->connecting = rc != 0;
+    if (!u->connecting) u->warned = 0;
+}
+
+/* the connection of a backend to queue a client's command on, NULL if
+ * none is up. while the client has commands waiting on one, the next go
+ * there too, so its commands to a backend run in the order it sent them
+ * even when a connection it fell back from comes back up; with none
+ * waiting it gets the first one up of its own order */
+static upstream_t *pick_upstream(int backend, int client) {
+    route_link_t *l = &clients[client].links[backend];
+    upstream_t *u;
+    if (l->inflight) {
+        u = &ups[backend * conns_per_backend + l->conn];
+        return u->fd >= 0 ? u : NULL;
+    }
+    for (int i = 0; i < conns_per_backend; i++) {
+        int conn = (client + i) % conns_per_backend;
+        u = &ups[backend * conns_per_backend + conn];
+        if (u->fd >= 0) {
+            l->conn = conn;
+            return u;
+        }
+    }
+    return NULL;
+}
+
+static void forward(upstream_t *u, int client, uint64_t seq, const char *raw, size_t len) {
+    resp_buf_append(&u->out, raw, len);
+    upstream_push(u, client, seq);
+    clients[client].links[u->backend].inflight++;
+    stat_forwarded++;
+}
+
+static int upstream_write(upstream_t *u) {
+    if (u->connecting || u->out_sent >= u->out.len) return 0;
+    ssize_t n = send(u->fd, u->out.buf + u->out_sent, u->out.len - u->out_sent, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    if (n <= 0) return -1;
+    stat_writes++;
+    u->out_sent += (size_t)n;
+    if (u->out_sent == u->out.len) u->out.len = u->out_sent = 0;
+    return 0;
+}
+
+static int upstream_read(upstream_t *u) {
+    char buf[READ_BUF];
+    ssize_t n = recv(u->fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    if (n <= 0) return -1;
+    resp_parser_feed(&u->parser, buf, (size_t)n);
+    for (;;) {
+        size_t start = u->parser.pos;
+        resp_value_t *v;
+        if (resp_parse(&u->parser, &v) != 1) break;
+        if (u->q_len == 0) {
+            resp_value_free(v);
+            return -1;  /* a reply nobody asked for */
+        }
+        pending_t p = u->queue[u->q_head++];
+        if (--u->q_len == 0) u->q_head = 0;
+        deliver(u->backend, &p, u->parser.buf + start, u->parser.pos - start, v->type == RESP_ERROR,
+                v->type == RESP_INTEGER ? v->integer : 0, v->type == RESP_INTEGER);
+        resp_value_free(v);
+    }
+    return 0;
+}
+
+/* ---- commands ---- */
+
+typedef enum {
+    ROUTE_KEY,     /* the first argument is the key */
+    ROUTE_KEYS,    /* every argument is a key: split, counts added */
+    ROUTE_ALL_SUM, /* every backend, counts added */
+    ROUTE_ALL_OK,  /* every backend, +OK unless one fails */
+    ROUTE_LOCAL
+} route_t;
+
+static const struct {
+    const char *name;
+    route_t route;
+} routes[] = {
+    { "GET", ROUTE_KEY }, { "SET", ROUTE_KEY }, { "INCR", ROUTE_KEY },
+    { "DECR", ROUTE_KEY }, { "LPUSH", ROUTE_KEY }, { "RPUSH", ROUTE_KEY },
+    { "LPOP", ROUTE_KEY }, { "RPOP", ROUTE_KEY }, { "LRANGE", ROUTE_KEY },
+    { "LLEN", ROUTE_KEY }, { "HSET", ROUTE_KEY }, { "HGET", ROUTE_KEY },
+    { "HDEL", ROUTE_KEY }, { "HGETALL", ROUTE_KEY }, { "EXPIRE", ROUTE_KEY },
+    { "PEXPIREAT", ROUTE_KEY }, { "TTL", ROUTE_KEY }, { "PERSIST", ROUTE_KEY },
+    { "DEL", ROUTE_KEYS }, { "UNLINK", ROUTE_KEYS }, { "EXISTS", ROUTE_KEYS },
+    { "DBSIZE", ROUTE_ALL_SUM }, { "FLUSHDB", ROUTE_ALL_OK },
+    { "PING", ROUTE_LOCAL }, { "ECHO", ROUTE_LOCAL }, { "QUIT", ROUTE_LOCAL },
+    { "INFO", ROUTE_LOCAL },
+};
+
+static const char *arg(resp_value_t *cmd, int i) {
+    if (i >= cmd->array.count) return NULL;
+    resp_value_t *v = cmd->array.elements[i];
+    return v->type == RESP_BULK_STRING || v->type == RESP_SIMPLE_STRING ? v->str : NULL;
+}
+
+static void proxy_info(client_t *c) {
+    char buf[4096];
+    int n = snprintf(buf, sizeof(buf),
+                     "# Proxy\r\nconnected_clients:%d\r\nbackends:%d\r\n"
+                     "connections_per_backend:%d\r\ncommands_processed:%llu\r\n"
+                     "commands_forwarded:%llu\r\nupstream_writes:%llu\r\n"
+                     "commands_per_write:%.2f\r\nbackend_errors:%llu\r\n",
+                     n_clients, n_backends, conns_per_backend,
+                     (unsigned long long)stat_commands, (unsigned long long)stat_forwarded,
+                     (unsigned long long)stat_writes,
+                     stat_writes ? (double)stat_forwarded / (double)stat_writes : 0.0,
+                     (unsigned long long)stat_errors);
+    for (int b = 0; b < n_backends && (size_t)n < sizeof(buf); b++) {
+        int up = 0;
+        size_t queued = 0;
+        for (int i = 0; i < conns_per_backend; i++) {
+            upstream_t *u = &ups[b * conns_per_backend + i];
+            up += u->fd >= 0 && !u->connecting;
+            queued += u->q_len;
+        }
+        n += snprintf(buf + n, sizeof(buf) - (size_t)n,
+                      "backend%d:addr=%s,connections_up=%d,pending=%zu\r\n", b,
+                      backends[b].addr, up, queued);
+    }
+    if ((size_t)n >= sizeof(buf)) n = (int)sizeof(buf) - 1;
+    resp_buf_t out;
+    resp_buf_init(&out);
+    resp_write_bulk_string(&out, buf, (size_t)n);
+    reply_local(c, out.buf, out.len);
+    resp_buf_destroy(&out);
+}
+
+static void handle_local(client_t *c, resp_value_t *cmd, const char *name) {
+    if (strcasecmp(name, "QUIT") == 0) {
+        reply_local(c, "+OK\r\n", 5);
+        c->closing = 1;
+    } else if (strcasecmp(name, "INFO") == 0) {
+        proxy_info(c);
+    } else if (strcasecmp(name, "ECHO") == 0 && cmd->array.count != 2) {
+        reply_error(c, "ERR wrong number of arguments for 'echo' command");
+    } else if (arg(cmd, 1)) {
+        resp_buf_t out;
+        resp_buf_init(&out);
+        resp_write_bulk_string(&out, arg(cmd, 1), strlen(arg(cmd, 1)));
+        reply_local(c, out.buf, out.len);
+        resp_buf_destroy(&out);
+    } else {
+        reply_local(c, "+PONG\r\n", 7);
+    }
+}
+
+static void handle_command(int ci, resp_value_t *cmd, const char *raw, size_t len) {
+    client_t *c = &clients[ci];
+    stat_commands++;
+    const char *name = cmd->type == RESP_ARRAY && cmd->array.count > 0 ? arg(cmd, 0) : NULL;
+    if (!name) {
+        reply_error(c, "ERR invalid command format");
+        return;
+    }
+    int route = -1;
+    for (size_t i = 0; i < sizeof(routes) / sizeof(routes[0]); i++) {
+        if (strcasecmp(name, routes[i].name) == 0) route = (int)routes[i].route;
+    }
+    char err[300];
+    if (route < 0) {
+        snprintf(err, sizeof(err), "ERR unknown or unsupported command '%.64s' for the proxy",
+                 name);
+        reply_error(c, err);
+        return;
+    }
+    if (route == ROUTE_LOCAL) {
+        handle_local(c, cmd, name);
+        return;
+    }
+    if ((route == ROUTE_KEY || route == ROUTE_KEYS) && !arg(cmd, 1)) {
+        snprintf(err, sizeof(err), "ERR wrong number of arguments for '%.64s' command", name);
+        reply_error(c, err);
+        return;
+    }
+
+    /* all or nothing: every backend the command needs must be up */
+    int last = route == ROUTE_KEY ? 1 : cmd->array.count - 1;
+    int spread = route == ROUTE_ALL_SUM || route == ROUTE_ALL_OK;
+    for (int i = spread ? 0 : 1; i <= (spread ? n_backends - 1 : last); i++) {
+        int b = spread ? i : ring_lookup(ring, arg(cmd, i) ? arg(cmd, i) : "");
+        if (!pick_upstream(b, ci)) {
+            stat_errors++;
+            snprintf(err, sizeof(err), "ERR backend %s is down", backends[b].addr);
+            reply_error(c, err);
+            return;
+        }
+    }
+
+    uint64_t seq = c->next_seq;
+    reply_t *r = reply_push(c);
+    if (route == ROUTE_KEY) {
+        r->remaining = 1;
+        forward(pick_upstream(ring_lookup(ring, arg(cmd, 1)), ci), ci, seq, raw, len);
+    } else if (route == ROUTE_KEYS) {
+        r->merge = MERGE_SUM;
+        r->remaining = last;
+        resp_buf_t one;
+        resp_buf_init(&one);
+        for (int i = 1; i <= last; i++) {
+            const char *key = arg(cmd, i) ? arg(cmd, i) : "";
+            one.len = 0;
+            resp_write_array_header(&one, 2);
+            resp_write_bulk_string(&one, name, strlen(name));
+            resp_write_bulk_string(&one, key, strlen(key));
+            forward(pick_upstream(ring_lookup(ring, key), ci), ci, seq, one.buf, one.len);
+        }
+        resp_buf_destroy(&one);
+    } else {
+        r->merge = route == ROUTE_ALL_SUM ? MERGE_SUM : MERGE_OK;
+        r->remaining = n_backends;
+        for (int b = 0; b < n_backends; b++) forward(pick_upstream(b, ci), ci, seq, raw, len);
+    }
+}
+
+/* ---- clients ---- */
+
+static void client_close(int i) {
+    client_t *c = &clients[i];
+    close(c->fd);
+    c->fd = -1;
+    c->gen++;
+    resp_parser_destroy(&c->parser);
+    resp_buf_destroy(&c->out);
+    for (size_t k = 0; k < c->r_len; k++) ck_free(c->replies[c->r_head + k].data);
+    ck_free(c->replies);
+    c->replies = NULL;
+    c->r_head = c->r_len = c->r_cap = 0;
+    n_clients--;
+}
+
+static int client_wants_read(const client_t *c) {
+    return !c->closing && c->r_len < MAX_INFLIGHT && c->out.len - c->out_sent < MAX_CLIENT_OUT;
+}
+
+static void accept_clients(void) {
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) return;
+        if (n_clients == max_clients) {
+            close(fd);
+            continue;
+        }
+        set_nonblock(fd);
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        for (int i = 0; i < max_clients; i++) {
+            client_t *c = &clients[i];
+            if (c->fd >= 0) continue;
+            c->fd = fd;
+            resp_parser_init(&c->parser);
+            resp_buf_init(&c->out);
+            c->out_sent = 0;
+            c->r_seq = c->next_seq = 0;
+            c->closing = 0;
+            memset(c->links, 0, sizeof(route_link_t) * (size_t)n_backends);
+            n_clients++;
+            break;
+        }
+    }
+}
+
+static int client_read(int i) {
+    client_t *c = &clients[i];
+    char buf[READ_BUF];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+    if (n <= 0) return -1;
+    resp_parser_feed(&c->parser, buf, (size_t)n);
+    while (client_wants_read(c)) {
+        size_t start = c->parser.pos;
+        resp_value_t *cmd;
+        if (resp_parse(&c->parser, &cmd) != 1) break;
+        handle_command(i, cmd, c->parser.buf + start, c->parser.pos - start);
+        resp_value_free(cmd);
+    }
+    client_flush_replies(c);
+    return 0;
+}
+
+static int client_write(int i) {
+    client_t *c = &clients[i];
+    if (c->out_sent < c->out.len) {
+        ssize_t n = send(c->fd, c->out.buf + c->out_sent, c->out.len - c->out_sent, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return 0;
+        if (n <= 0) return -1;
+        c->out_sent += (size_t)n;
+        if (c->out_sent == c->out.len) c->out.len = c->out_sent = 0;
+    }
+    if (c->closing && c->r_len == 0 && c->out.len == 0) return -1;
+    return 0;
+}
+
+/* commands parsed but held back while the client was over its limits */
+static void client_resume(int i) {
+    client_t *c = &clients[i];
+    while (client_wants_read(c)) {
+        size_t start = c->parser.pos;
+        resp_value_t *cmd;
+        if (resp_parse(&c->parser, &cmd) != 1) break;
+        handle_command(i, cmd, c->parser.buf + start, c->parser.pos - start);
+        resp_value_free(cmd);
+    }
+    client_flush_replies(c);
+}
+
+/* ---- main loop ---- */
+
+static int parse_backend(const char *spec, backend_t *b) {
+    const char *colon = strrchr(spec, ':');
+    int64_t port;
+    if (!colon || colon == spec || (size_t)(colon - spec) >= sizeof(b->host) ||
+        ck_str_to_int64(colon + 1, &port) != 0 || port <= 0 || port > 65535) {
+        return -1;
+    }
+    memcpy(b->host, spec, (size_t)(colon - spec));
+    b->host[colon - spec] = '\0';
+    b->port = (int)port;
+    b->addr = ck_strdup(spec);
+    return 0;
+}
+
+static int listen_on(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    int opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons((unsigned short)port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 511) != 0) {
+        close(fd);
+        return -1;
+    }
+    set_nonblock(fd);
+    return fd;
+}
+
+/* thousands of clients need as many descriptors */
+static void raise_fd_limit(int want) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= (rlim_t)want) return;
+    rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= (rlim_t)want
+                      ? (rlim_t)want : rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur < (rlim_t)want) {
+        ck_log(CK_LOG_WARN, "file descriptor limit is %llu, fewer than %d clients fit",
+               (unsigned long long)rl.rlim_cur, want);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-p port] [-c conns] [-v vnodes] [-m maxclients] "
+                    "host:port [host:port ...]\n", prog);
+    fprintf(stderr, "  -p port        listen port (default %d)\n", DEFAULT_PORT);
+    fprintf(stderr, "  -c conns       connections per backend (default %d)\n", DEFAULT_CONNS);
+    fprintf(stderr, "  -v vnodes      hash ring points per backend (default %d)\n",
+            CK_RING_DEFAULT_VNODES);
+    fprintf(stderr, "  -m maxclients  most clients at once (default %d)\n",
+            DEFAULT_MAX_CLIENTS);
+}
+
+int main(int argc, char **argv) {
+    int port = DEFAULT_PORT, vnodes = CK_RING_DEFAULT_VNODES;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i += 2) {
+        int64_t v;
+        if (i + 1 >= argc || ck_str_to_int64(argv[i + 1], &v) != 0 || v <= 0 || v > 1000000) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[i], "-p") == 0 && v <= 65535) {
+            port = (int)v;
+        } else if (strcmp(argv[i], "-c") == 0 && v <= 64) {
+            conns_per_backend = (int)v;
+        } else if (strcmp(argv[i], "-v") == 0 && v <= 4096) {
+            vnodes = (int)v;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            max_clients = (int)v;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    n_backends = argc - i;
+    if (n_backends < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+    backends = ck_calloc((size_t)n_backends, sizeof(backend_t));
+    const char **names = ck_malloc(sizeof(char *) * (size_t)n_backends);
+    for (int b = 0; b < n_backends; b++) {
+        if (parse_backend(argv[i + b], &backends[b]) != 0) {
+            fprintf(stderr, "invalid backend '%s' (host:port)\n", argv[i + b]);
+            return 1;
+        }
+        names[b] = backends[b].addr;
+    }
+    ring = ring_create(names, n_backends, vnodes);
+    ck_free(names);
+
+    signal(SIGPIPE, SIG_IGN);
+    int n_ups = n_backends * conns_per_backend;
+    raise_fd_limit(max_clients + n_ups + 16);
+    listen_fd = listen_on(port);
+    if (listen_fd < 0) {
+        ck_log(CK_LOG_ERROR, "can't listen on port %d", port);
+        return 1;
+    }
+    ups = ck_calloc((size_t)n_ups, sizeof(upstream_t));
+    for (int u = 0; u < n_ups; u++) {
+        ups[u].fd = -1;
+        ups[u].backend = u / conns_per_backend;
+        resp_parser_init(&ups[u].parser);
+        resp_buf_init(&ups[u].out);
+        upstream_connect(&ups[u]);
+    }
+    clients = ck_calloc((size_t)max_clients, sizeof(client_t));
+    for (int c = 0; c < max_clients; c++) {
+        clients[c].fd = -1;
+        clients[c].links = ck_calloc((size_t)n_backends, sizeof(route_link_t));
+    }
+    struct pollfd *pfds = ck_malloc(sizeof(struct pollfd) * (size_t)(max_clients + n_ups + 1));
+    int *owner = ck_malloc(sizeof(int) * (size_t)(max_clients + n_ups + 1));
+
+    ck_log(CK_LOG_INFO, "cachekit-proxy listening on port %d, %d backends, %d connections each",
+           port, n_backends, conns_per_backend);
+
+    for (;;) {
+        int64_t now = ck_time_ms();
+        for (int u = 0; u < n_ups; u++) {
+            if (ups[u].fd < 0 && now >= ups[u].retry_at) upstream_connect(&ups[u]);
+        }
+
+        /* 0..n_ups-1: backends, then the listener, then clients */
+        int n = 0;
+        for (int u = 0; u < n_ups; u++) {
+            if (ups[u].fd < 0) continue;
+            pfds[n].fd = ups[u].fd;
+            pfds[n].events = (short)(ups[u].connecting ? POLLOUT
+                                     : POLLIN | (ups[u].out_sent < ups[u].out.len ? POLLOUT : 0));
+            owner[n++] = u;
+        }
+        int first_client = n + 1;
+        pfds[n].fd = listen_fd;
+        pfds[n].events = n_clients < max_clients ? POLLIN : 0;
+        owner[n++] = -1;
+        for (int c = 0; c < max_clients; c++) {
+            if (clients[c].fd < 0) continue;
+            pfds[n].fd = clients[c].fd;
+            pfds[n].events = (short)((client_wants_read(&clients[c]) ? POLLIN : 0) |
+                                     (clients[c].out_sent < clients[c].out.len ? POLLOUT : 0));
+            owner[n++] = c;
+        }
+
+        if (poll(pfds, (nfds_t)n, RECONNECT_MS / 4) < 0) {
+            if (errno == EINTR) continue;
+            ck_log(CK_LOG_ERROR, "poll() failed");
+            break;
+        }
+
+        for (int k = 0; k < first_client - 1; k++) {
+            upstream_t *u = &ups[owner[k]];
+            if (u->fd < 0 || !pfds[k].revents) continue;
+            if (u->connecting) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(u->fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+                    upstream_down(u, "connect failed");
+                    continue;
+                }
+                u->connecting = 0;
+                u->warned = 0;
+                ck_log(CK_LOG_INFO, "backend %s: connected", backends[u->backend].addr);
+                continue;
+            }
+            if ((pfds[k].revents & (POLLIN | POLLHUP | POLLERR)) && upstream_read(u) != 0) {
+                upstream_down(u, "connection closed");
+            }
+        }
+        if (pfds[first_client - 1].revents & POLLIN) accept_clients();
+        for (int k = first_client; k < n; k++) {
+            int c = owner[k];
+            if (clients[c].fd < 0 || !pfds[k].revents) continue;
+            if ((pfds[k].revents & (POLLIN | POLLHUP | POLLERR)) && client_read(c) != 0) {
+                client_close(c);
+            }
+        }
+
+        /* everything this turn queued for a backend goes out in one write
+         * per connection; replies that completed go out to their clients */
+        for (int u = 0; u < n_ups; u++) {
+            if (ups[u].fd >= 0 && upstream_write(&ups[u]) != 0) {
+                upstream_down(&ups[u], "write failed");
+            }
+        }
+        for (int c = 0; c < max_clients; c++) {
+            if (clients[c].fd < 0) continue;
+            if (client_write(c) != 0) {
+                client_close(c);
+                continue;
+            }
+            if (client_wants_read(&clients[c])) client_resume(c);
+        }
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,719 @@
+#include "aof.h"
+#include "child.h"
+#include "list.h"
+#include "persistence.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define ck_fsync(fd) _commit(fd)
+#else
+#include <unistd.h>
+#define ck_fsync(fd) fdatasync(fd)
+#endif
+
+/* a burst can leave the buffer large; don't keep that around */
+#define AOF_BUF_KEEP (4 * 1024 * 1024)
+
+static const char *fsync_names[] = {
+    [CK_AOF_FSYNC_NO]       = "no",
+    [CK_AOF_FSYNC_EVERYSEC] = "everysec",
+    [CK_AOF_FSYNC_ALWAYS]   = "always",
+};
+
+static char *g_filename;
+static ck_aof_fsync_t g_policy = CK_AOF_FSYNC_EVERYSEC;
+static int g_wanted;
+static int g_started;
+
+static int g_fd = -1;
+static resp_buf_t g_buf;
+static size_t g_size;          /* bytes in the file */
+static int g_unsynced;         /* written since the last fsync */
+static int64_t g_last_fsync_ms;
+static int g_last_write_ok = 1;
+static size_t g_base_size;     /* after the last rewrite, or when opened */
+
+/* rewrite */
+static int g_preamble = 1;
+static int g_rewrite_pct = 100;
+static size_t g_rewrite_min = 64 * 1024 * 1024;
+static int g_rewriting;
+static int g_rewrite_scheduled;
+static int g_rewrite_stale;    /* the log was closed while the child ran */
+static resp_buf_t g_rewrite_buf;   /* writes since the fork */
+static char g_rewrite_tmp[512];
+static int g_last_rewrite_ok = 1;
+static int64_t g_last_rewrite_ms = -1;
+static size_t g_last_cow_bytes;
+static uint64_t g_rewrites;
+
+/* background fsync for everysec */
+static pthread_t g_thread;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_idle = PTHREAD_COND_INITIALIZER;
+static int g_thread_running;
+static int g_stopping;
+static int g_sync_fd = -1;     /* requested, not yet picked up */
+static atomic_int g_fsync_busy;
+static atomic_uint_least64_t g_fsyncs;
+
+static void *fsync_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_lock);
+    for (;;) {
+        while (g_sync_fd < 0 && !g_stopping)
+            pthread_cond_wait(&g_wakeup, &g_lock);
+        if (g_sync_fd < 0) break;
+
+        int fd = g_sync_fd;
+        g_sync_fd = -1;
+        pthread_mutex_unlock(&g_lock);
+
+        if (ck_fsync(fd) != 0) {
+            ck_log(CK_LOG_WARN, "aof: fsync failed: %d", errno);
+        }
+        atomic_fetch_add(&g_fsyncs, 1);
+
+        pthread_mutex_lock(&g_lock);
+        atomic_store(&g_fsync_busy, 0);
+        pthread_cond_broadcast(&g_idle);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+static void request_fsync(int fd) {
+    atomic_store(&g_fsync_busy, 1);
+    pthread_mutex_lock(&g_lock);
+    g_sync_fd = fd;
+    pthread_cond_signal(&g_wakeup);
+    pthread_mutex_unlock(&g_lock);
+}
+
+/* the fd is about to be closed; the thread must be done with it */
+static void wait_fsync(void) {
+    if (!g_thread_running) return;
+    pthread_mutex_lock(&g_lock);
+    while (atomic_load(&g_fsync_busy))
+        pthread_cond_wait(&g_idle, &g_lock);
+    pthread_mutex_unlock(&g_lock);
+}
+
+static void start_thread(void) {
+    g_stopping = 0;
+    if (pthread_create(&g_thread, NULL, fsync_main, NULL) != 0) {
+        ck_log(CK_LOG_WARN, "aof: failed to start fsync thread, syncing inline");
+        return;
+    }
+    g_thread_running = 1;
+}
+
+static void stop_thread(void) {
+    if (!g_thread_running) return;
+    pthread_mutex_lock(&g_lock);
+    g_stopping = 1;
+    pthread_cond_signal(&g_wakeup);
+    pthread_mutex_unlock(&g_lock);
+    pthread_join(g_thread, NULL);
+    g_thread_running = 0;
+}
+
+/* command encoding */
+
+static void append_command(resp_buf_t *b, int argc, const char **argv) {
+    resp_write_array_header(b, argc);
+    for (int i = 0; i < argc; i++) {
+        resp_write_bulk_string(b, argv[i], strlen(argv[i]));
+    }
+}
+
+static void append_expire_at(resp_buf_t *b, const char *key, int64_t when_ms) {
+    char num[32];
+    snprintf(num, sizeof(num), "%lld", (long long)when_ms);
+    const char *argv[] = { "PEXPIREAT", key, num };
+    append_command(b, 3, argv);
+}
+
+static const char *arg_str(resp_value_t *cmd, int i) {
+    if (i >= cmd->array.count) return NULL;
+    resp_value_t *v = cmd->array.elements[i];
+    if (v->type != RESP_BULK_STRING && v->type != RESP_SIMPLE_STRING) return NULL;
+    return v->str;
+}
+
+/* one command of a key's rebuild, after the prefix if there is one */
+static void append_key_command(resp_buf_t *b, const char *prefix, int argc, const char **argv) {
+    if (prefix) resp_buf_append(b, prefix, strlen(prefix));
+    append_command(b, argc, argv);
+}
+
+int aof_encode_key(resp_buf_t *b, const char *key, const store_entry_t *e, const char *prefix) {
+    char num[32];
+    int n = 0;
+    switch (e->type) {
+        case CK_STRING: {
+            const char *argv[] = { "SET", key, e->str };
+            append_key_command(b, prefix, 3, argv);
+            n++;
+            break;
+        }
+        case CK_INT: {
+            snprintf(num, sizeof(num), "%lld", (long long)e->integer);
+            const char *argv[] = { "SET", key, num };
+            append_key_command(b, prefix, 3, argv);
+            n++;
+            break;
+        }
+        case CK_LIST: {
+            for (list_node_t *node = e->list->head; node; node = node->next) {
+                const char *argv[] = { "RPUSH", key, (const char *)node->value };
+                append_key_command(b, prefix, 3, argv);
+                n++;
+            }
+            break;
+        }
+        case CK_HASH: {
+            ht_iter_t hiter;
+            ht_iter_init(&hiter, e->hash);
+            const char *field;
+            void *hval;
+            while (ht_iter_next(&hiter, &field, &hval)) {
+                const char *argv[] = { "HSET", key, field, (const char *)hval };
+                append_key_command(b, prefix, 4, argv);
+                n++;
+            }
+            break;
+        }
+    }
+
+    if (e->expire_at) {
+        snprintf(num, sizeof(num), "%lld", (long long)e->expire_at);
+        const char *argv[] = { "PEXPIREAT", key, num };
+        append_key_command(b, prefix, 3, argv);
+        n++;
+    }
+    return n;
+}
+
+/* the current dataset as commands that rebuild it */
+static void append_dataset(resp_buf_t *b, store_t *s) {
+    ht_iter_t iter;
+    ht_iter_init(&iter, s->data);
+    const char *key;
+    void *val;
+
+    while (ht_iter_next(&iter, &key, &val)) {
+        store_entry_t *e = (store_entry_t *)val;
+        if (!store_is_expired(e)) aof_encode_key(b, key, e, NULL);
+    }
+}
+
+/* file handling */
+
+/* returns how much was written; short only on error */
+static size_t write_all(int fd, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = write(fd, buf + off, len - off);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        off += (size_t)n;
+    }
+    return off;
+}
+
+static int write_buffer(void) {
+    size_t off = write_all(g_fd, g_buf.buf, g_buf.len);
+    g_size += off;
+
+    if (off < g_buf.len) {
+        /* keep the rest; the next flush continues where this one stopped */
+        memmove(g_buf.buf, g_buf.buf + off, g_buf.len - off);
+        g_buf.len -= off;
+        if (g_last_write_ok) {
+            ck_log(CK_LOG_ERROR, "aof: write to %s failed: %d", aof_filename(), errno);
+        }
+        g_last_write_ok = 0;
+        return -1;
+    }
+
+    if (!g_last_write_ok) {
+        ck_log(CK_LOG_INFO, "aof: write error cleared");
+    }
+    g_last_write_ok = 1;
+    if (g_buf.cap > AOF_BUF_KEEP) {
+        resp_buf_destroy(&g_buf);
+        resp_buf_init(&g_buf);
+    } else {
+        g_buf.len = 0;
+    }
+    return 0;
+}
+
+static int sync_now(void) {
+    if (ck_fsync(g_fd) != 0) {
+        ck_log(CK_LOG_ERROR, "aof: fsync failed: %d", errno);
+        return -1;
+    }
+    atomic_fetch_add(&g_fsyncs, 1);
+    g_unsynced = 0;
+    g_last_fsync_ms = ck_time_ms();
+    return 0;
+}
+
+/* truncate: start over from the dataset instead of appending to what's there */
+static int open_log(store_t *s, int truncate_log) {
+    const char *filename = aof_filename();
+    int flags = O_WRONLY | O_APPEND | O_CREAT | (truncate_log ? O_TRUNC : 0);
+    int fd = open(filename, flags, 0644);
+    if (fd < 0) {
+        ck_log(CK_LOG_ERROR, "aof: can't open %s: %d", filename, errno);
+        return -1;
+    }
+
+    struct stat st;
+    g_size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    g_fd = fd;
+    g_unsynced = 0;
+    g_last_write_ok = 1;
+    g_last_fsync_ms = ck_time_ms();
+    resp_buf_init(&g_buf);
+    start_thread();
+
+    if (g_size == 0 && store_dbsize(s) > 0) {
+        append_dataset(&g_buf, s);
+        if (write_buffer() != 0 || sync_now() != 0) {
+            ck_log(CK_LOG_ERROR, "aof: failed to write the dataset to %s", filename);
+        } else {
+            ck_log(CK_LOG_INFO, "aof: wrote %zu keys to %s", store_dbsize(s), filename);
+        }
+    }
+
+    g_base_size = g_size;
+    ck_log(CK_LOG_INFO, "aof: appending to %s (appendfsync %s)",
+           filename, fsync_names[g_policy]);
+    return 0;
+}
+
+static void close_log(void) {
+    if (g_fd < 0) return;
+    if (g_rewriting) g_rewrite_stale = 1;
+    aof_flush();
+    stop_thread();
+    if (g_unsynced || g_policy != CK_AOF_FSYNC_NO) sync_now();
+    close(g_fd);
+    g_fd = -1;
+    resp_buf_destroy(&g_buf);
+}
+
+/* settings */
+
+int aof_set_appendonly(store_t *s, int enabled) {
+    g_wanted = enabled;
+    if (!g_started) return 0;
+    if (enabled && g_fd < 0) return open_log(s, 1);
+    if (!enabled) close_log();
+    return 0;
+}
+
+int aof_set_filename(const char *filename) {
+    if (g_fd >= 0) return -1;
+    char *copy = ck_strdup(filename);
+    ck_free(g_filename);
+    g_filename = copy;
+    return 0;
+}
+
+void aof_set_fsync(ck_aof_fsync_t policy) {
+    g_policy = policy;
+}
+
+int aof_wanted(void) {
+    return g_wanted;
+}
+
+const char *aof_filename(void) {
+    return g_filename ? g_filename : CK_AOF_DEFAULT_FILENAME;
+}
+
+ck_aof_fsync_t aof_fsync_policy(void) {
+    return g_policy;
+}
+
+const char *aof_fsync_name(ck_aof_fsync_t policy) {
+    return fsync_names[policy];
+}
+
+int aof_parse_fsync(const char *name, ck_aof_fsync_t *out) {
+    for (size_t i = 0; i < sizeof(fsync_names) / sizeof(fsync_names[0]); i++) {
+        if (strcasecmp(name, fsync_names[i]) == 0) {
+            *out = (ck_aof_fsync_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void aof_set_preamble(int enabled) {
+    g_preamble = enabled;
+}
+
+void aof_set_rewrite_percentage(int pct) {
+    g_rewrite_pct = pct;
+}
+
+void aof_set_rewrite_min_size(size_t bytes) {
+    g_rewrite_min = bytes;
+}
+
+int aof_preamble(void) {
+    return g_preamble;
+}
+
+int aof_rewrite_percentage(void) {
+    return g_rewrite_pct;
+}
+
+size_t aof_rewrite_min_size(void) {
+    return g_rewrite_min;
+}
+
+int aof_start(store_t *s) {
+    g_started = 1;
+    if (!g_wanted || g_fd >= 0) return 0;
+    return open_log(s, 0);
+}
+
+void aof_stop(void) {
+    close_log();
+    g_started = 0;
+}
+
+int aof_enabled(void) {
+    return g_fd >= 0;
+}
+
+void aof_encode(resp_buf_t *b, resp_value_t *cmd) {
+    const char *name = arg_str(cmd, 0);
+    if (!name) return;
+
+    int64_t secs;
+    if (strcasecmp(name, "EXPIRE") == 0 && cmd->array.count >= 3) {
+        const char *key = arg_str(cmd, 1);
+        if (key && ck_str_to_int64(arg_str(cmd, 2), &secs) == 0) {
+            append_expire_at(b, key, ck_wall_time_ms() + secs * 1000);
+        }
+    } else if (strcasecmp(name, "SET") == 0 && cmd->array.count >= 5 &&
+               arg_str(cmd, 3) && strcasecmp(arg_str(cmd, 3), "EX") == 0 &&
+               ck_str_to_int64(arg_str(cmd, 4), &secs) == 0 && secs > 0) {
+        const char *argv[] = { "SET", arg_str(cmd, 1), arg_str(cmd, 2) };
+        if (!argv[1] || !argv[2]) return;
+        append_command(b, 3, argv);
+        append_expire_at(b, argv[1], ck_wall_time_ms() + secs * 1000);
+    } else {
+        resp_write_array_header(b, cmd->array.count);
+        for (int i = 0; i < cmd->array.count; i++) {
+            const char *arg = arg_str(cmd, i);
+            if (!arg) arg = "";
+            resp_write_bulk_string(b, arg, strlen(arg));
+        }
+    }
+}
+
+void aof_feed(resp_value_t *cmd) {
+    if (g_fd < 0) return;
+
+    size_t start = g_buf.len;
+    aof_encode(&g_buf, cmd);
+
+    /* the rewrite child only sees the dataset as of the fork */
+    if (g_rewriting) {
+        resp_buf_append(&g_rewrite_buf, g_buf.buf + start, g_buf.len - start);
+    }
+}
+
+int aof_flush(void) {
+    if (g_fd < 0) return 0;
+
+    if (g_buf.len > 0) {
+        if (write_buffer() != 0) return -1;
+        g_unsynced = 1;
+    }
+    if (!g_unsynced) return 0;
+
+    switch (g_policy) {
+        case CK_AOF_FSYNC_ALWAYS:
+            /* one fsync covers every command since the last iteration */
+            return sync_now();
+        case CK_AOF_FSYNC_EVERYSEC: {
+            int64_t now = ck_time_ms();
+            if (now - g_last_fsync_ms < 1000) break;
+            if (!g_thread_running) return sync_now();
+            /* a slow disk may still be on the previous one; try again
+             * next time rather than queueing behind it */
+            if (atomic_load(&g_fsync_busy)) break;
+            request_fsync(g_fd);
+            g_unsynced = 0;
+            g_last_fsync_ms = now;
+            break;
+        }
+        case CK_AOF_FSYNC_NO:
+            g_unsynced = 0;
+            break;
+    }
+    return 0;
+}
+
+/* rewrite */
+
+static int write_rewrite(store_t *s, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return -1;
+
+    int rc;
+    if (g_preamble) {
+        rc = persistence_write(s, f);
+    } else {
+        resp_buf_t b;
+        resp_buf_init(&b);
+        append_dataset(&b, s);
+        rc = fwrite(b.buf, 1, b.len, f) == b.len ? 0 : -1;
+        resp_buf_destroy(&b);
+    }
+    if (fflush(f) != 0 || ck_fsync(fileno(f)) != 0) rc = -1;
+    if (fclose(f) != 0) rc = -1;
+    return rc;
+}
+
+/* finish the child's file with what arrived meanwhile and put it in place */
+static int install_rewrite(void) {
+    int fd = open(g_rewrite_tmp, O_WRONLY | O_APPEND);
+    if (fd < 0) return -1;
+
+    if (write_all(fd, g_rewrite_buf.buf, g_rewrite_buf.len) != g_rewrite_buf.len ||
+        ck_fsync(fd) != 0 || rename(g_rewrite_tmp, aof_filename()) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct stat st;
+    size_t size = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    if (g_fd >= 0) {
+        /* everything still buffered for the old file is in the rewrite
+         * buffer too, so it is already in the new one */
+        wait_fsync();
+        close(g_fd);
+        g_fd = fd;
+        g_buf.len = 0;
+        g_unsynced = 0;
+        g_size = size;
+        g_base_size = size;
+    } else {
+        close(fd);
+    }
+    ck_log(CK_LOG_INFO, "aof: rewrite installed, %s is now %zu bytes", aof_filename(), size);
+    return 0;
+}
+
+int aof_rewrite_start(store_t *s) {
+    if (g_rewriting) return -1;
+    snprintf(g_rewrite_tmp, sizeof(g_rewrite_tmp), "%s.rewrite.tmp", aof_filename());
+
+    int pid = child_fork(CK_CHILD_AOF);
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        child_exit(write_rewrite(s, g_rewrite_tmp) == 0);
+    }
+
+    g_rewriting = 1;
+    g_rewrite_scheduled = 0;
+    g_rewrite_stale = 0;
+    resp_buf_init(&g_rewrite_buf);
+    ck_log(CK_LOG_INFO, "aof: background rewrite started by pid %d", pid);
+    return 0;
+}
+
+void aof_rewrite_schedule(void) {
+    g_rewrite_scheduled = 1;
+}
+
+void aof_rewrite_done(int ok, size_t cow_bytes, int64_t duration_ms) {
+    g_rewriting = 0;
+    g_last_rewrite_ms = duration_ms;
+    g_last_cow_bytes = cow_bytes;
+
+    if (ok && g_rewrite_stale) {
+        ok = 0;
+        ck_log(CK_LOG_WARN, "aof: log was turned off during the rewrite, discarding it");
+    } else if (ok && install_rewrite() != 0) {
+        ok = 0;
+        ck_log(CK_LOG_ERROR, "aof: failed to install rewrite: %d", errno);
+    } else if (!ok) {
+        ck_log(CK_LOG_ERROR, "aof: background rewrite failed");
+    }
+    if (!ok) remove(g_rewrite_tmp);
+
+    resp_buf_destroy(&g_rewrite_buf);
+    g_last_rewrite_ok = ok;
+    if (ok) g_rewrites++;
+}
+
+void aof_cron(store_t *s) {
+    if (g_rewriting || child_active()) return;
+
+    if (g_rewrite_scheduled) {
+        aof_rewrite_start(s);
+        return;
+    }
+
+    if (g_fd < 0 || g_rewrite_pct <= 0 || g_size < g_rewrite_min) return;
+    size_t base = g_base_size ? g_base_size : 1;
+    if (g_size > base && (double)(g_size - base) * 100 / (double)base >= g_rewrite_pct) {
+        ck_log(CK_LOG_INFO, "aof: starting rewrite, %zu bytes is %d%% over %zu",
+               g_size, g_rewrite_pct, base);
+        aof_rewrite_start(s);
+    }
+}
+
+int64_t aof_load(command_ctx_t *ctx, const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return -1;
+
+    /* a rewritten log starts with a snapshot of the dataset */
+    size_t preamble = 0;
+    char magic[8];
+    int has_preamble = fread(magic, 1, 8, f) == 8 && memcmp(magic, CK_RDB_MAGIC, 8) == 0;
+    rewind(f);
+    if (has_preamble) {
+        int keys = persistence_read(ctx->store, f);
+        long pos = ftell(f);
+        if (keys < 0 || pos < 0) {
+            ck_log(CK_LOG_ERROR, "aof: bad snapshot preamble in %s", filename);
+            fclose(f);
+            return -1;
+        }
+        preamble = (size_t)pos;
+        ck_log(CK_LOG_INFO, "aof: loaded %d keys from the preamble of %s", keys, filename);
+    }
+
+    resp_parser_t parser;
+    resp_parser_init(&parser);
+    resp_buf_t reply;
+    resp_buf_init(&reply);
+
+    int64_t processed = ctx->commands_processed;
+    int64_t applied = 0;
+    size_t fed = 0;
+    int bad = 0;
+    char chunk[16384];
+    size_t n;
+
+    /* these writes were accepted once already */
+    ctx->replaying = 1;
+    while (!bad && (n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+        resp_parser_feed(&parser, chunk, n);
+        fed += n;
+
+        resp_value_t *cmd;
+        while (resp_parse(&parser, &cmd) == 1) {
+            if (cmd->type != RESP_ARRAY || cmd->array.count < 1) {
+                resp_value_free(cmd);
+                bad = 1;
+                break;
+            }
+            reply.len = 0;
+            command_dispatch(ctx, cmd, &reply);
+            resp_value_free(cmd);
+            applied++;
+        }
+    }
+    ctx->replaying = 0;
+    fclose(f);
+
+    size_t valid = preamble + fed - (parser.len - parser.pos);
+    resp_parser_destroy(&parser);
+    resp_buf_destroy(&reply);
+    ctx->commands_processed = processed;
+
+    if (bad) {
+        ck_log(CK_LOG_ERROR, "aof: %s is not a command log (offset %zu)", filename, valid);
+        return -1;
+    }
+    if (valid < preamble + fed) {
+        ck_log(CK_LOG_WARN, "aof: %s ends with an incomplete command, dropping %zu bytes",
+               filename, preamble + fed - valid);
+#ifndef _WIN32
+        if (truncate(filename, (off_t)valid) != 0) {
+            ck_log(CK_LOG_ERROR, "aof: can't truncate %s: %d", filename, errno);
+            return -1;
+        }
+#endif
+    }
+
+    ck_log(CK_LOG_INFO, "aof: replayed %lld commands from %s", (long long)applied, filename);
+    return applied;
+}
+
+size_t aof_current_size(void) {
+    return g_size;
+}
+
+size_t aof_buffer_length(void) {
+    return g_fd >= 0 ? g_buf.len : 0;
+}
+
+size_t aof_memory(void) {
+    return ck_malloc_size(g_buf.buf) + ck_malloc_size(g_rewrite_buf.buf);
+}
+
+int aof_fsync_in_progress(void) {
+    return atomic_load(&g_fsync_busy);
+}
+
+uint64_t aof_fsync_count(void) {
+    return atomic_load(&g_fsyncs);
+}
+
+int aof_last_write_ok(void) {
+    return g_last_write_ok;
+}
+
+size_t aof_base_size(void) {
+    return g_base_size;
+}
+
+int aof_rewrite_in_progress(void) {
+    return g_rewriting;
+}
+
+int aof_rewrite_scheduled(void) {
+    return g_rewrite_scheduled;
+}
+
+int aof_last_rewrite_ok(void) {
+    return g_last_rewrite_ok;
+}
+
+int64_t aof_last_rewrite_duration_ms(void) {
+    return g_last_rewrite_ms;
+}
+
+size_t aof_last_cow_bytes(void) {
+    return g_last_cow_bytes;
+}
+
+uint64_t aof_rewrite_count(void) {
+    return g_rewrites;
+}
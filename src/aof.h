@@ -0,0 +1,99 @@
+#ifndef CK_AOF_H
+#define CK_AOF_H
+
+#include "command.h"
+#include "protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* append-only file: every successful write command is appended in RESP
+ * form and replayed at startup. writes are buffered and flushed once per
+ * event-loop iteration, before any reply to them is sent */
+typedef enum {
+    CK_AOF_FSYNC_NO,        /* leave it to the kernel */
+    CK_AOF_FSYNC_EVERYSEC,  /* fdatasync once a second on a background thread */
+    CK_AOF_FSYNC_ALWAYS     /* fdatasync every flush (group commit per iteration) */
+} ck_aof_fsync_t;
+
+#define CK_AOF_DEFAULT_FILENAME "appendonly.aof"
+
+/* settings. appendonly only records the wish until aof_start() has been
+ * called; after that it opens or closes the file right away */
+int aof_set_appendonly(store_t *s, int enabled);
+int aof_set_filename(const char *filename);
+void aof_set_fsync(ck_aof_fsync_t policy);
+int aof_wanted(void);
+const char *aof_filename(void);
+ck_aof_fsync_t aof_fsync_policy(void);
+const char *aof_fsync_name(ck_aof_fsync_t policy);
+int aof_parse_fsync(const char *name, ck_aof_fsync_t *out);
+/* rewrites start the file with a snapshot (yes) or with commands (no) */
+void aof_set_preamble(int enabled);
+/* automatic rewrite once the file has grown by pct over its size after the
+ * last rewrite, and is at least min_size. 0 turns it off */
+void aof_set_rewrite_percentage(int pct);
+void aof_set_rewrite_min_size(size_t bytes);
+int aof_preamble(void);
+int aof_rewrite_percentage(void);
+size_t aof_rewrite_min_size(void);
+
+/* open the file if appendonly is set. a new or empty file is seeded with
+ * the current dataset so it can stand in for the snapshot on restart */
+int aof_start(store_t *s);
+/* flush, fsync and close; settings are kept */
+void aof_stop(void);
+int aof_enabled(void);
+
+/* buffer a write command. relative expiries are rewritten as absolute
+ * PEXPIREAT so a replay doesn't extend them */
+void aof_feed(resp_value_t *cmd);
+/* append cmd to b the way the log records it (also the replication
+ * stream) */
+void aof_encode(resp_buf_t *b, resp_value_t *cmd);
+/* append the commands that rebuild key and its TTL, each after prefix
+ * (raw RESP, may be NULL), and return how many there are. for rewrites,
+ * and for MIGRATE with ASKING as the prefix */
+int aof_encode_key(resp_buf_t *b, const char *key, const store_entry_t *e, const char *prefix);
+
+/* write the buffer and fsync according to the policy. called before the
+ * event loop sleeps and from the cron. returns -1 if the write failed;
+ * the data stays buffered and is retried */
+int aof_flush(void);
+
+/* compact the log: a forked child writes the current dataset to a new
+ * file while writes keep going to the old one and to a rewrite buffer.
+ * when the child is done the buffer is appended and the new file renamed
+ * over the old. returns 0 once the child is started, -1 if a rewrite is
+ * running or fork() failed */
+int aof_rewrite_start(store_t *s);
+/* start a rewrite from the cron once no other child is running */
+void aof_rewrite_schedule(void);
+/* the rewrite child has exited (see child_poll()) */
+void aof_rewrite_done(int ok, size_t cow_bytes, int64_t duration_ms);
+/* scheduled and automatic rewrites */
+void aof_cron(store_t *s);
+
+/* replay a log through command_dispatch, after loading its snapshot
+ * preamble if it has one. a truncated last command (crash mid-write) is
+ * dropped and cut from the file. returns the number of
+ * commands applied, -1 if the file can't be read or isn't RESP */
+int64_t aof_load(command_ctx_t *ctx, const char *filename);
+
+/* stats */
+size_t aof_current_size(void);
+size_t aof_buffer_length(void);
+/* what the write buffer and the rewrite buffer hold allocated */
+size_t aof_memory(void);
+int aof_fsync_in_progress(void);
+uint64_t aof_fsync_count(void);
+int aof_last_write_ok(void);
+size_t aof_base_size(void);
+int aof_rewrite_in_progress(void);
+int aof_rewrite_scheduled(void);
+int aof_last_rewrite_ok(void);
+/* -1 before the first rewrite */
+int64_t aof_last_rewrite_duration_ms(void);
+size_t aof_last_cow_bytes(void);
+uint64_t aof_rewrite_count(void);
+
+#endif
@@ -0,0 +1,122 @@
+#include "child.h"
+#include "hashtable.h"
+#include "util.h"
+
+#ifdef _WIN32
+/* no fork(): background saves aren't available */
+int child_fork(ck_child_type_t type) {
+    (void)type;
+    return -1;
+}
+
+void child_exit(int ok) {
+    (void)ok;
+}
+
+int child_poll(child_result_t *res) {
+    (void)res;
+    return 0;
+}
+
+int child_active(void) {
+    return 0;
+}
+
+ck_child_type_t child_type(void) {
+    return CK_CHILD_NONE;
+}
+
+int64_t child_elapsed_ms(void) {
+    return -1;
+}
+#else
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <errno.h>
+
+static pid_t g_pid = -1;
+static ck_child_type_t g_type = CK_CHILD_NONE;
+static int64_t g_start_ms;
+static int g_info_fd = -1;   /* read end in the parent, write end in the child */
+
+int child_fork(ck_child_type_t type) {
+    if (g_pid != -1) return -1;
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        ck_log(CK_LOG_ERROR, "pipe() failed: %d", errno);
+        return -1;
+    }
+
+    int64_t start = ck_time_ms();
+    pid_t pid = fork();
+    if (pid < 0) {
+        ck_log(CK_LOG_ERROR, "fork() failed: %d", errno);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        g_info_fd = fds[1];
+        return 0;
+    }
+
+    close(fds[1]);
+    g_info_fd = fds[0];
+    g_pid = pid;
+    g_type = type;
+    g_start_ms = start;
+    ht_set_resize_allowed(0);
+    return (int)pid;
+}
+
+void child_exit(int ok) {
+    size_t cow = ck_mem_private_dirty();
+    if (g_info_fd != -1) {
+        ssize_t n = write(g_info_fd, &cow, sizeof(cow));
+        (void)n;
+        close(g_info_fd);
+    }
+    /* skip atexit handlers and stdio flushing: they belong to the parent */
+    _exit(ok ? 0 : 1);
+}
+
+int child_poll(child_result_t *res) {
+    if (g_pid == -1) return 0;
+
+    int status;
+    pid_t r = waitpid(g_pid, &status, WNOHANG);
+    if (r == 0) return 0;
+
+    res->type = g_type;
+    res->ok = r == g_pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    res->duration_ms = ck_time_ms() - g_start_ms;
+    res->cow_bytes = 0;
+
+    /* the child wrote before exiting, so this doesn't block */
+    size_t cow;
+    if (read(g_info_fd, &cow, sizeof(cow)) == (ssize_t)sizeof(cow)) res->cow_bytes = cow;
+    close(g_info_fd);
+
+    g_info_fd = -1;
+    g_pid = -1;
+    g_type = CK_CHILD_NONE;
+    ht_set_resize_allowed(1);
+    return 1;
+}
+
+int child_active(void) {
+    return g_pid != -1;
+}
+
+ck_child_type_t child_type(void) {
+    return g_type;
+}
+
+int64_t child_elapsed_ms(void) {
+    return g_pid == -1 ? -1 : ck_time_ms() - g_start_ms;
+}
+#endif
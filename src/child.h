@@ -0,0 +1,38 @@
+#ifndef CK_CHILD_H
+#define CK_CHILD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* forked background work. at most one child runs at a time; while it
+ * does, hashtable resizing is held back so fewer pages get copied */
+typedef enum {
+    CK_CHILD_NONE,
+    CK_CHILD_RDB,     /* BGSAVE */
+    CK_CHILD_AOF      /* BGREWRITEAOF */
+} ck_child_type_t;
+
+typedef struct {
+    ck_child_type_t type;
+    int ok;              /* exited with status 0 */
+    size_t cow_bytes;    /* copied-on-write memory, as the child last saw it */
+    int64_t duration_ms;
+} child_result_t;
+
+/* fork a child of the given type. returns the pid in the parent, 0 in the
+ * child, -1 if a child is already running or fork() failed */
+int child_fork(ck_child_type_t type);
+
+/* in the child: report copy-on-write usage to the parent and exit */
+void child_exit(int ok);
+
+/* in the parent: reap the child if it has exited. returns 1 and fills
+ * *res if it has, 0 if it is still running or there is none */
+int child_poll(child_result_t *res);
+
+int child_active(void);
+ck_child_type_t child_type(void);
+/* ms since the running child was forked, -1 if there is none */
+int64_t child_elapsed_ms(void);
+
+#endif
@@ -0,0 +1,521 @@
+#include "cluster.h"
+#include "aof.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static int g_enabled;
+static char g_config_file[256] = CK_CLUSTER_DEFAULT_CONFIG;
+static char g_announce_ip[64] = CK_CLUSTER_DEFAULT_ANNOUNCE_IP;
+static int g_port;
+static int g_loaded;            /* the slot map has been read (or started) */
+
+/* nodes by address, "host:port"; node 0 is this one. slots refer to
+ * them by index, -1 for none */
+static char *g_nodes[CK_CLUSTER_MAX_NODES];
+static int g_n_nodes;
+static int16_t g_owner[CK_CLUSTER_SLOTS];
+static int16_t g_migrating[CK_CLUSTER_SLOTS];  /* to, while ours */
+static int16_t g_importing[CK_CLUSTER_SLOTS];  /* from, while not yet ours */
+
+static void set_myself(void) {
+    char addr[96];
+    snprintf(addr, sizeof(addr), "%s:%d", g_announce_ip, g_port);
+    ck_free(g_nodes[0]);
+    g_nodes[0] = ck_strdup(addr);
+    if (g_n_nodes == 0) g_n_nodes = 1;
+}
+
+static void reset_map(void) {
+    for (int i = 0; i < CK_CLUSTER_SLOTS; i++) {
+        g_owner[i] = -1;
+        g_migrating[i] = -1;
+        g_importing[i] = -1;
+    }
+}
+
+void cluster_set_enabled(store_t *s, int enabled) {
+    g_enabled = enabled;
+    store_slot_index(s, enabled);
+}
+
+int cluster_set_config_file(const char *path) {
+    if (strlen(path) >= sizeof(g_config_file)) return -1;
+    snprintf(g_config_file, sizeof(g_config_file), "%s", path);
+    return 0;
+}
+
+int cluster_set_announce_ip(const char *ip) {
+    if (strlen(ip) >= sizeof(g_announce_ip) || strchr(ip, ':') || !ip[0]) return -1;
+    snprintf(g_announce_ip, sizeof(g_announce_ip), "%s", ip);
+    if (g_loaded) set_myself();
+    return 0;
+}
+
+int cluster_enabled(void) {
+    return g_enabled;
+}
+
+const char *cluster_config_file(void) {
+    return g_config_file;
+}
+
+const char *cluster_announce_ip(void) {
+    return g_announce_ip;
+}
+
+/* host:port with a port in range */
+static int valid_addr(const char *addr) {
+    const char *colon = strrchr(addr, ':');
+    int64_t port;
+    return colon && colon != addr && strlen(addr) < 300 &&
+           ck_str_to_int64(colon + 1, &port) == 0 && port > 0 && port <= 65535;
+}
+
+/* index of a node, added if it's new; -1 if addr isn't host:port or
+ * there are too many */
+static int node_index(const char *addr) {
+    if (!valid_addr(addr)) return -1;
+    for (int i = 0; i < g_n_nodes; i++) {
+        if (strcmp(g_nodes[i], addr) == 0) return i;
+    }
+    if (g_n_nodes == CK_CLUSTER_MAX_NODES) return -1;
+    g_nodes[g_n_nodes] = ck_strdup(addr);
+    return g_n_nodes++;
+}
+
+/* the config file: one line per range of slots with the same owner, then
+ * the slots being moved. written to a temporary file and renamed over */
+static void save_config(void) {
+    char tmp[300];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", g_config_file);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        ck_log(CK_LOG_WARN, "cluster: can't write %s", tmp);
+        return;
+    }
+    fprintf(f, "# cachekit cluster slot map, rewritten on every change\n");
+    for (int i = 0; i < CK_CLUSTER_SLOTS;) {
+        int j = i;
+        while (j + 1 < CK_CLUSTER_SLOTS && g_owner[j + 1] == g_owner[i]) j++;
+        if (g_owner[i] >= 0) fprintf(f, "slots %d-%d %s\n", i, j, g_nodes[g_owner[i]]);
+        i = j + 1;
+    }
+    for (int i = 0; i < CK_CLUSTER_SLOTS; i++) {
+        if (g_migrating[i] >= 0) fprintf(f, "migrating %d %s\n", i, g_nodes[g_migrating[i]]);
+        if (g_importing[i] >= 0) fprintf(f, "importing %d %s\n", i, g_nodes[g_importing[i]]);
+    }
+    int ok = fflush(f) == 0;
+    if (fclose(f) != 0) ok = 0;
+    if (!ok || rename(tmp, g_config_file) != 0) {
+        ck_log(CK_LOG_WARN, "cluster: can't save the slot map to %s", g_config_file);
+        remove(tmp);
+    }
+}
+
+static int parse_range(const char *spec, int *first, int *last) {
+    char extra;
+    if (sscanf(spec, "%d-%d%c", first, last, &extra) == 2) {
+        /* a range */
+    } else if (sscanf(spec, "%d%c", first, &extra) == 1) {
+        *last = *first;
+    } else {
+        return -1;
+    }
+    return *first >= 0 && *first <= *last && *last < CK_CLUSTER_SLOTS ? 0 : -1;
+}
+
+static int load_config(void) {
+    FILE *f = fopen(g_config_file, "r");
+    if (!f) return 0;  /* a new node: no slots yet */
+    char line[512];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char what[16], range[32], addr[320];
+        if (line[0] == '#' || line[0] == '\n') continue;
+        int first, last, node;
+        if (sscanf(line, "%15s %31s %319s", what, range, addr) != 3 ||
+            parse_range(range, &first, &last) != 0 || (node = node_index(addr)) < 0) {
+            ck_log(CK_LOG_ERROR, "cluster: %s:%d: bad line", g_config_file, lineno);
+            fclose(f);
+            return -1;
+        }
+        for (int i = first; i <= last; i++) {
+            if (strcmp(what, "slots") == 0) {
+                g_owner[i] = (int16_t)node;
+            } else if (strcmp(what, "migrating") == 0) {
+                g_migrating[i] = (int16_t)node;
+            } else if (strcmp(what, "importing") == 0) {
+                g_importing[i] = (int16_t)node;
+            }
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+int cluster_init(store_t *s, int port) {
+    (void)s;
+    g_port = port;
+    reset_map();
+    for (int i = 1; i < g_n_nodes; i++) {
+        ck_free(g_nodes[i]);
+        g_nodes[i] = NULL;
+    }
+    g_n_nodes = 0;
+    set_myself();
+    g_loaded = 1;
+    if (!g_enabled) return 0;
+    if (load_config() != 0) return -1;
+    int mine = 0;
+    for (int i = 0; i < CK_CLUSTER_SLOTS; i++) mine += g_owner[i] == 0;
+    ck_log(CK_LOG_INFO, "cluster mode as %s, serving %d slots", g_nodes[0], mine);
+    return 0;
+}
+
+int cluster_route(store_t *s, const char **keys, int n, int asking, char *err, size_t errlen) {
+    int slot = -1;
+    for (int i = 0; i < n; i++) {
+        int k = (int)store_key_slot(keys[i]);
+        if (slot >= 0 && k != slot) {
+            snprintf(err, errlen, "CROSSSLOT Keys in request don't hash to the same slot");
+            return -1;
+        }
+        slot = k;
+    }
+    if (slot < 0) return 0;
+
+    int owner = g_owner[slot];
+    if (owner == 0) {
+        if (g_migrating[slot] < 0) return 0;
+        /* keys already moved (or new ones) are the target's business */
+        int missing = 0;
+        for (int i = 0; i < n; i++) missing += store_peek(s, keys[i]) == NULL;
+        if (missing == 0) return 0;
+        if (missing < n) {
+            snprintf(err, errlen, "TRYAGAIN Multiple keys request during rehashing of slot");
+        } else {
+            snprintf(err, errlen, "ASK %d %s", slot, g_nodes[g_migrating[slot]]);
+        }
+        return -1;
+    }
+    if (asking && g_importing[slot] >= 0) return 0;
+    if (owner < 0) {
+        snprintf(err, errlen, "CLUSTERDOWN Hash slot not served");
+    } else {
+        snprintf(err, errlen, "MOVED %d %s", slot, g_nodes[owner]);
+    }
+    return -1;
+}
+
+int cluster_add_slots(const int *ranges, int n_ranges, char *err, size_t errlen) {
+    for (int r = 0; r < n_ranges; r++) {
+        for (int i = ranges[2 * r]; i <= ranges[2 * r + 1]; i++) {
+            if (g_owner[i] >= 0) {
+                snprintf(err, errlen, "Slot %d is already busy", i);
+                return -1;
+            }
+        }
+    }
+    for (int r = 0; r < n_ranges; r++) {
+        for (int i = ranges[2 * r]; i <= ranges[2 * r + 1]; i++) {
+            g_owner[i] = 0;
+            g_importing[i] = -1;
+        }
+    }
+    save_config();
+    return 0;
+}
+
+int cluster_del_slots(const int *ranges, int n_ranges, char *err, size_t errlen) {
+    for (int r = 0; r < n_ranges; r++) {
+        for (int i = ranges[2 * r]; i <= ranges[2 * r + 1]; i++) {
+            if (g_owner[i] < 0) {
+                snprintf(err, errlen, "Slot %d is already unassigned", i);
+                return -1;
+            }
+        }
+    }
+    for (int r = 0; r < n_ranges; r++) {
+        for (int i = ranges[2 * r]; i <= ranges[2 * r + 1]; i++) {
+            g_owner[i] = -1;
+            g_migrating[i] = -1;
+            g_importing[i] = -1;
+        }
+    }
+    save_config();
+    return 0;
+}
+
+int cluster_set_slot(store_t *s, int first, int last, ck_slot_state_t how, const char *node,
+                     char *err, size_t errlen) {
+    int idx = -1;
+    if (how != CK_SLOT_STABLE && (idx = node_index(node)) < 0) {
+        snprintf(err, errlen, "Unknown node address '%s' (host:port)", node);
+        return -1;
+    }
+    for (int i = first; i <= last; i++) {
+        if (how == CK_SLOT_MIGRATING && g_owner[i] != 0) {
+            snprintf(err, errlen, "I'm not the owner of hash slot %d", i);
+            return -1;
+        }
+        if ((how == CK_SLOT_MIGRATING || how == CK_SLOT_IMPORTING) && idx == 0) {
+            snprintf(err, errlen, "Slot %d can't be moved to or from this node itself", i);
+            return -1;
+        }
+        if (how == CK_SLOT_IMPORTING && g_owner[i] == 0) {
+            snprintf(err, errlen, "I'm already the owner of hash slot %d", i);
+            return -1;
+        }
+        if (how == CK_SLOT_NODE && idx != 0 && g_owner[i] == 0 && g_migrating[i] < 0 &&
+            store_slot_count(s, (unsigned)i) > 0) {
+            snprintf(err, errlen, "Can't assign hashslot %d to a different node while I still "
+                     "hold keys for this hash slot.", i);
+            return -1;
+        }
+    }
+    for (int i = first; i <= last; i++) {
+        switch (how) {
+            case CK_SLOT_NODE:
+                g_owner[i] = (int16_t)idx;
+                g_migrating[i] = -1;
+                g_importing[i] = -1;
+                break;
+            case CK_SLOT_MIGRATING:
+                g_migrating[i] = (int16_t)idx;
+                break;
+            case CK_SLOT_IMPORTING:
+                g_importing[i] = (int16_t)idx;
+                break;
+            case CK_SLOT_STABLE:
+                g_migrating[i] = -1;
+                g_importing[i] = -1;
+                break;
+        }
+    }
+    save_config();
+    return 0;
+}
+
+void cluster_slots(resp_buf_t *out) {
+    int n = 0;
+    for (int i = 0; i < CK_CLUSTER_SLOTS;) {
+        int j = i;
+        while (j + 1 < CK_CLUSTER_SLOTS && g_owner[j + 1] == g_owner[i]) j++;
+        n += g_owner[i] >= 0;
+        i = j + 1;
+    }
+    resp_write_array_header(out, n);
+    for (int i = 0; i < CK_CLUSTER_SLOTS;) {
+        int j = i;
+        while (j + 1 < CK_CLUSTER_SLOTS && g_owner[j + 1] == g_owner[i]) j++;
+        if (g_owner[i] >= 0) {
+            const char *addr = g_nodes[g_owner[i]];
+            const char *colon = strrchr(addr, ':');
+            resp_write_array_header(out, 3);
+            resp_write_integer(out, i);
+            resp_write_integer(out, j);
+            resp_write_array_header(out, 2);
+            resp_write_bulk_string(out, addr, (size_t)(colon - addr));
+            resp_write_integer(out, atoi(colon + 1));
+        }
+        i = j + 1;
+    }
+}
+
+void cluster_info(char *buf, size_t len) {
+    int assigned = 0, mine = 0, moving = 0;
+    int serving[CK_CLUSTER_MAX_NODES] = { 0 };
+    for (int i = 0; i < CK_CLUSTER_SLOTS; i++) {
+        if (g_owner[i] >= 0) {
+            assigned++;
+            serving[g_owner[i]] = 1;
+        }
+        mine += g_owner[i] == 0;
+        moving += g_migrating[i] >= 0 || g_importing[i] >= 0;
+    }
+    int size = 0;
+    for (int i = 0; i < g_n_nodes; i++) size += serving[i];
+    snprintf(buf, len,
+             "cluster_state:%s\r\ncluster_slots_assigned:%d\r\ncluster_slots_ok:%d\r\n"
+             "cluster_known_nodes:%d\r\ncluster_size:%d\r\ncluster_my_slots:%d\r\n"
+             "cluster_slots_moving:%d\r\ncluster_myself:%s\r\n",
+             assigned == CK_CLUSTER_SLOTS ? "ok" : "fail", assigned, assigned, g_n_nodes, size,
+             mine, moving, g_nodes[0] ? g_nodes[0] : "");
+}
+
+#ifdef _WIN32
+int cluster_migrate(store_t *s, const char *host, int port, char **keys, int n,
+                    int64_t timeout_ms, int replace, char *err, size_t errlen) {
+    (void)s;
+    (void)host;
+    (void)port;
+    (void)keys;
+    (void)n;
+    (void)timeout_ms;
+    (void)replace;
+    snprintf(err, errlen, "MIGRATE is not supported on this platform");
+    return -1;
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+static const char asking[] = "*1\r\n$6\r\nASKING\r\n";
+
+/* connected, blocking, with send and receive timeouts; -1 on failure */
+static int migrate_connect(const char *host, int port, int64_t timeout_ms) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char portstr[16];
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    if (getaddrinfo(host, portstr, &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+        freeaddrinfo(res);
+        return -1;
+    }
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    int rc = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc != 0 && errno == EINPROGRESS) {
+        fd_set wr;
+        FD_ZERO(&wr);
+        FD_SET(fd, &wr);
+        struct timeval tv = { (long)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000 };
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (select(fd + 1, NULL, &wr, NULL, &tv) == 1 &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0) {
+            rc = 0;
+        }
+    }
+    if (rc != 0) {
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, flags);
+    struct timeval tv = { (long)(timeout_ms / 1000), (long)(timeout_ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+static int send_buf(int fd, const resp_buf_t *b) {
+    size_t off = 0;
+    while (off < b->len) {
+        ssize_t w = send(fd, b->buf + off, b->len - off, MSG_NOSIGNAL);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        off += (size_t)w;
+    }
+    return 0;
+}
+
+/* read n replies. the first error one fails the lot; *last is set to the
+ * last reply's integer, if it is one */
+static int read_replies(int fd, resp_parser_t *p, int n, int64_t *last, char *err,
+                        size_t errlen) {
+    char buf[4096];
+    while (n > 0) {
+        resp_value_t *v;
+        if (resp_parse(p, &v) == 1) {
+            int bad = v->type == RESP_ERROR;
+            if (bad) snprintf(err, errlen, "ERR Target instance replied with error: %s", v->str);
+            if (v->type == RESP_INTEGER && last) *last = v->integer;
+            resp_value_free(v);
+            if (bad) return -1;
+            n--;
+            continue;
+        }
+        ssize_t r = recv(fd, buf, sizeof(buf), 0);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) {
+            snprintf(err, errlen, "IOERR error or timeout reading from target instance");
+            return -1;
+        }
+        resp_parser_feed(p, buf, (size_t)r);
+    }
+    return 0;
+}
+
+int cluster_migrate(store_t *s, const char *host, int port, char **keys, int n,
+                    int64_t timeout_ms, int replace, char *err, size_t errlen) {
+    int found = 0;
+    for (int i = 0; i < n; i++) found += store_peek(s, keys[i]) != NULL;
+    if (found == 0) return 0;
+
+    resp_buf_t b;
+    resp_buf_init(&b);
+    int replies = 0, sent = 0;
+
+    int fd = migrate_connect(host, port, timeout_ms);
+    if (fd < 0) {
+        snprintf(err, errlen, "IOERR error or timeout connecting to the client");
+        resp_buf_destroy(&b);
+        return -1;
+    }
+    resp_parser_t p;
+    resp_parser_init(&p);
+
+    if (!replace) {
+        /* all or nothing: first make sure the target has none of them */
+        resp_buf_append(&b, asking, sizeof(asking) - 1);
+        resp_write_array_header(&b, n + 1);
+        resp_write_bulk_string(&b, "EXISTS", 6);
+        for (int i = 0; i < n; i++) resp_write_bulk_string(&b, keys[i], strlen(keys[i]));
+        int64_t existing = 0;
+        if (send_buf(fd, &b) != 0) {
+            snprintf(err, errlen, "IOERR error or timeout writing to target instance");
+            sent = -1;
+        } else if (read_replies(fd, &p, 2, &existing, err, errlen) != 0) {
+            sent = -1;
+        } else if (existing > 0) {
+            snprintf(err, errlen, "BUSYKEY Target key name already exists.");
+            sent = -1;
+        }
+        b.len = 0;
+    }
+
+    for (int i = 0; i < n && sent >= 0; i++) {
+        store_entry_t *e = store_peek(s, keys[i]);
+        if (!e) continue;
+        if (replace) {
+            const char *del[] = { "DEL", keys[i] };
+            resp_buf_append(&b, asking, sizeof(asking) - 1);
+            resp_write_array_header(&b, 2);
+            for (int j = 0; j < 2; j++) resp_write_bulk_string(&b, del[j], strlen(del[j]));
+            replies += 2;
+        }
+        replies += 2 * aof_encode_key(&b, keys[i], e, asking);
+        sent++;
+    }
+    if (sent > 0) {
+        if (send_buf(fd, &b) != 0) {
+            snprintf(err, errlen, "IOERR error or timeout writing to target instance");
+            sent = -1;
+        } else if (read_replies(fd, &p, replies, NULL, err, errlen) != 0) {
+            sent = -1;
+        }
+    }
+
+    resp_parser_destroy(&p);
+    resp_buf_destroy(&b);
+    close(fd);
+    return sent;
+}
+
+#endif
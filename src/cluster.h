@@ -0,0 +1,74 @@
+#ifndef CK_CLUSTER_H
+#define CK_CLUSTER_H
+
+#include "protocol.h"
+#include "store.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* cluster mode: the keyspace is split into CK_CLUSTER_SLOTS hash slots
+ * (store_key_slot) spread over several servers. every node knows which
+ * node serves each slot by its address, host:port, and answers a command
+ * on keys of another node's slot with -MOVED <slot> <host>:<port>. there
+ * is no gossip between nodes: the slot map is set on each of them with
+ * CLUSTER ADDSLOTS (its own slots) and CLUSTER SETSLOT (any slot), and
+ * kept in cluster-config-file across restarts.
+ *
+ * a slot moves while it is being served. the target is told it is
+ * IMPORTING the slot from the source, the source that it is MIGRATING it
+ * to the target, and MIGRATE moves its keys (CLUSTER GETKEYSINSLOT lists
+ * them). meanwhile the source serves the keys it still has and answers
+ * -ASK <slot> <target> for the others, and the target serves the slot
+ * only to a command that follows ASKING. SETSLOT <slot> NODE <target> on
+ * every node ends it */
+#define CK_CLUSTER_MAX_NODES 256
+#define CK_CLUSTER_DEFAULT_CONFIG "nodes.conf"
+#define CK_CLUSTER_DEFAULT_ANNOUNCE_IP "127.0.0.1"
+
+typedef enum {
+    CK_SLOT_NODE,       /* served by the given node from now on */
+    CK_SLOT_MIGRATING,  /* ours, moving to the given node */
+    CK_SLOT_IMPORTING,  /* the given node's, moving to us */
+    CK_SLOT_STABLE      /* neither migrating nor importing */
+} ck_slot_state_t;
+
+/* settings. cluster-enabled indexes the store by slot (see
+ * store_slot_index); our address is cluster-announce-ip and the port */
+void cluster_set_enabled(store_t *s, int enabled);
+int cluster_set_config_file(const char *path);
+int cluster_set_announce_ip(const char *ip);
+int cluster_enabled(void);
+const char *cluster_config_file(void);
+const char *cluster_announce_ip(void);
+
+/* learn our port and read the slot map from the config file, if cluster
+ * mode is on; once the configuration is loaded */
+int cluster_init(store_t *s, int port);
+
+/* where a command on these keys is served: 0 here, or -1 with the error
+ * to reply in err (-MOVED, -ASK, -CROSSSLOT, -TRYAGAIN, -CLUSTERDOWN,
+ * without the dash). asking: the command follows ASKING */
+int cluster_route(store_t *s, const char **keys, int n, int asking, char *err, size_t errlen);
+
+/* change the slot map; slots are given as inclusive first/last pairs.
+ * -1 with a message in err if any slot can't be changed, in which case
+ * none is. every change is saved to the config file */
+int cluster_add_slots(const int *ranges, int n_ranges, char *err, size_t errlen);
+int cluster_del_slots(const int *ranges, int n_ranges, char *err, size_t errlen);
+int cluster_set_slot(store_t *s, int first, int last, ck_slot_state_t how, const char *node,
+                     char *err, size_t errlen);
+
+/* CLUSTER SLOTS: [first, last, [host, port]] for every range of slots
+ * served by one node */
+void cluster_slots(resp_buf_t *out);
+/* CLUSTER INFO */
+void cluster_info(char *buf, size_t len);
+
+/* send keys to host:port as the commands that rebuild them, each after
+ * ASKING, and wait for every reply (MIGRATE). without replace it fails if
+ * the target has any of them. returns how many of the keys were sent (the
+ * others don't exist), -1 with a message in err */
+int cluster_migrate(store_t *s, const char *host, int port, char **keys, int n,
+                    int64_t timeout_ms, int replace, char *err, size_t errlen);
+
+#endif
@@ -1,6 +1,13 @@
 #include "command.h"
+#include "aof.h"
+#include "child.h"
+#include "cluster.h"
+#include "config.h"
 #include "eviction.h"
+#include "fmap.h"
+#include "lazyfree.h"
 #include "persistence.h"
+#include "replication.h"
 #include "util.h"
 #include <string.h>
 #include <strings.h>
@@ -64,6 +71,7 @@ static void cmd_set(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     char *key = get_arg(cmd, 1);
     char *value = get_arg(cmd, 2);
     store_set(ctx->store, key, value);
+    persistence_add_dirty(1);
 
     /* handle EX option */
     if (argc >= 5) {
@@ -77,7 +85,6 @@ static void cmd_set(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
         }
     }
 
-    eviction_check(ctx->store);
     resp_write_simple_string(out, "OK");
 }
 
@@ -118,9 +125,41 @@ static void cmd_del(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
         char *key = get_arg(cmd, i);
         if (key) deleted += store_del(ctx->store, key);
     }
+    persistence_add_dirty((uint64_t)deleted);
     resp_write_integer(out, deleted);
 }
 
+static void cmd_unlink(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    int argc = arg_count(cmd);
+    if (argc < 2) {
+        resp_write_error(out, "ERR wrong number of arguments for 'unlink' command");
+        return;
+    }
+
+    int deleted = 0;
+    for (int i = 1; i < argc; i++) {
+        char *key = get_arg(cmd, i);
+        if (key) deleted += store_unlink(ctx->store, key);
+    }
+    persistence_add_dirty((uint64_t)deleted);
+    resp_write_integer(out, deleted);
+}
+
+static void cmd_exists(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    int argc = arg_count(cmd);
+    if (argc < 2) {
+        resp_write_error(out, "ERR wrong number of arguments for 'exists' command");
+        return;
+    }
+
+    int found = 0;
+    for (int i = 1; i < argc; i++) {
+        char *key = get_arg(cmd, i);
+        if (key) found += store_exists(ctx->store, key);
+    }
+    resp_write_integer(out, found);
+}
+
 static void cmd_incr(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     if (arg_count(cmd) < 2) {
         resp_write_error(out, "ERR wrong number of arguments for 'incr' command");
@@ -132,6 +171,7 @@ static void cmd_incr(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
         resp_write_error(out, "ERR value is not an integer or out of range");
         return;
     }
+    persistence_add_dirty(1);
     resp_write_integer(out, result);
 }
 
@@ -146,6 +186,7 @@ static void cmd_decr(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
         resp_write_error(out, "ERR value is not an integer or out of range");
         return;
     }
+    persistence_add_dirty(1);
     resp_write_integer(out, result);
 }
 
@@ -161,7 +202,7 @@ static void cmd_lpush(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
         resp_write_error(out, ERR_WRONGTYPE);
         return;
     }
-    eviction_check(ctx->store);
+    persistence_add_dirty(1);
     resp_write_integer(out, len);
 }
 
@@ -177,7 +218,7 @@ static void cmd_rpush(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
         resp_write_error(out, ERR_WRONGTYPE);
         return;
     }
-    eviction_check(ctx->store);
+    persistence_add_dirty(1);
     resp_write_integer(out, len);
 }
 
@@ -191,8 +232,9 @@ static void cmd_lpop(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     if (!val) {
         resp_write_null(out);
     } else {
+        persistence_add_dirty(1);
         resp_write_bulk_string(out, val, strlen(val));
-        free(val);
+        ck_free(val);
     }
 }
 
@@ -206,8 +248,9 @@ static void cmd_rpop(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     if (!val) {
         resp_write_null(out);
     } else {
+        persistence_add_dirty(1);
         resp_write_bulk_string(out, val, strlen(val));
-        free(val);
+        ck_free(val);
     }
 }
 
@@ -234,7 +277,7 @@ static void cmd_lrange(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     for (int i = 0; i < count; i++) {
         resp_write_bulk_string(out, items[i], strlen(items[i]));
     }
-    free(items);
+    ck_free(items);
 }
 
 static void cmd_llen(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
@@ -260,7 +303,7 @@ static void cmd_hset(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
         resp_write_error(out, ERR_WRONGTYPE);
         return;
     }
-    eviction_check(ctx->store);
+    persistence_add_dirty(1);
     resp_write_integer(out, result);
 }
 
@@ -286,7 +329,9 @@ static void cmd_hdel(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     }
     char *key = get_arg(cmd, 1);
     char *field = get_arg(cmd, 2);
-    resp_write_integer(out, store_hdel(ctx->store, key, field));
+    int deleted = store_hdel(ctx->store, key, field);
+    persistence_add_dirty((uint64_t)deleted);
+    resp_write_integer(out, deleted);
 }
 
 static void cmd_hgetall(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
@@ -305,8 +350,8 @@ static void cmd_hgetall(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out)
         resp_write_bulk_string(out, values[i], strlen(values[i]));
     }
     if (count > 0) {
-        free(fields);
-        free(values);
+        ck_free(fields);
+        ck_free(values);
     }
 }
 
@@ -321,7 +366,25 @@ static void cmd_expire(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
         resp_write_error(out, "ERR value is not an integer or out of range");
         return;
     }
-    resp_write_integer(out, store_expire(ctx->store, key, secs));
+    int set = store_expire(ctx->store, key, secs);
+    persistence_add_dirty((uint64_t)set);
+    resp_write_integer(out, set);
+}
+
+static void cmd_pexpireat(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    if (arg_count(cmd) < 3) {
+        resp_write_error(out, "ERR wrong number of arguments for 'pexpireat' command");
+        return;
+    }
+    char *key = get_arg(cmd, 1);
+    int64_t when_ms;
+    if (ck_str_to_int64(get_arg(cmd, 2), &when_ms) != 0) {
+        resp_write_error(out, "ERR value is not an integer or out of range");
+        return;
+    }
+    int set = store_expire_at(ctx->store, key, when_ms);
+    persistence_add_dirty((uint64_t)set);
+    resp_write_integer(out, set);
 }
 
 static void cmd_ttl(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
@@ -339,7 +402,9 @@ static void cmd_persist(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out)
         return;
     }
     char *key = get_arg(cmd, 1);
-    resp_write_integer(out, store_persist(ctx->store, key));
+    int removed = store_persist(ctx->store, key);
+    persistence_add_dirty((uint64_t)removed);
+    resp_write_integer(out, removed);
 }
 
 static void cmd_keys(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
@@ -355,9 +420,9 @@ static void cmd_keys(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     resp_write_array_header(out, count);
     for (int i = 0; i < count; i++) {
         resp_write_bulk_string(out, keys[i], strlen(keys[i]));
-        free(keys[i]);
+        ck_free(keys[i]);
     }
-    free(keys);
+    ck_free(keys);
 }
 
 static void cmd_dbsize(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
@@ -366,13 +431,32 @@ static void cmd_dbsize(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
 }
 
 static void cmd_flushdb(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
-    (void)cmd;
-    store_flushdb(ctx->store);
+    int async = 0;
+    if (arg_count(cmd) > 1) {
+        char *mode = get_arg(cmd, 1);
+        if (mode && cmd_eq(mode, "ASYNC")) {
+            async = 1;
+        } else if (!mode || !cmd_eq(mode, "SYNC")) {
+            resp_write_error(out, ERR_SYNTAX);
+            return;
+        }
+    }
+
+    persistence_add_dirty(store_dbsize(ctx->store));
+    if (async) {
+        store_flushdb_async(ctx->store);
+    } else {
+        store_flushdb(ctx->store);
+    }
     resp_write_simple_string(out, "OK");
 }
 
 static void cmd_save(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     (void)cmd;
+    if (persistence_bgsave_in_progress()) {
+        resp_write_error(out, "ERR Background save already in progress");
+        return;
+    }
     int rc = persistence_save(ctx->store, ctx->rdb_filename);
     if (rc == 0) {
         resp_write_simple_string(out, "OK");
@@ -381,10 +465,460 @@ static void cmd_save(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     }
 }
 
+static void cmd_bgsave(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    (void)cmd;
+    if (child_type() == CK_CHILD_AOF) {
+        resp_write_error(out, "ERR Background append only file rewriting in progress");
+    } else if (child_active() || persistence_bgsave_in_progress()) {
+        resp_write_error(out, "ERR Background save already in progress");
+    } else if (persistence_bgsave(ctx->store, ctx->rdb_filename) == 0) {
+        resp_write_simple_string(out, "Background saving started");
+    } else {
+        resp_write_error(out, "ERR background save failed to start");
+    }
+}
+
+static void cmd_bgrewriteaof(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    (void)cmd;
+    if (aof_rewrite_in_progress()) {
+        resp_write_error(out, "ERR Background append only file rewriting already in progress");
+    } else if (child_active()) {
+        aof_rewrite_schedule();
+        resp_write_simple_string(out, "Background append only file rewriting scheduled");
+    } else if (aof_rewrite_start(ctx->store) == 0) {
+        resp_write_simple_string(out, "Background append only file rewriting started");
+    } else {
+        resp_write_error(out, "ERR background append only file rewrite failed to start");
+    }
+}
+
+static void cmd_lastsave(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    (void)ctx; (void)cmd;
+    resp_write_integer(out, persistence_lastsave());
+}
+
+/* REPLICAOF host port | REPLICAOF NO ONE */
+static void cmd_replicaof(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    (void)ctx;
+    char *host = get_arg(cmd, 1);
+    char *port = get_arg(cmd, 2);
+    if (arg_count(cmd) != 3 || !host || !port) {
+        resp_write_error(out, "ERR wrong number of arguments for 'replicaof' command");
+        return;
+    }
+    if (cmd_eq(host, "NO") && cmd_eq(port, "ONE")) {
+        repl_set_master(NULL, 0);
+        resp_write_simple_string(out, "OK");
+        return;
+    }
+    int64_t p;
+    if (ck_str_to_int64(port, &p) != 0 || p <= 0 || p > 65535) {
+        resp_write_error(out, "ERR Invalid master port");
+    } else if (repl_set_master(host, (int)p) != 0) {
+        resp_write_error(out, "ERR can't replicate from this address");
+    } else {
+        resp_write_simple_string(out, "OK");
+    }
+}
+
+/* the replica handshake; nothing to configure yet */
+static void cmd_replconf(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    (void)ctx;
+    if (arg_count(cmd) < 2) {
+        resp_write_error(out, "ERR wrong number of arguments for 'replconf' command");
+        return;
+    }
+    resp_write_simple_string(out, "OK");
+}
+
+/* the next command may use a slot this node is importing */
+static void cmd_asking(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    (void)cmd;
+    ctx->asking = 1;
+    resp_write_simple_string(out, "OK");
+}
+
+/* slot ranges from args[first..]: one slot per argument, or first/last
+ * pairs for the RANGE forms */
+static int *parse_slots(resp_value_t *cmd, int first, int pairs, int *n_ranges,
+                        resp_buf_t *out) {
+    int argc = arg_count(cmd);
+    int n = argc - first;
+    if (n < 1 || (pairs && n % 2)) {
+        resp_write_error(out, "ERR wrong number of arguments for 'cluster' command");
+        return NULL;
+    }
+    int *ranges = ck_malloc(sizeof(int) * 2 * (size_t)n);
+    *n_ranges = pairs ? n / 2 : n;
+    for (int i = 0; i < n; i++) {
+        int64_t v;
+        if (ck_str_to_int64(get_arg(cmd, first + i), &v) != 0 || v < 0 ||
+            v >= CK_CLUSTER_SLOTS) {
+            resp_write_error(out, "ERR Invalid or out of range slot");
+            ck_free(ranges);
+            return NULL;
+        }
+        if (pairs) {
+            ranges[i] = (int)v;
+        } else {
+            ranges[2 * i] = ranges[2 * i + 1] = (int)v;
+        }
+    }
+    for (int i = 0; i < *n_ranges; i++) {
+        if (ranges[2 * i] > ranges[2 * i + 1]) {
+            resp_write_error(out, "ERR start slot number is greater than end slot number");
+            ck_free(ranges);
+            return NULL;
+        }
+    }
+    return ranges;
+}
+
+static void cmd_cluster(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    int argc = arg_count(cmd);
+    char *sub = get_arg(cmd, 1);
+    char err[200], errbuf[220];
+    if (!sub) {
+        resp_write_error(out, "ERR wrong number of arguments for 'cluster' command");
+        return;
+    }
+    if (cmd_eq(sub, "KEYSLOT") && argc == 3) {
+        resp_write_integer(out, store_key_slot(get_arg(cmd, 2)));
+        return;
+    }
+    if (!cluster_enabled()) {
+        resp_write_error(out, "ERR This instance has cluster support disabled");
+        return;
+    }
+
+    int64_t slot = -1, max = 0;
+    if ((cmd_eq(sub, "COUNTKEYSINSLOT") && argc == 3) ||
+        (cmd_eq(sub, "GETKEYSINSLOT") && argc == 4)) {
+        if (ck_str_to_int64(get_arg(cmd, 2), &slot) != 0 || slot < 0 ||
+            slot >= CK_CLUSTER_SLOTS) {
+            resp_write_error(out, "ERR Invalid slot");
+            return;
+        }
+        if (argc == 4 && (ck_str_to_int64(get_arg(cmd, 3), &max) != 0 || max < 0)) {
+            resp_write_error(out, "ERR Invalid number of keys");
+            return;
+        }
+    }
+
+    if (cmd_eq(sub, "INFO") && argc == 2) {
+        char buf[512];
+        cluster_info(buf, sizeof(buf));
+        resp_write_bulk_string(out, buf, strlen(buf));
+    } else if (cmd_eq(sub, "SLOTS") && argc == 2) {
+        cluster_slots(out);
+    } else if (cmd_eq(sub, "COUNTKEYSINSLOT") && argc == 3) {
+        resp_write_integer(out, (int64_t)store_slot_count(ctx->store, (unsigned)slot));
+    } else if (cmd_eq(sub, "GETKEYSINSLOT") && argc == 4) {
+        char **keys;
+        int count;
+        store_slot_keys(ctx->store, (unsigned)slot, (size_t)max, &keys, &count);
+        resp_write_array_header(out, count);
+        for (int i = 0; i < count; i++) {
+            resp_write_bulk_string(out, keys[i], strlen(keys[i]));
+            ck_free(keys[i]);
+        }
+        ck_free(keys);
+    } else if (cmd_eq(sub, "ADDSLOTS") || cmd_eq(sub, "ADDSLOTSRANGE") ||
+               cmd_eq(sub, "DELSLOTS") || cmd_eq(sub, "DELSLOTSRANGE")) {
+        int n_ranges;
+        int *ranges = parse_slots(cmd, 2, strlen(sub) > 8, &n_ranges, out);
+        if (!ranges) return;
+        int rc = toupper((unsigned char)sub[0]) == 'A'
+                     ? cluster_add_slots(ranges, n_ranges, err, sizeof(err))
+                     : cluster_del_slots(ranges, n_ranges, err, sizeof(err));
+        ck_free(ranges);
+        if (rc != 0) {
+            snprintf(errbuf, sizeof(errbuf), "ERR %s", err);
+            resp_write_error(out, errbuf);
+            return;
+        }
+        resp_write_simple_string(out, "OK");
+    } else if (cmd_eq(sub, "SETSLOT") && argc >= 4) {
+        /* SETSLOT <slot>|<first>-<last> IMPORTING|MIGRATING|NODE <host:port> | STABLE */
+        char *how = get_arg(cmd, 3);
+        int first, last;
+        char extra;
+        const char *spec = get_arg(cmd, 2);
+        if (sscanf(spec, "%d-%d%c", &first, &last, &extra) != 2) {
+            if (sscanf(spec, "%d%c", &first, &extra) != 1) first = -1;
+            last = first;
+        }
+        if (first < 0 || first > last || last >= CK_CLUSTER_SLOTS) {
+            resp_write_error(out, "ERR Invalid or out of range slot");
+            return;
+        }
+        ck_slot_state_t state;
+        if (cmd_eq(how, "STABLE") && argc == 4) {
+            state = CK_SLOT_STABLE;
+        } else if (cmd_eq(how, "NODE") && argc == 5) {
+            state = CK_SLOT_NODE;
+        } else if (cmd_eq(how, "MIGRATING") && argc == 5) {
+            state = CK_SLOT_MIGRATING;
+        } else if (cmd_eq(how, "IMPORTING") && argc == 5) {
+            state = CK_SLOT_IMPORTING;
+        } else {
+            resp_write_error(out, "ERR Invalid CLUSTER SETSLOT action or number of arguments");
+            return;
+        }
+        if (cluster_set_slot(ctx->store, first, last, state, get_arg(cmd, 4), err,
+                             sizeof(err)) != 0) {
+            snprintf(errbuf, sizeof(errbuf), "ERR %s", err);
+            resp_write_error(out, errbuf);
+            return;
+        }
+        resp_write_simple_string(out, "OK");
+    } else {
+        snprintf(errbuf, sizeof(errbuf), "ERR unknown subcommand or wrong number of arguments "
+                 "for '%s'", sub);
+        resp_write_error(out, errbuf);
+    }
+}
+
+/* a write done here on behalf of a command that isn't one (MIGRATE's DEL,
+ * keys the store removed by itself) */
+static void propagate(int argc, char **argv) {
+    resp_value_t *args = ck_malloc(sizeof(resp_value_t) * (size_t)argc);
+    resp_value_t **elements = ck_malloc(sizeof(resp_value_t *) * (size_t)argc);
+    for (int i = 0; i < argc; i++) {
+        args[i].type = RESP_BULK_STRING;
+        args[i].str = argv[i];
+        elements[i] = &args[i];
+    }
+    resp_value_t cmd = { .type = RESP_ARRAY };
+    cmd.array.elements = elements;
+    cmd.array.count = argc;
+    if (aof_enabled()) aof_feed(&cmd);
+    repl_feed(&cmd);
+    ck_free(elements);
+    ck_free(args);
+}
+
+void command_key_removed(const char *key, void *arg) {
+    command_ctx_t *ctx = arg;
+    /* a replayed write was logged when it first ran, with its deletions */
+    if (ctx->replaying) return;
+    char *argv[] = { "UNLINK", (char *)key };
+    persistence_add_dirty(1);
+    propagate(2, argv);
+}
+
+/* MIGRATE host port key|"" 0 timeout [COPY] [REPLACE] [KEYS key ...]: move
+ * keys to another server, deleted here once it has them all */
+static void cmd_migrate(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    int argc = arg_count(cmd);
+    if (argc < 6) {
+        resp_write_error(out, "ERR wrong number of arguments for 'migrate' command");
+        return;
+    }
+    char *host = get_arg(cmd, 1);
+    int64_t port, db, timeout;
+    if (!host || ck_str_to_int64(get_arg(cmd, 2), &port) != 0 || port <= 0 || port > 65535 ||
+        ck_str_to_int64(get_arg(cmd, 5), &timeout) != 0 || timeout < 0) {
+        resp_write_error(out, "ERR value is not an integer or out of range");
+        return;
+    }
+    if (ck_str_to_int64(get_arg(cmd, 4), &db) != 0 || db != 0) {
+        resp_write_error(out, "ERR DB index is out of range");
+        return;
+    }
+
+    int copy = 0, replace = 0, first = 3, n = 1;
+    for (int i = 6; i < argc; i++) {
+        char *opt = get_arg(cmd, i);
+        if (opt && cmd_eq(opt, "COPY")) {
+            copy = 1;
+        } else if (opt && cmd_eq(opt, "REPLACE")) {
+            replace = 1;
+        } else if (opt && cmd_eq(opt, "KEYS") && get_arg(cmd, 3) && !get_arg(cmd, 3)[0]) {
+            first = i + 1;
+            n = argc - first;
+            break;
+        } else {
+            resp_write_error(out, ERR_SYNTAX);
+            return;
+        }
+    }
+    if (!copy && repl_read_only()) {
+        resp_write_error(out, "READONLY You can't write against a read only replica.");
+        return;
+    }
+    char **keys = ck_malloc(sizeof(char *) * (size_t)(n + 1));
+    keys[0] = "DEL";
+    for (int i = 0; i < n; i++) {
+        keys[i + 1] = get_arg(cmd, first + i);
+        if (!keys[i + 1]) {
+            resp_write_error(out, ERR_SYNTAX);
+            ck_free(keys);
+            return;
+        }
+    }
+
+    char err[200];
+    int sent = cluster_migrate(ctx->store, host, (int)port, keys + 1, n,
+                               timeout ? timeout : 1000, replace, err, sizeof(err));
+    if (sent < 0) {
+        resp_write_error(out, err);
+    } else if (sent == 0) {
+        resp_write_simple_string(out, "NOKEY");
+    } else {
+        if (!copy) {
+            int deleted = 0;
+            for (int i = 1; i <= n; i++) deleted += store_del(ctx->store, keys[i]);
+            persistence_add_dirty((uint64_t)deleted);
+            if (deleted) propagate(n + 1, keys);
+        }
+        resp_write_simple_string(out, "OK");
+    }
+    ck_free(keys);
+}
+
+static void cmd_memory(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    int argc = arg_count(cmd);
+    char *sub = get_arg(cmd, 1);
+    if (!sub) {
+        resp_write_error(out, "ERR wrong number of arguments for 'memory' command");
+        return;
+    }
+
+    if (cmd_eq(sub, "USAGE")) {
+        if (argc != 3 && argc != 5) {
+            resp_write_error(out, ERR_SYNTAX);
+            return;
+        }
+        int64_t samples = 5;
+        if (argc == 5) {
+            char *opt = get_arg(cmd, 3);
+            if (!opt || !cmd_eq(opt, "SAMPLES") ||
+                ck_str_to_int64(get_arg(cmd, 4), &samples) != 0 || samples < 0) {
+                resp_write_error(out, ERR_SYNTAX);
+                return;
+            }
+        }
+        size_t bytes = store_memory_usage(ctx->store, get_arg(cmd, 2), (size_t)samples);
+        if (bytes == 0) {
+            resp_write_null(out);
+        } else {
+            resp_write_integer(out, (int64_t)bytes);
+        }
+    } else if (cmd_eq(sub, "STATS")) {
+        size_t used = ck_mem_used();
+        size_t keys = store_dbsize(ctx->store);
+        size_t overhead = store_overhead(ctx->store);
+        size_t fixed = ctx->startup_memory + ctx->client_buffers_memory + repl_memory() +
+                       aof_memory() + overhead;
+        size_t dataset = used > fixed ? used - fixed : 0;
+        size_t rss = ck_mem_rss();
+
+        const char *names[] = {
+            "peak.allocated", "total.allocated", "startup.allocated",
+            "clients.normal", "replication", "aof.buffers", "keyspace.overhead", "keys.count",
+            "keys.bytes-per-key", "dataset.bytes", "rss.bytes"
+        };
+        int64_t values[] = {
+            (int64_t)ck_mem_peak(), (int64_t)used, (int64_t)ctx->startup_memory,
+            (int64_t)ctx->client_buffers_memory, (int64_t)repl_memory(), (int64_t)aof_memory(),
+            (int64_t)overhead,
+            (int64_t)keys,
+            keys ? (int64_t)(dataset / keys) : 0, (int64_t)dataset, (int64_t)rss
+        };
+        int n = (int)(sizeof(values) / sizeof(values[0]));
+
+        resp_write_array_header(out, n * 2 + 2);
+        for (int i = 0; i < n; i++) {
+            resp_write_bulk_string(out, names[i], strlen(names[i]));
+            resp_write_integer(out, values[i]);
+        }
+        char ratio[32];
+        int rn = snprintf(ratio, sizeof(ratio), "%.2f", used ? (double)rss / (double)used : 0.0);
+        resp_write_bulk_string(out, "fragmentation", strlen("fragmentation"));
+        resp_write_bulk_string(out, ratio, (size_t)rn);
+    } else {
+        char errbuf[128];
+        snprintf(errbuf, sizeof(errbuf), "ERR unknown subcommand '%s' for 'memory'", sub);
+        resp_write_error(out, errbuf);
+    }
+}
+
+static void cmd_object(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    char *sub = get_arg(cmd, 1);
+    if (!sub || arg_count(cmd) != 3) {
+        resp_write_error(out, "ERR wrong number of arguments for 'object' command");
+        return;
+    }
+
+    /* read the entry without going through a lookup, which would count
+     * as an access and skew the very numbers being asked for */
+    store_entry_t *e = (store_entry_t *)ht_get(ctx->store->data, get_arg(cmd, 2));
+    if (!e || store_is_expired(e)) {
+        resp_write_null(out);
+        return;
+    }
+
+    int lfu = store_policy_is_lfu(ctx->store->policy);
+    if (cmd_eq(sub, "FREQ")) {
+        if (!lfu) {
+            resp_write_error(out, "ERR an LFU eviction policy is not selected, access frequency not tracked");
+            return;
+        }
+        resp_write_integer(out, store_lfu_counter(ctx->store, e));
+    } else if (cmd_eq(sub, "IDLETIME")) {
+        if (lfu) {
+            resp_write_error(out, "ERR an LFU eviction policy is selected, idle time not tracked");
+            return;
+        }
+        resp_write_integer(out, (ck_wall_time_ms() - e->last_access) / 1000);
+    } else {
+        char errbuf[128];
+        snprintf(errbuf, sizeof(errbuf), "ERR unknown subcommand '%s' for 'object'", sub);
+        resp_write_error(out, errbuf);
+    }
+}
+
+static void cmd_config(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
+    int argc = arg_count(cmd);
+    char *sub = get_arg(cmd, 1);
+
+    if (sub && cmd_eq(sub, "GET") && argc == 3) {
+        config_get(ctx, get_arg(cmd, 2), out);
+    } else if (sub && cmd_eq(sub, "SET") && argc == 4) {
+        char *name = get_arg(cmd, 2);
+        /* config file only: the port and cluster mode are fixed once it
+         * serves, and a client mustn't point it at files of its choosing */
+        if (cmd_eq(name, "port") || cmd_eq(name, "cluster-enabled") ||
+            cmd_eq(name, "cluster-config-file") || cmd_eq(name, "rdb") ||
+            cmd_eq(name, "appendfilename")) {
+            char errbuf[96];
+            snprintf(errbuf, sizeof(errbuf), "ERR '%s' can't be changed at runtime", name);
+            resp_write_error(out, errbuf);
+            return;
+        }
+        char err[128], errbuf[160];
+        if (config_set(ctx, name, get_arg(cmd, 3), err, sizeof(err)) != 0) {
+            snprintf(errbuf, sizeof(errbuf), "ERR %s", err);
+            resp_write_error(out, errbuf);
+            return;
+        }
+        eviction_perform(ctx->store);
+        resp_write_simple_string(out, "OK");
+    } else {
+        resp_write_error(out, "ERR wrong number of arguments for 'config' command");
+    }
+}
+
 static void cmd_info(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     (void)cmd;
-    char buf[1024];
+    char buf[8192];
     int64_t uptime = (ck_time_ms() - ctx->start_time) / 1000;
+    size_t used = ck_mem_used();
+    size_t rss = ck_mem_rss();
+    int64_t bgsave_ms = persistence_last_bgsave_duration_ms();
+    int64_t current_ms = persistence_bgsave_elapsed_ms();
+    int64_t rewrite_ms = aof_last_rewrite_duration_ms();
 
     int n = snprintf(buf, sizeof(buf),
         "# Server\r\n"
@@ -393,17 +927,246 @@ static void cmd_info(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
         "connected_clients:%d\r\n"
         "used_memory:%zu\r\n"
         "total_commands_processed:%lld\r\n"
-        "db0:keys=%zu\r\n",
+        "db0:keys=%zu\r\n"
+        "# Memory\r\n"
+        "used_memory_peak:%zu\r\n"
+        "used_memory_rss:%zu\r\n"
+        "used_memory_overhead:%zu\r\n"
+        "used_memory_clients:%zu\r\n"
+        "used_memory_replication:%zu\r\n"
+        "used_memory_aof:%zu\r\n"
+        "used_memory_mapped:%zu\r\n"
+        "mem_fragmentation_ratio:%.2f\r\n"
+        "maxmemory:%zu\r\n"
+        "lazyfree_pending_objects:%zu\r\n"
+        "lazyfree_pending_memory:%zu\r\n"
+        "lazyfreed_objects:%zu\r\n"
+        "evicted_keys:%llu\r\n"
+        "expired_keys:%llu\r\n"
+        "keyspace_hits:%llu\r\n"
+        "keyspace_misses:%llu\r\n"
+        "admission_rejected_keys:%llu\r\n"
+        "eviction_in_progress:%d\r\n"
+        "eviction_exceeded_time_limit:%llu\r\n"
+        "# Persistence\r\n"
+        "rdb_bgsave_in_progress:%d\r\n"
+        "rdb_last_save_time:%lld\r\n"
+        "rdb_last_bgsave_status:%s\r\n"
+        "rdb_last_bgsave_time_sec:%lld\r\n"
+        "rdb_current_bgsave_time_sec:%lld\r\n"
+        "rdb_last_cow_size:%zu\r\n"
+        "rdb_bgsave_method:%s\r\n"
+        "rdb_last_preimage_size:%zu\r\n"
+        "rdb_changes_since_last_save:%llu\r\n"
+        "rdb_last_save_duration_ms:%lld\r\n"
+        "rdb_delta_enabled:%d\r\n"
+        "rdb_delta_pending_keys:%zu\r\n"
+        "rdb_delta_size:%llu\r\n"
+        "rdb_base_size:%llu\r\n"
+        "aof_enabled:%d\r\n"
+        "aof_fsync:%s\r\n"
+        "aof_current_size:%zu\r\n"
+        "aof_buffer_length:%zu\r\n"
+        "aof_fsync_in_progress:%d\r\n"
+        "aof_fsyncs:%llu\r\n"
+        "aof_last_write_status:%s\r\n"
+        "aof_base_size:%zu\r\n"
+        "aof_rewrite_in_progress:%d\r\n"
+        "aof_rewrite_scheduled:%d\r\n"
+        "aof_rewrites:%llu\r\n"
+        "aof_last_rewrite_time_sec:%lld\r\n"
+        "aof_last_bgrewrite_status:%s\r\n"
+        "aof_last_cow_size:%zu\r\n",
         (long long)uptime,
         ctx->connected_clients,
-        ck_mem_used(),
+        used,
         (long long)ctx->commands_processed,
-        store_dbsize(ctx->store)
+        store_dbsize(ctx->store),
+        ck_mem_peak(),
+        rss,
+        store_overhead(ctx->store),
+        ctx->client_buffers_memory,
+        repl_memory(),
+        aof_memory(),
+        fmap_mapped_bytes(),
+        used ? (double)rss / (double)used : 0.0,
+        ctx->store->maxmemory,
+        lazyfree_pending_objects(),
+        lazyfree_pending_memory(),
+        lazyfree_freed_objects(),
+        (unsigned long long)ctx->store->evicted_keys,
+        (unsigned long long)ctx->store->expired_keys,
+        (unsigned long long)ctx->store->keyspace_hits,
+        (unsigned long long)ctx->store->keyspace_misses,
+        (unsigned long long)ctx->store->admission_rejected,
+        ctx->store->eviction_in_progress,
+        (unsigned long long)ctx->store->eviction_time_exceeded,
+        persistence_bgsave_in_progress(),
+        (long long)persistence_lastsave(),
+        persistence_last_bgsave_ok() ? "ok" : "err",
+        (long long)(bgsave_ms < 0 ? -1 : bgsave_ms / 1000),
+        (long long)(current_ms < 0 ? -1 : current_ms / 1000),
+        persistence_last_cow_bytes(),
+        persistence_bgsave_method_name(persistence_bgsave_method()),
+        persistence_last_preimage_bytes(),
+        (unsigned long long)persistence_dirty(),
+        (long long)persistence_last_save_duration_ms(),
+        persistence_delta(),
+        store_delta_count(ctx->store),
+        (unsigned long long)persistence_delta_size(),
+        (unsigned long long)persistence_base_size(),
+        aof_enabled(),
+        aof_fsync_name(aof_fsync_policy()),
+        aof_current_size(),
+        aof_buffer_length(),
+        aof_fsync_in_progress(),
+        (unsigned long long)aof_fsync_count(),
+        aof_last_write_ok() ? "ok" : "err",
+        aof_base_size(),
+        aof_rewrite_in_progress(),
+        aof_rewrite_scheduled(),
+        (unsigned long long)aof_rewrite_count(),
+        (long long)(rewrite_ms < 0 ? -1 : rewrite_ms / 1000),
+        aof_last_rewrite_ok() ? "ok" : "err",
+        aof_last_cow_bytes()
     );
+    if (n > 0 && (size_t)n < sizeof(buf)) {
+        repl_info(buf + n, sizeof(buf) - (size_t)n);
+        n += (int)strlen(buf + n);
+    }
+    if (n > 0 && (size_t)n < sizeof(buf)) {
+        n += snprintf(buf + n, sizeof(buf) - (size_t)n, "# Cluster\r\ncluster_enabled:%d\r\n",
+                      cluster_enabled());
+        if ((size_t)n >= sizeof(buf)) n = (int)sizeof(buf) - 1;
+    }
 
     resp_write_bulk_string(out, buf, (size_t)n);
 }
 
+#define CMD_WRITE   (1 << 0)  /* modifies the keyspace */
+#define CMD_DENYOOM (1 << 1)  /* may grow memory: refused above maxmemory */
+#define CMD_LOADING (1 << 2)  /* allowed while a replica loads its snapshot */
+#define CMD_KEY     (1 << 3)  /* the first argument is a key (cluster routing) */
+#define CMD_KEYS    (1 << 4)  /* every argument is a key */
+
+typedef struct {
+    const char *name;
+    void (*proc)(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out);
+    int flags;
+} command_t;
+
+static const command_t command_table[] = {
+    { "PING",    cmd_ping,    CMD_LOADING },
+    { "ECHO",    cmd_echo,    CMD_LOADING },
+    { "SET",     cmd_set,     CMD_WRITE | CMD_DENYOOM | CMD_KEY },
+    { "GET",     cmd_get,     CMD_KEY },
+    { "DEL",     cmd_del,     CMD_WRITE | CMD_KEYS },
+    { "EXISTS",  cmd_exists,  CMD_KEYS },
+    { "UNLINK",  cmd_unlink,  CMD_WRITE | CMD_KEYS },
+    { "INCR",    cmd_incr,    CMD_WRITE | CMD_DENYOOM | CMD_KEY },
+    { "DECR",    cmd_decr,    CMD_WRITE | CMD_DENYOOM | CMD_KEY },
+    { "LPUSH",   cmd_lpush,   CMD_WRITE | CMD_DENYOOM | CMD_KEY },
+    { "RPUSH",   cmd_rpush,   CMD_WRITE | CMD_DENYOOM | CMD_KEY },
+    { "LPOP",    cmd_lpop,    CMD_WRITE | CMD_KEY },
+    { "RPOP",    cmd_rpop,    CMD_WRITE | CMD_KEY },
+    { "LRANGE",  cmd_lrange,  CMD_KEY },
+    { "LLEN",    cmd_llen,    CMD_KEY },
+    { "HSET",    cmd_hset,    CMD_WRITE | CMD_DENYOOM | CMD_KEY },
+    { "HGET",    cmd_hget,    CMD_KEY },
+    { "HDEL",    cmd_hdel,    CMD_WRITE | CMD_KEY },
+    { "HGETALL", cmd_hgetall, CMD_KEY },
+    { "EXPIRE",  cmd_expire,  CMD_WRITE | CMD_KEY },
+    { "PEXPIREAT", cmd_pexpireat, CMD_WRITE | CMD_KEY },
+    { "TTL",     cmd_ttl,     CMD_KEY },
+    { "PERSIST", cmd_persist, CMD_WRITE | CMD_KEY },
+    { "KEYS",    cmd_keys,    0 },
+    { "DBSIZE",  cmd_dbsize,  0 },
+    { "FLUSHDB", cmd_flushdb, CMD_WRITE },
+    { "SAVE",    cmd_save,    0 },
+    { "BGSAVE",  cmd_bgsave,  0 },
+    { "BGREWRITEAOF", cmd_bgrewriteaof, 0 },
+    { "LASTSAVE", cmd_lastsave, CMD_LOADING },
+    { "INFO",    cmd_info,    CMD_LOADING },
+    { "MEMORY",  cmd_memory,  0 },
+    { "CONFIG",  cmd_config,  CMD_LOADING },
+    { "REPLICAOF", cmd_replicaof, CMD_LOADING },
+    { "SLAVEOF", cmd_replicaof, CMD_LOADING },
+    { "REPLCONF", cmd_replconf, CMD_LOADING },
+    { "OBJECT",  cmd_object,  0 },
+    { "ASKING",  cmd_asking,  0 },
+    { "CLUSTER", cmd_cluster, 0 },
+    { "MIGRATE", cmd_migrate, 0 },
+};
+
+#define N_COMMANDS (sizeof(command_table) / sizeof(command_table[0]))
+
+static const command_t *lookup_command(const char *name) {
+    for (size_t i = 0; i < N_COMMANDS; i++) {
+        if (cmd_eq(name, command_table[i].name)) return &command_table[i];
+    }
+    return NULL;
+}
+
+static void command_run(command_ctx_t *ctx, resp_value_t *cmd, const char *name,
+                        resp_buf_t *out) {
+    /* run passive expiration on a few random keys each command. not on a
+     * replica: its keys expire when the primary's stream deletes them */
+    if (!repl_is_replica()) store_expire_cycle(ctx->store, 3);
+    int asking = ctx->asking;  /* ASKING is good for the one command after it */
+    ctx->asking = 0;
+
+    const command_t *c = lookup_command(name);
+    if (!c) {
+        char errbuf[128];
+        snprintf(errbuf, sizeof(errbuf), "ERR unknown command '%s'", name);
+        resp_write_error(out, errbuf);
+        return;
+    }
+
+    if (!(c->flags & CMD_LOADING) && !ctx->replaying && repl_loading()) {
+        resp_write_error(out, "LOADING cachekit is loading the dataset in memory");
+        return;
+    }
+    if ((c->flags & (CMD_KEY | CMD_KEYS)) && cluster_enabled() && !ctx->replaying) {
+        int n = (c->flags & CMD_KEY) ? 1 : arg_count(cmd) - 1;
+        const char **keys = ck_malloc(sizeof(char *) * (size_t)(n > 0 ? n : 1));
+        int n_keys = 0;
+        for (int i = 1; i <= n; i++) {
+            char *key = get_arg(cmd, i);
+            if (key) keys[n_keys++] = key;
+        }
+        char err[256];
+        int rc = cluster_route(ctx->store, keys, n_keys, asking, err, sizeof(err));
+        ck_free(keys);
+        if (rc != 0) {
+            resp_write_error(out, err);
+            return;
+        }
+    }
+    if ((c->flags & CMD_WRITE) && !ctx->replaying && repl_read_only()) {
+        resp_write_error(out, "READONLY You can't write against a read only replica.");
+        return;
+    }
+
+    /* make room first, within the eviction time budget. if the policy
+     * can't (noeviction, or no volatile keys left), refuse anything that
+     * could grow memory further */
+    if (ctx->store->maxmemory && !ctx->replaying &&
+        eviction_perform(ctx->store) == CK_EVICT_FAIL && (c->flags & CMD_DENYOOM)) {
+        resp_write_error(out, "OOM command not allowed when used memory > 'maxmemory'");
+        return;
+    }
+
+    size_t reply_start = out->len;
+    c->proc(ctx, cmd, out);
+
+    /* log writes that went through; an error reply means nothing changed */
+    if ((c->flags & CMD_WRITE) && out->len > reply_start && out->buf[reply_start] != '-') {
+        if (aof_enabled()) aof_feed(cmd);
+        repl_feed(cmd);
+    }
+}
+
 void command_dispatch(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
     if (!cmd || (cmd->type != RESP_ARRAY) || cmd->array.count < 1) {
         resp_write_error(out, "ERR invalid command format");
@@ -418,37 +1181,8 @@ void command_dispatch(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out) {
 
     ctx->commands_processed++;
 
-    /* run passive expiration on a few random keys each command */
-    store_expire_cycle(ctx->store, 3);
-
-    if (cmd_eq(name, "PING"))         cmd_ping(ctx, cmd, out);
-    else if (cmd_eq(name, "ECHO"))    cmd_echo(ctx, cmd, out);
-    else if (cmd_eq(name, "SET"))     cmd_set(ctx, cmd, out);
-    else if (cmd_eq(name, "GET"))     cmd_get(ctx, cmd, out);
-    else if (cmd_eq(name, "DEL"))     cmd_del(ctx, cmd, out);
-    else if (cmd_eq(name, "INCR"))    cmd_incr(ctx, cmd, out);
-    else if (cmd_eq(name, "DECR"))    cmd_decr(ctx, cmd, out);
-    else if (cmd_eq(name, "LPUSH"))   cmd_lpush(ctx, cmd, out);
-    else if (cmd_eq(name, "RPUSH"))   cmd_rpush(ctx, cmd, out);
-    else if (cmd_eq(name, "LPOP"))    cmd_lpop(ctx, cmd, out);
-    else if (cmd_eq(name, "RPOP"))    cmd_rpop(ctx, cmd, out);
-    else if (cmd_eq(name, "LRANGE"))  cmd_lrange(ctx, cmd, out);
-    else if (cmd_eq(name, "LLEN"))    cmd_llen(ctx, cmd, out);
-    else if (cmd_eq(name, "HSET"))    cmd_hset(ctx, cmd, out);
-    else if (cmd_eq(name, "HGET"))    cmd_hget(ctx, cmd, out);
-    else if (cmd_eq(name, "HDEL"))    cmd_hdel(ctx, cmd, out);
-    else if (cmd_eq(name, "HGETALL")) cmd_hgetall(ctx, cmd, out);
-    else if (cmd_eq(name, "EXPIRE"))  cmd_expire(ctx, cmd, out);
-    else if (cmd_eq(name, "TTL"))     cmd_ttl(ctx, cmd, out);
-    else if (cmd_eq(name, "PERSIST")) cmd_persist(ctx, cmd, out);
-    else if (cmd_eq(name, "KEYS"))    cmd_keys(ctx, cmd, out);
-    else if (cmd_eq(name, "DBSIZE"))  cmd_dbsize(ctx, cmd, out);
-    else if (cmd_eq(name, "FLUSHDB")) cmd_flushdb(ctx, cmd, out);
-    else if (cmd_eq(name, "SAVE"))    cmd_save(ctx, cmd, out);
-    else if (cmd_eq(name, "INFO"))    cmd_info(ctx, cmd, out);
-    else {
-        char errbuf[128];
-        snprintf(errbuf, sizeof(errbuf), "ERR unknown command '%s'", name);
-        resp_write_error(out, errbuf);
-    }
+    /* a BGSAVE thread reads the store between commands */
+    int locked = store_lock(ctx->store);
+    command_run(ctx, cmd, name, out);
+    store_unlock(ctx->store, locked);
 }
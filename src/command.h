@@ -4,15 +4,27 @@
 #include "protocol.h"
 #include "store.h"
 
+struct server_config;
+
 typedef struct {
     store_t *store;
+    struct server_config *config; /* NULL when running without a server */
     const char *rdb_filename;
     int64_t start_time;
     int64_t commands_processed;
     int connected_clients;
+    size_t startup_memory;       /* ck_mem_used() before the dataset was loaded */
+    size_t client_buffers_memory; /* parser + reply buffers, kept by the server */
+    int replaying;               /* applying writes already accepted (the primary's
+                                  * stream, the AOF): none are refused */
+    int asking;                  /* the last command was ASKING (cluster mode) */
 } command_ctx_t;
 
 /* dispatch a parsed RESP command and write the response */
 void command_dispatch(command_ctx_t *ctx, resp_value_t *cmd, resp_buf_t *out);
 
+/* store_t.on_removed, arg the command_ctx_t: logs a key that was evicted
+ * or expired as an UNLINK to the AOF and the replicas */
+void command_key_removed(const char *key, void *arg);
+
 #endif
@@ -0,0 +1,418 @@
+#include "config.h"
+#include "aof.h"
+#include "cluster.h"
+#include "lz.h"
+#include "persistence.h"
+#include "replication.h"
+#include "util.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+static const char *policy_names[] = {
+    [CK_EVICT_ALLKEYS_LRU]       = "allkeys-lru",
+    [CK_EVICT_ALLKEYS_LRU_EXACT] = "allkeys-lru-exact",
+    [CK_EVICT_ALLKEYS_LFU]       = "allkeys-lfu",
+    [CK_EVICT_VOLATILE_LFU]      = "volatile-lfu",
+    [CK_EVICT_ALLKEYS_RANDOM]    = "allkeys-random",
+    [CK_EVICT_VOLATILE_LRU]      = "volatile-lru",
+    [CK_EVICT_VOLATILE_TTL]      = "volatile-ttl",
+    [CK_EVICT_NOEVICTION]        = "noeviction",
+};
+
+#define N_POLICIES (sizeof(policy_names) / sizeof(policy_names[0]))
+
+/* "rdb" values have to outlive the caller's line buffer */
+static char *g_rdb_filename;
+
+/* bytes with an optional kb/mb/gb suffix (powers of 1024) */
+static int parse_memory(const char *s, size_t *out) {
+    /* strtoull takes a sign and negates the result, so "-1" would be
+     * the largest value there is */
+    while (isspace((unsigned char)*s)) s++;
+    if (!isdigit((unsigned char)*s)) return -1;
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (errno == ERANGE) return -1;
+
+    unsigned long long mul = 1;
+    if (*end) {
+        if (strcasecmp(end, "kb") == 0) mul = 1024ULL;
+        else if (strcasecmp(end, "mb") == 0) mul = 1024ULL * 1024;
+        else if (strcasecmp(end, "gb") == 0) mul = 1024ULL * 1024 * 1024;
+        else return -1;
+    }
+    if (v > SIZE_MAX / mul) return -1;
+    *out = (size_t)(v * mul);
+    return 0;
+}
+
+int config_set(command_ctx_t *ctx, const char *name, const char *value,
+               char *err, size_t errlen) {
+    if (strcasecmp(name, "port") == 0) {
+        int p = atoi(value);
+        if (p <= 0 || p > 65535) {
+            snprintf(err, errlen, "invalid port '%s'", value);
+            return -1;
+        }
+        if (ctx->config) ctx->config->port = (uint16_t)p;
+    } else if (strcasecmp(name, "rdb") == 0) {
+        char *copy = ck_strdup(value);
+        ck_free(g_rdb_filename);
+        g_rdb_filename = copy;
+        ctx->rdb_filename = copy;
+        if (ctx->config) ctx->config->rdb_filename = copy;
+    } else if (strcasecmp(name, "rdb-compression-level") == 0) {
+        int64_t v;
+        if (ck_str_to_int64(value, &v) != 0 || v < 0 || v > CK_LZ_MAX_LEVEL) {
+            snprintf(err, errlen, "invalid rdb-compression-level '%s' (0-%d)", value,
+                     CK_LZ_MAX_LEVEL);
+            return -1;
+        }
+        persistence_set_compression((int)v);
+    } else if (strcasecmp(name, "rdb-load-threads") == 0) {
+        int64_t v;
+        if (ck_str_to_int64(value, &v) != 0 || v < 0 || v > CK_RDB_MAX_LOAD_THREADS) {
+            snprintf(err, errlen, "invalid rdb-load-threads '%s' (0-%d)", value,
+                     CK_RDB_MAX_LOAD_THREADS);
+            return -1;
+        }
+        persistence_set_load_threads((int)v);
+    } else if (strcasecmp(name, "rdb-delta") == 0) {
+        if (strcasecmp(value, "yes") == 0) {
+            persistence_set_delta(ctx->store, 1);
+        } else if (strcasecmp(value, "no") == 0) {
+            persistence_set_delta(ctx->store, 0);
+        } else {
+            snprintf(err, errlen, "invalid rdb-delta '%s' (yes|no)", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "rdb-delta-compact-percentage") == 0) {
+        int64_t v;
+        if (ck_str_to_int64(value, &v) != 0 || v < 0 || v > 1000000) {
+            snprintf(err, errlen, "invalid rdb-delta-compact-percentage '%s'", value);
+            return -1;
+        }
+        persistence_set_delta_compact_percentage((int)v);
+    } else if (strcasecmp(name, "rdb-bgsave-method") == 0) {
+        ck_rdb_bgsave_method_t method;
+        if (persistence_parse_bgsave_method(value, &method) != 0) {
+            snprintf(err, errlen, "invalid rdb-bgsave-method '%s' (fork|thread)", value);
+            return -1;
+        }
+        persistence_set_bgsave_method(method);
+    } else if (strcasecmp(name, "save") == 0) {
+        if (strcmp(value, "\"\"") == 0) value = "";
+        if (persistence_set_save_points(value) != 0) {
+            snprintf(err, errlen, "invalid save '%s' (seconds changes ...)", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "replicaof") == 0) {
+        char host[256], rest[8];
+        int port;
+        if (strcasecmp(value, "no one") == 0) {
+            repl_set_master(NULL, 0);
+        } else if (sscanf(value, "%255s %d %7s", host, &port, rest) != 2 ||
+                   repl_set_master(host, port) != 0) {
+            snprintf(err, errlen, "invalid replicaof '%s' (host port|no one)", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "repl-backlog-size") == 0) {
+        size_t bytes;
+        if (parse_memory(value, &bytes) != 0 || bytes < 16 * 1024) {
+            snprintf(err, errlen, "invalid repl-backlog-size '%s' (at least 16kb)", value);
+            return -1;
+        }
+        repl_set_backlog_size(bytes);
+    } else if (strcasecmp(name, "repl-timeout") == 0) {
+        int64_t v;
+        if (ck_str_to_int64(value, &v) != 0 || v < 1 || v > 3600) {
+            snprintf(err, errlen, "invalid repl-timeout '%s' (1-3600)", value);
+            return -1;
+        }
+        repl_set_timeout((int)v);
+    } else if (strcasecmp(name, "replica-read-only") == 0) {
+        if (strcasecmp(value, "yes") == 0) {
+            repl_set_read_only(1);
+        } else if (strcasecmp(value, "no") == 0) {
+            repl_set_read_only(0);
+        } else {
+            snprintf(err, errlen, "invalid replica-read-only '%s' (yes|no)", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "repl-diskless-sync") == 0) {
+        if (strcasecmp(value, "yes") == 0) {
+            repl_set_diskless(1);
+        } else if (strcasecmp(value, "no") == 0) {
+            repl_set_diskless(0);
+        } else {
+            snprintf(err, errlen, "invalid repl-diskless-sync '%s' (yes|no)", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "repl-diskless-sync-delay") == 0) {
+        int64_t v;
+        if (ck_str_to_int64(value, &v) != 0 || v < 0 || v > 3600) {
+            snprintf(err, errlen, "invalid repl-diskless-sync-delay '%s' (0-3600)", value);
+            return -1;
+        }
+        repl_set_diskless_delay((int)v);
+    } else if (strcasecmp(name, "cluster-enabled") == 0) {
+        if (strcasecmp(value, "yes") == 0) {
+            cluster_set_enabled(ctx->store, 1);
+        } else if (strcasecmp(value, "no") == 0) {
+            cluster_set_enabled(ctx->store, 0);
+        } else {
+            snprintf(err, errlen, "invalid cluster-enabled '%s' (yes|no)", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "cluster-config-file") == 0) {
+        if (!value[0] || cluster_set_config_file(value) != 0) {
+            snprintf(err, errlen, "invalid cluster-config-file '%s'", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "cluster-announce-ip") == 0) {
+        if (cluster_set_announce_ip(value) != 0) {
+            snprintf(err, errlen, "invalid cluster-announce-ip '%s'", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "appendonly") == 0) {
+        int enabled;
+        if (strcasecmp(value, "yes") == 0) {
+            enabled = 1;
+        } else if (strcasecmp(value, "no") == 0) {
+            enabled = 0;
+        } else {
+            snprintf(err, errlen, "invalid appendonly '%s' (yes|no)", value);
+            return -1;
+        }
+        if (aof_set_appendonly(ctx->store, enabled) != 0) {
+            snprintf(err, errlen, "can't open append-only file %s", aof_filename());
+            return -1;
+        }
+    } else if (strcasecmp(name, "appendfilename") == 0) {
+        if (aof_set_filename(value) != 0) {
+            snprintf(err, errlen, "can't change appendfilename while appendonly is on");
+            return -1;
+        }
+    } else if (strcasecmp(name, "appendfsync") == 0) {
+        ck_aof_fsync_t policy;
+        if (aof_parse_fsync(value, &policy) != 0) {
+            snprintf(err, errlen, "invalid appendfsync '%s' (always|everysec|no)", value);
+            return -1;
+        }
+        aof_set_fsync(policy);
+    } else if (strcasecmp(name, "aof-use-rdb-preamble") == 0) {
+        if (strcasecmp(value, "yes") == 0) {
+            aof_set_preamble(1);
+        } else if (strcasecmp(value, "no") == 0) {
+            aof_set_preamble(0);
+        } else {
+            snprintf(err, errlen, "invalid aof-use-rdb-preamble '%s' (yes|no)", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "auto-aof-rewrite-percentage") == 0) {
+        int64_t v;
+        if (ck_str_to_int64(value, &v) != 0 || v < 0 || v > 1000000) {
+            snprintf(err, errlen, "invalid auto-aof-rewrite-percentage '%s'", value);
+            return -1;
+        }
+        aof_set_rewrite_percentage((int)v);
+    } else if (strcasecmp(name, "auto-aof-rewrite-min-size") == 0) {
+        size_t bytes;
+        if (parse_memory(value, &bytes) != 0) {
+            snprintf(err, errlen, "invalid auto-aof-rewrite-min-size '%s'", value);
+            return -1;
+        }
+        aof_set_rewrite_min_size(bytes);
+    } else if (strcasecmp(name, "maxmemory") == 0) {
+        size_t bytes;
+        if (parse_memory(value, &bytes) != 0) {
+            snprintf(err, errlen, "invalid maxmemory '%s'", value);
+            return -1;
+        }
+        ctx->store->maxmemory = bytes;
+    } else if (strcasecmp(name, "maxmemory-hard-limit") == 0) {
+        size_t bytes;
+        if (parse_memory(value, &bytes) != 0) {
+            snprintf(err, errlen, "invalid maxmemory-hard-limit '%s'", value);
+            return -1;
+        }
+        ctx->store->maxmemory_hard = bytes;
+    } else if (strcasecmp(name, "eviction-tenacity") == 0) {
+        int64_t v;
+        if (ck_str_to_int64(value, &v) != 0 || v < 0 || v > 100) {
+            snprintf(err, errlen, "invalid eviction-tenacity '%s' (0-100)", value);
+            return -1;
+        }
+        ctx->store->eviction_tenacity = (int)v;
+    } else if (strcasecmp(name, "eviction") == 0) {
+        size_t i;
+        for (i = 0; i < N_POLICIES; i++) {
+            if (strcasecmp(value, policy_names[i]) == 0) break;
+        }
+        if (i == N_POLICIES) {
+            snprintf(err, errlen, "unknown eviction policy '%s'", value);
+            return -1;
+        }
+        store_set_policy(ctx->store, (ck_evict_policy_t)i);
+    } else if (strcasecmp(name, "admission") == 0) {
+        if (strcasecmp(value, "tinylfu") == 0) {
+            store_set_admission(ctx->store, 1);
+        } else if (strcasecmp(value, "none") == 0) {
+            store_set_admission(ctx->store, 0);
+        } else {
+            snprintf(err, errlen, "unknown admission policy '%s'", value);
+            return -1;
+        }
+    } else if (strcasecmp(name, "maxmemory-samples") == 0) {
+        int64_t v;
+        if (ck_str_to_int64(value, &v) != 0 || v < 1 || v > 64) {
+            snprintf(err, errlen, "invalid maxmemory-samples '%s' (1-64)", value);
+            return -1;
+        }
+        ctx->store->maxmemory_samples = (int)v;
+    } else if (strcasecmp(name, "lfu-log-factor") == 0 ||
+               strcasecmp(name, "lfu-decay-time") == 0) {
+        int64_t v;
+        if (ck_str_to_int64(value, &v) != 0 || v < 0 || v > 1000000) {
+            snprintf(err, errlen, "invalid %s '%s'", name, value);
+            return -1;
+        }
+        if (strcasecmp(name, "lfu-log-factor") == 0) {
+            ctx->store->lfu_log_factor = (int)v;
+        } else {
+            ctx->store->lfu_decay_time = (int)v;
+        }
+    } else {
+        snprintf(err, errlen, "unknown directive '%s'", name);
+        return -1;
+    }
+    return 0;
+}
+
+int config_load(command_ctx_t *ctx, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        ck_log(CK_LOG_ERROR, "can't open config file %s", path);
+        return -1;
+    }
+
+    char line[512];
+    int lineno = 0;
+    int rc = 0;
+    /* each save line adds a point to those of the lines before it */
+    char saves[512] = "";
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '\0' || *p == '#') continue;
+
+        char *name = strtok(p, " \t\r\n");
+        int is_save = strcasecmp(name, "save") == 0;
+        int whole_line = is_save || strcasecmp(name, "replicaof") == 0;
+        char *value = strtok(NULL, whole_line ? "\r\n" : " \t\r\n");
+        if (!value) {
+            ck_log(CK_LOG_ERROR, "%s:%d: missing value for '%s'", path, lineno, name);
+            rc = -1;
+            break;
+        }
+
+        if (is_save) {
+            size_t used = strlen(saves);
+            if (strcmp(value, "\"\"") == 0) used = 0;
+            snprintf(saves + used, sizeof(saves) - used, "%s%s", used ? " " : "", value);
+            value = saves;
+        }
+
+        char err[128];
+        if (config_set(ctx, name, value, err, sizeof(err)) != 0) {
+            ck_log(CK_LOG_ERROR, "%s:%d: %s", path, lineno, err);
+            rc = -1;
+            break;
+        }
+    }
+
+    fclose(f);
+    return rc;
+}
+
+static void add_pair(resp_buf_t *out, const char *pattern, const char *name,
+                     const char *value, int *count) {
+    if (!ck_glob_match(pattern, name)) return;
+    resp_write_bulk_string(out, name, strlen(name));
+    resp_write_bulk_string(out, value, strlen(value));
+    *count += 2;
+}
+
+void config_get(command_ctx_t *ctx, const char *pattern, resp_buf_t *out) {
+    /* values are written to a scratch buffer first since the array
+     * header needs the final count */
+    resp_buf_t body;
+    resp_buf_init(&body);
+    int count = 0;
+    char num[32];
+
+    if (ctx->config) {
+        snprintf(num, sizeof(num), "%u", (unsigned)ctx->config->port);
+        add_pair(&body, pattern, "port", num, &count);
+    }
+    add_pair(&body, pattern, "rdb", ctx->rdb_filename, &count);
+    snprintf(num, sizeof(num), "%d", persistence_compression());
+    add_pair(&body, pattern, "rdb-compression-level", num, &count);
+    snprintf(num, sizeof(num), "%d", persistence_load_threads());
+    add_pair(&body, pattern, "rdb-load-threads", num, &count);
+    add_pair(&body, pattern, "rdb-delta", persistence_delta() ? "yes" : "no", &count);
+    snprintf(num, sizeof(num), "%d", persistence_delta_compact_percentage());
+    add_pair(&body, pattern, "rdb-delta-compact-percentage", num, &count);
+    add_pair(&body, pattern, "rdb-bgsave-method",
+             persistence_bgsave_method_name(persistence_bgsave_method()), &count);
+    char saves[512];
+    persistence_save_points(saves, sizeof(saves));
+    add_pair(&body, pattern, "save", saves, &count);
+    char master[300];
+    repl_master(master, sizeof(master));
+    add_pair(&body, pattern, "replicaof", master, &count);
+    snprintf(num, sizeof(num), "%zu", repl_backlog_size());
+    add_pair(&body, pattern, "repl-backlog-size", num, &count);
+    snprintf(num, sizeof(num), "%d", repl_timeout());
+    add_pair(&body, pattern, "repl-timeout", num, &count);
+    add_pair(&body, pattern, "replica-read-only", repl_read_only_setting() ? "yes" : "no", &count);
+    add_pair(&body, pattern, "repl-diskless-sync", repl_diskless() ? "yes" : "no", &count);
+    snprintf(num, sizeof(num), "%d", repl_diskless_delay());
+    add_pair(&body, pattern, "repl-diskless-sync-delay", num, &count);
+    add_pair(&body, pattern, "cluster-enabled", cluster_enabled() ? "yes" : "no", &count);
+    add_pair(&body, pattern, "cluster-config-file", cluster_config_file(), &count);
+    add_pair(&body, pattern, "cluster-announce-ip", cluster_announce_ip(), &count);
+    add_pair(&body, pattern, "appendonly", aof_wanted() ? "yes" : "no", &count);
+    add_pair(&body, pattern, "appendfilename", aof_filename(), &count);
+    add_pair(&body, pattern, "appendfsync", aof_fsync_name(aof_fsync_policy()), &count);
+    add_pair(&body, pattern, "aof-use-rdb-preamble", aof_preamble() ? "yes" : "no", &count);
+    snprintf(num, sizeof(num), "%d", aof_rewrite_percentage());
+    add_pair(&body, pattern, "auto-aof-rewrite-percentage", num, &count);
+    snprintf(num, sizeof(num), "%zu", aof_rewrite_min_size());
+    add_pair(&body, pattern, "auto-aof-rewrite-min-size", num, &count);
+    snprintf(num, sizeof(num), "%zu", ctx->store->maxmemory);
+    add_pair(&body, pattern, "maxmemory", num, &count);
+    snprintf(num, sizeof(num), "%zu", ctx->store->maxmemory_hard);
+    add_pair(&body, pattern, "maxmemory-hard-limit", num, &count);
+    snprintf(num, sizeof(num), "%d", ctx->store->eviction_tenacity);
+    add_pair(&body, pattern, "eviction-tenacity", num, &count);
+    add_pair(&body, pattern, "eviction", policy_names[ctx->store->policy], &count);
+    add_pair(&body, pattern, "admission", ctx->store->admission ? "tinylfu" : "none", &count);
+    snprintf(num, sizeof(num), "%d", ctx->store->maxmemory_samples);
+    add_pair(&body, pattern, "maxmemory-samples", num, &count);
+    snprintf(num, sizeof(num), "%d", ctx->store->lfu_log_factor);
+    add_pair(&body, pattern, "lfu-log-factor", num, &count);
+    snprintf(num, sizeof(num), "%d", ctx->store->lfu_decay_time);
+    add_pair(&body, pattern, "lfu-decay-time", num, &count);
+
+    resp_write_array_header(out, count);
+    resp_buf_append(out, body.buf, body.len);
+    resp_buf_destroy(&body);
+}
@@ -0,0 +1,18 @@
+#ifndef CK_CONFIG_H
+#define CK_CONFIG_H
+
+#include "command.h"
+#include "server.h"
+
+/* apply one directive. on failure returns -1 and writes a message to err */
+int config_set(command_ctx_t *ctx, const char *name, const char *value,
+               char *err, size_t errlen);
+
+/* read "name value" lines from path; '#' starts a comment.
+ * returns 0 on success, -1 if the file can't be read or a line is invalid */
+int config_load(command_ctx_t *ctx, const char *path);
+
+/* write a name/value array for every directive matching the glob pattern */
+void config_get(command_ctx_t *ctx, const char *pattern, resp_buf_t *out);
+
+#endif
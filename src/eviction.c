@@ -1,45 +1,256 @@
 #include "eviction.h"
+#include "aof.h"
+#include "lazyfree.h"
+#include "replication.h"
 #include "util.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <math.h>
 
-int eviction_run(store_t *s) {
-    if (ht_count(s->data) == 0) return 0;
+/* LFU scores keep idle time in the low bits to break counter ties */
+#define IDLE_BITS 40
+#define IDLE_MAX  ((UINT64_C(1) << IDLE_BITS) - 1)
+
+/* how good a victim e is under the store's policy; higher is better */
+static uint64_t victim_score(store_t *s, store_entry_t *e, int64_t now) {
+    uint64_t idle = now > e->last_access ? (uint64_t)(now - e->last_access) : 0;
+
+    switch (s->policy) {
+        case CK_EVICT_VOLATILE_TTL:
+            /* the sooner it expires anyway, the better */
+            return UINT64_MAX - (uint64_t)e->expire_at;
+        case CK_EVICT_ALLKEYS_LFU:
+        case CK_EVICT_VOLATILE_LFU:
+            if (idle > IDLE_MAX) idle = IDLE_MAX;
+            return ((uint64_t)(255 - store_lfu_counter(s, e)) << IDLE_BITS) | idle;
+        default:
+            return idle;
+    }
+}
+
+static void candidate_clear(store_evict_candidate_t *c) {
+    if (c->key != c->cached) ck_free(c->key);
+    c->key = NULL;
+}
 
-    const char *victim = NULL;
-    int64_t oldest_access = INT64_MAX;
+/* used slots are packed at the front of the pool in ascending score order,
+ * so the best victim is always the last used one */
+static void pool_insert(store_t *s, store_entry_t *e, uint64_t score) {
+    store_evict_candidate_t *pool = s->evict_pool;
 
-    /* sample random keys and pick the least recently accessed */
-    for (int i = 0; i < CK_EVICTION_SAMPLES; i++) {
-        const char *key;
-        if (!ht_random_key(s->data, &key)) break;
+    for (int i = 0; i < CK_EVPOOL_SIZE && pool[i].key; i++) {
+        if (pool[i].entry == e && strcmp(pool[i].key, e->key) == 0) return;
+    }
+
+    int k = 0;
+    while (k < CK_EVPOOL_SIZE && pool[k].key && pool[k].score < score) k++;
+
+    char *cached;
+    if (!pool[CK_EVPOOL_SIZE - 1].key) {
+        /* room left: shift the better candidates right, reusing the
+         * free last slot's buffer */
+        cached = pool[CK_EVPOOL_SIZE - 1].cached;
+        memmove(&pool[k + 1], &pool[k], sizeof(*pool) * (size_t)(CK_EVPOOL_SIZE - k - 1));
+    } else {
+        /* full: worse than everything already here, or drop the worst */
+        if (k == 0) return;
+        k--;
+        candidate_clear(&pool[0]);
+        cached = pool[0].cached;
+        memmove(&pool[0], &pool[1], sizeof(*pool) * (size_t)k);
+    }
+
+    store_evict_candidate_t *c = &pool[k];
+    size_t len = strlen(e->key);
+    c->cached = cached;
+    if (len > CK_EVPOOL_KEY_SIZE) {
+        c->key = ck_strdup(e->key);
+    } else {
+        memcpy(cached, e->key, len + 1);
+        c->key = cached;
+    }
+    c->entry = e;
+    c->score = score;
+}
 
-        store_entry_t *e = (store_entry_t *)ht_get(s->data, key);
-        if (!e) continue;
+/* add a sample of keys to the pool; returns how many were sampled */
+static int pool_populate(store_t *s) {
+    int volatile_only = store_policy_is_volatile(s->policy);
+    int64_t now = ck_wall_time_ms();
+    int n = 0;
 
-        if (e->last_access < oldest_access) {
-            oldest_access = e->last_access;
-            victim = key;
+    for (int i = 0; i < s->maxmemory_samples; i++) {
+        store_entry_t *e = NULL;
+        if (volatile_only) {
+            e = store_random_volatile(s);
+        } else if (!ht_random_entry(s->data, NULL, (void **)&e)) {
+            e = NULL;
         }
+        if (!e) break;
+
+        pool_insert(s, e, victim_score(s, e, now));
+        n++;
+    }
+    return n;
+}
+
+/* the best candidate still in the keyspace. candidates deleted or made
+ * persistent since they were sampled are dropped on the way */
+static store_evict_candidate_t *pool_best(store_t *s) {
+    for (int i = CK_EVPOOL_SIZE - 1; i >= 0; i--) {
+        store_evict_candidate_t *c = &s->evict_pool[i];
+        if (!c->key) continue;
+
+        store_entry_t *e = (store_entry_t *)ht_get(s->data, c->key);
+        if (e && (!store_policy_is_volatile(s->policy) || e->expire_at != 0)) return c;
+        candidate_clear(c);
+    }
+    return NULL;
+}
+
+/* the key to evict next under s->policy, NULL if there is none. it points
+ * into the keyspace or, with *cand set, the eviction pool, so it is only
+ * valid until the next eviction */
+static const char *select_victim(store_t *s, store_evict_candidate_t **cand) {
+    *cand = NULL;
+    const char *key;
+
+    switch (s->policy) {
+        case CK_EVICT_NOEVICTION:
+            return NULL;
+        case CK_EVICT_ALLKEYS_LRU_EXACT:
+            /* the recency list tail: O(1), no sampling */
+            return s->lru.tail ? ((store_entry_t *)s->lru.tail->value)->key : NULL;
+        case CK_EVICT_ALLKEYS_RANDOM:
+            return ht_random_key(s->data, &key) ? key : NULL;
+        default:
+            break;
     }
 
+    /* a round whose pool held only stale candidates empties it, so the
+     * next round's live samples are guaranteed a pick */
+    while (pool_populate(s) > 0) {
+        *cand = pool_best(s);
+        if (*cand) return (*cand)->key;
+    }
+    return NULL;
+}
+
+/* TinyLFU admission: the newest key is only worth keeping if it has been
+ * asked for more often than the victim it would displace. otherwise it is
+ * evicted in the victim's place. each newcomer is judged once */
+static int reject_newcomer(store_t *s, const char *victim) {
+    store_entry_t *n = s->newcomer;
+    if (!s->admission || !n) return 0;
+    s->newcomer = NULL;
+    if (store_policy_is_volatile(s->policy) && n->expire_at == 0) return 0;
+
+    tinylfu_ensure_capacity(s->admission, ht_count(s->data));
+    return tinylfu_estimate(s->admission, n->key) <= tinylfu_estimate(s->admission, victim);
+}
+
+int eviction_run(store_t *s) {
+    if (ht_count(s->data) == 0) return 0;
+
+    store_evict_candidate_t *cand;
+    const char *victim = select_victim(s, &cand);
     if (!victim) return 0;
 
-    char *key_copy = ck_strdup(victim);
-    ck_log(CK_LOG_DEBUG, "evicting key: %s", key_copy);
-    ht_delete(s->data, key_copy);
-    free(key_copy);
+    store_entry_t *newcomer = s->newcomer;
+    if (reject_newcomer(s, victim)) {
+        /* the victim stays pooled for the next eviction */
+        ck_log(CK_LOG_DEBUG, "not admitting key: %s", newcomer->key);
+        store_key_removed(s, newcomer->key);
+        store_unlink(s, newcomer->key);
+        s->admission_rejected++;
+    } else {
+        ck_log(CK_LOG_DEBUG, "evicting key: %s", victim);
+        store_key_removed(s, victim);
+        store_unlink(s, victim);
+        if (cand) candidate_clear(cand);
+    }
+    s->evicted_keys++;
     return 1;
 }
 
+/* memory still queued on the lazyfree thread is already on its way out,
+ * so it doesn't count towards maxmemory. neither do the replication and
+ * AOF buffers: evicting keys wouldn't shrink them, and a slow replica, a
+ * long BGREWRITEAOF or a failing disk alone could otherwise empty the
+ * keyspace */
+static size_t mem_counted(void) {
+    size_t used = ck_mem_used();
+    size_t excluded = lazyfree_pending_memory() + repl_memory() + aof_memory();
+    return used > excluded ? used - excluded : 0;
+}
+
+static int over_hard_limit(store_t *s) {
+    return s->maxmemory_hard != 0 && mem_counted() > s->maxmemory_hard;
+}
+
+/* evict until under maxmemory or, with limit_us >= 0, out of time. the
+ * table isn't shrunk meanwhile: a shrink rehashes every remaining key */
+static ck_evict_status_t evict_until(store_t *s, int64_t limit_us, int *evicted) {
+    int64_t start = ck_time_us();
+    ck_evict_status_t status = CK_EVICT_OK;
+
+    ht_pause_shrink(s->data, 1);
+    while (mem_counted() > s->maxmemory) {
+        if (!eviction_run(s)) {
+            status = CK_EVICT_FAIL;
+            break;
+        }
+        (*evicted)++;
+
+        /* reading the clock costs about as much as an eviction, so only
+         * check it once per batch */
+        if (limit_us >= 0 && *evicted % 16 == 0 &&
+            ck_time_us() - start > limit_us && !over_hard_limit(s)) {
+            status = CK_EVICT_RUNNING;
+            s->eviction_time_exceeded++;
+            break;
+        }
+    }
+    ht_pause_shrink(s->data, 0);
+    return status;
+}
+
 int eviction_check(store_t *s) {
     if (s->maxmemory == 0) return 0;
 
     int evicted = 0;
-    while (ck_mem_used() > s->maxmemory && ht_count(s->data) > 0) {
-        if (!eviction_run(s)) break;
-        evicted++;
-    }
+    evict_until(s, -1, &evicted);
+    s->eviction_in_progress = 0;
     return evicted;
 }
+
+int64_t eviction_time_limit_us(int tenacity) {
+    if (tenacity <= 10) return 50 * (int64_t)tenacity;
+    if (tenacity < 100) return (int64_t)(500.0 * pow(1.15, tenacity - 10.0));
+    return -1;
+}
+
+ck_evict_status_t eviction_perform(store_t *s) {
+    /* a replica holds what its primary has, and loses keys only when the
+     * primary's stream deletes them */
+    if (s->maxmemory == 0 || repl_is_replica() || mem_counted() <= s->maxmemory) {
+        s->eviction_in_progress = 0;
+        return CK_EVICT_OK;
+    }
+
+    int evicted = 0;
+    ck_evict_status_t status =
+        evict_until(s, eviction_time_limit_us(s->eviction_tenacity), &evicted);
+    s->eviction_in_progress = status == CK_EVICT_RUNNING;
+    return status;
+}
+
+void eviction_cron(store_t *s) {
+    eviction_perform(s);
+    if (!s->eviction_in_progress) ht_shrink_if_needed(s->data);
+}
+
+int eviction_over_limit(store_t *s) {
+    return s->maxmemory != 0 && mem_counted() > s->maxmemory;
+}
@@ -3,14 +3,38 @@
 
 #include "store.h"
 
-#define CK_EVICTION_SAMPLES 5
-
-/* evict one key using approximate LRU via random sampling.
+/* evict one key according to s->policy: the best candidate in the
+ * eviction pool after adding a fresh sample of s->maxmemory_samples keys,
+ * a random key, or the tail of the recency list in exact LRU mode.
+ * volatile-* policies sample only keys with a TTL.
  * returns 1 if a key was evicted, 0 if nothing to evict. */
 int eviction_run(store_t *s);
 
-/* check if memory limit is exceeded and evict as needed.
- * returns number of keys evicted. */
+/* check if memory limit is exceeded and evict until it isn't, however
+ * long that takes. returns number of keys evicted. */
 int eviction_check(store_t *s);
 
+typedef enum {
+    CK_EVICT_OK,       /* under maxmemory */
+    CK_EVICT_RUNNING,  /* still over, time slice used up; the cron continues */
+    CK_EVICT_FAIL      /* still over and nothing left that may be evicted */
+} ck_evict_status_t;
+
+/* evict in batches for at most eviction_time_limit_us(s->eviction_tenacity),
+ * so a single command never stalls on a long eviction run. above
+ * s->maxmemory_hard the time limit doesn't apply. a replica never evicts */
+ck_evict_status_t eviction_perform(store_t *s);
+
+/* server cron: carry on with an eviction that ran out of time, and shrink
+ * the keyspace table once evictions have left it mostly empty */
+void eviction_cron(store_t *s);
+
+/* microseconds per eviction pass: 50us per step up to tenacity 10, then
+ * growing 15% per step; -1 (unlimited) at 100 */
+int64_t eviction_time_limit_us(int tenacity);
+
+/* still above maxmemory, e.g. under noeviction or with no volatile keys
+ * left to evict? writes that would grow memory must be refused */
+int eviction_over_limit(store_t *s);
+
 #endif
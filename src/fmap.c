@@ -0,0 +1,129 @@
+#include "fmap.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+struct fmap {
+    uint8_t *data;
+    size_t size;
+    atomic_size_t refs;
+    struct fmap *next;
+};
+
+/* live mappings, so a value can find the one it points into. values are
+ * released from the lazyfree thread too */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static fmap_t *g_maps;
+
+#ifndef _WIN32
+fmap_t *fmap_open(const char *filename) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    /* private and writable: terminating a value in place copies just that
+     * page, and nothing goes back to the file */
+    void *p = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) return NULL;
+    posix_madvise(p, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+    fmap_t *m = ck_malloc(sizeof(fmap_t));
+    m->data = p;
+    m->size = (size_t)st.st_size;
+    atomic_init(&m->refs, 1);
+    pthread_mutex_lock(&g_lock);
+    m->next = g_maps;
+    g_maps = m;
+    pthread_mutex_unlock(&g_lock);
+    return m;
+}
+
+void fmap_willneed(fmap_t *m, size_t off, size_t len) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = off / page * page;
+    if (start >= m->size) return;
+    if (len > m->size - off) len = m->size - off;
+    posix_madvise(m->data + start, len + (off - start), POSIX_MADV_WILLNEED);
+}
+
+static void unmap(fmap_t *m) {
+    munmap(m->data, m->size);
+    ck_free(m);
+}
+#else
+fmap_t *fmap_open(const char *filename) {
+    (void)filename;
+    return NULL;
+}
+
+void fmap_willneed(fmap_t *m, size_t off, size_t len) {
+    (void)m;
+    (void)off;
+    (void)len;
+}
+
+static void unmap(fmap_t *m) {
+    ck_free(m);
+}
+#endif
+
+uint8_t *fmap_data(fmap_t *m) {
+    return m->data;
+}
+
+size_t fmap_size(fmap_t *m) {
+    return m->size;
+}
+
+void fmap_retain(fmap_t *m) {
+    atomic_fetch_add_explicit(&m->refs, 1, memory_order_relaxed);
+}
+
+static void put(fmap_t *m) {
+    if (atomic_fetch_sub_explicit(&m->refs, 1, memory_order_acq_rel) != 1) return;
+
+    pthread_mutex_lock(&g_lock);
+    for (fmap_t **pp = &g_maps; *pp; pp = &(*pp)->next) {
+        if (*pp == m) {
+            *pp = m->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&g_lock);
+    unmap(m);
+}
+
+void fmap_release(const void *p) {
+    const uint8_t *b = p;
+    fmap_t *m;
+    pthread_mutex_lock(&g_lock);
+    for (m = g_maps; m; m = m->next) {
+        if (b >= m->data && b < m->data + m->size) break;
+    }
+    pthread_mutex_unlock(&g_lock);
+    if (m) put(m);
+}
+
+void fmap_close(fmap_t *m) {
+    if (m) put(m);
+}
+
+size_t fmap_mapped_bytes(void) {
+    size_t total = 0;
+    pthread_mutex_lock(&g_lock);
+    for (fmap_t *m = g_maps; m; m = m->next) total += m->size;
+    pthread_mutex_unlock(&g_lock);
+    return total;
+}
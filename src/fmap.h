@@ -0,0 +1,31 @@
+#ifndef CK_FMAP_H
+#define CK_FMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* a private, copy-on-write mapping of a whole file. large snapshot values
+ * point straight into it instead of being copied out; the mapping stays
+ * until the opener has closed it and every reference taken on it has
+ * been released */
+typedef struct fmap fmap_t;
+
+/* NULL if the file can't be opened or mapped (or is empty) */
+fmap_t *fmap_open(const char *filename);
+uint8_t *fmap_data(fmap_t *m);
+size_t fmap_size(fmap_t *m);
+
+/* hint that [off, off + len) will be read soon */
+void fmap_willneed(fmap_t *m, size_t off, size_t len);
+
+/* one reference per value that points into the mapping */
+void fmap_retain(fmap_t *m);
+/* drop the reference held for p, a pointer into a live mapping */
+void fmap_release(const void *p);
+/* drop the opener's reference */
+void fmap_close(fmap_t *m);
+
+/* bytes of mappings still referenced by values */
+size_t fmap_mapped_bytes(void);
+
+#endif
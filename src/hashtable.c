@@ -4,9 +4,16 @@
 #include <string.h>
 
 #define HT_LOAD_GROW  0.70
+#define HT_LOAD_GROW_FORCED 0.90  /* grow even when resizing is disallowed */
 #define HT_LOAD_SHRINK 0.10
 #define HT_MIN_CAP    16
 
+static int resize_allowed = 1;
+
+void ht_set_resize_allowed(int allowed) {
+    resize_allowed = allowed;
+}
+
 /* FNV-1a hash */
 static uint32_t hash_key(const char *key) {
     uint32_t h = 2166136261u;
@@ -32,6 +39,7 @@ hashtable_t *ht_create(size_t initial_cap, void (*free_value)(void *)) {
     ht->capacity = initial_cap;
     ht->count = 0;
     ht->free_value = free_value;
+    ht->shrink_paused = 0;
 
     /* mark all slots empty */
     for (size_t i = 0; i < initial_cap; i++) {
@@ -45,14 +53,40 @@ void ht_destroy(hashtable_t *ht) {
     if (!ht) return;
     for (size_t i = 0; i < ht->capacity; i++) {
         if (ht->entries[i].psl >= 0) {
-            free(ht->entries[i].key);
+            ck_free(ht->entries[i].key);
             if (ht->free_value && ht->entries[i].value) {
                 ht->free_value(ht->entries[i].value);
             }
         }
     }
-    free(ht->entries);
-    free(ht);
+    ck_free(ht->entries);
+    ck_free(ht);
+}
+
+/* Robin Hood insert of a slot whose key is known to be absent */
+static void place_entry(hashtable_t *ht, ht_entry_t incoming) {
+    size_t mask = ht->capacity - 1;
+    size_t idx = incoming.hash & mask;
+    incoming.psl = 0;
+
+    while (1) {
+        ht_entry_t *slot = &ht->entries[idx];
+
+        if (slot->psl < 0) {
+            *slot = incoming;
+            ht->count++;
+            return;
+        }
+
+        if (incoming.psl > slot->psl) {
+            ht_entry_t tmp = *slot;
+            *slot = incoming;
+            incoming = tmp;
+        }
+
+        incoming.psl++;
+        idx = (idx + 1) & mask;
+    }
 }
 
 static int ht_resize(hashtable_t *ht, size_t new_cap) {
@@ -69,21 +103,30 @@ static int ht_resize(hashtable_t *ht, size_t new_cap) {
         ht->entries[i].psl = -1;
     }
 
-    /* reinsert all existing entries */
+    /* move existing slots over; keys keep their address, so pointers
+     * handed out by ht_replace stay valid across resizes */
     for (size_t i = 0; i < old_cap; i++) {
         if (old_entries[i].psl >= 0) {
-            ht_set(ht, old_entries[i].key, old_entries[i].value);
-            free(old_entries[i].key);
+            place_entry(ht, old_entries[i]);
         }
     }
 
-    free(old_entries);
+    ck_free(old_entries);
     return 0;
 }
 
-int ht_set(hashtable_t *ht, const char *key, void *value) {
+void ht_reserve(hashtable_t *ht, size_t n) {
+    size_t cap = next_power_of_two((size_t)((double)n / HT_LOAD_GROW) + 1);
+    if (cap > ht->capacity) ht_resize(ht, cap);
+}
+
+/* owned: a heap copy of key to store instead of duplicating it. freed if
+ * the key turns out to exist already */
+static int replace_entry(hashtable_t *ht, const char *key, char *owned, void *value,
+                         void **old, const char **stored_key) {
     /* grow if load factor exceeded */
-    if ((double)(ht->count + 1) / ht->capacity > HT_LOAD_GROW) {
+    double max_load = resize_allowed ? HT_LOAD_GROW : HT_LOAD_GROW_FORCED;
+    if ((double)(ht->count + 1) / ht->capacity > max_load) {
         ht_resize(ht, ht->capacity * 2);
     }
 
@@ -92,8 +135,12 @@ int ht_set(hashtable_t *ht, const char *key, void *value) {
     size_t idx = h & mask;
     int32_t psl = 0;
 
+    if (old) *old = NULL;
+
+    /* the key is only copied once it is known to be new: an existing key
+     * is always found before the probe reaches a richer slot or a hole */
     ht_entry_t incoming;
-    incoming.key = ck_strdup(key);
+    incoming.key = NULL;
     incoming.value = value;
     incoming.hash = h;
     incoming.psl = 0;
@@ -103,6 +150,10 @@ int ht_set(hashtable_t *ht, const char *key, void *value) {
 
         if (slot->psl < 0) {
             /* empty slot */
+            if (!incoming.key) {
+                incoming.key = owned ? owned : ck_strdup(key);
+                if (stored_key) *stored_key = incoming.key;
+            }
             incoming.psl = psl;
             *slot = incoming;
             ht->count++;
@@ -110,17 +161,20 @@ int ht_set(hashtable_t *ht, const char *key, void *value) {
         }
 
         /* key already exists - update */
-        if (slot->hash == h && strcmp(slot->key, incoming.key) == 0) {
-            if (ht->free_value && slot->value) {
-                ht->free_value(slot->value);
-            }
-            slot->value = incoming.value;
-            free(incoming.key);
+        if (!incoming.key && slot->hash == h && strcmp(slot->key, key) == 0) {
+            if (old) *old = slot->value;
+            if (stored_key) *stored_key = slot->key;
+            slot->value = value;
+            ck_free(owned);
             return 0; /* existing key updated */
         }
 
         /* Robin Hood: steal from rich slots */
         if (psl > slot->psl) {
+            if (!incoming.key) {
+                incoming.key = owned ? owned : ck_strdup(key);
+                if (stored_key) *stored_key = incoming.key;
+            }
             incoming.psl = psl;
             ht_entry_t tmp = *slot;
             *slot = incoming;
@@ -133,7 +187,26 @@ int ht_set(hashtable_t *ht, const char *key, void *value) {
     }
 }
 
-void *ht_get(hashtable_t *ht, const char *key) {
+int ht_replace(hashtable_t *ht, const char *key, void *value, void **old,
+               const char **stored_key) {
+    return replace_entry(ht, key, NULL, value, old, stored_key);
+}
+
+int ht_replace_owned(hashtable_t *ht, char *key, void *value, void **old,
+                     const char **stored_key) {
+    return replace_entry(ht, key, key, value, old, stored_key);
+}
+
+int ht_set(hashtable_t *ht, const char *key, void *value) {
+    void *old;
+    int added = ht_replace(ht, key, value, &old, NULL);
+    if (ht->free_value && old) {
+        ht->free_value(old);
+    }
+    return added;
+}
+
+static ht_entry_t *find_slot(hashtable_t *ht, const char *key) {
     uint32_t h = hash_key(key);
     size_t mask = ht->capacity - 1;
     size_t idx = h & mask;
@@ -147,7 +220,7 @@ void *ht_get(hashtable_t *ht, const char *key) {
         }
 
         if (slot->hash == h && strcmp(slot->key, key) == 0) {
-            return slot->value;
+            return slot;
         }
 
         psl++;
@@ -155,7 +228,17 @@ void *ht_get(hashtable_t *ht, const char *key) {
     }
 }
 
-int ht_delete(hashtable_t *ht, const char *key) {
+void *ht_get(hashtable_t *ht, const char *key) {
+    ht_entry_t *slot = find_slot(ht, key);
+    return slot ? slot->value : NULL;
+}
+
+const char *ht_get_key(hashtable_t *ht, const char *key) {
+    ht_entry_t *slot = find_slot(ht, key);
+    return slot ? slot->key : NULL;
+}
+
+int ht_unlink(hashtable_t *ht, const char *key, void **value) {
     uint32_t h = hash_key(key);
     size_t mask = ht->capacity - 1;
     size_t idx = h & mask;
@@ -169,10 +252,8 @@ int ht_delete(hashtable_t *ht, const char *key) {
         }
 
         if (slot->hash == h && strcmp(slot->key, key) == 0) {
-            free(slot->key);
-            if (ht->free_value && slot->value) {
-                ht->free_value(slot->value);
-            }
+            ck_free(slot->key);
+            if (value) *value = slot->value;
             slot->key = NULL;
             slot->value = NULL;
             slot->psl = -1;
@@ -193,7 +274,7 @@ int ht_delete(hashtable_t *ht, const char *key) {
             ht->count--;
 
             /* shrink if load factor too low */
-            if (ht->capacity > HT_MIN_CAP &&
+            if (resize_allowed && !ht->shrink_paused && ht->capacity > HT_MIN_CAP &&
                 (double)ht->count / ht->capacity < HT_LOAD_SHRINK) {
                 ht_resize(ht, ht->capacity / 2);
             }
@@ -206,6 +287,32 @@ int ht_delete(hashtable_t *ht, const char *key) {
     }
 }
 
+int ht_delete(hashtable_t *ht, const char *key) {
+    void *value;
+    if (!ht_unlink(ht, key, &value)) return 0;
+    if (ht->free_value && value) {
+        ht->free_value(value);
+    }
+    return 1;
+}
+
+void ht_pause_shrink(hashtable_t *ht, int paused) {
+    ht->shrink_paused = paused;
+}
+
+int ht_shrink_if_needed(hashtable_t *ht) {
+    if (!resize_allowed || ht->shrink_paused || ht->capacity <= HT_MIN_CAP ||
+        (double)ht->count / ht->capacity >= HT_LOAD_SHRINK) {
+        return 0;
+    }
+
+    /* one resize straight to the final size, keeping the load under
+     * half so the next few inserts don't grow it right back */
+    size_t cap = next_power_of_two(ht->count * 2);
+    if (cap < HT_MIN_CAP) cap = HT_MIN_CAP;
+    return ht_resize(ht, cap) == 0;
+}
+
 int ht_exists(hashtable_t *ht, const char *key) {
     return ht_get(ht, key) != NULL;
 }
@@ -218,6 +325,10 @@ size_t ht_capacity(hashtable_t *ht) {
     return ht->capacity;
 }
 
+size_t ht_mem_overhead(hashtable_t *ht) {
+    return ck_malloc_size(ht) + ck_malloc_size(ht->entries);
+}
+
 void ht_iter_init(ht_iter_t *iter, hashtable_t *ht) {
     iter->ht = ht;
     iter->index = 0;
@@ -237,13 +348,18 @@ int ht_iter_next(ht_iter_t *iter, const char **key, void **value) {
 }
 
 int ht_random_key(hashtable_t *ht, const char **key) {
+    return ht_random_entry(ht, key, NULL);
+}
+
+int ht_random_entry(hashtable_t *ht, const char **key, void **value) {
     if (ht->count == 0) return 0;
 
     size_t start = (size_t)rand() % ht->capacity;
     size_t idx = start;
     do {
         if (ht->entries[idx].psl >= 0) {
-            *key = ht->entries[idx].key;
+            if (key) *key = ht->entries[idx].key;
+            if (value) *value = ht->entries[idx].value;
             return 1;
         }
         idx = (idx + 1) % ht->capacity;
@@ -17,6 +17,7 @@ typedef struct {
     size_t capacity;
     size_t count;
     void (*free_value)(void *);
+    int shrink_paused;   /* deletes never trigger a shrink while set */
 } hashtable_t;
 
 typedef struct {
@@ -28,12 +29,42 @@ hashtable_t *ht_create(size_t initial_cap, void (*free_value)(void *));
 void ht_destroy(hashtable_t *ht);
 
 int ht_set(hashtable_t *ht, const char *key, void *value);
+/* like ht_set, but a displaced value is handed back in *old instead of
+ * being freed (*old is NULL for a new key). the table's own copy of the
+ * key is returned in *stored_key; it stays valid until the key is removed */
+int ht_replace(hashtable_t *ht, const char *key, void *value, void **old,
+               const char **stored_key);
+/* like ht_replace, but key is a ck_malloc'd string the table takes over
+ * instead of copying (and frees if the key is already present) */
+int ht_replace_owned(hashtable_t *ht, char *key, void *value, void **old,
+                     const char **stored_key);
 void *ht_get(hashtable_t *ht, const char *key);
+/* the table's own copy of key, or NULL if absent */
+const char *ht_get_key(hashtable_t *ht, const char *key);
 int ht_delete(hashtable_t *ht, const char *key);
+/* remove key without freeing its value, which is returned in *value */
+int ht_unlink(hashtable_t *ht, const char *key, void **value);
 int ht_exists(hashtable_t *ht, const char *key);
 
 size_t ht_count(hashtable_t *ht);
 size_t ht_capacity(hashtable_t *ht);
+/* grow once so that n keys fit without further resizes */
+void ht_reserve(hashtable_t *ht, size_t n);
+
+/* while a forked child shares the parent's memory, every page a resize
+ * touches gets copied. with resizing disallowed, tables only grow once
+ * nearly full and never shrink. applies to every table in the process */
+void ht_set_resize_allowed(int allowed);
+
+/* shrinking rehashes every key; pause it around bulk deletes that must
+ * stay cheap, then catch up with ht_shrink_if_needed() when convenient */
+void ht_pause_shrink(hashtable_t *ht, int paused);
+/* shrink to fit the current count if the load is too low. returns 1 if
+ * the table was resized */
+int ht_shrink_if_needed(hashtable_t *ht);
+
+/* bytes held by the table itself (struct + slot array), not keys or values */
+size_t ht_mem_overhead(hashtable_t *ht);
 
 /* iterator */
 void ht_iter_init(ht_iter_t *iter, hashtable_t *ht);
@@ -41,5 +72,8 @@ int ht_iter_next(ht_iter_t *iter, const char **key, void **value);
 
 /* get a random occupied key, for sampling */
 int ht_random_key(hashtable_t *ht, const char **key);
+/* same, also returning the value so sampling needn't look the key up
+ * again. either out pointer may be NULL */
+int ht_random_entry(hashtable_t *ht, const char **key, void **value);
 
 #endif
@@ -0,0 +1,126 @@
+#include "lazyfree.h"
+#include "util.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+typedef struct lazyfree_job {
+    struct lazyfree_job *next;
+    void (*free_fn)(void *);
+    void *obj;
+    size_t bytes;
+} lazyfree_job_t;
+
+static pthread_t g_thread;
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_wakeup = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t g_idle = PTHREAD_COND_INITIALIZER;
+
+static lazyfree_job_t *g_head;
+static lazyfree_job_t *g_tail;
+static int g_running;
+static int g_stopping;
+static int g_busy;
+
+static atomic_size_t g_pending_objects;
+static atomic_size_t g_pending_memory;
+static atomic_size_t g_freed_objects;
+
+static void *lazyfree_main(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_lock);
+    for (;;) {
+        while (!g_head && !g_stopping)
+            pthread_cond_wait(&g_wakeup, &g_lock);
+        if (!g_head) break;
+
+        lazyfree_job_t *job = g_head;
+        g_head = job->next;
+        if (!g_head) g_tail = NULL;
+        g_busy = 1;
+        pthread_mutex_unlock(&g_lock);
+
+        job->free_fn(job->obj);
+        atomic_fetch_sub(&g_pending_memory, job->bytes);
+        atomic_fetch_sub(&g_pending_objects, 1);
+        atomic_fetch_add(&g_freed_objects, 1);
+        ck_free(job);
+
+        pthread_mutex_lock(&g_lock);
+        g_busy = 0;
+        if (!g_head) pthread_cond_broadcast(&g_idle);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+int lazyfree_start(void) {
+    if (g_running) return 0;
+    g_stopping = 0;
+    if (pthread_create(&g_thread, NULL, lazyfree_main, NULL) != 0) {
+        ck_log(CK_LOG_WARN, "lazyfree: failed to start thread, freeing synchronously");
+        return -1;
+    }
+    g_running = 1;
+    return 0;
+}
+
+void lazyfree_stop(void) {
+    if (!g_running) return;
+    pthread_mutex_lock(&g_lock);
+    g_stopping = 1;
+    pthread_cond_signal(&g_wakeup);
+    pthread_mutex_unlock(&g_lock);
+    pthread_join(g_thread, NULL);
+    g_running = 0;
+}
+
+int lazyfree_running(void) {
+    return g_running;
+}
+
+void lazyfree_submit(void (*free_fn)(void *), void *obj, size_t bytes) {
+    if (!g_running) {
+        free_fn(obj);
+        atomic_fetch_add(&g_freed_objects, 1);
+        return;
+    }
+
+    lazyfree_job_t *job = ck_malloc(sizeof(lazyfree_job_t));
+    job->next = NULL;
+    job->free_fn = free_fn;
+    job->obj = obj;
+    job->bytes = bytes;
+
+    atomic_fetch_add(&g_pending_objects, 1);
+    atomic_fetch_add(&g_pending_memory, bytes);
+
+    pthread_mutex_lock(&g_lock);
+    if (g_tail) {
+        g_tail->next = job;
+    } else {
+        g_head = job;
+    }
+    g_tail = job;
+    pthread_cond_signal(&g_wakeup);
+    pthread_mutex_unlock(&g_lock);
+}
+
+void lazyfree_wait(void) {
+    if (!g_running) return;
+    pthread_mutex_lock(&g_lock);
+    while (g_head || g_busy)
+        pthread_cond_wait(&g_idle, &g_lock);
+    pthread_mutex_unlock(&g_lock);
+}
+
+size_t lazyfree_pending_objects(void) {
+    return atomic_load(&g_pending_objects);
+}
+
+size_t lazyfree_pending_memory(void) {
+    return atomic_load(&g_pending_memory);
+}
+
+size_t lazyfree_freed_objects(void) {
+    return atomic_load(&g_freed_objects);
+}
@@ -0,0 +1,27 @@
+#ifndef CK_LAZYFREE_H
+#define CK_LAZYFREE_H
+
+#include <stddef.h>
+
+/* containers with more elements than this are freed in the background;
+ * smaller ones cost less to free than to hand over */
+#define CK_LAZYFREE_THRESHOLD 64
+
+/* start / stop the background free thread. stop drains the queue first */
+int lazyfree_start(void);
+void lazyfree_stop(void);
+int lazyfree_running(void);
+
+/* run free_fn(obj) on the background thread. `bytes` is the caller's
+ * estimate of what will be released, reported as pending until done.
+ * frees synchronously when the thread isn't running */
+void lazyfree_submit(void (*free_fn)(void *), void *obj, size_t bytes);
+
+/* block until every submitted object has been freed */
+void lazyfree_wait(void);
+
+size_t lazyfree_pending_objects(void);
+size_t lazyfree_pending_memory(void);
+size_t lazyfree_freed_objects(void);
+
+#endif
@@ -16,10 +16,10 @@ void list_destroy(list_t *list) {
         if (list->free_value && node->value) {
             list->free_value(node->value);
         }
-        free(node);
+        ck_free(node);
         node = next;
     }
-    free(list);
+    ck_free(list);
 }
 
 void list_lpush(list_t *list, void *value) {
@@ -65,7 +65,7 @@ void *list_lpop(list_t *list) {
         list->tail = NULL;
     }
 
-    free(node);
+    ck_free(node);
     list->length--;
     return value;
 }
@@ -83,7 +83,7 @@ void *list_rpop(list_t *list) {
         list->head = NULL;
     }
 
-    free(node);
+    ck_free(node);
     list->length--;
     return value;
 }
@@ -152,7 +152,19 @@ void list_move_to_head(list_t *list, list_node_t *node) {
     list->head = node;
 }
 
-void list_remove_node(list_t *list, list_node_t *node) {
+void list_link_head(list_t *list, list_node_t *node) {
+    node->prev = NULL;
+    node->next = list->head;
+    if (list->head) {
+        list->head->prev = node;
+    } else {
+        list->tail = node;
+    }
+    list->head = node;
+    list->length++;
+}
+
+void list_unlink_node(list_t *list, list_node_t *node) {
     if (node->prev) {
         node->prev->next = node->next;
     } else {
@@ -165,6 +177,12 @@ void list_remove_node(list_t *list, list_node_t *node) {
         list->tail = node->prev;
     }
 
+    node->prev = NULL;
+    node->next = NULL;
     list->length--;
-    free(node);
+}
+
+void list_remove_node(list_t *list, list_node_t *node) {
+    list_unlink_node(list, node);
+    ck_free(node);
 }
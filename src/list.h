@@ -38,4 +38,9 @@ void list_move_to_head(list_t *list, list_node_t *node);
 /* remove a specific node */
 void list_remove_node(list_t *list, list_node_t *node);
 
+/* intrusive use: link / unlink a caller-owned node without allocating or
+ * freeing it. node->value is left to the caller */
+void list_link_head(list_t *list, list_node_t *node);
+void list_unlink_node(list_t *list, list_node_t *node);
+
 #endif
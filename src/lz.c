@@ -0,0 +1,149 @@
+#include "lz.h"
+#include "util.h"
+#include <string.h>
+
+#define MIN_MATCH   4
+#define LAST_LITERALS 5          /* the end of a block is always literals */
+#define MAX_OFFSET  65535
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static uint32_t hash4(uint32_t v, int bits) {
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+/* a length of 15 or more continues in 255-steps after the token */
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+size_t lz_compress(const uint8_t *in, size_t n, uint8_t *out, size_t cap, int level) {
+    if (level < CK_LZ_MIN_LEVEL) level = CK_LZ_MIN_LEVEL;
+    if (level > CK_LZ_MAX_LEVEL) level = CK_LZ_MAX_LEVEL;
+    int bits = 11 + level;
+    int skip_shift = 3 + level;
+
+    /* positions + 1, so 0 means empty */
+    uint32_t *table = ck_calloc((size_t)1 << bits, sizeof(uint32_t));
+    const uint8_t *ip = in, *anchor = in;
+    const uint8_t *end = in + n;
+    const uint8_t *match_limit = n > LAST_LITERALS ? end - LAST_LITERALS : in;
+    uint8_t *op = out, *op_end = out + cap;
+
+    if (n > MIN_MATCH + LAST_LITERALS && n < UINT32_MAX) {
+        unsigned misses = 0;
+        while (ip + MIN_MATCH <= match_limit) {
+            uint32_t h = hash4(read32(ip), bits);
+            const uint8_t *ref = table[h] ? in + table[h] - 1 : NULL;
+            table[h] = (uint32_t)(ip - in) + 1;
+
+            if (!ref || ip - ref > MAX_OFFSET || read32(ref) != read32(ip)) {
+                /* step further the longer nothing has matched */
+                ip += 1 + (misses++ >> skip_shift);
+                continue;
+            }
+            misses = 0;
+
+            /* extend back over literals, then forward */
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *mp = ip + MIN_MATCH, *mr = ref + MIN_MATCH;
+            while (mp < match_limit && *mp == *mr) {
+                mp++;
+                mr++;
+            }
+
+            size_t lit = (size_t)(ip - anchor);
+            size_t mlen = (size_t)(mp - ip) - MIN_MATCH;
+            if ((size_t)(op_end - op) < 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1) goto overflow;
+
+            uint8_t *token = op++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15) op = put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            size_t off = (size_t)(ip - ref);
+            *op++ = (uint8_t)off;
+            *op++ = (uint8_t)(off >> 8);
+            *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15) op = put_length(op, mlen - 15);
+
+            /* index a position inside the match too, so the next match
+             * can start from it */
+            if (mp - 2 > ip) table[hash4(read32(mp - 2), bits)] = (uint32_t)(mp - 2 - in) + 1;
+            ip = anchor = mp;
+        }
+    }
+
+    /* the rest as literals */
+    size_t lit = (size_t)(end - anchor);
+    if ((size_t)(op_end - op) < 1 + lit + lit / 255 + 1) goto overflow;
+    *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    ck_free(table);
+    return (size_t)(op - out);
+
+overflow:
+    ck_free(table);
+    return 0;
+}
+
+/* a length continued past the token; -1 if it runs off the input */
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= end) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int lz_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t raw) {
+    const uint8_t *ip = in, *end = in + n;
+    uint8_t *op = out, *op_end = out + raw;
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, end, &lit) != 0) return -1;
+        if ((size_t)(end - ip) < lit || (size_t)(op_end - op) < lit) return -1;
+        memcpy(op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == end) break;   /* the last sequence has no match */
+
+        if (end - ip < 2) return -1;
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, end, &mlen) != 0) return -1;
+        mlen += MIN_MATCH;
+        if (off == 0 || off > (size_t)(op - out) || (size_t)(op_end - op) < mlen) return -1;
+
+        /* byte by byte: the match may overlap what it produces */
+        const uint8_t *ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+            op += mlen;
+        } else {
+            while (mlen--) *op++ = *ref++;
+        }
+    }
+    return op == op_end ? 0 : -1;
+}
@@ -0,0 +1,29 @@
+#ifndef CK_LZ_H
+#define CK_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* LZ77 block codec in the LZ4 block format: each sequence is a token
+ * (literal length << 4 | match length - 4, 15 meaning more length bytes
+ * follow, 255 at a time), the literals, and a 16-bit little-endian
+ * offset back into the output. the last sequence is literals only and
+ * the last 5 bytes are always literals. greedy, one hash table probe per
+ * position, so it trades some ratio for speed. */
+
+#define CK_LZ_MIN_LEVEL 1
+#define CK_LZ_MAX_LEVEL 9
+
+/* worst case compressed size of n bytes */
+#define lz_bound(n) ((n) + (n) / 255 + 16)
+
+/* compress n bytes at in into out, which has room for cap. higher levels
+ * use a bigger hash table and give up on incompressible stretches more
+ * slowly. returns the compressed size, 0 if it wouldn't fit in cap */
+size_t lz_compress(const uint8_t *in, size_t n, uint8_t *out, size_t cap, int level);
+
+/* decompress exactly raw bytes into out. returns 0, or -1 if the input is
+ * malformed or doesn't decompress to raw bytes */
+int lz_decompress(const uint8_t *in, size_t n, uint8_t *out, size_t raw);
+
+#endif
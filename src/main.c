@@ -1,6 +1,11 @@
 #include "server.h"
 #include "store.h"
 #include "persistence.h"
+#include "aof.h"
+#include "cluster.h"
+#include "lazyfree.h"
+#include "replication.h"
+#include "config.h"
 #include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,7 +15,8 @@
 #define DEFAULT_RDB "dump.ckdb"
 
 static void usage(const char *prog) {
-    fprintf(stderr, "usage: %s [-p port] [-d rdb_file]\n", prog);
+    fprintf(stderr, "usage: %s [-c config] [-p port] [-d rdb_file]\n", prog);
+    fprintf(stderr, "  -c file     config file (see cachekit.conf.example)\n");
     fprintf(stderr, "  -p port     listen port (default %d)\n", DEFAULT_PORT);
     fprintf(stderr, "  -d file     RDB snapshot path (default %s)\n", DEFAULT_RDB);
 }
@@ -22,6 +28,11 @@ int main(int argc, char **argv) {
         .max_clients = 64
     };
 
+    /* -p and -d override the config file, so apply them after loading it */
+    const char *config_file = NULL;
+    int port_override = 0;
+    const char *rdb_override = NULL;
+
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
             int p = atoi(argv[i + 1]);
@@ -29,10 +40,13 @@ int main(int argc, char **argv) {
                 fprintf(stderr, "invalid port\n");
                 return 1;
             }
-            config.port = (uint16_t)p;
+            port_override = p;
             i++;
         } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
-            config.rdb_filename = argv[i + 1];
+            rdb_override = argv[i + 1];
+            i++;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            config_file = argv[i + 1];
             i++;
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             usage(argv[0]);
@@ -45,26 +59,55 @@ int main(int argc, char **argv) {
 
     ck_log_set_level(CK_LOG_INFO);
 
+    size_t startup_memory = ck_mem_used();
     store_t *store = store_create();
     if (!store) {
         ck_log(CK_LOG_ERROR, "store_create failed");
         return 1;
     }
 
-    if (persistence_load(store, config.rdb_filename) == 0) {
-        ck_log(CK_LOG_INFO, "loaded RDB from %s", config.rdb_filename);
-    }
-
     command_ctx_t ctx = {
         .store = store,
+        .config = &config,
         .rdb_filename = config.rdb_filename,
         .start_time = ck_time_ms(),
         .commands_processed = 0,
-        .connected_clients = 0
+        .connected_clients = 0,
+        .startup_memory = startup_memory,
+        .client_buffers_memory = 0
     };
+    store->on_removed = command_key_removed;
+    store->on_removed_arg = &ctx;
+    repl_init(&ctx);
+
+    if (config_file && config_load(&ctx, config_file) != 0) {
+        return 1;
+    }
+    if (port_override) config.port = (uint16_t)port_override;
+    if (rdb_override) config.rdb_filename = rdb_override;
+    ctx.rdb_filename = config.rdb_filename;
+    if (cluster_init(store, config.port) != 0) return 1;
+
+    /* the log has every write since it was started from the dataset, so
+     * when there is one it replaces the snapshot rather than adding to it */
+    FILE *aof = aof_wanted() ? fopen(aof_filename(), "rb") : NULL;
+    if (aof) {
+        fclose(aof);
+        if (aof_load(&ctx, aof_filename()) < 0) return 1;
+    } else if (persistence_load(store, config.rdb_filename) == 0) {
+        ck_log(CK_LOG_INFO, "loaded RDB from %s", config.rdb_filename);
+    }
+    /* the replay went through the write commands, but none of it is new */
+    persistence_reset_dirty();
+    if (aof_start(store) != 0) return 1;
 
+    lazyfree_start();
     server_run(&config, &ctx);
 
+    repl_stop();
+    persistence_stop();
+    aof_stop();
+    lazyfree_stop();
     store_destroy(store);
     return 0;
 }
@@ -1,32 +1,41 @@
 #include "persistence.h"
+#include "child.h"
+#include "fmap.h"
+#include "lz.h"
 #include "util.h"
+#include <pthread.h>
+#include <errno.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-/* binary write helpers */
-static int write_u8(FILE *f, uint8_t v) {
-    return fwrite(&v, 1, 1, f) == 1 ? 0 : -1;
-}
-
-static int write_u32(FILE *f, uint32_t v) {
-    return fwrite(&v, 4, 1, f) == 1 ? 0 : -1;
-}
+static int64_t g_lastsave;
+static int g_last_bgsave_ok = 1;
+static int64_t g_last_bgsave_ms = -1;
+static size_t g_last_cow_bytes;
+static int64_t g_last_save_ms = -1;
 
-static int write_u64(FILE *f, uint64_t v) {
-    return fwrite(&v, 8, 1, f) == 1 ? 0 : -1;
-}
+/* writes since the last save, and how many of them the running BGSAVE
+ * child has */
+static uint64_t g_dirty;
+static uint64_t g_dirty_at_fork;
+/* monotonic ms of the last save (or of startup), and of the last BGSAVE
+ * attempt */
+static int64_t g_save_base_ms;
+static int64_t g_bgsave_start_ms;
 
-static int write_i64(FILE *f, int64_t v) {
-    return fwrite(&v, 8, 1, f) == 1 ? 0 : -1;
-}
+typedef struct {
+    int64_t seconds;
+    uint64_t changes;
+} save_point_t;
 
-static int write_str(FILE *f, const char *s) {
-    uint32_t len = (uint32_t)strlen(s);
-    if (write_u32(f, len) != 0) return -1;
-    return fwrite(s, 1, len, f) == len ? 0 : -1;
-}
+static save_point_t g_save_points[CK_RDB_MAX_SAVE_POINTS];
+static int g_n_save_points;
 
 /* binary read helpers */
 static int read_u8(FILE *f, uint8_t *v) {
@@ -52,89 +61,420 @@ static char *read_str(FILE *f) {
 
     char *s = ck_malloc(len + 1);
     if (fread(s, 1, len, f) != len) {
-        free(s);
+        ck_free(s);
         return NULL;
     }
     s[len] = '\0';
     return s;
 }
 
-int persistence_save(store_t *s, const char *filename) {
-    char tmpname[256];
-    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+/* the writer encodes a chunk of entries into a buffer that grows as
+ * needed; once it holds CK_RDB_CHUNK_SIZE bytes it goes out behind its
+ * frame in two fwrites */
+#define RDB_IO_BUF (256 * 1024)
 
-    FILE *f = fopen(tmpname, "wb");
-    if (!f) {
-        ck_log(CK_LOG_ERROR, "failed to open %s for writing", tmpname);
-        return -1;
+typedef struct {
+    uint64_t offset;    /* of the entries, from the start of the snapshot */
+    uint64_t len;       /* as stored */
+    uint64_t raw_len;   /* once decompressed, 0 if stored as is */
+    uint64_t keys;
+    uint32_t crc;       /* of the stored bytes */
+} rdb_chunk_t;
+
+typedef struct {
+    FILE *f;
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    uint64_t written;   /* bytes already handed to f */
+    rdb_chunk_t *chunks;
+    size_t n_chunks;
+    size_t cap_chunks;
+    uint8_t *zbuf;      /* compressed chunk */
+    size_t zcap;
+    int err;
+} rdb_writer_t;
+
+static void w_write(rdb_writer_t *w, const void *p, size_t n) {
+    if (n && !w->err && fwrite(p, 1, n, w->f) != n) w->err = 1;
+    w->written += n;
+}
+
+static void w_flush(rdb_writer_t *w) {
+    w_write(w, w->buf, w->len);
+    w->len = 0;
+}
+
+static void w_reserve(rdb_writer_t *w, size_t n) {
+    if (w->len + n <= w->cap) return;
+    while (w->len + n > w->cap) w->cap *= 2;
+    w->buf = ck_realloc(w->buf, w->cap);
+}
+
+/* LEB128: 7 bits per byte, low bits first */
+static size_t put_varint(uint8_t *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (uint8_t)v;
+    return n;
+}
+
+static size_t put_fixed(uint8_t *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (uint8_t)(v >> (8 * i));
+    return (size_t)bytes;
+}
+
+static void w_u8(rdb_writer_t *w, uint8_t v) {
+    w_reserve(w, 1);
+    w->buf[w->len++] = v;
+}
+
+static void w_varint(rdb_writer_t *w, uint64_t v) {
+    w_reserve(w, 10);
+    w->len += put_varint(w->buf + w->len, v);
+}
+
+static void w_fixed32(rdb_writer_t *w, uint32_t v) {
+    w_reserve(w, 4);
+    w->len += put_fixed(w->buf + w->len, v, 4);
+}
+
+static void w_fixed64(rdb_writer_t *w, uint64_t v) {
+    w_reserve(w, 8);
+    w->len += put_fixed(w->buf + w->len, v, 8);
+}
+
+static void w_bytes(rdb_writer_t *w, const void *p, size_t n) {
+    w_reserve(w, n);
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+}
+
+static void w_str(rdb_writer_t *w, const char *s) {
+    size_t len = strlen(s);
+    w_varint(w, len);
+    w_bytes(w, s, len);
+}
+
+static int g_compression_level;
+
+/* write the buffered entries as one chunk and remember it for the index.
+ * with compression on, the chunk is stored compressed if that saves at
+ * least 1/16 of it; a chunk holding one large value is in effect that
+ * value compressed on its own */
+static void w_chunk(rdb_writer_t *w, uint64_t keys) {
+    const uint8_t *data = w->buf;
+    size_t len = w->len, raw_len = 0;
+    if (g_compression_level > 0 && w->len >= 64) {
+        if (w->zcap < w->len) {
+            w->zcap = w->len;
+            w->zbuf = ck_realloc(w->zbuf, w->zcap);
+        }
+        size_t zlen = lz_compress(w->buf, w->len, w->zbuf, w->len - w->len / 16,
+                                  g_compression_level);
+        if (zlen) {
+            data = w->zbuf;
+            len = zlen;
+            raw_len = w->len;
+        }
+    }
+
+    uint8_t frame[1 + 10 + 10 + 10 + 4];
+    uint32_t crc = ck_crc32c(0, data, len);
+    size_t n = 0;
+    frame[n++] = raw_len ? CK_RDB_OPCODE_CHUNK_LZ : CK_RDB_OPCODE_CHUNK;
+    n += put_varint(frame + n, keys);
+    n += put_varint(frame + n, len);
+    if (raw_len) n += put_varint(frame + n, raw_len);
+    n += put_fixed(frame + n, crc, 4);
+    w_write(w, frame, n);
+
+    if (w->n_chunks == w->cap_chunks) {
+        w->cap_chunks = w->cap_chunks ? w->cap_chunks * 2 : 64;
+        w->chunks = ck_realloc(w->chunks, sizeof(rdb_chunk_t) * w->cap_chunks);
+    }
+    w->chunks[w->n_chunks++] = (rdb_chunk_t){ w->written, len, raw_len, keys, crc };
+    w_write(w, data, len);
+    w->len = 0;
+}
+
+/* zigzag so small negative numbers stay short */
+static uint64_t zigzag(int64_t v) {
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t unzigzag(uint64_t v) {
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static int entry_expired(const store_entry_t *e, int64_t now) {
+    return e->expire_at != 0 && now >= e->expire_at;
+}
+
+/* the value encoding used for each type, so a reader can tell what it's
+ * getting before it sees a key */
+static const uint8_t type_encodings[][2] = {
+    { CK_RDB_TYPE_STRING, CK_RDB_ENC_RAW },
+    { CK_RDB_TYPE_INT,    CK_RDB_ENC_VARINT },
+    { CK_RDB_TYPE_LIST,   CK_RDB_ENC_LINKED },
+    { CK_RDB_TYPE_HASH,   CK_RDB_ENC_HT },
+};
+
+#define N_TYPE_ENCODINGS (sizeof(type_encodings) / sizeof(type_encodings[0]))
+
+/* [EXPIRE_MS expire_at] type key value */
+static void w_entry(rdb_writer_t *w, const char *key, const store_entry_t *e) {
+    if (e->expire_at) {
+        w_u8(w, CK_RDB_OPCODE_EXPIRE_MS);
+        w_fixed64(w, (uint64_t)e->expire_at);
+    }
+
+    switch (e->type) {
+        case CK_STRING:
+            w_u8(w, CK_RDB_TYPE_STRING);
+            w_str(w, key);
+            w_str(w, e->str);
+            break;
+
+        case CK_INT:
+            w_u8(w, CK_RDB_TYPE_INT);
+            w_str(w, key);
+            w_varint(w, zigzag(e->integer));
+            break;
+
+        case CK_LIST:
+            w_u8(w, CK_RDB_TYPE_LIST);
+            w_str(w, key);
+            w_varint(w, list_length(e->list));
+            for (list_node_t *node = e->list->head; node; node = node->next) {
+                w_str(w, (const char *)node->value);
+            }
+            break;
+
+        case CK_HASH: {
+            w_u8(w, CK_RDB_TYPE_HASH);
+            w_str(w, key);
+            w_varint(w, ht_count(e->hash));
+
+            ht_iter_t hiter;
+            ht_iter_init(&hiter, e->hash);
+            const char *field;
+            void *hval;
+            while (ht_iter_next(&hiter, &field, &hval)) {
+                w_str(w, field);
+                w_str(w, (const char *)hval);
+            }
+            break;
+        }
     }
+}
+
+/* a new snapshot's id: what a delta file is tied to, so it must differ
+ * between any two bases, even ones saved in the same second */
+static uint64_t random_base_id(void) {
+    uint64_t id = 0;
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (!f || fread(&id, 1, sizeof(id), f) != sizeof(id)) {
+        static uint64_t seq;
+        id = (uint64_t)ck_time_us() ^ (uint64_t)getpid() << 32 ^ ++seq * 0x9e3779b97f4a7c15ull;
+    }
+    if (f) fclose(f);
+    return id;
+}
+
+static void w_header(rdb_writer_t *w, uint64_t keys) {
+    w_bytes(w, CK_RDB_MAGIC, 8);
+    w_fixed32(w, CK_RDB_VERSION);
+    w_fixed64(w, (uint64_t)time(NULL));
+    w_fixed64(w, random_base_id());
+    w_varint(w, keys);
+    w_varint(w, N_TYPE_ENCODINGS);
+    for (size_t i = 0; i < N_TYPE_ENCODINGS; i++) {
+        w_u8(w, type_encodings[i][0]);
+        w_u8(w, type_encodings[i][1]);
+    }
+    w_flush(w);
+}
+
+/* EOF, then the index and trailer, so a loader can find every chunk
+ * without reading through the file */
+static void w_index(rdb_writer_t *w) {
+    w_u8(w, CK_RDB_EOF);
 
-    /* header */
-    fwrite(CK_RDB_MAGIC, 1, 8, f);
-    write_u32(f, CK_RDB_VERSION);
-    write_u64(f, (uint64_t)time(NULL));
+    uint64_t index_offset = w->written + w->len;
+    w_varint(w, w->n_chunks);
+    for (size_t i = 0; i < w->n_chunks; i++) {
+        w_varint(w, w->chunks[i].offset);
+        w_varint(w, w->chunks[i].len);
+        w_varint(w, w->chunks[i].raw_len);
+        w_varint(w, w->chunks[i].keys);
+        w_fixed32(w, w->chunks[i].crc);
+    }
+    w_fixed64(w, index_offset);
+    w_bytes(w, CK_RDB_INDEX_MAGIC, 8);
+    w_flush(w);
+}
+
+static void w_release(rdb_writer_t *w) {
+    ck_free(w->chunks);
+    ck_free(w->zbuf);
+    ck_free(w->buf);
+}
+
+int persistence_write(store_t *s, FILE *f) {
+    rdb_writer_t w = { .f = f, .buf = ck_malloc(CK_RDB_CHUNK_SIZE + RDB_IO_BUF),
+                       .cap = CK_RDB_CHUNK_SIZE + RDB_IO_BUF };
+    int64_t now = ck_wall_time_ms();
 
     ht_iter_t iter;
-    ht_iter_init(&iter, s->data);
     const char *key;
     void *val;
+    uint64_t keys = 0;
+    ht_iter_init(&iter, s->data);
+    while (ht_iter_next(&iter, &key, &val)) {
+        if (!entry_expired((store_entry_t *)val, now)) keys++;
+    }
+    w_header(&w, keys);
 
+    uint64_t chunk_keys = 0;
+    ht_iter_init(&iter, s->data);
     while (ht_iter_next(&iter, &key, &val)) {
         store_entry_t *e = (store_entry_t *)val;
+        if (entry_expired(e, now)) continue;
 
-        /* skip expired keys */
-        if (store_is_expired(e)) continue;
+        w_entry(&w, key, e);
+        chunk_keys++;
+        if (w.len >= CK_RDB_CHUNK_SIZE) {
+            w_chunk(&w, chunk_keys);
+            chunk_keys = 0;
+        }
+    }
+    if (chunk_keys) w_chunk(&w, chunk_keys);
+    w_index(&w);
 
-        switch (e->type) {
-            case CK_STRING:
-                write_u8(f, CK_RDB_TYPE_STRING);
-                write_str(f, key);
-                write_str(f, e->str);
-                break;
+    w_release(&w);
+    return w.err || ferror(f) ? -1 : 0;
+}
 
-            case CK_INT:
-                write_u8(f, CK_RDB_TYPE_INT);
-                write_str(f, key);
-                write_i64(f, e->integer);
-                break;
+enum { SAVE_FULL, SAVE_DELTA };
 
-            case CK_LIST: {
-                write_u8(f, CK_RDB_TYPE_LIST);
-                write_str(f, key);
-                uint32_t len = (uint32_t)list_length(e->list);
-                write_u32(f, len);
-                list_node_t *node = e->list->head;
-                while (node) {
-                    write_str(f, (const char *)node->value);
-                    node = node->next;
-                }
-                break;
-            }
+static int g_delta_enabled;
+static int g_delta_compact_pct = 100;
+/* the base snapshot and delta file on disk that further deltas can be
+ * appended to; g_base_size is 0 when the next save has to be a full one */
+static uint64_t g_base_size;
+static uint64_t g_delta_size;
 
-            case CK_HASH: {
-                write_u8(f, CK_RDB_TYPE_HASH);
-                write_str(f, key);
-                uint32_t cnt = (uint32_t)ht_count(e->hash);
-                write_u32(f, cnt);
-
-                ht_iter_t hiter;
-                ht_iter_init(&hiter, e->hash);
-                const char *field;
-                void *hval;
-                while (ht_iter_next(&hiter, &field, &hval)) {
-                    write_str(f, field);
-                    write_str(f, (const char *)hval);
-                }
-                break;
-            }
-        }
+/* the running BGSAVE */
+static int g_bgsave_kind;
+static uint64_t g_bgsave_cut;
+static store_t *g_bgsave_store;
+static char g_bgsave_filename[256];
+static int g_bgsave_to_fd;      /* streamed to a pipe: the files aren't touched */
+
+static void delta_path(const char *filename, char *buf, size_t len) {
+    snprintf(buf, len, "%s" CK_RDB_DELTA_SUFFIX, filename);
+}
 
-        /* write TTL */
-        write_i64(f, e->expire_at);
+static uint64_t path_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+static uint64_t get_fixed(const uint8_t *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static uint32_t header_version(const uint8_t *v) {
+    return (uint32_t)v[0] | (uint32_t)v[1] << 8 | (uint32_t)v[2] << 16 | (uint32_t)v[3] << 24;
+}
+
+/* the header a delta file written against the base in filename starts
+ * with: the base's id and size. a version 4 or older base has no id and
+ * is matched by its save time, under the old delta magic */
+static int delta_header(const char *filename, uint8_t *out) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return -1;
+    uint8_t hdr[28];
+    size_t n = fread(hdr, 1, sizeof(hdr), f);
+    fclose(f);
+    if (n < 20 || memcmp(hdr, CK_RDB_MAGIC, 8) != 0) return -1;
+    if (header_version(hdr + 8) >= 5) {
+        if (n < 28) return -1;
+        memcpy(out, CK_RDB_DELTA_MAGIC, 8);
+        memcpy(out + 8, hdr + 20, 8);
+    } else {
+        memcpy(out, CK_RDB_DELTA_MAGIC_V4, 8);
+        memcpy(out + 8, hdr + 12, 8);
+    }
+    put_fixed(out + 16, path_size(filename), 8);
+    return 0;
+}
+
+/* start an empty delta file for the base just written to filename */
+static int delta_reset(const char *filename) {
+    uint8_t hdr[CK_RDB_DELTA_HEADER];
+    if (delta_header(filename, hdr) != 0) return -1;
+
+    char path[256], tmpname[272];
+    delta_path(filename, path, sizeof(path));
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", path);
+
+    FILE *f = fopen(tmpname, "wb");
+    if (!f) return -1;
+    size_t n = fwrite(hdr, 1, sizeof(hdr), f);
+    if (fclose(f) != 0 || n != sizeof(hdr) || rename(tmpname, path) != 0) {
+        remove(tmpname);
+        return -1;
     }
+    return 0;
+}
 
-    write_u8(f, CK_RDB_EOF);
+/* pick up what a save left on disk: deltas can go on only if the delta
+ * file still belongs to the base */
+static void delta_refresh(const char *filename) {
+    g_base_size = g_delta_size = 0;
+    if (!g_delta_enabled) return;
+
+    char path[256];
+    uint8_t want[CK_RDB_DELTA_HEADER], hdr[CK_RDB_DELTA_HEADER];
+    delta_path(filename, path, sizeof(path));
+    if (delta_header(filename, want) != 0) return;
+    FILE *f = fopen(path, "rb");
+    if (!f) return;
+    int ok = fread(hdr, 1, sizeof(hdr), f) == sizeof(hdr);
     fclose(f);
+    if (ok && memcmp(hdr, want, sizeof(hdr)) == 0) {
+        g_base_size = get_fixed(want + 16, 8);
+        g_delta_size = path_size(path);
+    }
+}
+
+static int save_kind(store_t *s) {
+    if (!g_delta_enabled || !s->delta_keys || !g_base_size || s->delta_flush_epoch) {
+        return SAVE_FULL;
+    }
+    /* compaction: once the deltas add up to enough of the base, replaying
+     * them costs more than writing a new base */
+    uint64_t deltas = g_delta_size - CK_RDB_DELTA_HEADER;
+    if (g_delta_compact_pct && deltas * 100 >= g_base_size * (uint64_t)g_delta_compact_pct) {
+        return SAVE_FULL;
+    }
+    return SAVE_DELTA;
+}
+
+/* the snapshot in tmpname is complete: put it in filename's place */
+static int install_base(const char *tmpname, const char *filename) {
+    /* deltas written against the old base don't apply to this one: they
+     * go first, so a crash can't leave them next to the new base */
+    char path[256];
+    delta_path(filename, path, sizeof(path));
+    remove(path);
 
     /* atomic rename */
     remove(filename);
@@ -143,123 +483,1687 @@ int persistence_save(store_t *s, const char *filename) {
         return -1;
     }
 
+    if (g_delta_enabled && delta_reset(filename) != 0) {
+        ck_log(CK_LOG_ERROR, "failed to start %s, next save is a full one", path);
+    }
+
     ck_log(CK_LOG_INFO, "saved snapshot to %s", filename);
     return 0;
 }
 
-int persistence_load(store_t *s, const char *filename) {
-    FILE *f = fopen(filename, "rb");
-    if (!f) return -1;
+static int write_base(store_t *s, const char *filename) {
+    char tmpname[256];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
 
-    /* verify magic */
-    char magic[8];
-    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, CK_RDB_MAGIC, 8) != 0) {
-        ck_log(CK_LOG_ERROR, "invalid snapshot magic");
-        fclose(f);
+    FILE *f = fopen(tmpname, "wb");
+    if (!f) {
+        ck_log(CK_LOG_ERROR, "failed to open %s for writing", tmpname);
         return -1;
     }
 
-    uint32_t version;
-    uint64_t timestamp;
-    read_u32(f, &version);
-    read_u64(f, &timestamp);
+    int rc = persistence_write(s, f);
+    if (fclose(f) != 0 || rc != 0) {
+        ck_log(CK_LOG_ERROR, "failed to write %s", tmpname);
+        remove(tmpname);
+        return -1;
+    }
+    return install_base(tmpname, filename);
+}
 
-    if (version != CK_RDB_VERSION) {
-        ck_log(CK_LOG_ERROR, "unsupported snapshot version %u", version);
+/* the delta file, positioned after its last good record. whatever a
+ * failed append left behind is cut off */
+static FILE *delta_open(const char *filename, char *path, size_t len) {
+    delta_path(filename, path, len);
+    FILE *f = fopen(path, "r+b");
+    if (!f) {
+        ck_log(CK_LOG_ERROR, "failed to open %s for writing", path);
+        return NULL;
+    }
+    if (ftruncate(fileno(f), (off_t)g_delta_size) != 0 ||
+        fseeko(f, (off_t)g_delta_size, SEEK_SET) != 0) {
+        ck_log(CK_LOG_ERROR, "failed to truncate %s", path);
         fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+static void w_delta_header(rdb_writer_t *w, uint64_t keys) {
+    w_u8(w, CK_RDB_OPCODE_DELTA);
+    w_fixed64(w, (uint64_t)ck_wall_time_ms());
+    w_varint(w, keys);
+    w_flush(w);
+}
+
+/* append the keys changed since the last save as one record */
+static int write_delta(store_t *s, const char *filename) {
+    char path[256];
+    FILE *f = delta_open(filename, path, sizeof(path));
+    if (!f) return -1;
+
+    rdb_writer_t w = { .f = f, .buf = ck_malloc(CK_RDB_CHUNK_SIZE + RDB_IO_BUF),
+                       .cap = CK_RDB_CHUNK_SIZE + RDB_IO_BUF, .written = g_delta_size };
+    int64_t now = ck_wall_time_ms();
+    size_t keys = ht_count(s->delta_keys);
+    w_delta_header(&w, keys);
+
+    ht_iter_t iter;
+    const char *key;
+    uint64_t chunk_keys = 0;
+    ht_iter_init(&iter, s->delta_keys);
+    while (ht_iter_next(&iter, &key, NULL)) {
+        store_entry_t *e = ht_get(s->data, key);
+        if (e && !entry_expired(e, now)) {
+            w_entry(&w, key, e);
+        } else {
+            w_u8(&w, CK_RDB_OPCODE_DELETE);
+            w_str(&w, key);
+        }
+        chunk_keys++;
+        if (w.len >= CK_RDB_CHUNK_SIZE) {
+            w_chunk(&w, chunk_keys);
+            chunk_keys = 0;
+        }
+    }
+    if (chunk_keys) w_chunk(&w, chunk_keys);
+    w_u8(&w, CK_RDB_EOF);
+    w_flush(&w);
+
+    w_release(&w);
+    if (fclose(f) != 0 || w.err) {
+        ck_log(CK_LOG_ERROR, "failed to write %s", path);
         return -1;
     }
+    ck_log(CK_LOG_INFO, "saved delta of %zu keys to %s", keys, path);
+    return 0;
+}
 
-    int loaded = 0;
-    while (1) {
-        uint8_t type;
-        if (read_u8(f, &type) != 0) break;
-        if (type == CK_RDB_EOF) break;
+static int save_as(store_t *s, const char *filename, int kind) {
+    return kind == SAVE_DELTA ? write_delta(s, filename) : write_base(s, filename);
+}
 
-        char *key = read_str(f);
-        if (!key) break;
+/* told when a BGSAVE is over */
+static void (*g_bgsave_hook)(int ok);
 
-        int64_t expire_at;
+static void bgsave_finished(int ok, int64_t duration_ms) {
+    if (g_bgsave_to_fd) {
+        g_bgsave_to_fd = 0;
+        if (!ok) ck_log(CK_LOG_ERROR, "streaming the snapshot failed");
+        if (g_bgsave_hook) g_bgsave_hook(ok);
+        return;
+    }
+    g_last_bgsave_ok = ok;
+    g_last_bgsave_ms = duration_ms;
+    if (ok) {
+        /* writes made while the save ran aren't in the file */
+        store_delta_commit(g_bgsave_store, g_bgsave_cut);
+        g_lastsave = (int64_t)time(NULL);
+        g_last_save_ms = duration_ms;
+        g_dirty -= g_dirty_at_fork;
+        g_save_base_ms = g_bgsave_start_ms;
+    } else {
+        ck_log(CK_LOG_ERROR, "background saving failed");
+    }
+    /* a failed full save may have replaced the base without starting a
+     * delta file for it. a failed delta is cut off by the next one */
+    if (ok || g_bgsave_kind == SAVE_FULL) delta_refresh(g_bgsave_filename);
+    if (g_bgsave_hook) g_bgsave_hook(ok);
+}
 
-        switch (type) {
-            case CK_RDB_TYPE_STRING: {
-                char *val = read_str(f);
-                if (!val) { free(key); goto done; }
-                read_i64(f, &expire_at);
-                store_set(s, key, val);
-                if (expire_at > 0) {
-                    store_entry_t *e = (store_entry_t *)ht_get(s->data, key);
-                    if (e) e->expire_at = expire_at;
-                }
-                free(val);
-                break;
-            }
+/* BGSAVE on a thread: the store hands the thread its entries in batches
+ * (store_snapshot_next) and the pre-images of the ones the main thread
+ * changes before the thread got to them. both go into the file in
+ * whatever order they come; the loader doesn't care */
+typedef struct {
+    store_t *s;
+    int kind;
+    char filename[256];
+    char path[272];         /* the file being written */
+    rdb_writer_t w;         /* the thread's */
+    rdb_writer_t pre;       /* pre-images; under the store lock */
+    uint64_t pre_keys;
+    size_t pre_peak;
+    pthread_t thread;
+    atomic_int done;
+    int ok;
+    int to_fd;              /* writing to a pipe rather than path */
+} thread_save_t;
 
-            case CK_RDB_TYPE_INT: {
-                int64_t val;
-                read_i64(f, &val);
-                read_i64(f, &expire_at);
-                store_set_int(s, key, val);
-                if (expire_at > 0) {
-                    store_entry_t *e = (store_entry_t *)ht_get(s->data, key);
-                    if (e) e->expire_at = expire_at;
-                }
-                break;
-            }
+static ck_rdb_bgsave_method_t g_bgsave_method = CK_RDB_BGSAVE_FORK;
+static thread_save_t *g_thread_save;
+static size_t g_last_preimage_bytes;
 
-            case CK_RDB_TYPE_LIST: {
-                uint32_t len;
-                read_u32(f, &len);
-                for (uint32_t i = 0; i < len; i++) {
-                    char *val = read_str(f);
-                    if (!val) { free(key); goto done; }
-                    store_rpush(s, key, val);
-                    free(val);
-                }
-                read_i64(f, &expire_at);
-                if (expire_at > 0) {
-                    store_entry_t *e = (store_entry_t *)ht_get(s->data, key);
-                    if (e) e->expire_at = expire_at;
-                }
-                break;
-            }
+static void save_preimage(void *arg, const char *key, const store_entry_t *e) {
+    thread_save_t *t = arg;
+    w_entry(&t->pre, key, e);
+    t->pre_keys++;
+    if (t->pre.len > t->pre_peak) t->pre_peak = t->pre.len;
+}
 
-            case CK_RDB_TYPE_HASH: {
-                uint32_t cnt;
-                read_u32(f, &cnt);
-                for (uint32_t i = 0; i < cnt; i++) {
-                    char *field = read_str(f);
-                    char *val = read_str(f);
-                    if (!field || !val) {
-                        free(field);
-                        free(val);
-                        free(key);
-                        goto done;
-                    }
-                    store_hset(s, key, field, val);
-                    free(field);
-                    free(val);
-                }
-                read_i64(f, &expire_at);
-                if (expire_at > 0) {
-                    store_entry_t *e = (store_entry_t *)ht_get(s->data, key);
-                    if (e) e->expire_at = expire_at;
-                }
-                break;
-            }
+static void save_visit(void *arg, const char *key, const store_entry_t *e) {
+    w_entry(arg, key, e);
+}
 
-            default:
-                ck_log(CK_LOG_ERROR, "unknown type marker 0x%02x", type);
-                free(key);
-                goto done;
+/* expired entries are written too: the key count in the header was taken
+ * at the start, and the loader drops them anyway */
+static void *thread_save_main(void *arg) {
+    thread_save_t *t = arg;
+    rdb_writer_t *w = &t->w;
+    uint64_t chunk_keys = 0;
+    while (!w->err) {
+        int locked = store_lock(t->s);
+        uint64_t n = store_snapshot_next(t->s, save_visit, w, CK_RDB_THREAD_BATCH);
+        w_bytes(w, t->pre.buf, t->pre.len);
+        n += t->pre_keys;
+        t->pre.len = 0;
+        t->pre_keys = 0;
+        store_unlock(t->s, locked);
+        if (n == 0) break;
+
+        chunk_keys += n;
+        if (w->len >= CK_RDB_CHUNK_SIZE) {
+            w_chunk(w, chunk_keys);
+            chunk_keys = 0;
         }
+    }
+    if (chunk_keys) w_chunk(w, chunk_keys);
+    if (t->kind == SAVE_FULL) {
+        w_index(w);
+    } else {
+        w_u8(w, CK_RDB_EOF);
+        w_flush(w);
+    }
 
-        free(key);
-        loaded++;
+    t->ok = fclose(w->f) == 0 && !w->err;
+    atomic_store(&t->done, 1);
+    return NULL;
+}
+
+/* a full save goes to out when it is set, instead of a file */
+static int thread_save_start(store_t *s, const char *filename, int kind, FILE *out) {
+    thread_save_t *t = ck_malloc(sizeof(thread_save_t));
+    memset(t, 0, sizeof(*t));
+    t->s = s;
+    t->kind = kind;
+    t->to_fd = out != NULL;
+    snprintf(t->filename, sizeof(t->filename), "%s", filename ? filename : "");
+
+    FILE *f;
+    if (out) {
+        f = out;
+    } else if (kind == SAVE_DELTA) {
+        f = delta_open(filename, t->path, sizeof(t->path));
+    } else {
+        snprintf(t->path, sizeof(t->path), "%s.tmp", filename);
+        if (!(f = fopen(t->path, "wb"))) {
+            ck_log(CK_LOG_ERROR, "failed to open %s for writing", t->path);
+        }
     }
+    if (!f) {
+        ck_free(t);
+        return -1;
+    }
+    t->w = (rdb_writer_t){ .f = f, .buf = ck_malloc(CK_RDB_CHUNK_SIZE + RDB_IO_BUF),
+                           .cap = CK_RDB_CHUNK_SIZE + RDB_IO_BUF,
+                           .written = kind == SAVE_DELTA ? g_delta_size : 0 };
+    t->pre = (rdb_writer_t){ .buf = ck_malloc(RDB_IO_BUF), .cap = RDB_IO_BUF };
 
-done:
-    fclose(f);
-    ck_log(CK_LOG_INFO, "loaded %d keys from %s", loaded, filename);
+    /* a delta covers the keys changed up to the cut. the ones gone by now
+     * are written as deletes right away; the snapshot takes the rest */
+    char **keys = NULL;
+    size_t n = 0;
+    if (kind == SAVE_DELTA) {
+        size_t total = ht_count(s->delta_keys);
+        keys = ck_malloc(sizeof(char *) * (total ? total : 1));
+        ht_iter_t iter;
+        const char *key;
+        ht_iter_init(&iter, s->delta_keys);
+        while (ht_iter_next(&iter, &key, NULL)) {
+            if (ht_exists(s->data, key)) {
+                keys[n++] = ck_strdup(key);
+            } else {
+                w_u8(&t->pre, CK_RDB_OPCODE_DELETE);
+                w_str(&t->pre, key);
+                t->pre_keys++;
+            }
+        }
+        w_delta_header(&t->w, total);
+    } else {
+        w_header(&t->w, store_dbsize(s));
+    }
+    t->pre_peak = t->pre.len;
+
+    store_snapshot_begin(s, keys, n, save_preimage, t);
+    if (pthread_create(&t->thread, NULL, thread_save_main, t) != 0) {
+        ck_log(CK_LOG_ERROR, "failed to start the save thread");
+        store_snapshot_end(s);
+        fclose(f);
+        if (kind == SAVE_FULL && !out) remove(t->path);
+        w_release(&t->w);
+        w_release(&t->pre);
+        ck_free(t);
+        return -1;
+    }
+    g_thread_save = t;
+    return 0;
+}
+
+/* join a save thread that is done, or wait for it */
+static void thread_save_finish(void) {
+    thread_save_t *t = g_thread_save;
+    pthread_join(t->thread, NULL);
+    store_snapshot_end(t->s);
+    g_thread_save = NULL;
+
+    /* a streamed snapshot has no file to install; bgsave_finished()
+     * reports how it went */
+    int ok = t->ok;
+    if (t->kind == SAVE_FULL && !t->to_fd) {
+        if (!ok) {
+            ck_log(CK_LOG_ERROR, "failed to write %s", t->path);
+            remove(t->path);
+        } else if (install_base(t->path, t->filename) != 0) {
+            ok = 0;
+        }
+    } else if (t->kind == SAVE_DELTA) {
+        if (!ok) {
+            ck_log(CK_LOG_ERROR, "failed to write %s", t->path);
+        } else {
+            ck_log(CK_LOG_INFO, "saved delta to %s", t->path);
+        }
+    }
+    int64_t duration_ms = ck_time_ms() - g_bgsave_start_ms;
+    g_last_preimage_bytes = t->pre_peak;
+    if (ok) {
+        ck_log(CK_LOG_INFO, "background saving finished in %lld ms, %zu KB of pre-images",
+               (long long)duration_ms, t->pre_peak / 1024);
+    }
+    w_release(&t->w);
+    w_release(&t->pre);
+    ck_free(t);
+    bgsave_finished(ok, duration_ms);
+}
+
+int persistence_save(store_t *s, const char *filename) {
+    if (g_thread_save) return -1;
+    int64_t start = ck_time_ms();
+    int kind = save_kind(s);
+    uint64_t cut = store_delta_cut(s);
+    if (save_as(s, filename, kind) != 0) return -1;
+
+    store_delta_commit(s, cut);
+    delta_refresh(filename);
+    g_lastsave = (int64_t)time(NULL);
+    g_last_save_ms = ck_time_ms() - start;
+    g_dirty = 0;
+    g_save_base_ms = ck_time_ms();
     return 0;
 }
+
+static int bgsave(store_t *s, const char *filename, int full) {
+    if (child_active() || g_thread_save) return -1;
+    g_bgsave_start_ms = ck_time_ms();
+    /* the child writes the keys changed up to the cut; later changes
+     * are for the next save */
+    g_bgsave_kind = full ? SAVE_FULL : save_kind(s);
+    g_bgsave_cut = store_delta_cut(s);
+    g_bgsave_store = s;
+    snprintf(g_bgsave_filename, sizeof(g_bgsave_filename), "%s", filename);
+
+    if (g_bgsave_method == CK_RDB_BGSAVE_THREAD) {
+        if (thread_save_start(s, filename, g_bgsave_kind, NULL) != 0) {
+            g_last_bgsave_ok = 0;
+            return -1;
+        }
+        g_dirty_at_fork = g_dirty;
+        ck_log(CK_LOG_INFO, "background saving started on a thread");
+        return 0;
+    }
+
+    int pid = child_fork(CK_CHILD_RDB);
+    if (pid < 0) {
+        g_last_bgsave_ok = 0;
+        return -1;
+    }
+
+    if (pid == 0) {
+        /* the child sees the store as it was at fork time */
+        child_exit(save_as(s, filename, g_bgsave_kind) == 0);
+    }
+
+    g_dirty_at_fork = g_dirty;
+    ck_log(CK_LOG_INFO, "background saving started by pid %d", pid);
+    return 0;
+}
+
+int persistence_bgsave(store_t *s, const char *filename) {
+    return bgsave(s, filename, 0);
+}
+
+int persistence_bgsave_full(store_t *s, const char *filename) {
+    return bgsave(s, filename, 1);
+}
+
+int persistence_bgsave_to(store_t *s, int fd) {
+    if (child_active() || g_thread_save) {
+        close(fd);
+        return -1;
+    }
+    g_bgsave_start_ms = ck_time_ms();
+    g_bgsave_kind = SAVE_FULL;
+    g_bgsave_store = s;
+    g_bgsave_to_fd = 1;
+
+    if (g_bgsave_method == CK_RDB_BGSAVE_THREAD) {
+        FILE *f = fdopen(fd, "wb");
+        if (!f) close(fd);
+        if (!f || thread_save_start(s, NULL, SAVE_FULL, f) != 0) {
+            g_bgsave_to_fd = 0;
+            return -1;
+        }
+        ck_log(CK_LOG_INFO, "streaming a snapshot from a thread");
+        return 0;
+    }
+
+    int pid = child_fork(CK_CHILD_RDB);
+    if (pid < 0) {
+        close(fd);
+        g_bgsave_to_fd = 0;
+        return -1;
+    }
+    if (pid == 0) {
+        FILE *f = fdopen(fd, "wb");
+        int ok = f && persistence_write(s, f) == 0;
+        if (f && fclose(f) != 0) ok = 0;
+        child_exit(ok);
+    }
+    close(fd);
+    ck_log(CK_LOG_INFO, "streaming a snapshot from pid %d", pid);
+    return 0;
+}
+
+void persistence_on_bgsave_done(void (*fn)(int ok)) {
+    g_bgsave_hook = fn;
+}
+
+void persistence_bgsave_done(int ok, size_t cow_bytes, int64_t duration_ms) {
+    g_last_cow_bytes = cow_bytes;
+    if (ok) {
+        ck_log(CK_LOG_INFO, "background saving finished in %lld ms, %zu KB copied on write",
+               (long long)duration_ms, cow_bytes / 1024);
+    }
+    bgsave_finished(ok, duration_ms);
+}
+
+int64_t persistence_lastsave(void) {
+    return g_lastsave;
+}
+
+int persistence_last_bgsave_ok(void) {
+    return g_last_bgsave_ok;
+}
+
+int64_t persistence_last_bgsave_duration_ms(void) {
+    return g_last_bgsave_ms;
+}
+
+size_t persistence_last_cow_bytes(void) {
+    return g_last_cow_bytes;
+}
+
+int64_t persistence_last_save_duration_ms(void) {
+    return g_last_save_ms;
+}
+
+void persistence_add_dirty(uint64_t n) {
+    g_dirty += n;
+}
+
+uint64_t persistence_dirty(void) {
+    return g_dirty;
+}
+
+void persistence_reset_dirty(void) {
+    g_dirty = 0;
+    g_save_base_ms = ck_time_ms();
+}
+
+int persistence_set_save_points(const char *spec) {
+    save_point_t points[CK_RDB_MAX_SAVE_POINTS];
+    int n = 0;
+    const char *p = spec;
+    for (;;) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0') break;
+        char *end;
+        long long secs = strtoll(p, &end, 10);
+        if (end == p) return -1;
+        p = end;
+        long long changes = strtoll(p, &end, 10);
+        if (end == p || secs <= 0 || secs > INT32_MAX || changes <= 0 ||
+            n == CK_RDB_MAX_SAVE_POINTS) {
+            return -1;
+        }
+        p = end;
+        if (*p != '\0' && *p != ' ' && *p != '\t') return -1;
+        points[n].seconds = secs;
+        points[n].changes = (uint64_t)changes;
+        n++;
+    }
+    memcpy(g_save_points, points, sizeof(points[0]) * (size_t)n);
+    g_n_save_points = n;
+    return 0;
+}
+
+void persistence_save_points(char *buf, size_t len) {
+    size_t used = 0;
+    if (len) buf[0] = '\0';
+    for (int i = 0; i < g_n_save_points && used < len; i++) {
+        int w = snprintf(buf + used, len - used, "%s%lld %llu", i ? " " : "",
+                         (long long)g_save_points[i].seconds,
+                         (unsigned long long)g_save_points[i].changes);
+        if (w < 0) break;
+        used += (size_t)w;
+    }
+}
+
+int persistence_bgsave_in_progress(void) {
+    return child_type() == CK_CHILD_RDB || g_thread_save != NULL;
+}
+
+int64_t persistence_bgsave_elapsed_ms(void) {
+    if (child_type() == CK_CHILD_RDB) return child_elapsed_ms();
+    return g_thread_save ? ck_time_ms() - g_bgsave_start_ms : -1;
+}
+
+void persistence_stop(void) {
+    if (g_thread_save) thread_save_finish();
+}
+
+void persistence_set_bgsave_method(ck_rdb_bgsave_method_t method) {
+    g_bgsave_method = method;
+}
+
+ck_rdb_bgsave_method_t persistence_bgsave_method(void) {
+    return g_bgsave_method;
+}
+
+const char *persistence_bgsave_method_name(ck_rdb_bgsave_method_t method) {
+    return method == CK_RDB_BGSAVE_THREAD ? "thread" : "fork";
+}
+
+int persistence_parse_bgsave_method(const char *name, ck_rdb_bgsave_method_t *out) {
+    if (strcasecmp(name, "fork") == 0) {
+        *out = CK_RDB_BGSAVE_FORK;
+    } else if (strcasecmp(name, "thread") == 0) {
+        *out = CK_RDB_BGSAVE_THREAD;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+size_t persistence_last_preimage_bytes(void) {
+    return g_last_preimage_bytes;
+}
+
+void persistence_cron(store_t *s, const char *filename) {
+    if (g_thread_save && atomic_load(&g_thread_save->done)) thread_save_finish();
+    if (g_n_save_points == 0 || g_dirty == 0 || child_active() || g_thread_save) return;
+
+    int64_t now = ck_time_ms();
+    if (!g_last_bgsave_ok && now - g_bgsave_start_ms < CK_RDB_BGSAVE_RETRY_MS) return;
+
+    for (int i = 0; i < g_n_save_points; i++) {
+        const save_point_t *sp = &g_save_points[i];
+        if (g_dirty >= sp->changes && now - g_save_base_ms >= sp->seconds * 1000) {
+            ck_log(CK_LOG_INFO, "%llu changes in %lld seconds, saving",
+                   (unsigned long long)sp->changes, (long long)sp->seconds);
+            persistence_bgsave(s, filename);
+            return;
+        }
+    }
+}
+
+/* version 1: fixed-width host-order fields, a TTL after every key */
+static int read_entries_v1(store_t *s, FILE *f) {
+    uint64_t timestamp;
+    read_u64(f, &timestamp);
+
+    int loaded = 0;
+    while (1) {
+        uint8_t type;
+        if (read_u8(f, &type) != 0) break;
+        if (type == CK_RDB_EOF) break;
+
+        char *key = read_str(f);
+        if (!key) break;
+
+        int64_t expire_at;
+
+        switch (type) {
+            case CK_RDB_TYPE_STRING: {
+                char *val = read_str(f);
+                if (!val) { ck_free(key); goto done; }
+                read_i64(f, &expire_at);
+                store_set(s, key, val);
+                if (expire_at > 0) store_expire_at(s, key, expire_at);
+                ck_free(val);
+                break;
+            }
+
+            case CK_RDB_TYPE_INT: {
+                int64_t val;
+                read_i64(f, &val);
+                read_i64(f, &expire_at);
+                store_set_int(s, key, val);
+                if (expire_at > 0) store_expire_at(s, key, expire_at);
+                break;
+            }
+
+            case CK_RDB_TYPE_LIST: {
+                uint32_t len;
+                read_u32(f, &len);
+                for (uint32_t i = 0; i < len; i++) {
+                    char *val = read_str(f);
+                    if (!val) { ck_free(key); goto done; }
+                    store_rpush(s, key, val);
+                    ck_free(val);
+                }
+                read_i64(f, &expire_at);
+                if (expire_at > 0) store_expire_at(s, key, expire_at);
+                break;
+            }
+
+            case CK_RDB_TYPE_HASH: {
+                uint32_t cnt;
+                read_u32(f, &cnt);
+                for (uint32_t i = 0; i < cnt; i++) {
+                    char *field = read_str(f);
+                    char *val = read_str(f);
+                    if (!field || !val) {
+                        ck_free(field);
+                        ck_free(val);
+                        ck_free(key);
+                        goto done;
+                    }
+                    store_hset(s, key, field, val);
+                    ck_free(field);
+                    ck_free(val);
+                }
+                read_i64(f, &expire_at);
+                if (expire_at > 0) store_expire_at(s, key, expire_at);
+                break;
+            }
+
+            default:
+                ck_log(CK_LOG_ERROR, "unknown type marker 0x%02x", type);
+                ck_free(key);
+                goto done;
+        }
+
+        ck_free(key);
+        loaded++;
+    }
+
+done:
+    return loaded;
+}
+
+/* v2/v3 reader: refills a large buffer instead of a stdio call per field.
+ * with f == NULL it decodes bytes already in memory; with map set those
+ * are a mapped chunk that large string values may point into */
+typedef struct {
+    FILE *f;
+    uint8_t *buf;
+    size_t len;
+    size_t pos;
+    uint64_t base;      /* offset of buf[0] from the start of the snapshot */
+    int err;
+    fmap_t *map;
+    size_t *terms;      /* where to terminate borrowed values in buf */
+    size_t n_terms;
+    size_t cap_terms;
+    int short_read;     /* err was running out of bytes in memory */
+} rdb_reader_t;
+
+/* make at least n bytes available; sets err at end of input */
+static int r_fill(rdb_reader_t *r, size_t n) {
+    if (r->len - r->pos >= n) return 0;
+    if (!r->f) {
+        r->err = 1;
+        r->short_read = 1;
+        return -1;
+    }
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->base += r->pos;
+    r->len -= r->pos;
+    r->pos = 0;
+    r->len += fread(r->buf + r->len, 1, RDB_IO_BUF - r->len, r->f);
+    if (r->len < n) {
+        r->err = 1;
+        return -1;
+    }
+    return 0;
+}
+
+static uint8_t r_u8(rdb_reader_t *r) {
+    if (r_fill(r, 1) != 0) return 0;
+    return r->buf[r->pos++];
+}
+
+static uint64_t r_varint(rdb_reader_t *r) {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = r_u8(r);
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return v;
+    }
+    r->err = 1;
+    return 0;
+}
+
+static uint64_t r_fixed(rdb_reader_t *r, int bytes) {
+    if (r_fill(r, (size_t)bytes) != 0) return 0;
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) v |= (uint64_t)r->buf[r->pos++] << (8 * i);
+    return v;
+}
+
+/* skip n bytes, seeking past what isn't buffered */
+static void r_skip(rdb_reader_t *r, uint64_t n) {
+    size_t have = r->len - r->pos;
+    if (n <= have) {
+        r->pos += (size_t)n;
+        return;
+    }
+    n -= have;
+    r->base += r->len + n;
+    r->len = r->pos = 0;
+    if (!r->f || n > INT64_MAX || fseeko(r->f, (off_t)n, SEEK_CUR) != 0) r->err = 1;
+}
+
+static char *r_str(rdb_reader_t *r) {
+    uint64_t len = r_varint(r);
+    if (r->err || len > 512ULL * 1024 * 1024) { /* sanity limit */
+        r->err = 1;
+        return NULL;
+    }
+
+    char *str = ck_malloc((size_t)len + 1);
+    size_t have = r->len - r->pos;
+    if (have >= len) {
+        memcpy(str, r->buf + r->pos, (size_t)len);
+        r->pos += (size_t)len;
+    } else {
+        /* longer than what's buffered: take that, read the rest directly */
+        memcpy(str, r->buf + r->pos, have);
+        if (!r->f || fread(str + have, 1, (size_t)len - have, r->f) != (size_t)len - have) {
+            ck_free(str);
+            r->err = 1;
+            return NULL;
+        }
+        r->base += r->len + (len - have);
+        r->len = r->pos = 0;
+    }
+    str[len] = '\0';
+    return str;
+}
+
+/* a large string value in a mapped chunk is left where it is: the value
+ * points at it and is terminated in place, over the first byte of what
+ * follows, once the whole chunk has been decoded. only strings that end
+ * inside the chunk qualify; the byte after the last one belongs to the
+ * next chunk and another thread */
+static char *r_str_value(rdb_reader_t *r, int *mapped) {
+    *mapped = 0;
+    if (!r->map) return r_str(r);
+
+    size_t mark = r->pos;
+    uint64_t len = r_varint(r);
+    if (r->err) return NULL;
+    if (len < CK_RDB_MAP_MIN_VALUE || len >= r->len - r->pos) {
+        r->pos = mark;
+        return r_str(r);
+    }
+
+    char *str = (char *)r->buf + r->pos;
+    r->pos += (size_t)len;
+    if (r->n_terms == r->cap_terms) {
+        r->cap_terms = r->cap_terms ? r->cap_terms * 2 : 16;
+        r->terms = ck_realloc(r->terms, sizeof(size_t) * r->cap_terms);
+    }
+    r->terms[r->n_terms++] = r->pos;
+    fmap_retain(r->map);
+    *mapped = 1;
+    return str;
+}
+
+/* decode the value of one entry of `type` into a detached entry. the value
+ * is consumed either way; NULL if it is malformed or keep is 0 */
+static store_entry_t *r_value(rdb_reader_t *r, uint8_t type, int keep, int64_t clock) {
+    store_entry_t *e = NULL;
+
+    switch (type) {
+        case CK_RDB_TYPE_STRING: {
+            if (!keep) {
+                ck_free(r_str(r));
+                break;
+            }
+            int mapped;
+            char *val = r_str_value(r, &mapped);
+            if (val) {
+                e = store_entry_new(CK_STRING, 0, clock);
+                e->str = val;
+                e->str_mapped = (uint8_t)mapped;
+            }
+            break;
+        }
+
+        case CK_RDB_TYPE_INT: {
+            int64_t val = unzigzag(r_varint(r));
+            if (!r->err && keep) {
+                e = store_entry_new(CK_INT, 0, clock);
+                e->integer = val;
+            }
+            break;
+        }
+
+        case CK_RDB_TYPE_LIST: {
+            uint64_t len = r_varint(r);
+            if (!r->err && keep) e = store_entry_new(CK_LIST, 0, clock);
+            for (uint64_t i = 0; i < len && !r->err; i++) {
+                char *val = r_str(r);
+                if (val && e) {
+                    list_rpush(e->list, val);
+                } else {
+                    ck_free(val);
+                }
+            }
+            break;
+        }
+
+        case CK_RDB_TYPE_HASH: {
+            uint64_t cnt = r_varint(r);
+            /* the count is only a sizing hint; don't let a corrupt one
+             * allocate the world */
+            if (!r->err && keep) {
+                e = store_entry_new(CK_HASH, cnt < (1u << 30) ? (size_t)cnt : 0, clock);
+            }
+            for (uint64_t i = 0; i < cnt && !r->err; i++) {
+                char *field = r_str(r);
+                char *val = field ? r_str(r) : NULL;
+                if (val && e) {
+                    void *old;
+                    ht_replace_owned(e->hash, field, val, &old, NULL);
+                    ck_free(old);
+                } else {
+                    ck_free(field);
+                    ck_free(val);
+                }
+            }
+            break;
+        }
+
+        default:
+            r->err = 1;
+            break;
+    }
+
+    if (r->err && e) {
+        store_entry_free(e);
+        e = NULL;
+    }
+    return e;
+}
+
+/* next entry, up to EOF in a stream or the end of a chunk in memory.
+ * returns 1 with *key set and *e the decoded entry, or NULL if it had
+ * already expired at `now` or is a deletion; 0 at the end; -1 if the
+ * input is bad */
+static int r_entry(rdb_reader_t *r, int64_t now, int64_t clock, char **key,
+                   store_entry_t **e, int64_t *expire_at) {
+    *expire_at = 0;
+    if (!r->f && r->pos == r->len) return 0;
+
+    uint8_t type = r_u8(r);
+    if (!r->err && type == CK_RDB_OPCODE_EXPIRE_MS) {
+        *expire_at = (int64_t)r_fixed(r, 8);
+        type = r_u8(r);
+    }
+    if (r->err) return -1;
+    if (type == CK_RDB_EOF && r->f) return 0;
+    if (type == CK_RDB_OPCODE_DELETE && *expire_at == 0) {
+        *key = r_str(r);
+        *e = NULL;
+        return *key ? 1 : -1;
+    }
+    if (type < CK_RDB_TYPE_STRING || type > CK_RDB_TYPE_HASH) {
+        ck_log(CK_LOG_ERROR, "unknown type marker 0x%02x", type);
+        r->err = 1;
+        return -1;
+    }
+
+    *key = r_str(r);
+    if (!*key) return -1;
+
+    /* already expired: decode past it but don't keep it */
+    *e = r_value(r, type, *expire_at == 0 || *expire_at > now, clock);
+    if (r->err) {
+        ck_free(*key);
+        return -1;
+    }
+    return 1;
+}
+
+/* the part of the header after the version. returns the key count */
+static uint64_t r_header(rdb_reader_t *r, uint32_t version) {
+    r_fixed(r, 8); /* save time */
+    if (version >= 5) r_fixed(r, 8); /* base id */
+    uint64_t keys = r_varint(r);
+    uint64_t n_enc = r_varint(r);
+    for (uint64_t i = 0; i < n_enc && !r->err; i++) {
+        uint8_t type = r_u8(r);
+        uint8_t enc = r_u8(r);
+        size_t j;
+        for (j = 0; j < N_TYPE_ENCODINGS; j++) {
+            if (type_encodings[j][0] == type && type_encodings[j][1] == enc) break;
+        }
+        if (j == N_TYPE_ENCODINGS) {
+            ck_log(CK_LOG_ERROR, "unsupported encoding %u for type 0x%02x", enc, type);
+            r->err = 1;
+        }
+    }
+    return keys < (1u << 30) ? keys : 0;
+}
+
+/* give back what was read past the end of the snapshot; in an AOF the
+ * command log follows */
+static void r_release(rdb_reader_t *r) {
+    if (r->f && r->len > r->pos) fseeko(r->f, -(off_t)(r->len - r->pos), SEEK_CUR);
+    ck_free(r->buf);
+}
+
+static int read_entries_v2(store_t *s, FILE *f) {
+    rdb_reader_t r = { .f = f, .buf = ck_malloc(RDB_IO_BUF) };
+    int loaded = 0;
+
+    uint64_t keys = r_header(&r, 2);
+    store_bulk_begin(s, (size_t)keys);
+    int64_t now = ck_wall_time_ms();
+
+    char *key;
+    store_entry_t *e;
+    int64_t expire_at;
+    int rc;
+    while (!r.err && (rc = r_entry(&r, now, s->bulk_clock, &key, &e, &expire_at)) > 0) {
+        /* the store owns the key once it's added */
+        if (e) {
+            store_bulk_insert(s, key, e, expire_at);
+            loaded++;
+        } else {
+            ck_free(key);
+        }
+    }
+    store_bulk_end(s);
+
+    if (r.err) {
+        ck_log(CK_LOG_WARN, "snapshot ended early: %d of %llu keys", loaded,
+               (unsigned long long)keys);
+    }
+    r_release(&r);
+    return loaded;
+}
+
+/* v3: chunks are read, checksummed and decoded by worker threads while
+ * the calling thread inserts them into the keyspace in file order */
+typedef struct {
+    char *key;
+    store_entry_t *e;
+    int64_t expire_at;
+} rdb_item_t;
+
+typedef struct {
+    const rdb_chunk_t *chunk;
+    rdb_item_t *items;
+    size_t count;
+    const char *err;    /* why the chunk was dropped or cut short */
+    int done;
+} rdb_job_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    rdb_job_t *jobs;
+    size_t n_jobs;
+    size_t next;        /* next job for a worker to take */
+    fmap_t *map;        /* chunks are decoded in place, or else */
+    const uint8_t *mem; /* copied from here, or else */
+    int fd;             /* read from here */
+    uint64_t start;     /* file offset of the snapshot */
+    uint64_t size;      /* of the file, from start */
+    int64_t now;
+    int64_t clock;
+    int deltas;         /* keep entries without a value: they delete the key */
+} rdb_loader_t;
+
+static int g_load_threads;
+
+static int read_at(int fd, void *buf, size_t len, uint64_t off) {
+    uint8_t *p = buf;
+    while (len) {
+        ssize_t n = pread(fd, p, len, (off_t)off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+        off += (uint64_t)n;
+    }
+    return 0;
+}
+
+static void drop_items(rdb_job_t *job) {
+    for (size_t i = 0; i < job->count; i++) {
+        ck_free(job->items[i].key);
+        store_entry_free(job->items[i].e);
+    }
+    job->count = 0;
+}
+
+static void decode_chunk(rdb_loader_t *l, rdb_job_t *job) {
+    const rdb_chunk_t *c = job->chunk;
+    if (c->offset > l->size || c->len > l->size - c->offset) {
+        job->err = "past the end of the file";
+        return;
+    }
+
+    uint8_t *buf;
+    if (l->map) {
+        buf = fmap_data(l->map) + l->start + c->offset;
+        fmap_willneed(l->map, (size_t)(l->start + c->offset), (size_t)c->len);
+    } else if (l->mem) {
+        buf = (uint8_t *)l->mem + c->offset;
+    } else {
+        buf = ck_malloc(c->len ? (size_t)c->len : 1);
+        if (read_at(l->fd, buf, (size_t)c->len, l->start + c->offset) != 0) {
+            job->err = "short read";
+            ck_free(buf);
+            return;
+        }
+    }
+
+    /* a compressed chunk is checked as stored, then decompressed into a
+     * buffer of its own that no value may point into */
+    uint8_t *raw = NULL;
+    if (c->raw_len) {
+        if (c->raw_len > lz_bound(c->len) * 255 || c->raw_len > SIZE_MAX / 2) {
+            job->err = "bad length";
+        } else if (ck_crc32c(0, buf, (size_t)c->len) != c->crc) {
+            job->err = "checksum mismatch";
+        } else {
+            raw = ck_malloc((size_t)c->raw_len);
+            if (lz_decompress(buf, (size_t)c->len, raw, (size_t)c->raw_len) != 0) {
+                job->err = "corrupt compressed data";
+            }
+        }
+        if (!l->map && !l->mem) ck_free(buf);
+        if (job->err) {
+            ck_free(raw);
+            return;
+        }
+        buf = raw;
+    }
+    size_t len = raw ? (size_t)c->raw_len : (size_t)c->len;
+
+    /* every entry takes at least three bytes */
+    size_t cap = c->keys < len / 3 ? (size_t)c->keys : len / 3;
+    job->items = ck_malloc(sizeof(rdb_item_t) * (cap ? cap : 1));
+
+    /* each entry of a stored chunk is checksummed right after it is
+     * decoded, while its bytes are still in cache, instead of in a pass
+     * of its own */
+    rdb_reader_t r = { .buf = buf, .len = len, .base = c->offset, .map = raw ? NULL : l->map };
+    uint32_t crc = 0;
+    size_t checked = 0;
+    rdb_item_t it;
+    int rc;
+    while ((rc = r_entry(&r, l->now, l->clock, &it.key, &it.e, &it.expire_at)) > 0) {
+        if (!raw) {
+            crc = ck_crc32c(crc, buf + checked, r.pos - checked);
+            checked = r.pos;
+        }
+        if (!it.e && !l->deltas) {
+            ck_free(it.key);
+            continue;
+        }
+        if (job->count == cap) {
+            cap = cap ? cap * 2 : 16;
+            job->items = ck_realloc(job->items, sizeof(rdb_item_t) * cap);
+        }
+        job->items[job->count++] = it;
+    }
+    if (!raw) crc = ck_crc32c(crc, buf + checked, r.len - checked);
+
+    if (!raw && crc != c->crc) {
+        job->err = "checksum mismatch";
+        drop_items(job);
+    } else {
+        if (rc < 0) job->err = "malformed entry";
+        for (size_t i = 0; i < r.n_terms; i++) buf[r.terms[i]] = '\0';
+    }
+    ck_free(r.terms);
+    if (raw || (!l->map && !l->mem)) ck_free(buf);
+}
+
+static void *load_worker(void *arg) {
+    rdb_loader_t *l = arg;
+    while (1) {
+        pthread_mutex_lock(&l->lock);
+        size_t i = l->next++;
+        pthread_mutex_unlock(&l->lock);
+        if (i >= l->n_jobs) break;
+
+        decode_chunk(l, &l->jobs[i]);
+
+        pthread_mutex_lock(&l->lock);
+        l->jobs[i].done = 1;
+        pthread_cond_broadcast(&l->cond);
+        pthread_mutex_unlock(&l->lock);
+    }
+    return NULL;
+}
+
+static int insert_chunk(store_t *s, rdb_job_t *job, size_t idx) {
+    for (size_t i = 0; i < job->count; i++) {
+        store_bulk_insert(s, job->items[i].key, job->items[i].e, job->items[i].expire_at);
+    }
+    if (job->err) {
+        ck_log(CK_LOG_ERROR, "snapshot chunk %zu at offset %llu: %s, %zu of %llu keys kept",
+               idx, (unsigned long long)job->chunk->offset, job->err, job->count,
+               (unsigned long long)job->chunk->keys);
+    }
+    ck_free(job->items);
+    job->items = NULL;
+    return (int)job->count;
+}
+
+/* chunks come from map when it's set, else from fd */
+static int load_chunks(store_t *s, fmap_t *map, int fd, uint64_t start,
+                       const rdb_chunk_t *chunks, size_t n, uint64_t keys) {
+    store_bulk_begin(s, (size_t)keys);
+    rdb_loader_t l = { .jobs = ck_calloc(n ? n : 1, sizeof(rdb_job_t)), .n_jobs = n,
+                       .map = map, .fd = fd, .start = start, .now = ck_wall_time_ms(),
+                       .clock = s->bulk_clock };
+    for (size_t i = 0; i < n; i++) l.jobs[i].chunk = &chunks[i];
+    struct stat st;
+    if (map) {
+        l.size = fmap_size(map) - start;
+    } else if (fstat(fd, &st) == 0 && (uint64_t)st.st_size > start) {
+        l.size = (uint64_t)st.st_size - start;
+    }
+
+    int nthreads = g_load_threads ? g_load_threads : ck_cpu_count();
+    if ((size_t)nthreads > n) nthreads = (int)n;
+    if (nthreads > CK_RDB_MAX_LOAD_THREADS) nthreads = CK_RDB_MAX_LOAD_THREADS;
+
+    pthread_t threads[CK_RDB_MAX_LOAD_THREADS];
+    int started = 0;
+    if (nthreads > 1) {
+        pthread_mutex_init(&l.lock, NULL);
+        pthread_cond_init(&l.cond, NULL);
+        while (started < nthreads &&
+               pthread_create(&threads[started], NULL, load_worker, &l) == 0) {
+            started++;
+        }
+    }
+    ck_log(CK_LOG_DEBUG, "decoding %zu snapshot chunks on %d threads", n,
+           started ? started : 1);
+
+    int loaded = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (started) {
+            pthread_mutex_lock(&l.lock);
+            while (!l.jobs[i].done) pthread_cond_wait(&l.cond, &l.lock);
+            pthread_mutex_unlock(&l.lock);
+        } else {
+            decode_chunk(&l, &l.jobs[i]);
+        }
+        loaded += insert_chunk(s, &l.jobs[i], i);
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    if (nthreads > 1) {
+        pthread_mutex_destroy(&l.lock);
+        pthread_cond_destroy(&l.cond);
+    }
+    ck_free(l.jobs);
+    store_bulk_end(s);
+    return loaded;
+}
+
+/* the index, read from r positioned at it. NULL if it doesn't fit in the
+ * index_offset bytes before it */
+static rdb_chunk_t *r_index(rdb_reader_t *r, uint32_t version, uint64_t index_offset,
+                            size_t *n) {
+    uint64_t count = r_varint(r);
+    if (r->err || count > index_offset) return NULL;
+
+    rdb_chunk_t *chunks = ck_malloc(sizeof(rdb_chunk_t) * (count ? count : 1));
+    for (uint64_t i = 0; i < count && !r->err; i++) {
+        chunks[i].offset = r_varint(r);
+        chunks[i].len = r_varint(r);
+        chunks[i].raw_len = version >= 4 ? r_varint(r) : 0;
+        chunks[i].keys = r_varint(r);
+        chunks[i].crc = (uint32_t)r_fixed(r, 4);
+        if (chunks[i].offset > index_offset ||
+            chunks[i].len > index_offset - chunks[i].offset) {
+            r->err = 1;
+        }
+    }
+    if (r->err) {
+        ck_free(chunks);
+        return NULL;
+    }
+    *n = (size_t)count;
+    return chunks;
+}
+
+/* index_offset from a trailer, -1 if it isn't one */
+static int64_t trailer_offset(const uint8_t *trailer) {
+    if (memcmp(trailer + 8, CK_RDB_INDEX_MAGIC, 8) != 0) return -1;
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++) v |= (uint64_t)trailer[i] << (8 * i);
+    return v > INT64_MAX ? -1 : (int64_t)v;
+}
+
+/* follow the chunk frames from r up to their EOF; r->err is set if they
+ * don't get there */
+static rdb_chunk_t *r_frames(rdb_reader_t *r, uint32_t version, size_t *n) {
+    rdb_chunk_t *chunks = NULL;
+    size_t cap = 0;
+    *n = 0;
+    while (!r->err) {
+        uint8_t op = r_u8(r);
+        if (r->err || op == CK_RDB_EOF) break;
+        if (op != CK_RDB_OPCODE_CHUNK && (op != CK_RDB_OPCODE_CHUNK_LZ || version < 4)) {
+            ck_log(CK_LOG_ERROR, "unexpected opcode 0x%02x between chunks", op);
+            r->err = 1;
+            break;
+        }
+        rdb_chunk_t c;
+        c.keys = r_varint(r);
+        c.len = r_varint(r);
+        c.raw_len = op == CK_RDB_OPCODE_CHUNK_LZ ? r_varint(r) : 0;
+        c.crc = (uint32_t)r_fixed(r, 4);
+        c.offset = r->base + r->pos;
+        r_skip(r, c.len);
+        if (r->err) break;
+        if (*n == cap) {
+            cap = cap ? cap * 2 : 64;
+            chunks = ck_realloc(chunks, sizeof(rdb_chunk_t) * cap);
+        }
+        chunks[(*n)++] = c;
+    }
+    if (!chunks) chunks = ck_malloc(sizeof(rdb_chunk_t));
+    return chunks;
+}
+
+/* follow the chunk frames from r, just after the header, to the end of
+ * the snapshot */
+static rdb_chunk_t *r_scan_chunks(rdb_reader_t *r, uint32_t version, size_t *n) {
+    rdb_chunk_t *chunks = r_frames(r, version, n);
+
+    /* past the index and trailer */
+    if (!r->err) {
+        uint64_t count = r_varint(r);
+        for (uint64_t i = 0; i < count && !r->err; i++) {
+            r_varint(r);
+            r_varint(r);
+            if (version >= 4) r_varint(r);
+            r_varint(r);
+            r_fixed(r, 4);
+        }
+        r_skip(r, 16);
+    }
+    if (r->err) {
+        ck_log(CK_LOG_WARN, "snapshot ended early after %zu chunks", *n);
+    }
+    return chunks;
+}
+
+static int finish_v3(int loaded, uint64_t keys) {
+    if ((uint64_t)loaded < keys) {
+        ck_log(CK_LOG_WARN, "snapshot loaded %d of %llu keys", loaded,
+               (unsigned long long)keys);
+    }
+    return loaded;
+}
+
+/* the index from the trailer at the end of the file, NULL if there isn't
+ * a valid one */
+static rdb_chunk_t *read_index(FILE *f, uint32_t version, uint64_t start, size_t *n) {
+    uint8_t trailer[16];
+    if (fseeko(f, -16, SEEK_END) != 0 || fread(trailer, 1, 16, f) != 16) return NULL;
+    int64_t index_offset = trailer_offset(trailer);
+    if (index_offset < 0 || (uint64_t)index_offset > INT64_MAX - start ||
+        fseeko(f, (off_t)(start + (uint64_t)index_offset), SEEK_SET) != 0) {
+        return NULL;
+    }
+
+    rdb_reader_t r = { .f = f, .buf = ck_malloc(RDB_IO_BUF), .base = (uint64_t)index_offset };
+    rdb_chunk_t *chunks = r_index(&r, version, (uint64_t)index_offset, n);
+    ck_free(r.buf);
+    return chunks;
+}
+
+/* version 3+ from a stream. with whole_file the snapshot is all there is
+ * in f and its index is read from the trailer; otherwise (an AOF
+ * preamble) the chunk frames are followed, which leaves f right after the
+ * snapshot */
+static int read_entries_chunked(store_t *s, FILE *f, uint32_t version, int whole_file) {
+    off_t pos = ftello(f);
+    if (pos < 12) return -1;
+    uint64_t start = (uint64_t)pos - 12;
+
+    rdb_reader_t r = { .f = f, .buf = ck_malloc(RDB_IO_BUF), .base = 12 };
+    uint64_t keys = r_header(&r, version);
+    if (r.err) {
+        ck_free(r.buf);
+        return -1;
+    }
+
+    size_t n = 0;
+    rdb_chunk_t *chunks = whole_file ? read_index(f, version, start, &n) : NULL;
+    if (chunks) {
+        ck_free(r.buf);
+    } else {
+        if (whole_file) {
+            ck_log(CK_LOG_WARN, "snapshot has no valid chunk index, scanning it");
+            r.base += r.pos;
+            r.len = r.pos = 0;
+            if (fseeko(f, (off_t)(start + r.base), SEEK_SET) != 0) r.err = 1;
+        }
+        chunks = r_scan_chunks(&r, version, &n);
+        r_release(&r);
+    }
+
+    int loaded = load_chunks(s, NULL, fileno(f), start, chunks, n, keys);
+    ck_free(chunks);
+    return finish_v3(loaded, keys);
+}
+
+/* version 3+ from a mapping of the whole file: no reads or copies, and
+ * large values in chunks that aren't compressed keep pointing into it */
+static int read_entries_mapped(store_t *s, fmap_t *m, uint32_t version) {
+    uint8_t *data = fmap_data(m);
+    size_t size = fmap_size(m);
+    rdb_reader_t r = { .buf = data, .len = size, .pos = 12 };
+    uint64_t keys = r_header(&r, version);
+    if (r.err) return -1;
+
+    size_t n = 0;
+    rdb_chunk_t *chunks = NULL;
+    int64_t index_offset = size >= 16 ? trailer_offset(data + size - 16) : -1;
+    if (index_offset >= 0 && (uint64_t)index_offset < size - 16) {
+        rdb_reader_t ir = { .buf = data + index_offset, .len = size - 16 - (size_t)index_offset,
+                            .base = (uint64_t)index_offset };
+        chunks = r_index(&ir, version, (uint64_t)index_offset, &n);
+    }
+    if (!chunks) {
+        ck_log(CK_LOG_WARN, "snapshot has no valid chunk index, scanning it");
+        chunks = r_scan_chunks(&r, version, &n);
+    }
+
+    int loaded = load_chunks(s, m, -1, 0, chunks, n, keys);
+    ck_free(chunks);
+    return finish_v3(loaded, keys);
+}
+
+static int read_snapshot(store_t *s, FILE *f, int whole_file) {
+    /* verify magic */
+    char magic[8];
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, CK_RDB_MAGIC, 8) != 0) {
+        ck_log(CK_LOG_ERROR, "invalid snapshot magic");
+        return -1;
+    }
+
+    /* little-endian; version 1 wrote it in host order, which on every
+     * platform it was built for was the same thing */
+    uint8_t v[4];
+    if (fread(v, 1, 4, f) != 4) return -1;
+    uint32_t version = header_version(v);
+
+    if (version == 1) return read_entries_v1(s, f);
+    if (version == 2) return read_entries_v2(s, f);
+    if (version >= 3 && version <= CK_RDB_VERSION) {
+        return read_entries_chunked(s, f, version, whole_file);
+    }
+
+    ck_log(CK_LOG_ERROR, "unsupported snapshot version %u", version);
+    return -1;
+}
+
+int persistence_read(store_t *s, FILE *f) {
+    return read_snapshot(s, f, 0);
+}
+
+/* a snapshot arriving over a socket: bytes are buffered until a whole
+ * chunk is there, which is then decoded and inserted right away */
+enum { STREAM_HEADER, STREAM_CHUNKS, STREAM_INDEX, STREAM_DONE };
+
+/* a chunk frame is at most 35 bytes and the header well under this; a
+ * reader that fails with more than this in hand is looking at garbage */
+#define STREAM_MAX_FRAME 4096
+
+struct persistence_stream {
+    store_t *s;
+    int stage;
+    uint32_t version;
+    uint64_t keys;          /* from the header */
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    size_t n_chunks;
+    int loaded;
+};
+
+persistence_stream_t *persistence_stream_begin(store_t *s) {
+    persistence_stream_t *st = ck_malloc(sizeof(persistence_stream_t));
+    memset(st, 0, sizeof(*st));
+    st->s = s;
+    st->cap = RDB_IO_BUF;
+    st->buf = ck_malloc(st->cap);
+    return st;
+}
+
+/* one header, chunk or index from buf. returns the bytes it took, 0 if it
+ * isn't all there yet, -1 if it's malformed */
+static int64_t stream_step(persistence_stream_t *st) {
+    rdb_reader_t r = { .buf = st->buf, .len = st->len };
+    if (st->stage == STREAM_HEADER) {
+        if (st->len < 12) return 0;
+        st->version = header_version(st->buf + 8);
+        if (memcmp(st->buf, CK_RDB_MAGIC, 8) != 0 || st->version < 3 ||
+            st->version > CK_RDB_VERSION) {
+            ck_log(CK_LOG_ERROR, "streamed snapshot: bad magic or version");
+            return -1;
+        }
+        r.pos = 12;
+        st->keys = r_header(&r, st->version);
+        if (r.err) return r.short_read && st->len < STREAM_MAX_FRAME ? 0 : -1;
+        st->stage = STREAM_CHUNKS;
+        return (int64_t)r.pos;
+    }
+
+    if (st->stage == STREAM_INDEX) {
+        uint64_t count = r_varint(&r);
+        for (uint64_t i = 0; i < count && !r.err; i++) {
+            r_varint(&r);
+            r_varint(&r);
+            if (st->version >= 4) r_varint(&r);
+            r_varint(&r);
+            r_fixed(&r, 4);
+        }
+        if (!r.err && r_fill(&r, 16) == 0 && memcmp(r.buf + r.pos + 8, CK_RDB_INDEX_MAGIC, 8) != 0) {
+            ck_log(CK_LOG_ERROR, "streamed snapshot: bad trailer");
+            return -1;
+        }
+        if (r.err) return r.short_read ? 0 : -1;
+        st->stage = STREAM_DONE;
+        return (int64_t)(r.pos + 16);
+    }
+
+    uint8_t op = r_u8(&r);
+    if (r.err) return 0;
+    if (op == CK_RDB_EOF) {
+        st->stage = STREAM_INDEX;
+        return 1;
+    }
+    if (op != CK_RDB_OPCODE_CHUNK && (op != CK_RDB_OPCODE_CHUNK_LZ || st->version < 4)) {
+        ck_log(CK_LOG_ERROR, "streamed snapshot: unexpected opcode 0x%02x", op);
+        return -1;
+    }
+    rdb_chunk_t c;
+    c.keys = r_varint(&r);
+    c.len = r_varint(&r);
+    c.raw_len = op == CK_RDB_OPCODE_CHUNK_LZ ? r_varint(&r) : 0;
+    c.crc = (uint32_t)r_fixed(&r, 4);
+    if (r.err) return r.short_read && st->len < STREAM_MAX_FRAME ? 0 : -1;
+    if (c.len > SIZE_MAX / 2) return -1;
+    c.offset = r.pos;
+    if (st->len - r.pos < c.len) {
+        if (st->cap < r.pos + c.len) {
+            st->cap = r.pos + (size_t)c.len;
+            st->buf = ck_realloc(st->buf, st->cap);
+        }
+        return 0;
+    }
+
+    store_bulk_begin(st->s, st->n_chunks ? 0 : (size_t)st->keys);
+    rdb_loader_t l = { .mem = st->buf, .size = st->len, .now = ck_wall_time_ms(),
+                       .clock = st->s->bulk_clock };
+    rdb_job_t job = { .chunk = &c };
+    decode_chunk(&l, &job);
+    st->loaded += insert_chunk(st->s, &job, st->n_chunks++);
+    store_bulk_end(st->s);
+    return (int64_t)(c.offset + c.len);
+}
+
+int64_t persistence_stream_feed(persistence_stream_t *st, const void *p, size_t n, int *done) {
+    *done = st->stage == STREAM_DONE;
+    if (*done) return 0;
+    if (st->cap - st->len < n) {
+        while (st->cap - st->len < n) st->cap *= 2;
+        st->buf = ck_realloc(st->buf, st->cap);
+    }
+    memcpy(st->buf + st->len, p, n);
+    st->len += n;
+
+    size_t used = 0;
+    int64_t step = 0;
+    while (st->stage != STREAM_DONE && (step = stream_step(st)) > 0) {
+        memmove(st->buf, st->buf + step, st->len - (size_t)step);
+        st->len -= (size_t)step;
+        used += (size_t)step;
+    }
+    if (st->stage != STREAM_DONE && step < 0) return -1;
+
+    /* what is left over after the end isn't ours; the buffered rest of
+     * an unfinished snapshot is */
+    *done = st->stage == STREAM_DONE;
+    if (*done) return (int64_t)(n - st->len);
+    return (int64_t)n;
+}
+
+int persistence_stream_end(persistence_stream_t *st) {
+    int loaded = st->loaded;
+    if (st->stage != STREAM_DONE) {
+        ck_log(CK_LOG_WARN, "streamed snapshot cut short after %zu chunks, %d keys",
+               st->n_chunks, loaded);
+    } else {
+        finish_v3(loaded, st->keys);
+    }
+    ck_free(st->buf);
+    ck_free(st);
+    return loaded;
+}
+
+/* decode every chunk of a delta record before applying any of it, so a
+ * record goes in whole or not at all */
+static int apply_delta(store_t *s, rdb_loader_t *l, const rdb_chunk_t *chunks, size_t n,
+                       uint64_t keys) {
+    rdb_job_t *jobs = ck_malloc(sizeof(rdb_job_t) * (n ? n : 1));
+    int bad = 0;
+    for (size_t i = 0; i < n; i++) {
+        jobs[i] = (rdb_job_t){ .chunk = &chunks[i] };
+        if (!bad) {
+            decode_chunk(l, &jobs[i]);
+            if (jobs[i].err) {
+                ck_log(CK_LOG_ERROR, "delta chunk at offset %llu: %s",
+                       (unsigned long long)chunks[i].offset, jobs[i].err);
+                bad = 1;
+            }
+        }
+    }
+
+    store_bulk_begin(s, (size_t)keys);
+    for (size_t i = 0; i < n; i++) {
+        for (size_t j = 0; j < jobs[i].count && !bad; j++) {
+            rdb_item_t *it = &jobs[i].items[j];
+            if (it->e) {
+                store_bulk_insert(s, it->key, it->e, it->expire_at);
+            } else {
+                store_del(s, it->key);
+                ck_free(it->key);
+            }
+        }
+        if (bad) drop_items(&jobs[i]);
+        ck_free(jobs[i].items);
+    }
+    store_bulk_end(s);
+    ck_free(jobs);
+    return bad ? -1 : 0;
+}
+
+/* apply the records of filename's delta file if it was written against
+ * the base just loaded. *valid is set to the end of the last good record,
+ * 0 if there is no delta file for this base */
+static int load_deltas(store_t *s, const char *filename, uint64_t *valid) {
+    *valid = 0;
+    uint8_t want[CK_RDB_DELTA_HEADER], hdr[CK_RDB_DELTA_HEADER];
+    if (delta_header(filename, want) != 0) return 0;
+
+    char path[256];
+    delta_path(filename, path, sizeof(path));
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr) || memcmp(hdr, want, sizeof(hdr)) != 0) {
+        ck_log(CK_LOG_WARN, "%s doesn't belong to %s, ignored", path, filename);
+        fclose(f);
+        return 0;
+    }
+    *valid = CK_RDB_DELTA_HEADER;
+
+    rdb_loader_t l = { .fd = fileno(f), .size = path_size(path),
+                       .now = ck_wall_time_ms(), .deltas = 1 };
+    rdb_reader_t r = { .f = f, .buf = ck_malloc(RDB_IO_BUF), .base = CK_RDB_DELTA_HEADER };
+    int applied = 0;
+    uint64_t keys = 0;
+    while (1) {
+        uint8_t op = r_u8(&r);
+        if (r.err) break;
+        if (op != CK_RDB_OPCODE_DELTA) {
+            ck_log(CK_LOG_ERROR, "unexpected opcode 0x%02x in %s", op, path);
+            break;
+        }
+        r_fixed(&r, 8); /* save time */
+        uint64_t record_keys = r_varint(&r);
+        size_t n;
+        rdb_chunk_t *chunks = r_frames(&r, CK_RDB_VERSION, &n);
+        if (r.err) {
+            ck_log(CK_LOG_WARN, "%s ends in a partial record, dropped", path);
+            ck_free(chunks);
+            break;
+        }
+        l.clock = ck_wall_time_ms();
+        int rc = apply_delta(s, &l, chunks, n, record_keys);
+        ck_free(chunks);
+        if (rc != 0) break;
+        applied++;
+        keys += record_keys;
+        *valid = r.base + r.pos;
+    }
+    ck_free(r.buf);
+    fclose(f);
+
+    if (applied) {
+        ck_log(CK_LOG_INFO, "applied %d delta records (%llu keys) from %s", applied,
+               (unsigned long long)keys, path);
+    }
+    return applied;
+}
+
+int persistence_load(store_t *s, const char *filename) {
+    int64_t start = ck_time_us();
+    int loaded;
+
+    /* current snapshots are decoded straight from a mapping of the file;
+     * older versions, or if it can't be mapped, go through stdio */
+    fmap_t *m = fmap_open(filename);
+    uint32_t version = m && fmap_size(m) >= 12 ? header_version(fmap_data(m) + 8) : 0;
+    if (version >= 3 && version <= CK_RDB_VERSION &&
+        memcmp(fmap_data(m), CK_RDB_MAGIC, 8) == 0) {
+        loaded = read_entries_mapped(s, m, version);
+        fmap_close(m);
+    } else {
+        fmap_close(m);
+        FILE *f = fopen(filename, "rb");
+        if (!f) return -1;
+        loaded = read_snapshot(s, f, 1);
+        fclose(f);
+    }
+    if (loaded < 0) return -1;
+
+    /* later writes to the base go in the delta file after what's there,
+     * cutting off a torn record; if it has none, it gets a new one. the
+     * applied deltas aren't changes of their own */
+    uint64_t valid;
+    load_deltas(s, filename, &valid);
+    store_delta_commit(s, store_delta_cut(s));
+    g_base_size = g_delta_size = 0;
+    if (g_delta_enabled) {
+        if (!valid && delta_reset(filename) == 0) valid = CK_RDB_DELTA_HEADER;
+        if (valid) {
+            g_base_size = path_size(filename);
+            g_delta_size = valid;
+        }
+    }
+
+    double secs = (double)(ck_time_us() - start) / 1e6;
+    ck_log(CK_LOG_INFO, "loaded %d keys from %s in %.3f s (%.0f keys/sec)",
+           loaded, filename, secs, secs > 0 ? loaded / secs : 0.0);
+    g_lastsave = (int64_t)time(NULL);
+    return 0;
+}
+
+void persistence_set_compression(int level) {
+    g_compression_level = level < 0 ? 0 : level > CK_LZ_MAX_LEVEL ? CK_LZ_MAX_LEVEL : level;
+}
+
+int persistence_compression(void) {
+    return g_compression_level;
+}
+
+void persistence_set_delta(store_t *s, int enabled) {
+    if (enabled && !g_delta_enabled) g_base_size = g_delta_size = 0;
+    g_delta_enabled = enabled;
+    store_delta_track(s, enabled);
+}
+
+int persistence_delta(void) {
+    return g_delta_enabled;
+}
+
+void persistence_set_delta_compact_percentage(int pct) {
+    g_delta_compact_pct = pct < 0 ? 0 : pct;
+}
+
+int persistence_delta_compact_percentage(void) {
+    return g_delta_compact_pct;
+}
+
+uint64_t persistence_delta_size(void) {
+    return g_delta_size;
+}
+
+uint64_t persistence_base_size(void) {
+    return g_base_size;
+}
+
+void persistence_set_load_threads(int n) {
+    g_load_threads = n < 0 ? 0 : n;
+}
+
+int persistence_load_threads(void) {
+    return g_load_threads;
+}
@@ -2,22 +2,209 @@
 #define CK_PERSISTENCE_H
 
 #include "store.h"
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #define CK_RDB_MAGIC    "CACHEKIT"
-#define CK_RDB_VERSION  1
+#define CK_RDB_VERSION  5
 #define CK_RDB_DEFAULT  "dump.ckdb"
+#define CK_RDB_INDEX_MAGIC "CKINDEX1"
+
+/*
+ * version 5 layout, all fixed-width fields little-endian:
+ *   magic[8] version:u32 saved_at:u64 base_id:u64 keys:varint
+ *   n:varint (type:u8 encoding:u8) * n
+ *   chunks, each
+ *     CHUNK keys:varint len:varint crc32c:u32 followed by len bytes of
+ *       entries, each [EXPIRE_MS expire_at:u64] type key value, or
+ *     CHUNK_LZ keys:varint len:varint raw_len:varint crc32c:u32 followed
+ *       by the entries compressed to len bytes (see lz.h)
+ *   EOF
+ *   index: n:varint
+ *     (offset:varint len:varint raw_len:varint keys:varint crc32c:u32) * n
+ *   index_offset:u64 INDEX_MAGIC[8]
+ * strings are varint length + bytes; lengths and counts are LEB128
+ * varints, integers zigzag varints. offsets count from the start of the
+ * snapshot; raw_len is 0 for a chunk that isn't compressed, and the CRC
+ * covers the bytes as stored. a chunk holds whole entries, so it can be
+ * checked and decoded on its own; the index at the end lets a loader hand
+ * chunks to threads without reading through the file first. base_id is
+ * random, new for every snapshot. version 4 (no base_id), version 3 (no
+ * compression, no raw_len in the index), version 2 (the same entries with
+ * no chunks or index) and version 1 are still read.
+ */
+
+/*
+ * delta snapshots: with rdb-delta on, a save after the first writes only
+ * the keys changed or deleted since the previous one, appended as a
+ * record to <rdb>.delta:
+ *   DELTA_MAGIC[8] base_id:u64 base_size:u64
+ *   records, each
+ *     DELTA saved_at:u64 keys:varint, CHUNK / CHUNK_LZ frames as above, EOF
+ * the header ties the file to one base snapshot, by the id in its header
+ * and its size; for a version 4 base it has DELTA_MAGIC_V4 and the
+ * base's save time in place of the id. delta entries are snapshot entries or
+ * DELETE key; an entry that has expired by the time it is loaded deletes
+ * the key too. a record is applied only once all of its chunks check
+ * out, so a torn append at the end is dropped (and cut off by the next
+ * one). once the file outgrows rdb-delta-compact-percentage of the base,
+ * the next save merges everything into a new base and starts a new file
+ */
+#define CK_RDB_DELTA_MAGIC "CKDELTA2"
+#define CK_RDB_DELTA_MAGIC_V4 "CKDELTA1"
+#define CK_RDB_DELTA_HEADER 24
+#define CK_RDB_DELTA_SUFFIX ".delta"
+
+/* a chunk is cut once its entries reach this many bytes */
+#define CK_RDB_CHUNK_SIZE (1024 * 1024)
+#define CK_RDB_MAX_LOAD_THREADS 64
+/* string values at least this long are left in the mapped file on load
+ * instead of being copied out */
+#define CK_RDB_MAP_MIN_VALUE (16 * 1024)
 
 /* type markers in binary format */
 #define CK_RDB_TYPE_STRING  0x01
 #define CK_RDB_TYPE_INT     0x02
 #define CK_RDB_TYPE_LIST    0x03
 #define CK_RDB_TYPE_HASH    0x04
+#define CK_RDB_OPCODE_DELTA     0xF8  /* a delta record */
+#define CK_RDB_OPCODE_CHUNK_LZ  0xF9  /* a compressed frame of entries */
+#define CK_RDB_OPCODE_CHUNK     0xFA  /* a frame of entries */
+#define CK_RDB_OPCODE_DELETE    0xFB  /* key deleted, in a delta */
+#define CK_RDB_OPCODE_EXPIRE_MS 0xFC  /* absolute expiry of the next key */
 #define CK_RDB_EOF          0xFF
 
-/* save all data to file, returns 0 on success */
+/* value encodings named in the header */
+#define CK_RDB_ENC_RAW      0x00  /* string: length + bytes */
+#define CK_RDB_ENC_VARINT   0x01  /* integer: zigzag varint */
+#define CK_RDB_ENC_LINKED   0x02  /* list: count + elements head to tail */
+#define CK_RDB_ENC_HT       0x03  /* hash: count + field/value pairs */
+
+/* save all data to file, returns 0 on success. with delta snapshots on,
+ * only the changes since the last save are appended to its delta file
+ * when that is possible */
 int persistence_save(store_t *s, const char *filename);
 
-/* load data from file into store, returns 0 on success, -1 on error */
+/* load data from file into store, returns 0 on success, -1 on error. the
+ * file is mapped, and large string values point into the mapping until
+ * they are deleted or overwritten. deltas written against it are applied
+ * afterwards, in order */
 int persistence_load(store_t *s, const char *filename);
 
+/* the snapshot format on an open stream, for embedding it in another
+ * file (the AOF preamble). write returns 0 / -1; read stops at the end of
+ * the snapshot and returns the number of keys loaded, -1 if there is no
+ * valid header */
+int persistence_write(store_t *s, FILE *f);
+int persistence_read(store_t *s, FILE *f);
+
+/* load a snapshot as it arrives, a piece at a time (diskless
+ * replication): each chunk goes into the store as soon as all of it is
+ * there. feed returns how many of the n bytes were part of the snapshot,
+ * fewer than n once its end is reached (*done is set from then on), -1 if
+ * it is malformed. end returns the number of keys loaded and frees st */
+typedef struct persistence_stream persistence_stream_t;
+persistence_stream_t *persistence_stream_begin(store_t *s);
+int64_t persistence_stream_feed(persistence_stream_t *st, const void *p, size_t n, int *done);
+int persistence_stream_end(persistence_stream_t *st);
+
+/* compress chunks as they're saved, 1 (fastest) to 9 (smallest); 0
+ * stores them as they are */
+void persistence_set_compression(int level);
+int persistence_compression(void);
+
+/* threads that decode chunks while loading; 0 = one per CPU. the
+ * calling thread inserts what they decode */
+void persistence_set_load_threads(int n);
+int persistence_load_threads(void);
+
+/* save points: the cron starts a BGSAVE once `seconds` have passed since
+ * the last save and at least `changes` writes were made since. spec is
+ * "seconds changes [seconds changes ...]"; "" turns it off. returns -1
+ * (and keeps the old points) if spec is invalid */
+#define CK_RDB_MAX_SAVE_POINTS 16
+/* after a failed BGSAVE the cron waits this long before trying again */
+#define CK_RDB_BGSAVE_RETRY_MS 5000
+int persistence_set_save_points(const char *spec);
+/* the points in the same form, "" if there are none */
+void persistence_save_points(char *buf, size_t len);
+/* start a BGSAVE if a save point has been reached and no child is running */
+void persistence_cron(store_t *s, const char *filename);
+
+/* writes since the last successful save. write commands add the number
+ * of keys they changed */
+void persistence_add_dirty(uint64_t n);
+uint64_t persistence_dirty(void);
+/* count from zero and restart the save point clock, once the dataset has
+ * been loaded at startup */
+void persistence_reset_dirty(void);
+
+/* delta snapshots on or off; turning them on makes the next save a full
+ * one, since earlier changes weren't tracked */
+void persistence_set_delta(store_t *s, int enabled);
+int persistence_delta(void);
+/* merge the deltas into a new base once they add up to pct of its size;
+ * 0 = never */
+void persistence_set_delta_compact_percentage(int pct);
+int persistence_delta_compact_percentage(void);
+/* bytes in the delta file and the base it belongs to, 0 if there is none */
+uint64_t persistence_delta_size(void);
+uint64_t persistence_base_size(void);
+
+/* save a point-in-time copy of the store while the parent keeps serving,
+ * from a forked child or a thread (rdb-bgsave-method). returns 0 once it
+ * is started, -1 if a save is already running or it couldn't start */
+int persistence_bgsave(store_t *s, const char *filename);
+/* the same, always writing a full snapshot (never a delta), for
+ * replication */
+int persistence_bgsave_full(store_t *s, const char *filename);
+/* the same, written to fd (a pipe) instead of the file, which is left
+ * alone along with the save counters. fd is the save's from here on and
+ * closed once it is written */
+int persistence_bgsave_to(store_t *s, int fd);
+/* fn is called once each BGSAVE is over, with whether it succeeded */
+void persistence_on_bgsave_done(void (*fn)(int ok));
+
+/* the BGSAVE child has exited (see child_poll()) */
+void persistence_bgsave_done(int ok, size_t cow_bytes, int64_t duration_ms);
+
+/* how BGSAVE takes its point-in-time copy. fork: a child process, with
+ * the kernel copying pages the parent writes to. thread: a thread in this
+ * process walks the keyspace while the main thread keeps serving, and
+ * saves the old value of any key it changes that the thread hasn't
+ * written yet (see store_snapshot_begin()). no fork, so no page tables to
+ * copy and no latency spike for it. the extra memory is the pre-images
+ * the thread hasn't picked up yet, which it does after every batch */
+typedef enum {
+    CK_RDB_BGSAVE_FORK,
+    CK_RDB_BGSAVE_THREAD
+} ck_rdb_bgsave_method_t;
+
+/* entries the save thread takes per turn of the store lock */
+#define CK_RDB_THREAD_BATCH 256
+
+void persistence_set_bgsave_method(ck_rdb_bgsave_method_t method);
+ck_rdb_bgsave_method_t persistence_bgsave_method(void);
+const char *persistence_bgsave_method_name(ck_rdb_bgsave_method_t method);
+int persistence_parse_bgsave_method(const char *name, ck_rdb_bgsave_method_t *out);
+/* a BGSAVE child or thread is running. a thread is joined by the cron
+ * once it is done; SAVE and another BGSAVE are refused until then */
+int persistence_bgsave_in_progress(void);
+/* ms the running BGSAVE has taken so far, -1 if there is none */
+int64_t persistence_bgsave_elapsed_ms(void);
+/* wait for a save thread to finish, at shutdown */
+void persistence_stop(void);
+
+/* unix time of the last successful save or load, 0 if none */
+int64_t persistence_lastsave(void);
+int persistence_last_bgsave_ok(void);
+/* -1 before the first BGSAVE */
+int64_t persistence_last_bgsave_duration_ms(void);
+/* ms the last SAVE or BGSAVE took, -1 before the first */
+int64_t persistence_last_save_duration_ms(void);
+size_t persistence_last_cow_bytes(void);
+/* most pre-image bytes a thread BGSAVE held at once, the last time */
+size_t persistence_last_preimage_bytes(void);
+
 #endif
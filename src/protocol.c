@@ -15,7 +15,7 @@ void resp_parser_init(resp_parser_t *p) {
 }
 
 void resp_parser_destroy(resp_parser_t *p) {
-    free(p->buf);
+    ck_free(p->buf);
     p->buf = NULL;
     p->len = 0;
     p->cap = 0;
@@ -150,7 +150,7 @@ static int parse_array(resp_parser_t *p, resp_value_t **out) {
             for (int j = 0; j < i; j++) {
                 resp_value_free(elements[j]);
             }
-            free(elements);
+            ck_free(elements);
             p->pos = saved;
             return 0;
         }
@@ -191,19 +191,19 @@ void resp_value_free(resp_value_t *v) {
         case RESP_SIMPLE_STRING:
         case RESP_ERROR:
         case RESP_BULK_STRING:
-            free(v->str);
+            ck_free(v->str);
             break;
         case RESP_ARRAY:
             for (int i = 0; i < v->array.count; i++) {
                 resp_value_free(v->array.elements[i]);
             }
-            free(v->array.elements);
+            ck_free(v->array.elements);
             break;
         case RESP_INTEGER:
         case RESP_NIL:
             break;
     }
-    free(v);
+    ck_free(v);
 }
 
 /* response serialization */
@@ -215,13 +215,13 @@ void resp_buf_init(resp_buf_t *b) {
 }
 
 void resp_buf_destroy(resp_buf_t *b) {
-    free(b->buf);
+    ck_free(b->buf);
     b->buf = NULL;
     b->len = 0;
     b->cap = 0;
 }
 
-static void resp_buf_append(resp_buf_t *b, const char *data, size_t len) {
+void resp_buf_append(resp_buf_t *b, const char *data, size_t len) {
     if (b->len + len > b->cap) {
         while (b->len + len > b->cap) b->cap *= 2;
         b->buf = ck_realloc(b->buf, b->cap);
@@ -55,6 +55,7 @@ typedef struct {
 
 void resp_buf_init(resp_buf_t *b);
 void resp_buf_destroy(resp_buf_t *b);
+void resp_buf_append(resp_buf_t *b, const char *data, size_t len);
 
 void resp_write_simple_string(resp_buf_t *b, const char *s);
 void resp_write_error(resp_buf_t *b, const char *s);
@@ -0,0 +1,1226 @@
+#include "replication.h"
+#include "aof.h"
+#include "persistence.h"
+#include "server.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+static int g_read_only = 1;
+static int g_timeout = CK_REPL_DEFAULT_TIMEOUT;
+static int g_diskless = 1;
+static int g_diskless_delay = CK_REPL_DEFAULT_DISKLESS_DELAY;
+static size_t g_backlog_size = CK_REPL_DEFAULT_BACKLOG;
+
+void repl_set_timeout(int seconds) {
+    g_timeout = seconds;
+}
+
+void repl_set_read_only(int enabled) {
+    g_read_only = enabled;
+}
+
+void repl_set_diskless(int enabled) {
+    g_diskless = enabled;
+}
+
+void repl_set_diskless_delay(int seconds) {
+    g_diskless_delay = seconds;
+}
+
+int repl_timeout(void) {
+    return g_timeout;
+}
+
+int repl_read_only_setting(void) {
+    return g_read_only;
+}
+
+size_t repl_backlog_size(void) {
+    return g_backlog_size;
+}
+
+int repl_diskless(void) {
+    return g_diskless;
+}
+
+int repl_diskless_delay(void) {
+    return g_diskless_delay;
+}
+
+#ifdef _WIN32
+/* sockets here are POSIX only: a Windows build runs as a primary without
+ * replicas */
+void repl_init(command_ctx_t *ctx) {
+    (void)ctx;
+}
+
+void repl_stop(void) {
+}
+
+int repl_set_master(const char *host, int port) {
+    (void)port;
+    return host ? -1 : 0;
+}
+
+void repl_set_backlog_size(size_t bytes) {
+    g_backlog_size = bytes;
+}
+
+void repl_master(char *buf, size_t len) {
+    if (len) buf[0] = '\0';
+}
+
+int repl_is_replica(void) {
+    return 0;
+}
+
+int repl_read_only(void) {
+    return 0;
+}
+
+int repl_loading(void) {
+    return 0;
+}
+
+void repl_feed(resp_value_t *cmd) {
+    (void)cmd;
+}
+
+uint64_t repl_offset(void) {
+    return 0;
+}
+
+size_t repl_memory(void) {
+    return 0;
+}
+
+const char *repl_id(void) {
+    return "";
+}
+
+int repl_takes_over(resp_value_t *cmd) {
+    (void)cmd;
+    return 0;
+}
+
+void repl_attach_replica(int fd, resp_value_t *cmd) {
+    (void)fd;
+    (void)cmd;
+}
+
+int repl_fdset(fd_set *rd, fd_set *wr, int max_fd) {
+    (void)rd;
+    (void)wr;
+    return max_fd;
+}
+
+void repl_handle(fd_set *rd, fd_set *wr) {
+    (void)rd;
+    (void)wr;
+}
+
+void repl_cron(void) {
+}
+
+void repl_info(char *buf, size_t len) {
+    snprintf(buf, len, "# Replication\r\nrole:master\r\nconnected_slaves:0\r\n");
+}
+
+#else
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define REPL_IO_BUF (16 * 1024)
+
+static command_ctx_t *g_ctx;
+static char g_replid[CK_REPL_ID_LEN + 1];
+static uint64_t g_offset;       /* bytes in the stream so far */
+static resp_buf_t g_feed;       /* one command, encoded */
+/* what the backlog, g_feed and the replicas with their buffers take of
+ * ck_mem_used(), kept as they grow; see replica_account() */
+static size_t g_memory;
+
+/* the last g_backlog_size bytes of the stream. it is created for the
+ * first replica and kept from then on, so that one can come back */
+static char *g_backlog;
+static size_t g_backlog_idx;    /* where the next byte goes */
+static size_t g_backlog_histlen;
+
+static int64_t g_last_ping_ms;
+static int g_sync_bgsave;       /* the running BGSAVE is for replicas */
+/* diskless: the read end of the pipe the BGSAVE writes to, and the mark
+ * sent after what comes out of it */
+static int g_pipe = -1;
+static char g_eof_mark[CK_REPL_ID_LEN + 1];
+
+/* primary side */
+enum {
+    REPLICA_WAIT_BGSAVE_START,  /* needs a snapshot, none started for it yet */
+    REPLICA_WAIT_BGSAVE_END,    /* the stream is buffered from the snapshot's offset */
+    REPLICA_SEND_BULK,
+    REPLICA_ONLINE
+};
+
+static const char *replica_states[] = {
+    [REPLICA_WAIT_BGSAVE_START] = "wait_bgsave",
+    [REPLICA_WAIT_BGSAVE_END]   = "wait_bgsave",
+    [REPLICA_SEND_BULK]         = "send_bulk",
+    [REPLICA_ONLINE]            = "online",
+};
+
+typedef struct {
+    int fd;
+    int state;
+    char addr[64];
+    resp_buf_t head;        /* sync reply, then the snapshot a piece at a time */
+    size_t head_sent;
+    int file_fd;
+    uint64_t file_left;
+    resp_buf_t out;         /* the stream; held back until the snapshot is sent */
+    size_t out_sent;
+    resp_parser_t in;
+    uint64_t ack_offset;
+    int64_t last_io_ms;
+    int64_t wait_since_ms;  /* asked for a full resync */
+    int diskless;           /* its snapshot comes through g_pipe */
+    int pipe_ended;         /* all of that, and the mark, is in head */
+    int save_ok;            /* the BGSAVE behind it succeeded */
+    size_t mem;             /* its share of g_memory */
+} replica_t;
+
+static replica_t *g_replicas[CK_REPL_MAX_REPLICAS];
+static int g_n_replicas;
+
+/* replica side: the link to our primary */
+enum {
+    LINK_NONE,              /* we are a primary */
+    LINK_CONNECT,           /* waiting to connect */
+    LINK_CONNECTING,
+    LINK_HANDSHAKE,         /* PING, REPLCONF and PSYNC sent */
+    LINK_TRANSFER,          /* receiving the snapshot */
+    LINK_CONNECTED
+};
+
+static struct {
+    char host[256];
+    int port;
+    int state;
+    int fd;
+    resp_parser_t in;
+    resp_buf_t out;
+    size_t out_sent;
+    int replies;            /* handshake replies before the PSYNC one */
+    char sync_id[CK_REPL_ID_LEN + 1];
+    uint64_t sync_offset;
+    int64_t transfer_size;  /* -1 until $<len> has come */
+    uint64_t transfer_read;
+    FILE *transfer;
+    char transfer_path[272];
+    persistence_stream_t *load;     /* diskless: the snapshot loading as it comes */
+    int load_done;                  /* all of it is in; the mark is next */
+    char eof_mark[CK_REPL_ID_LEN + 1];
+    int64_t sync_start_ms;
+    char replid[CK_REPL_ID_LEN + 1];  /* the primary's; "" before a full sync */
+    uint64_t offset;        /* stream bytes applied */
+    int64_t last_io_ms;
+    int64_t last_ack_ms;
+    int64_t next_connect_ms;
+} g_link = { .fd = -1 };
+
+/* CK_REPL_ID_LEN random hex digits */
+static void random_hex(char *out) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char raw[CK_REPL_ID_LEN / 2];
+    FILE *f = fopen("/dev/urandom", "rb");
+    if (!f || fread(raw, 1, sizeof(raw), f) != sizeof(raw)) {
+        srand((unsigned)(ck_wall_time_ms() ^ (int64_t)getpid()));
+        for (size_t i = 0; i < sizeof(raw); i++) raw[i] = (unsigned char)rand();
+    }
+    if (f) fclose(f);
+    for (size_t i = 0; i < sizeof(raw); i++) {
+        out[2 * i] = hex[raw[i] >> 4];
+        out[2 * i + 1] = hex[raw[i] & 15];
+    }
+    out[CK_REPL_ID_LEN] = '\0';
+}
+
+static void new_replid(void) {
+    random_hex(g_replid);
+}
+
+static void set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* 1 if the socket would block, -1 on error, else what was sent */
+static ssize_t send_some(int fd, const char *p, size_t n) {
+    ssize_t w = send(fd, p, n, MSG_NOSIGNAL);
+    if (w < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    return w;
+}
+
+static const char *arg_str(resp_value_t *cmd, int idx) {
+    if (cmd->type != RESP_ARRAY || idx >= cmd->array.count) return NULL;
+    resp_value_t *v = cmd->array.elements[idx];
+    return v->type == RESP_BULK_STRING || v->type == RESP_SIMPLE_STRING ? v->str : NULL;
+}
+
+/* backlog */
+
+static void backlog_append(const char *p, size_t n) {
+    while (n > 0) {
+        size_t k = g_backlog_size - g_backlog_idx;
+        if (k > n) k = n;
+        memcpy(g_backlog + g_backlog_idx, p, k);
+        g_backlog_idx = (g_backlog_idx + k) % g_backlog_size;
+        g_backlog_histlen += k;
+        p += k;
+        n -= k;
+    }
+    if (g_backlog_histlen > g_backlog_size) g_backlog_histlen = g_backlog_size;
+}
+
+/* the stream from offset on, if the backlog still has all of it */
+static int backlog_copy(uint64_t offset, resp_buf_t *out) {
+    if (!g_backlog || offset > g_offset || g_offset - offset > g_backlog_histlen) return -1;
+    size_t n = (size_t)(g_offset - offset);
+    size_t start = (g_backlog_idx + g_backlog_size - n) % g_backlog_size;
+    size_t first = g_backlog_size - start < n ? g_backlog_size - start : n;
+    resp_buf_append(out, g_backlog + start, first);
+    resp_buf_append(out, g_backlog, n - first);
+    return 0;
+}
+
+void repl_set_backlog_size(size_t bytes) {
+    if (bytes == g_backlog_size) return;
+    g_backlog_size = bytes;
+    /* what it held can't be placed in a ring of another size */
+    if (g_backlog) {
+        g_memory -= ck_malloc_size(g_backlog);
+        ck_free(g_backlog);
+        g_backlog = ck_malloc(g_backlog_size);
+        g_memory += ck_malloc_size(g_backlog);
+        g_backlog_idx = 0;
+        g_backlog_histlen = 0;
+    }
+}
+
+/* replicas */
+
+/* a replica's buffers never shrink, they stay as big as the most they
+ * held (like a client's), so it is measured again after anything that
+ * may have grown them */
+static void replica_account(replica_t *r) {
+    size_t mem = ck_malloc_size(r) + ck_malloc_size(r->head.buf) +
+                 ck_malloc_size(r->out.buf) + ck_malloc_size(r->in.buf);
+    g_memory = g_memory - r->mem + mem;
+    r->mem = mem;
+}
+
+static void drop_replica(int i, const char *why) {
+    replica_t *r = g_replicas[i];
+    ck_log(CK_LOG_WARN, "replica %s dropped: %s", r->addr, why);
+    close(r->fd);
+    if (r->file_fd >= 0) close(r->file_fd);
+    resp_buf_destroy(&r->head);
+    resp_buf_destroy(&r->out);
+    resp_parser_destroy(&r->in);
+    g_memory -= r->mem;
+    ck_free(r);
+    g_replicas[i] = NULL;
+    g_n_replicas--;
+}
+
+static void feed_stream(const char *p, size_t n) {
+    backlog_append(p, n);
+    g_offset += n;
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        replica_t *r = g_replicas[i];
+        if (!r || r->state == REPLICA_WAIT_BGSAVE_START) continue;
+        resp_buf_append(&r->out, p, n);
+        replica_account(r);
+        if (r->out.len - r->out_sent > CK_REPL_OUTPUT_LIMIT) {
+            drop_replica(i, "output buffer over the limit");
+        }
+    }
+}
+
+void repl_feed(resp_value_t *cmd) {
+    if (!g_backlog || repl_is_replica()) return;
+    size_t feed_mem = ck_malloc_size(g_feed.buf);
+    g_feed.len = 0;
+    aof_encode(&g_feed, cmd);
+    g_memory += ck_malloc_size(g_feed.buf) - feed_mem;
+    feed_stream(g_feed.buf, g_feed.len);
+}
+
+/* a BGSAVE into a pipe, for diskless replicas */
+static int start_pipe_save(void) {
+    int p[2];
+    if (pipe(p) != 0) return -1;
+    if (persistence_bgsave_to(g_ctx->store, p[1]) != 0) {
+        close(p[0]);
+        return -1;
+    }
+    set_nonblock(p[0]);
+    g_pipe = p[0];
+    random_hex(g_eof_mark);
+    return 0;
+}
+
+/* snapshot for the replicas waiting for one, unless a BGSAVE is running;
+ * the cron tries again once it is over */
+static void start_full_sync(void) {
+    int waiting = 0;
+    int64_t oldest = 0;
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        replica_t *r = g_replicas[i];
+        if (!r || r->state != REPLICA_WAIT_BGSAVE_START) continue;
+        if (!waiting++ || r->wait_since_ms < oldest) oldest = r->wait_since_ms;
+    }
+    if (!waiting || persistence_bgsave_in_progress()) return;
+    /* the last stream is still being passed on, or more replicas may be
+     * about to ask: one snapshot serves all of them */
+    if (g_diskless &&
+        (g_pipe >= 0 || ck_time_ms() - oldest < (int64_t)g_diskless_delay * 1000)) {
+        return;
+    }
+
+    uint64_t offset = g_offset;
+    int rc = g_diskless ? start_pipe_save()
+                        : persistence_bgsave_full(g_ctx->store, g_ctx->rdb_filename);
+    if (rc != 0) {
+        ck_log(CK_LOG_WARN, "can't start a BGSAVE for %d replica(s)", waiting);
+        return;
+    }
+    g_sync_bgsave = 1;
+    char line[160];
+    int n = snprintf(line, sizeof(line), "+FULLRESYNC %s %llu\r\n", g_replid,
+                     (unsigned long long)offset);
+    if (g_diskless) snprintf(line + n, sizeof(line) - (size_t)n, "$EOF:%s\r\n", g_eof_mark);
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        replica_t *r = g_replicas[i];
+        if (!r || r->state != REPLICA_WAIT_BGSAVE_START) continue;
+        resp_buf_append(&r->head, line, strlen(line));
+        if (g_diskless) {
+            r->state = REPLICA_SEND_BULK;
+            r->diskless = 1;
+            r->last_io_ms = ck_time_ms();
+        } else {
+            r->state = REPLICA_WAIT_BGSAVE_END;
+        }
+    }
+}
+
+/* diskless replicas take the pipe at the pace of the slowest: the next
+ * read waits until all of the last one is sent */
+static int pipe_wanted(void) {
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        replica_t *r = g_replicas[i];
+        if (r && r->diskless && !r->pipe_ended && r->head_sent < r->head.len) return 0;
+    }
+    return 1;
+}
+
+/* pass what the BGSAVE wrote on to the replicas sharing it; once it's all
+ * out, the mark. with none left the rest is read and dropped */
+static void pipe_read(void) {
+    char buf[4 * REPL_IO_BUF];
+    ssize_t n = read(g_pipe, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return;
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        replica_t *r = g_replicas[i];
+        if (!r || !r->diskless || r->pipe_ended) continue;
+        if (n > 0) {
+            resp_buf_append(&r->head, buf, (size_t)n);
+            r->last_io_ms = ck_time_ms();
+        } else if (n == 0) {
+            resp_buf_append(&r->head, g_eof_mark, CK_REPL_ID_LEN);
+            r->pipe_ended = 1;
+        } else {
+            drop_replica(i, "can't read the snapshot");
+        }
+    }
+    if (n <= 0) {
+        close(g_pipe);
+        g_pipe = -1;
+    }
+}
+
+static void bgsave_done(int ok) {
+    if (!g_sync_bgsave) return;
+    g_sync_bgsave = 0;
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        replica_t *r = g_replicas[i];
+        if (r && r->state == REPLICA_SEND_BULK && r->diskless && !r->save_ok) {
+            /* what came through the pipe is only complete if it succeeded */
+            if (ok) {
+                r->save_ok = 1;
+            } else {
+                drop_replica(i, "snapshot failed");
+            }
+            continue;
+        }
+        if (!r || r->state != REPLICA_WAIT_BGSAVE_END) continue;
+        if (!ok) {
+            drop_replica(i, "snapshot failed");
+            continue;
+        }
+        struct stat st;
+        int fd = open(g_ctx->rdb_filename, O_RDONLY);
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            if (fd >= 0) close(fd);
+            drop_replica(i, "can't open the snapshot");
+            continue;
+        }
+        char line[32];
+        int n = snprintf(line, sizeof(line), "$%lld\r\n", (long long)st.st_size);
+        resp_buf_append(&r->head, line, (size_t)n);
+        r->file_fd = fd;
+        r->file_left = (uint64_t)st.st_size;
+        r->state = REPLICA_SEND_BULK;
+    }
+}
+
+int repl_takes_over(resp_value_t *cmd) {
+    const char *name = arg_str(cmd, 0);
+    return name && (strcasecmp(name, "PSYNC") == 0 || strcasecmp(name, "SYNC") == 0);
+}
+
+static void refuse(int fd, const char *err) {
+    send(fd, err, strlen(err), MSG_NOSIGNAL);
+    close(fd);
+}
+
+void repl_attach_replica(int fd, resp_value_t *cmd) {
+    if (repl_is_replica()) {
+        refuse(fd, "-ERR replicas don't take replicas\r\n");
+        return;
+    }
+    int slot = -1;
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS && slot < 0; i++) {
+        if (!g_replicas[i]) slot = i;
+    }
+    if (slot < 0) {
+        refuse(fd, "-ERR too many replicas\r\n");
+        return;
+    }
+
+    replica_t *r = ck_malloc(sizeof(replica_t));
+    memset(r, 0, sizeof(*r));
+    r->fd = fd;
+    r->file_fd = -1;
+    resp_buf_init(&r->head);
+    resp_buf_init(&r->out);
+    resp_parser_init(&r->in);
+    r->last_io_ms = ck_time_ms();
+    r->wait_since_ms = r->last_io_ms;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+    if (getpeername(fd, (struct sockaddr *)&peer, &peer_len) == 0 && peer.sin_family == AF_INET) {
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &peer.sin_addr, ip, sizeof(ip));
+        snprintf(r->addr, sizeof(r->addr), "%s:%u", ip, (unsigned)ntohs(peer.sin_port));
+    } else {
+        snprintf(r->addr, sizeof(r->addr), "fd %d", fd);
+    }
+    set_nonblock(fd);
+    g_replicas[slot] = r;
+    g_n_replicas++;
+    if (!g_backlog) {
+        g_backlog = ck_malloc(g_backlog_size);
+        g_memory += ck_malloc_size(g_backlog);
+        g_backlog_idx = 0;
+        g_backlog_histlen = 0;
+    }
+
+    /* PSYNC <replid> <offset>; SYNC is PSYNC ? -1 */
+    const char *id = arg_str(cmd, 1);
+    int64_t offset;
+    if (id && strcmp(id, g_replid) == 0 && ck_str_to_int64(arg_str(cmd, 2), &offset) == 0 &&
+        offset >= 0 && backlog_copy((uint64_t)offset, &r->out) == 0) {
+        char line[64];
+        int n = snprintf(line, sizeof(line), "+CONTINUE %s\r\n", g_replid);
+        resp_buf_append(&r->head, line, (size_t)n);
+        r->ack_offset = (uint64_t)offset;
+        r->state = REPLICA_ONLINE;
+        ck_log(CK_LOG_INFO, "replica %s: partial resync from offset %lld, %zu bytes",
+               r->addr, (long long)offset, r->out.len);
+        replica_account(r);
+        return;
+    }
+    r->state = REPLICA_WAIT_BGSAVE_START;
+    ck_log(CK_LOG_INFO, "replica %s: full resync", r->addr);
+    start_full_sync();
+    replica_account(r);
+}
+
+/* send what can be sent without blocking: the head, then the snapshot,
+ * then (once online) the stream. a diskless snapshot comes into the head
+ * from pipe_read() */
+static int replica_write(replica_t *r) {
+    char buf[REPL_IO_BUF];
+    for (;;) {
+        if (r->head_sent < r->head.len) {
+            ssize_t n = send_some(r->fd, r->head.buf + r->head_sent, r->head.len - r->head_sent);
+            if (n <= 0) return (int)n;
+            r->head_sent += (size_t)n;
+            if (r->state == REPLICA_SEND_BULK) r->last_io_ms = ck_time_ms();
+            continue;
+        }
+        r->head.len = 0;
+        r->head_sent = 0;
+
+        if (r->file_fd >= 0) {
+            if (r->file_left == 0) {
+                close(r->file_fd);
+                r->file_fd = -1;
+                r->state = REPLICA_ONLINE;
+                r->last_io_ms = ck_time_ms();
+                ck_log(CK_LOG_INFO, "replica %s: snapshot sent, streaming", r->addr);
+                continue;
+            }
+            size_t want = r->file_left < sizeof(buf) ? (size_t)r->file_left : sizeof(buf);
+            ssize_t n = read(r->file_fd, buf, want);
+            if (n <= 0) return -1;
+            r->file_left -= (uint64_t)n;
+            resp_buf_append(&r->head, buf, (size_t)n);
+            continue;
+        }
+        if (r->state == REPLICA_SEND_BULK) {
+            if (!r->pipe_ended || !r->save_ok) break;
+            r->state = REPLICA_ONLINE;
+            r->last_io_ms = ck_time_ms();
+            ck_log(CK_LOG_INFO, "replica %s: diskless snapshot sent, streaming", r->addr);
+            continue;
+        }
+
+        if (r->state != REPLICA_ONLINE || r->out_sent == r->out.len) break;
+        ssize_t n = send_some(r->fd, r->out.buf + r->out_sent, r->out.len - r->out_sent);
+        if (n <= 0) return (int)n;
+        r->out_sent += (size_t)n;
+    }
+    if (r->out_sent == r->out.len) {
+        r->out.len = 0;
+        r->out_sent = 0;
+    }
+    return 0;
+}
+
+static int replica_wants_write(const replica_t *r) {
+    return r->head_sent < r->head.len || r->file_fd >= 0 ||
+           (r->state == REPLICA_SEND_BULK && r->pipe_ended && r->save_ok) ||
+           (r->state == REPLICA_ONLINE && r->out_sent < r->out.len);
+}
+
+/* all a replica says after PSYNC is REPLCONF ACK <offset> */
+static int replica_read(replica_t *r) {
+    char buf[REPL_IO_BUF];
+    ssize_t n = recv(r->fd, buf, sizeof(buf), 0);
+    if (n == 0) return -1;
+    if (n < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    r->last_io_ms = ck_time_ms();
+    resp_parser_feed(&r->in, buf, (size_t)n);
+
+    resp_value_t *cmd;
+    while (resp_parse(&r->in, &cmd) == 1) {
+        const char *name = arg_str(cmd, 0);
+        const char *what = arg_str(cmd, 1);
+        int64_t offset;
+        if (name && what && strcasecmp(name, "REPLCONF") == 0 && strcasecmp(what, "ACK") == 0 &&
+            ck_str_to_int64(arg_str(cmd, 2), &offset) == 0 && offset >= 0) {
+            r->ack_offset = (uint64_t)offset;
+        }
+        resp_value_free(cmd);
+    }
+    return 0;
+}
+
+/* replica side */
+
+static void link_close(void) {
+    if (g_link.fd >= 0) {
+        close(g_link.fd);
+        g_link.fd = -1;
+        resp_parser_destroy(&g_link.in);
+        resp_buf_destroy(&g_link.out);
+    }
+    if (g_link.transfer) {
+        fclose(g_link.transfer);
+        g_link.transfer = NULL;
+        remove(g_link.transfer_path);
+    }
+    if (g_link.load) {
+        /* part of a dataset isn't served */
+        store_t *s = g_ctx->store;
+        int locked = store_lock(s);
+        persistence_stream_end(g_link.load);
+        store_flushdb(s);
+        store_unlock(s, locked);
+        g_link.load = NULL;
+    }
+}
+
+static void link_fail(const char *why) {
+    ck_log(CK_LOG_WARN, "replication from %s:%d: %s", g_link.host, g_link.port, why);
+    link_close();
+    g_link.state = LINK_CONNECT;
+    g_link.next_connect_ms = ck_time_ms() + CK_REPL_RETRY_MS;
+}
+
+static void link_send(int argc, const char **argv) {
+    resp_write_array_header(&g_link.out, argc);
+    for (int i = 0; i < argc; i++) resp_write_bulk_string(&g_link.out, argv[i], strlen(argv[i]));
+}
+
+static void link_connect(void) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    char port[16];
+    snprintf(port, sizeof(port), "%d", g_link.port);
+    if (getaddrinfo(g_link.host, port, &hints, &res) != 0) {
+        link_fail("can't resolve the host");
+        return;
+    }
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (fd < 0) {
+        freeaddrinfo(res);
+        link_fail("socket() failed");
+        return;
+    }
+    set_nonblock(fd);
+    int rc = connect(fd, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (rc != 0 && errno != EINPROGRESS) {
+        close(fd);
+        link_fail(strerror(errno));
+        return;
+    }
+    g_link.fd = fd;
+    resp_parser_init(&g_link.in);
+    resp_buf_init(&g_link.out);
+    g_link.out_sent = 0;
+    g_link.state = LINK_CONNECTING;
+    g_link.last_io_ms = ck_time_ms();
+}
+
+static void link_handshake(void) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(g_link.fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err) {
+        link_fail(err ? strerror(err) : "connect failed");
+        return;
+    }
+
+    char port[16], offset[24];
+    snprintf(port, sizeof(port), "%u",
+             g_ctx && g_ctx->config ? (unsigned)g_ctx->config->port : 0);
+    snprintf(offset, sizeof(offset), "%llu", (unsigned long long)g_link.offset);
+    const char *ping[] = { "PING" };
+    const char *replconf[] = { "REPLCONF", "listening-port", port };
+    const char *psync[] = { "PSYNC", g_link.replid[0] ? g_link.replid : "?",
+                            g_link.replid[0] ? offset : "-1" };
+    link_send(1, ping);
+    link_send(3, replconf);
+    link_send(3, psync);
+    g_link.replies = 2;
+    g_link.state = LINK_HANDSHAKE;
+    g_link.last_io_ms = ck_time_ms();
+}
+
+/* the next \r\n-terminated line in the input, consumed; NULL if it isn't
+ * all there yet. the caller frees it */
+static char *link_line(void) {
+    resp_parser_t *in = &g_link.in;
+    for (size_t i = in->pos; i + 1 < in->len; i++) {
+        if (in->buf[i] == '\r' && in->buf[i + 1] == '\n') {
+            char *line = ck_strndup(in->buf + in->pos, i - in->pos);
+            in->pos = i + 2;
+            return line;
+        }
+    }
+    return NULL;
+}
+
+/* the new dataset is in place: follow the stream from the snapshot's
+ * offset */
+static void sync_done(void) {
+    /* the log still describes the old dataset */
+    if (aof_enabled()) aof_rewrite_schedule();
+
+    memcpy(g_link.replid, g_link.sync_id, sizeof(g_link.replid));
+    g_link.offset = g_link.sync_offset;
+    g_link.state = LINK_CONNECTED;
+    ck_log(CK_LOG_INFO, "full sync from %s:%d: %zu keys, %llu bytes in %lld ms", g_link.host,
+           g_link.port, store_dbsize(g_ctx->store), (unsigned long long)g_link.transfer_read,
+           (long long)(ck_time_ms() - g_link.sync_start_ms));
+}
+
+/* $<len>: the snapshot is written to a file and loaded once all there */
+static int begin_file(const char *line) {
+    int64_t size;
+    if (line[0] != '$' || ck_str_to_int64(line + 1, &size) != 0 || size < 0) {
+        link_fail("bad snapshot header");
+        return -1;
+    }
+    snprintf(g_link.transfer_path, sizeof(g_link.transfer_path), "%s.sync.tmp",
+             g_ctx->rdb_filename);
+    g_link.transfer = fopen(g_link.transfer_path, "wb");
+    if (!g_link.transfer) {
+        link_fail("can't open a file for the snapshot");
+        return -1;
+    }
+    g_link.transfer_size = size;
+    return 0;
+}
+
+/* $EOF:<mark>: the snapshot is loaded as it comes, until the mark */
+static int begin_stream(const char *mark) {
+    if (strlen(mark) != CK_REPL_ID_LEN) {
+        link_fail("bad snapshot header");
+        return -1;
+    }
+    memcpy(g_link.eof_mark, mark, sizeof(g_link.eof_mark));
+    store_t *s = g_ctx->store;
+    int locked = store_lock(s);
+    store_flushdb(s);
+    g_link.load = persistence_stream_begin(s);
+    store_unlock(s, locked);
+    g_link.load_done = 0;
+    ck_log(CK_LOG_INFO, "loading the snapshot from %s:%d as it arrives", g_link.host,
+           g_link.port);
+    return 0;
+}
+
+/* 1 once the snapshot and the mark after it are in, 0 if more is needed */
+static int stream_load(void) {
+    resp_parser_t *in = &g_link.in;
+    store_t *s = g_ctx->store;
+    if (!g_link.load_done) {
+        int locked = store_lock(s);
+        int64_t n = persistence_stream_feed(g_link.load, in->buf + in->pos, in->len - in->pos,
+                                            &g_link.load_done);
+        store_unlock(s, locked);
+        if (n < 0) {
+            link_fail("bad snapshot");
+            return -1;
+        }
+        in->pos += (size_t)n;
+        g_link.transfer_read += (uint64_t)n;
+        if (!g_link.load_done) return 0;
+    }
+    if (in->len - in->pos < CK_REPL_ID_LEN) return 0;
+    if (memcmp(in->buf + in->pos, g_link.eof_mark, CK_REPL_ID_LEN) != 0) {
+        link_fail("no end mark after the snapshot");
+        return -1;
+    }
+    in->pos += CK_REPL_ID_LEN;
+    persistence_stream_end(g_link.load);
+    g_link.load = NULL;
+    /* our snapshot file doesn't have any of it */
+    persistence_add_dirty(store_dbsize(s));
+    sync_done();
+    return 1;
+}
+
+/* the snapshot is in: it replaces the dataset and our own snapshot file */
+static int finish_sync(void) {
+    int ok = fclose(g_link.transfer) == 0;
+    g_link.transfer = NULL;
+    if (!ok || rename(g_link.transfer_path, g_ctx->rdb_filename) != 0) {
+        remove(g_link.transfer_path);
+        link_fail("can't store the snapshot");
+        return -1;
+    }
+
+    store_t *s = g_ctx->store;
+    int locked = store_lock(s);
+    store_flushdb(s);
+    int rc = persistence_load(s, g_ctx->rdb_filename);
+    store_unlock(s, locked);
+    if (rc != 0) {
+        link_fail("can't load the snapshot");
+        return -1;
+    }
+    persistence_reset_dirty();
+    sync_done();
+    return 0;
+}
+
+/* apply what has come of the stream; the offset counts whole commands */
+static void link_apply(void) {
+    resp_parser_t *in = &g_link.in;
+    resp_buf_t reply;
+    resp_buf_init(&reply);
+    for (;;) {
+        size_t start = in->pos;
+        resp_value_t *cmd;
+        if (resp_parse(in, &cmd) != 1) break;
+        g_ctx->replaying = 1;
+        command_dispatch(g_ctx, cmd, &reply);
+        g_ctx->replaying = 0;
+        reply.len = 0;
+        resp_value_free(cmd);
+        g_link.offset += in->pos - start;
+    }
+    resp_buf_destroy(&reply);
+}
+
+static int link_process(void) {
+    resp_parser_t *in = &g_link.in;
+    for (;;) {
+        if (g_link.state == LINK_HANDSHAKE) {
+            char *line = link_line();
+            if (!line) return 0;
+            if (g_link.replies > 0) {
+                /* PING and REPLCONF; an old primary may not know REPLCONF */
+                if (line[0] == '-' && g_link.replies == 2) {
+                    link_fail(line);
+                    ck_free(line);
+                    return -1;
+                }
+                g_link.replies--;
+                ck_free(line);
+                continue;
+            }
+
+            unsigned long long offset;
+            char id[CK_REPL_ID_LEN + 1];
+            if (sscanf(line, "+FULLRESYNC %40s %llu", id, &offset) == 2) {
+                memcpy(g_link.sync_id, id, sizeof(id));
+                g_link.sync_offset = offset;
+                g_link.transfer_size = -1;
+                g_link.transfer_read = 0;
+                g_link.sync_start_ms = ck_time_ms();
+                ck_free(line);
+                g_link.state = LINK_TRANSFER;
+                ck_log(CK_LOG_INFO, "full sync from %s:%d at offset %llu", g_link.host,
+                       g_link.port, offset);
+            } else if (strncmp(line, "+CONTINUE", 9) == 0) {
+                if (sscanf(line, "+CONTINUE %40s", id) == 1) {
+                    memcpy(g_link.replid, id, sizeof(id));
+                }
+                g_link.state = LINK_CONNECTED;
+                ck_log(CK_LOG_INFO, "partial resync from %s:%d at offset %llu", g_link.host,
+                       g_link.port, (unsigned long long)g_link.offset);
+                ck_free(line);
+            } else {
+                link_fail(line);
+                ck_free(line);
+                return -1;
+            }
+        } else if (g_link.state == LINK_TRANSFER) {
+            if (g_link.transfer_size < 0 && !g_link.load) {
+                /* newlines keep the link alive while the primary saves */
+                while (in->pos < in->len && in->buf[in->pos] == '\n') in->pos++;
+                char *line = link_line();
+                if (!line) return 0;
+                int rc = strncmp(line, "$EOF:", 5) == 0 ? begin_stream(line + 5)
+                                                        : begin_file(line);
+                ck_free(line);
+                if (rc != 0) return -1;
+                continue;
+            }
+            if (g_link.load) {
+                int rc = stream_load();
+                if (rc <= 0) return rc;
+                continue;
+            }
+            size_t n = in->len - in->pos;
+            uint64_t left = (uint64_t)g_link.transfer_size - g_link.transfer_read;
+            if (n > left) n = (size_t)left;
+            if (n && fwrite(in->buf + in->pos, 1, n, g_link.transfer) != n) {
+                link_fail("can't write the snapshot");
+                return -1;
+            }
+            in->pos += n;
+            g_link.transfer_read += n;
+            if (g_link.transfer_read < (uint64_t)g_link.transfer_size) return 0;
+            if (finish_sync() != 0) return -1;
+        } else {
+            if (g_link.state == LINK_CONNECTED) link_apply();
+            return 0;
+        }
+    }
+}
+
+static void link_read(void) {
+    char buf[REPL_IO_BUF];
+    ssize_t n = recv(g_link.fd, buf, sizeof(buf), 0);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        link_fail(n == 0 ? "connection closed" : strerror(errno));
+        return;
+    }
+    if (n < 0) return;
+    g_link.last_io_ms = ck_time_ms();
+    resp_parser_feed(&g_link.in, buf, (size_t)n);
+    link_process();
+}
+
+static void link_write(void) {
+    while (g_link.out_sent < g_link.out.len) {
+        ssize_t n = send_some(g_link.fd, g_link.out.buf + g_link.out_sent,
+                              g_link.out.len - g_link.out_sent);
+        if (n < 0) {
+            link_fail(strerror(errno));
+            return;
+        }
+        if (n == 0) return;
+        g_link.out_sent += (size_t)n;
+    }
+    g_link.out.len = 0;
+    g_link.out_sent = 0;
+}
+
+/* public */
+
+void repl_init(command_ctx_t *ctx) {
+    g_ctx = ctx;
+    new_replid();
+    resp_buf_init(&g_feed);
+    g_memory += ck_malloc_size(g_feed.buf);
+    persistence_on_bgsave_done(bgsave_done);
+}
+
+void repl_stop(void) {
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        if (g_replicas[i]) drop_replica(i, "shutting down");
+    }
+    if (g_pipe >= 0) {
+        /* let a snapshot thread finish writing rather than block on a full
+         * pipe (or die of SIGPIPE on a closed one) */
+        int flags = fcntl(g_pipe, F_GETFL, 0);
+        if (flags >= 0) fcntl(g_pipe, F_SETFL, flags & ~O_NONBLOCK);
+        char buf[REPL_IO_BUF];
+        while (read(g_pipe, buf, sizeof(buf)) > 0) {
+        }
+        close(g_pipe);
+        g_pipe = -1;
+    }
+    link_close();
+    g_link.state = LINK_NONE;
+    g_memory -= ck_malloc_size(g_backlog) + ck_malloc_size(g_feed.buf);
+    ck_free(g_backlog);
+    g_backlog = NULL;
+    resp_buf_destroy(&g_feed);
+}
+
+int repl_set_master(const char *host, int port) {
+    if (!host) {
+        if (g_link.state == LINK_NONE) return 0;
+        link_close();
+        g_link.state = LINK_NONE;
+        /* our data goes its own way from here: nobody can continue from
+         * the old stream, including us */
+        g_link.replid[0] = '\0';
+        g_link.offset = 0;
+        new_replid();
+        ck_log(CK_LOG_INFO, "replication stopped, now a primary with ID %s", g_replid);
+        return 0;
+    }
+    if (port <= 0 || port > 65535 || strlen(host) >= sizeof(g_link.host)) return -1;
+    if (g_link.state != LINK_NONE && strcmp(host, g_link.host) == 0 && port == g_link.port) {
+        return 0;
+    }
+
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        if (g_replicas[i]) drop_replica(i, "this node became a replica");
+    }
+    link_close();
+    snprintf(g_link.host, sizeof(g_link.host), "%s", host);
+    g_link.port = port;
+    g_link.state = LINK_CONNECT;
+    g_link.next_connect_ms = 0;
+    ck_log(CK_LOG_INFO, "replicating from %s:%d", host, port);
+    return 0;
+}
+
+void repl_master(char *buf, size_t len) {
+    if (g_link.state == LINK_NONE) {
+        if (len) buf[0] = '\0';
+    } else {
+        snprintf(buf, len, "%s %d", g_link.host, g_link.port);
+    }
+}
+
+int repl_is_replica(void) {
+    return g_link.state != LINK_NONE;
+}
+
+int repl_read_only(void) {
+    return repl_is_replica() && g_read_only;
+}
+
+int repl_loading(void) {
+    return g_link.load != NULL;
+}
+
+uint64_t repl_offset(void) {
+    return repl_is_replica() ? g_link.offset : g_offset;
+}
+
+size_t repl_memory(void) {
+    return g_memory;
+}
+
+const char *repl_id(void) {
+    return g_replid;
+}
+
+int repl_fdset(fd_set *rd, fd_set *wr, int max_fd) {
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        replica_t *r = g_replicas[i];
+        if (!r) continue;
+        FD_SET(r->fd, rd);
+        if (replica_wants_write(r)) FD_SET(r->fd, wr);
+        if (r->fd > max_fd) max_fd = r->fd;
+    }
+    if (g_pipe >= 0 && pipe_wanted()) {
+        FD_SET(g_pipe, rd);
+        if (g_pipe > max_fd) max_fd = g_pipe;
+    }
+    if (g_link.fd >= 0) {
+        if (g_link.state != LINK_CONNECTING) FD_SET(g_link.fd, rd);
+        if (g_link.state == LINK_CONNECTING || g_link.out_sent < g_link.out.len) {
+            FD_SET(g_link.fd, wr);
+        }
+        if (g_link.fd > max_fd) max_fd = g_link.fd;
+    }
+    return max_fd;
+}
+
+void repl_handle(fd_set *rd, fd_set *wr) {
+    if (g_pipe >= 0 && FD_ISSET(g_pipe, rd)) pipe_read();
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        replica_t *r = g_replicas[i];
+        if (!r) continue;
+        if (FD_ISSET(r->fd, wr) && replica_write(r) < 0) {
+            drop_replica(i, "write failed");
+            continue;
+        }
+        if (FD_ISSET(r->fd, rd) && replica_read(r) < 0) {
+            drop_replica(i, "connection closed");
+            continue;
+        }
+        /* pipe_read() and the snapshot file may have grown it too */
+        replica_account(r);
+    }
+
+    int fd = g_link.fd;
+    if (fd < 0) return;
+    if (FD_ISSET(fd, wr)) {
+        if (g_link.state == LINK_CONNECTING) {
+            link_handshake();
+        } else {
+            link_write();
+        }
+    }
+    /* the link may have been closed (and its fd reused) meanwhile */
+    if (g_link.fd == fd && g_link.state != LINK_CONNECTING && FD_ISSET(fd, rd)) link_read();
+}
+
+void repl_cron(void) {
+    int64_t now = ck_time_ms();
+
+    start_full_sync();
+    if (g_n_replicas > 0 && now - g_last_ping_ms >= CK_REPL_PING_MS) {
+        static const char ping[] = "*1\r\n$4\r\nPING\r\n";
+        feed_stream(ping, sizeof(ping) - 1);
+        g_last_ping_ms = now;
+    }
+    for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+        replica_t *r = g_replicas[i];
+        if (!r) continue;
+        if ((r->state == REPLICA_ONLINE || r->state == REPLICA_SEND_BULK) &&
+            now - r->last_io_ms > (int64_t)g_timeout * 1000) {
+            drop_replica(i, "timeout");
+            continue;
+        }
+        if (r->state == REPLICA_WAIT_BGSAVE_END && r->head_sent == r->head.len) {
+            /* keep the link alive while the snapshot is written */
+            resp_buf_append(&r->head, "\n", 1);
+        }
+        /* so is what start_full_sync() and bgsave_done() added */
+        replica_account(r);
+    }
+
+    switch (g_link.state) {
+        case LINK_CONNECT:
+            if (now >= g_link.next_connect_ms) link_connect();
+            break;
+        case LINK_CONNECTED:
+            if (now - g_link.last_ack_ms >= CK_REPL_ACK_MS) {
+                char offset[24];
+                snprintf(offset, sizeof(offset), "%llu", (unsigned long long)g_link.offset);
+                const char *ack[] = { "REPLCONF", "ACK", offset };
+                link_send(3, ack);
+                g_link.last_ack_ms = now;
+            }
+            /* fall through */
+        case LINK_CONNECTING:
+        case LINK_HANDSHAKE:
+        case LINK_TRANSFER:
+            if (now - g_link.last_io_ms > (int64_t)g_timeout * 1000) link_fail("timeout");
+            break;
+        default:
+            break;
+    }
+}
+
+void repl_info(char *buf, size_t len) {
+    size_t used = 0;
+#define INFO_APPEND(...)                                                        \
+    do {                                                                        \
+        int w_ = snprintf(buf + used, len - used, __VA_ARGS__);                 \
+        if (w_ > 0) used = used + (size_t)w_ < len ? used + (size_t)w_ : len - 1; \
+    } while (0)
+
+    if (len == 0) return;
+    buf[0] = '\0';
+    INFO_APPEND("# Replication\r\nrole:%s\r\n", repl_is_replica() ? "slave" : "master");
+    if (repl_is_replica()) {
+        int64_t idle = g_link.fd >= 0 ? (ck_time_ms() - g_link.last_io_ms) / 1000 : -1;
+        INFO_APPEND("master_host:%s\r\nmaster_port:%d\r\nmaster_link_status:%s\r\n"
+                    "master_last_io_seconds_ago:%lld\r\nmaster_sync_in_progress:%d\r\n"
+                    "master_sync_read_bytes:%llu\r\nmaster_replid:%s\r\n"
+                    "slave_repl_offset:%llu\r\nslave_read_only:%d\r\n",
+                    g_link.host, g_link.port, g_link.state == LINK_CONNECTED ? "up" : "down",
+                    (long long)idle, g_link.state == LINK_TRANSFER,
+                    (unsigned long long)g_link.transfer_read,
+                    g_link.replid[0] ? g_link.replid : "?",
+                    (unsigned long long)g_link.offset, g_read_only);
+    } else {
+        INFO_APPEND("connected_slaves:%d\r\n", g_n_replicas);
+        int n = 0;
+        int64_t now = ck_time_ms();
+        for (int i = 0; i < CK_REPL_MAX_REPLICAS; i++) {
+            replica_t *r = g_replicas[i];
+            if (!r) continue;
+            INFO_APPEND("slave%d:addr=%s,state=%s,offset=%llu,lag=%lld\r\n", n++, r->addr,
+                        replica_states[r->state], (unsigned long long)r->ack_offset,
+                        (long long)((now - r->last_io_ms) / 1000));
+        }
+        INFO_APPEND("master_replid:%s\r\nmaster_repl_offset:%llu\r\n", g_replid,
+                    (unsigned long long)g_offset);
+    }
+    INFO_APPEND("repl_backlog_active:%d\r\nrepl_backlog_size:%zu\r\n"
+                "repl_backlog_first_byte_offset:%llu\r\nrepl_backlog_histlen:%zu\r\n",
+                g_backlog != NULL, g_backlog_size,
+                (unsigned long long)(g_offset - g_backlog_histlen), g_backlog_histlen);
+#undef INFO_APPEND
+}
+
+#endif
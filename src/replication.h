@@ -0,0 +1,99 @@
+#ifndef CK_REPLICATION_H
+#define CK_REPLICATION_H
+
+#include "command.h"
+#include "protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#else
+#include <sys/select.h>
+#endif
+
+/* asynchronous primary-replica replication.
+ *
+ * the primary numbers every byte of its write stream (the replication
+ * offset) under a random 40-character replication ID, and keeps the last
+ * repl-backlog-size bytes of it in a circular backlog. a replica connects,
+ * sends PSYNC <replid> <offset> and gets either
+ *   +CONTINUE <replid>, then the stream from its offset, if the backlog
+ *   still has it, or
+ *   +FULLRESYNC <replid> <offset>, then a full snapshot from a BGSAVE
+ *   started at that offset, then the stream from there on.
+ * the snapshot comes as $<len> and the file the BGSAVE wrote, or with
+ * repl-diskless-sync as $EOF:<40-character mark>, the encoding straight
+ * from the BGSAVE through a pipe, and the mark. replicas that are waiting
+ * when a diskless BGSAVE starts share it; repl-diskless-sync-delay holds it
+ * back a little so more can join. a replica loads a diskless snapshot
+ * chunk by chunk as it arrives and answers -LOADING meanwhile.
+ * the stream is the write commands as the AOF logs them (absolute
+ * expiries), plus a PING every CK_REPL_PING_MS. replicas send
+ * REPLCONF ACK <offset> once a second and serve reads; writes from
+ * clients are refused unless replica-read-only is off. a replica doesn't
+ * take replicas of its own */
+#define CK_REPL_ID_LEN 40
+#define CK_REPL_DEFAULT_BACKLOG (1024 * 1024)
+#define CK_REPL_DEFAULT_TIMEOUT 60        /* seconds without data from the other side */
+#define CK_REPL_MAX_REPLICAS 16
+#define CK_REPL_PING_MS 10000
+#define CK_REPL_ACK_MS 1000
+#define CK_REPL_RETRY_MS 1000             /* between connection attempts */
+#define CK_REPL_DEFAULT_DISKLESS_DELAY 5  /* seconds */
+/* a replica whose unsent stream grows past this is dropped (and will
+ * resync) rather than holding the primary's memory */
+#define CK_REPL_OUTPUT_LIMIT (256 * 1024 * 1024)
+
+/* pick a replication ID and take ctx for applying the stream; before
+ * the event loop starts */
+void repl_init(command_ctx_t *ctx);
+/* close every link, at shutdown */
+void repl_stop(void);
+
+/* replicate from host:port, or stop replicating (host NULL) and become a
+ * primary with a new ID. takes effect from the next cron */
+int repl_set_master(const char *host, int port);
+void repl_set_backlog_size(size_t bytes);
+void repl_set_timeout(int seconds);
+void repl_set_read_only(int enabled);
+void repl_set_diskless(int enabled);
+void repl_set_diskless_delay(int seconds);
+size_t repl_backlog_size(void);
+int repl_timeout(void);
+int repl_read_only_setting(void);
+int repl_diskless(void);
+int repl_diskless_delay(void);
+/* "host port", "" when this is a primary */
+void repl_master(char *buf, size_t len);
+
+int repl_is_replica(void);
+/* client writes are refused */
+int repl_read_only(void);
+/* a diskless snapshot is being loaded: the dataset is incomplete */
+int repl_loading(void);
+
+/* a write command went through on the primary */
+void repl_feed(resp_value_t *cmd);
+uint64_t repl_offset(void);
+const char *repl_id(void);
+/* what the backlog and the replicas' buffers take of ck_mem_used(). it
+ * isn't data, so it doesn't count towards maxmemory */
+size_t repl_memory(void);
+
+/* PSYNC and SYNC turn the connection into a replica link. attach takes
+ * over fd (and closes it if it turns the replica away) */
+int repl_takes_over(resp_value_t *cmd);
+void repl_attach_replica(int fd, resp_value_t *cmd);
+
+/* the event loop: add the replication sockets to the select() sets and
+ * return the new highest fd, then handle what select() found */
+int repl_fdset(fd_set *rd, fd_set *wr, int max_fd);
+void repl_handle(fd_set *rd, fd_set *wr);
+/* connect, time out, ping and ack */
+void repl_cron(void);
+
+/* the "# Replication" section of INFO */
+void repl_info(char *buf, size_t len);
+
+#endif
@@ -0,0 +1,65 @@
+#include "ring.h"
+#include "util.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* CRC-32C is quick but linear: similar names would land on related
+ * points. the murmur3 finalizer spreads them over the ring */
+static uint32_t ring_hash(const void *buf, size_t len) {
+    uint32_t h = ck_crc32c(0, buf, len);
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static int point_cmp(const void *a, const void *b) {
+    const ring_point_t *x = a, *y = b;
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->node - y->node;
+}
+
+ring_t *ring_create(const char *const *nodes, int n_nodes, int vnodes) {
+    ring_t *r = ck_malloc(sizeof(ring_t));
+    r->n_nodes = n_nodes;
+    r->n_points = (size_t)n_nodes * (size_t)vnodes;
+    r->points = ck_malloc(sizeof(ring_point_t) * (r->n_points ? r->n_points : 1));
+    size_t k = 0;
+    for (int i = 0; i < n_nodes; i++) {
+        for (int v = 0; v < vnodes; v++) {
+            char name[320];
+            int len = snprintf(name, sizeof(name), "%s#%d", nodes[i], v);
+            r->points[k].hash = ring_hash(name, (size_t)len < sizeof(name) ? (size_t)len
+                                                                          : sizeof(name) - 1);
+            r->points[k++].node = i;
+        }
+    }
+    qsort(r->points, r->n_points, sizeof(ring_point_t), point_cmp);
+    return r;
+}
+
+void ring_destroy(ring_t *r) {
+    if (!r) return;
+    ck_free(r->points);
+    ck_free(r);
+}
+
+int ring_lookup(const ring_t *r, const char *key) {
+    if (r->n_points == 0) return -1;
+    size_t len;
+    const char *tag = ck_hash_tag(key, &len);
+    uint32_t h = ring_hash(tag, len);
+    size_t lo = 0, hi = r->n_points;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (r->points[mid].hash < h) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return r->points[lo == r->n_points ? 0 : lo].node;
+}
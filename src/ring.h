@@ -0,0 +1,33 @@
+#ifndef CK_RING_H
+#define CK_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* consistent hashing (cachekit-proxy): each node is placed on a 32-bit
+ * ring at `vnodes` points, the hashes of "<name>#<i>", and a key belongs
+ * to the first point at or after its own hash. adding or removing a node
+ * only moves the keys of the arcs it gains or loses, about 1/n of them,
+ * and the many points per node keep the arcs even. keys are hashed by
+ * their hash tag (ck_hash_tag), so {user1}:a and {user1}:b stay together */
+
+#define CK_RING_DEFAULT_VNODES 160
+
+typedef struct {
+    uint32_t hash;
+    int node;
+} ring_point_t;
+
+typedef struct {
+    ring_point_t *points;  /* sorted by hash */
+    size_t n_points;
+    int n_nodes;
+} ring_t;
+
+ring_t *ring_create(const char *const *nodes, int n_nodes, int vnodes);
+void ring_destroy(ring_t *r);
+
+/* index in nodes of the node that owns key */
+int ring_lookup(const ring_t *r, const char *key);
+
+#endif
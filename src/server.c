@@ -1,6 +1,11 @@
 #define _POSIX_C_SOURCE 200112L
 #include "server.h"
 #include "protocol.h"
+#include "aof.h"
+#include "child.h"
+#include "eviction.h"
+#include "persistence.h"
+#include "replication.h"
 #include "util.h"
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +33,8 @@ typedef int ck_socket_t;
 
 #define MAX_CLIENTS 64
 #define CLIENT_READ_BUF 4096
+#define CLIENT_OUT_BATCH (64 * 1024)  /* replies queued before reading waits */
+#define CRON_INTERVAL_MS 100
 
 typedef struct {
     ck_socket_t fd;
@@ -35,6 +42,7 @@ typedef struct {
     resp_buf_t out_buf;
     size_t out_sent;
     int has_pending_write;
+    int asking;  /* sent ASKING: the next command may use an importing slot */
 } client_t;
 
 static client_t clients[MAX_CLIENTS];
@@ -50,6 +58,7 @@ static void client_clear(client_t *c) {
     resp_buf_destroy(&c->out_buf);
     c->out_sent = 0;
     c->has_pending_write = 0;
+    c->asking = 0;
 }
 
 static void client_init(client_t *c) {
@@ -58,6 +67,7 @@ static void client_init(client_t *c) {
     resp_buf_init(&c->out_buf);
     c->out_sent = 0;
     c->has_pending_write = 0;
+    c->asking = 0;
 }
 
 static int accept_new_client(server_config_t *config, command_ctx_t *ctx) {
@@ -93,17 +103,76 @@ static void remove_client(int i, command_ctx_t *ctx) {
     ctx->connected_clients = n_clients;
 }
 
-/* parse one command and set response; returns 1 if had a command, 0 otherwise */
-static int parse_and_dispatch(client_t *c, command_ctx_t *ctx) {
-    resp_value_t *cmd = NULL;
-    if (resp_parse(&c->parser, &cmd) != 1) return 0;
-    resp_buf_destroy(&c->out_buf);
-    resp_buf_init(&c->out_buf);
-    command_dispatch(ctx, cmd, &c->out_buf);
-    resp_value_free(cmd);
-    c->out_sent = 0;
-    c->has_pending_write = 1;
-    return 1;
+/* parser and reply buffers are sized by their peak use, so sum them
+ * for INFO / MEMORY STATS once per loop iteration */
+static void update_client_memory(command_ctx_t *ctx) {
+    size_t total = 0;
+    for (int i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd == CK_INVALID_SOCKET) continue;
+        total += ck_malloc_size(clients[i].parser.buf) +
+                 ck_malloc_size(clients[i].out_buf.buf);
+    }
+    ctx->client_buffers_memory = total;
+}
+
+/* periodic work that must not wait for client traffic */
+static void server_cron(command_ctx_t *ctx) {
+    child_result_t res;
+    if (child_poll(&res)) {
+        if (res.type == CK_CHILD_RDB) {
+            persistence_bgsave_done(res.ok, res.cow_bytes, res.duration_ms);
+        } else if (res.type == CK_CHILD_AOF) {
+            aof_rewrite_done(res.ok, res.cow_bytes, res.duration_ms);
+        }
+    }
+    persistence_cron(ctx->store, ctx->rdb_filename);
+    aof_cron(ctx->store);
+    repl_cron();
+    int locked = store_lock(ctx->store);
+    eviction_cron(ctx->store);
+    store_unlock(ctx->store, locked);
+}
+
+/* send whatever is still owed to the client, waiting for it to go out */
+static int send_pending(client_t *c) {
+    while (c->out_sent < c->out_buf.len) {
+        size_t remaining = c->out_buf.len - c->out_sent;
+#ifdef _WIN32
+        int n = send((SOCKET)c->fd, c->out_buf.buf + c->out_sent, (int)remaining, 0);
+#else
+        ssize_t n = send(c->fd, c->out_buf.buf + c->out_sent, remaining, 0);
+#endif
+        if (n <= 0) return -1;
+        c->out_sent += (size_t)n;
+    }
+    return 0;
+}
+
+/* run the commands the client has sent, appending each reply after the
+ * last, until the parser runs dry or CLIENT_OUT_BATCH bytes of replies
+ * wait to be sent; the rest is taken up once they are. a replica's PSYNC
+ * hands the socket over to replication, after the replies before it,
+ * and leaves the client without one, to be removed */
+static void process_input(client_t *c, command_ctx_t *ctx) {
+    while (c->out_buf.len - c->out_sent < CLIENT_OUT_BATCH) {
+        resp_value_t *cmd = NULL;
+        if (resp_parse(&c->parser, &cmd) != 1) break;
+        if (repl_takes_over(cmd)) {
+            if (send_pending(c) == 0) {
+                repl_attach_replica((int)c->fd, cmd);
+            } else {
+                ck_close(c->fd);
+            }
+            resp_value_free(cmd);
+            c->fd = CK_INVALID_SOCKET;
+            return;
+        }
+        ctx->asking = c->asking;
+        command_dispatch(ctx, cmd, &c->out_buf);
+        c->asking = ctx->asking;
+        resp_value_free(cmd);
+    }
+    c->has_pending_write = c->out_sent < c->out_buf.len;
 }
 
 static int do_read(client_t *c, command_ctx_t *ctx) {
@@ -116,31 +185,31 @@ static int do_read(client_t *c, command_ctx_t *ctx) {
     if (n <= 0) return -1;
 
     resp_parser_feed(&c->parser, buf, (size_t)n);
-    parse_and_dispatch(c, ctx);
-    return 0;
+    process_input(c, ctx);
+    return c->fd == CK_INVALID_SOCKET ? -1 : 0;
 }
 
-/* returns 0 on success, -1 on error. after send completes, drain parser for pipelined commands */
+/* returns 0 on success, -1 on error. once the replies are all sent the
+ * buffer is dropped (it is sized by its peak) and the commands held back
+ * behind them run */
 static int do_write(client_t *c, command_ctx_t *ctx) {
-    if (!c->has_pending_write || c->out_sent >= c->out_buf.len) {
-        c->has_pending_write = 0;
-        if (c->out_sent >= c->out_buf.len && c->out_buf.len > 0)
-            parse_and_dispatch(c, ctx);
-        return 0;
-    }
-    size_t remaining = c->out_buf.len - c->out_sent;
+    if (c->out_sent < c->out_buf.len) {
+        size_t remaining = c->out_buf.len - c->out_sent;
 #ifdef _WIN32
-    int n = send((SOCKET)c->fd, c->out_buf.buf + c->out_sent, (int)remaining, 0);
+        int n = send((SOCKET)c->fd, c->out_buf.buf + c->out_sent, (int)remaining, 0);
 #else
-    ssize_t n = send(c->fd, c->out_buf.buf + c->out_sent, remaining, 0);
+        ssize_t n = send(c->fd, c->out_buf.buf + c->out_sent, remaining, 0);
 #endif
-    if (n <= 0) return -1;
-    c->out_sent += (size_t)n;
+        if (n <= 0) return -1;
+        c->out_sent += (size_t)n;
+    }
     if (c->out_sent >= c->out_buf.len) {
-        c->has_pending_write = 0;
-        parse_and_dispatch(c, ctx);
+        resp_buf_destroy(&c->out_buf);
+        resp_buf_init(&c->out_buf);
+        c->out_sent = 0;
     }
-    return 0;
+    process_input(c, ctx);
+    return c->fd == CK_INVALID_SOCKET ? -1 : 0;
 }
 
 void server_run(server_config_t *config, command_ctx_t *ctx) {
@@ -197,8 +266,27 @@ void server_run(server_config_t *config, command_ctx_t *ctx) {
     for (int i = 0; i < MAX_CLIENTS; i++)
         clients[i].fd = CK_INVALID_SOCKET;
     n_clients = 0;
+    int64_t next_cron = ck_time_ms() + CRON_INTERVAL_MS;
 
     for (;;) {
+        int64_t now = ck_time_ms();
+        if (now >= next_cron) {
+            server_cron(ctx);
+            next_cron = now + CRON_INTERVAL_MS;
+        } else if (ctx->store->eviction_in_progress) {
+            /* an unfinished eviction gets a slice per loop iteration,
+             * interleaved with client I/O */
+            int locked = store_lock(ctx->store);
+            eviction_perform(ctx->store);
+            store_unlock(ctx->store, locked);
+        }
+
+        /* replies are only sent after the next select(), so writing the
+         * log here puts every command of the last iteration on disk (and,
+         * with appendfsync always, synced by one fsync) before its reply */
+        aof_flush();
+        update_client_memory(ctx);
+
         fd_set rd, wr;
         FD_ZERO(&rd);
         FD_ZERO(&wr);
@@ -225,12 +313,19 @@ void server_run(server_config_t *config, command_ctx_t *ctx) {
             if (clients[i].fd > max_fd) max_fd = clients[i].fd;
 #endif
         }
+#ifdef _WIN32
+        max_fd = (ck_socket_t)repl_fdset(&rd, &wr, (int)max_fd);
+#else
+        max_fd = repl_fdset(&rd, &wr, max_fd);
+#endif
 
+        /* wake up in time for the next cron run */
+        int64_t wait_ms = next_cron - ck_time_ms();
+        if (wait_ms < 0 || ctx->store->eviction_in_progress) wait_ms = 0;
+        struct timeval tv = { (long)(wait_ms / 1000), (long)(wait_ms % 1000) * 1000 };
 #ifdef _WIN32
-        struct timeval tv = { 1, 0 };
         int n = select((int)(max_fd + 1), &rd, &wr, NULL, &tv);
 #else
-        struct timeval tv = { 1, 0 };
         int n = select(max_fd + 1, &rd, &wr, NULL, &tv);
 #endif
 
@@ -273,6 +368,7 @@ void server_run(server_config_t *config, command_ctx_t *ctx) {
                 }
             }
         }
+        repl_handle(&rd, &wr);
     }
 
     for (int i = 0; i < MAX_CLIENTS; i++) {
@@ -1,25 +1,36 @@
 #include "store.h"
+#include "fmap.h"
+#include "lazyfree.h"
 #include "util.h"
+#include <pthread.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
 
 static int64_t now_ms(void) {
-    struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
-    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    return ck_wall_time_ms();
+}
+
+/* a value loaded from a snapshot may still point into its mapping; it is
+ * never changed in place, only dropped or replaced */
+static void free_str(store_entry_t *e) {
+    if (e->str_mapped) {
+        fmap_release(e->str);
+        e->str_mapped = 0;
+    } else {
+        ck_free(e->str);
+    }
 }
 
 static void free_entry(void *ptr) {
     store_entry_t *e = (store_entry_t *)ptr;
     if (!e) return;
 
-    ck_mem_track_free(e->mem_usage);
-
     switch (e->type) {
         case CK_STRING:
-            free(e->str);
+            free_str(e);
             break;
         case CK_INT:
             break;
@@ -30,20 +41,588 @@ static void free_entry(void *ptr) {
             ht_destroy(e->hash);
             break;
     }
-    free(e);
+    ck_free(e);
+}
+
+static void free_table(void *ptr) {
+    ht_destroy((hashtable_t *)ptr);
+}
+
+/* average the first `samples` elements and scale by the element count;
+ * samples == 0 walks the whole value */
+static size_t list_memory(list_t *list, size_t samples) {
+    size_t total = ck_malloc_size(list);
+    size_t seen = 0, elem = 0;
+    for (list_node_t *n = list->head; n; n = n->next) {
+        if (samples && seen == samples) break;
+        elem += ck_malloc_size(n) + ck_malloc_size(n->value);
+        seen++;
+    }
+    if (seen) total += elem / seen * list->length;
+    return total;
+}
+
+static size_t hash_memory(hashtable_t *hash, size_t samples) {
+    size_t total = ht_mem_overhead(hash);
+    size_t seen = 0, elem = 0;
+
+    ht_iter_t iter;
+    ht_iter_init(&iter, hash);
+    const char *field;
+    void *val;
+    while (ht_iter_next(&iter, &field, &val)) {
+        if (samples && seen == samples) break;
+        elem += ck_malloc_size((void *)field) + ck_malloc_size(val);
+        seen++;
+    }
+    if (seen) total += elem / seen * ht_count(hash);
+    return total;
+}
+
+/* entry header plus value, without the key */
+static size_t entry_memory(store_entry_t *e, size_t samples) {
+    size_t total = ck_malloc_size(e);
+    switch (e->type) {
+        case CK_STRING:
+            total += e->str_mapped ? strlen(e->str) + 1 : ck_malloc_size(e->str);
+            break;
+        case CK_INT:
+            break;
+        case CK_LIST:
+            total += list_memory(e->list, samples);
+            break;
+        case CK_HASH:
+            total += hash_memory(e->hash, samples);
+            break;
+    }
+    return total;
+}
+
+/* estimate for a whole keyspace table from a handful of random keys */
+static size_t table_memory(hashtable_t *ht) {
+    size_t n = ht_count(ht);
+    size_t seen = 0, sum = 0;
+    for (int i = 0; i < 16 && n > 0; i++) {
+        const char *key;
+        if (!ht_random_key(ht, &key)) break;
+        sum += ck_malloc_size((void *)key) + entry_memory(ht_get(ht, key), 5);
+        seen++;
+    }
+    return ht_mem_overhead(ht) + (seen ? sum / seen * n : 0);
+}
+
+/* number of allocations behind a value, i.e. how long freeing it takes */
+static size_t free_effort(store_entry_t *e) {
+    switch (e->type) {
+        case CK_LIST: return list_length(e->list);
+        case CK_HASH: return ht_count(e->hash);
+        default:      return 1;
+    }
+}
+
+/* release a value already detached from the keyspace. with `lazy`, big
+ * containers are handed to the lazyfree thread instead of blocking here */
+static void release_entry(store_entry_t *e, int lazy) {
+    if (lazy && lazyfree_running() && free_effort(e) > CK_LAZYFREE_THRESHOLD) {
+        lazyfree_submit(free_entry, e, entry_memory(e, 5));
+    } else {
+        free_entry(e);
+    }
+}
+
+static store_entry_t *new_entry_at(ck_type_t type, int64_t now) {
+    store_entry_t *e = ck_malloc(sizeof(store_entry_t));
+    e->type = type;
+    e->lfu_counter = CK_LFU_INIT_VAL;
+    e->str_mapped = 0;
+    e->delta_dirty = 0;
+    e->snap_bit = 0;
+    e->key = NULL;
+    e->expire_at = 0;
+    e->last_access = now;
+    e->lru.prev = NULL;
+    e->lru.next = NULL;
+    e->lru.value = e;
+    e->slot_node.prev = NULL;
+    e->slot_node.next = NULL;
+    e->slot_node.value = NULL;
+    return e;
+}
+
+static store_entry_t *new_entry(ck_type_t type) {
+    return new_entry_at(type, now_ms());
+}
+
+static void volatile_add(store_t *s, store_entry_t *e) {
+    if (s->volatile_count == s->volatile_cap) {
+        s->volatile_cap = s->volatile_cap ? s->volatile_cap * 2 : 64;
+        s->volatile_keys = ck_realloc(s->volatile_keys,
+                                      sizeof(store_entry_t *) * s->volatile_cap);
+    }
+    e->volatile_idx = s->volatile_count;
+    s->volatile_keys[s->volatile_count++] = e;
+}
+
+/* swap with the last slot so removal stays O(1) */
+static void volatile_remove(store_t *s, store_entry_t *e) {
+    store_entry_t *last = s->volatile_keys[--s->volatile_count];
+    s->volatile_keys[e->volatile_idx] = last;
+    last->volatile_idx = e->volatile_idx;
+}
+
+static void volatile_reset(store_t *s) {
+    ck_free(s->volatile_keys);
+    s->volatile_keys = NULL;
+    s->volatile_count = 0;
+    s->volatile_cap = 0;
+}
+
+static void set_expire_at(store_t *s, store_entry_t *e, int64_t when) {
+    if (e->expire_at == 0 && when != 0) volatile_add(s, e);
+    if (e->expire_at != 0 && when == 0) volatile_remove(s, e);
+    e->expire_at = when;
+}
+
+struct store_snapshot {
+    pthread_mutex_t lock;
+    hashtable_t *table;     /* the keyspace it was started on */
+    int own_table;          /* a flush replaced it; free it at the end */
+    ht_iter_t iter;
+    size_t remaining;       /* entries of the snapshot not visited yet */
+    size_t pass_visits;
+    int empty_passes;
+    char **keys;            /* only these keys, if set */
+    size_t n_keys;
+    size_t next_key;
+    store_visit_fn preimage;
+    void *arg;
+};
+
+/* hand the value of an entry to the running snapshot before it changes,
+ * unless the snapshot has it already */
+static void snapshot_preimage(store_t *s, const char *key, store_entry_t *e) {
+    store_snapshot_t *snap = s->snapshot;
+    if (!snap || e->snap_bit == s->snap_bit) return;
+    snap->preimage(snap->arg, key, e);
+    e->snap_bit = s->snap_bit;
+    snap->remaining--;
+}
+
+/* record a change for the next delta snapshot. e is NULL for a key that
+ * is gone */
+static void delta_mark(store_t *s, const char *key, store_entry_t *e) {
+    if (!s->delta_keys || (e && e->delta_dirty)) return;
+    if (e) e->delta_dirty = 1;
+    ht_set(s->delta_keys, key, (void *)(uintptr_t)s->delta_epoch);
+}
+
+/* detach an entry that is leaving the keyspace from the side indexes */
+static void unindex_entry(store_t *s, store_entry_t *e) {
+    if (s->newcomer == e) s->newcomer = NULL;
+    if (s->policy == CK_EVICT_ALLKEYS_LRU_EXACT) list_unlink_node(&s->lru, &e->lru);
+    if (e->expire_at != 0) volatile_remove(s, e);
+    if (s->slots) list_unlink_node(&s->slots[(uintptr_t)e->slot_node.value], &e->slot_node);
+}
+
+static void slot_link(store_t *s, const char *key, store_entry_t *e) {
+    unsigned slot = store_key_slot(key);
+    e->slot_node.value = (void *)(uintptr_t)slot;
+    list_link_head(&s->slots[slot], &e->slot_node);
+}
+
+static int delete_key(store_t *s, const char *key, int lazy) {
+    void *val;
+    /* before the unlink, which frees the table's copy of key */
+    if (s->delta_keys || s->snapshot) {
+        store_entry_t *e = ht_get(s->data, key);
+        if (e) {
+            snapshot_preimage(s, key, e);
+            delta_mark(s, key, NULL);
+        }
+    }
+    if (!ht_unlink(s->data, key, &val)) return 0;
+
+    store_entry_t *e = (store_entry_t *)val;
+    unindex_entry(s, e);
+    e->key = NULL;
+    release_entry(e, lazy);
+    return 1;
+}
+
+/* logarithmic increment: the more hits a key has, the less likely the
+ * next one is to count, so 8 bits cover millions of accesses */
+static uint8_t lfu_log_incr(store_t *s, uint8_t counter) {
+    if (counter == 255) return 255;
+    double base = counter > CK_LFU_INIT_VAL ? counter - CK_LFU_INIT_VAL : 0;
+    double p = 1.0 / (base * s->lfu_log_factor + 1);
+    if ((double)rand() / RAND_MAX < p) counter++;
+    return counter;
+}
+
+/* insert or overwrite; an overwritten value is released lazily. `owned`
+ * is a heap copy of key for the table to keep, or NULL to copy it */
+static void insert_entry_owned(store_t *s, const char *key, char *owned, store_entry_t *e) {
+    void *old;
+    if (owned) {
+        ht_replace_owned(s->data, owned, e, &old, &e->key);
+        key = e->key;
+    } else {
+        ht_replace(s->data, key, e, &old, &e->key);
+    }
+    e->snap_bit = s->snap_bit;
+    if (old) {
+        store_entry_t *prev = (store_entry_t *)old;
+        snapshot_preimage(s, key, prev);
+        unindex_entry(s, prev);
+        /* an overwrite is an access: the key keeps its frequency, decayed
+         * from its last access and bumped, rather than starting over */
+        int64_t now = e->last_access;
+        e->lfu_counter = prev->lfu_counter;
+        e->last_access = prev->last_access;
+        if (store_policy_is_lfu(s->policy)) {
+            e->lfu_counter = lfu_log_incr(s, store_lfu_counter(s, e));
+        }
+        e->last_access = now;
+    }
+    if (s->admission && !old) s->newcomer = e;
+    if (s->policy == CK_EVICT_ALLKEYS_LRU_EXACT) list_link_head(&s->lru, &e->lru);
+    if (s->slots) slot_link(s, key, e);
+    if (old) release_entry((store_entry_t *)old, 1);
+}
+
+static void insert_entry(store_t *s, const char *key, store_entry_t *e) {
+    insert_entry_owned(s, key, NULL, e);
+    delta_mark(s, key, e);
+}
+
+static int cmp_last_access(const void *a, const void *b) {
+    int64_t x = (*(store_entry_t *const *)a)->last_access;
+    int64_t y = (*(store_entry_t *const *)b)->last_access;
+    return (x > y) - (x < y);
+}
+
+/* thread every key into the recency list, most recently used at the head */
+static void rebuild_lru(store_t *s) {
+    memset(&s->lru, 0, sizeof(s->lru));
+    size_t n = ht_count(s->data);
+    if (n == 0) return;
+
+    store_entry_t **all = ck_malloc(sizeof(store_entry_t *) * n);
+    ht_iter_t iter;
+    ht_iter_init(&iter, s->data);
+    void *val;
+    size_t i = 0;
+    while (ht_iter_next(&iter, NULL, &val) && i < n) {
+        all[i++] = (store_entry_t *)val;
+    }
+
+    qsort(all, i, sizeof(store_entry_t *), cmp_last_access);
+    for (size_t j = 0; j < i; j++) {
+        list_link_head(&s->lru, &all[j]->lru);
+    }
+    ck_free(all);
+}
+
+/* candidates from another keyspace or policy would only go stale */
+static void evict_pool_reset(store_t *s) {
+    for (int i = 0; i < CK_EVPOOL_SIZE; i++) {
+        store_evict_candidate_t *c = &s->evict_pool[i];
+        if (c->key != c->cached) ck_free(c->key);
+        c->key = NULL;
+    }
 }
 
 store_t *store_create(void) {
     store_t *s = ck_malloc(sizeof(store_t));
     s->data = ht_create(64, free_entry);
     s->maxmemory = 0;
+    s->policy = CK_EVICT_ALLKEYS_LRU;
+    memset(&s->lru, 0, sizeof(s->lru));
+    s->lfu_log_factor = CK_LFU_LOG_FACTOR;
+    s->lfu_decay_time = CK_LFU_DECAY_TIME;
+    s->volatile_keys = NULL;
+    s->volatile_count = 0;
+    s->volatile_cap = 0;
+    s->maxmemory_samples = CK_MAXMEMORY_SAMPLES;
+    for (int i = 0; i < CK_EVPOOL_SIZE; i++) {
+        s->evict_pool[i].key = NULL;
+        s->evict_pool[i].cached = s->evict_pool_keys[i];
+    }
+    s->evicted_keys = 0;
+    s->keyspace_hits = 0;
+    s->keyspace_misses = 0;
+    s->expired_keys = 0;
+    s->eviction_tenacity = CK_EVICTION_TENACITY;
+    s->maxmemory_hard = 0;
+    s->eviction_in_progress = 0;
+    s->eviction_time_exceeded = 0;
+    s->admission = NULL;
+    s->newcomer = NULL;
+    s->admission_rejected = 0;
+    s->bulk_clock = 0;
+    s->delta_keys = NULL;
+    s->delta_epoch = 1;
+    s->delta_flush_epoch = 0;
+    s->slots = NULL;
+    s->snapshot = NULL;
+    s->snap_bit = 0;
+    s->on_removed = NULL;
+    s->on_removed_arg = NULL;
     return s;
 }
 
+void store_set_policy(store_t *s, ck_evict_policy_t policy) {
+    if (policy == s->policy) return;
+    s->policy = policy;
+    evict_pool_reset(s);
+    if (policy == CK_EVICT_ALLKEYS_LRU_EXACT) {
+        rebuild_lru(s);
+    } else {
+        memset(&s->lru, 0, sizeof(s->lru));
+    }
+}
+
+void store_set_admission(store_t *s, int enabled) {
+    if (enabled && !s->admission) {
+        s->admission = tinylfu_create(ht_count(s->data));
+    } else if (!enabled && s->admission) {
+        tinylfu_destroy(s->admission);
+        s->admission = NULL;
+        s->newcomer = NULL;
+    }
+}
+
+unsigned store_key_slot(const char *key) {
+    size_t len;
+    const char *tag = ck_hash_tag(key, &len);
+    return ck_crc16(tag, len) & (CK_CLUSTER_SLOTS - 1);
+}
+
+void store_slot_index(store_t *s, int enabled) {
+    if (enabled && !s->slots) {
+        s->slots = ck_calloc(CK_CLUSTER_SLOTS, sizeof(list_t));
+        ht_iter_t iter;
+        ht_iter_init(&iter, s->data);
+        const char *key;
+        void *val;
+        while (ht_iter_next(&iter, &key, &val)) slot_link(s, key, (store_entry_t *)val);
+    } else if (!enabled && s->slots) {
+        ck_free(s->slots);
+        s->slots = NULL;
+    }
+}
+
+size_t store_slot_count(store_t *s, unsigned slot) {
+    return s->slots && slot < CK_CLUSTER_SLOTS ? s->slots[slot].length : 0;
+}
+
+int store_slot_keys(store_t *s, unsigned slot, size_t max, char ***out, int *count) {
+    size_t n = store_slot_count(s, slot);
+    if (n > max) n = max;
+    char **keys = ck_malloc(sizeof(char *) * (n ? n : 1));
+    size_t i = 0;
+    for (list_node_t *node = n ? s->slots[slot].head : NULL; node && i < n; node = node->next) {
+        store_entry_t *e = (store_entry_t *)((char *)node - offsetof(store_entry_t, slot_node));
+        keys[i++] = ck_strdup(e->key);
+    }
+    *out = keys;
+    *count = (int)i;
+    return 0;
+}
+
 void store_destroy(store_t *store) {
     if (!store) return;
     ht_destroy(store->data);
-    free(store);
+    ck_free(store->slots);
+    volatile_reset(store);
+    evict_pool_reset(store);
+    tinylfu_destroy(store->admission);
+    if (store->delta_keys) ht_destroy(store->delta_keys);
+    ck_free(store);
+}
+
+void store_bulk_begin(store_t *s, size_t keys) {
+    ht_reserve(s->data, ht_count(s->data) + keys);
+    s->bulk_clock = now_ms();
+}
+
+store_entry_t *store_entry_new(ck_type_t type, size_t elements, int64_t now) {
+    store_entry_t *e = new_entry_at(type, now);
+    switch (type) {
+        case CK_STRING:
+            e->str = NULL;
+            break;
+        case CK_INT:
+            e->integer = 0;
+            break;
+        case CK_LIST:
+            e->list = list_create(ck_free);
+            break;
+        case CK_HASH:
+            e->hash = ht_create(16, ck_free);
+            ht_reserve(e->hash, elements);
+            break;
+    }
+    return e;
+}
+
+void store_entry_free(store_entry_t *e) {
+    free_entry(e);
+}
+
+void store_bulk_insert(store_t *s, char *key, store_entry_t *e, int64_t expire_at) {
+    insert_entry_owned(s, NULL, key, e);
+    if (expire_at) set_expire_at(s, e, expire_at);
+}
+
+void store_bulk_end(store_t *s) {
+    s->bulk_clock = 0;
+}
+
+void store_delta_track(store_t *s, int enabled) {
+    if (enabled && !s->delta_keys) {
+        s->delta_keys = ht_create(64, NULL);
+    } else if (!enabled && s->delta_keys) {
+        store_delta_commit(s, store_delta_cut(s));
+        ht_destroy(s->delta_keys);
+        s->delta_keys = NULL;
+    }
+}
+
+uint64_t store_delta_cut(store_t *s) {
+    if (s->delta_keys) {
+        ht_iter_t iter;
+        ht_iter_init(&iter, s->delta_keys);
+        const char *key;
+        while (ht_iter_next(&iter, &key, NULL)) {
+            store_entry_t *e = ht_get(s->data, key);
+            if (e) e->delta_dirty = 0;
+        }
+    }
+    return s->delta_epoch++;
+}
+
+void store_delta_commit(store_t *s, uint64_t cut) {
+    if (s->delta_flush_epoch && s->delta_flush_epoch <= cut) s->delta_flush_epoch = 0;
+    if (!s->delta_keys) return;
+
+    /* keys changed again since the cut stay, under their newer epoch */
+    hashtable_t *keep = ht_create(64, NULL);
+    ht_iter_t iter;
+    ht_iter_init(&iter, s->delta_keys);
+    const char *key;
+    void *val;
+    while (ht_iter_next(&iter, &key, &val)) {
+        if ((uint64_t)(uintptr_t)val > cut) ht_set(keep, key, val);
+    }
+    ht_destroy(s->delta_keys);
+    s->delta_keys = keep;
+}
+
+size_t store_delta_count(store_t *s) {
+    return s->delta_keys ? ht_count(s->delta_keys) : 0;
+}
+
+void store_snapshot_begin(store_t *s, char **keys, size_t n, store_visit_fn preimage, void *arg) {
+    store_snapshot_t *snap = ck_malloc(sizeof(store_snapshot_t));
+    memset(snap, 0, sizeof(*snap));
+    pthread_mutex_init(&snap->lock, NULL);
+    snap->table = s->data;
+    snap->keys = keys;
+    snap->n_keys = n;
+    snap->preimage = preimage;
+    snap->arg = arg;
+
+    /* an entry is unvisited while its bit differs from the store's. every
+     * entry matches the store between snapshots, so flipping the store's
+     * bit takes in the whole keyspace */
+    if (keys) {
+        for (size_t i = 0; i < n; i++) {
+            store_entry_t *e = ht_get(s->data, keys[i]);
+            if (e && e->snap_bit == s->snap_bit) {
+                e->snap_bit ^= 1;
+                snap->remaining++;
+            }
+        }
+    } else {
+        s->snap_bit ^= 1;
+        snap->remaining = ht_count(s->data);
+        ht_iter_init(&snap->iter, s->data);
+    }
+    s->snapshot = snap;
+}
+
+size_t store_snapshot_next(store_t *s, store_visit_fn visit, void *arg, size_t max) {
+    store_snapshot_t *snap = s->snapshot;
+    size_t n = 0;
+    while (n < max && snap->remaining > 0) {
+        const char *key;
+        void *val;
+        if (snap->keys) {
+            if (snap->next_key == snap->n_keys) {
+                snap->remaining = 0;
+                break;
+            }
+            key = snap->keys[snap->next_key++];
+            if (!(val = ht_get(snap->table, key))) continue;
+        } else if (!ht_iter_next(&snap->iter, &key, &val)) {
+            /* deletes shift entries back and resizes move them anywhere,
+             * so some may have gone behind the cursor: go round again */
+            if (snap->pass_visits == 0 && ++snap->empty_passes == 2) {
+                ck_log(CK_LOG_ERROR, "snapshot lost track of %zu keys", snap->remaining);
+                snap->remaining = 0;
+                break;
+            }
+            if (snap->pass_visits) snap->empty_passes = 0;
+            snap->pass_visits = 0;
+            ht_iter_init(&snap->iter, snap->table);
+            continue;
+        }
+
+        store_entry_t *e = val;
+        if (e->snap_bit == s->snap_bit) continue;
+        visit(arg, key, e);
+        e->snap_bit = s->snap_bit;
+        snap->remaining--;
+        snap->pass_visits++;
+        n++;
+    }
+    return n;
+}
+
+static void skip_entry(void *arg, const char *key, const store_entry_t *e) {
+    (void)arg;
+    (void)key;
+    (void)e;
+}
+
+void store_snapshot_end(store_t *s) {
+    store_snapshot_t *snap = s->snapshot;
+    if (!snap) return;
+    /* anything left unvisited would look visited to the next snapshot */
+    store_snapshot_next(s, skip_entry, NULL, SIZE_MAX);
+    if (snap->own_table) {
+        if (lazyfree_running()) {
+            lazyfree_submit(free_table, snap->table, table_memory(snap->table));
+        } else {
+            ht_destroy(snap->table);
+        }
+    }
+    for (size_t i = 0; i < snap->n_keys; i++) ck_free(snap->keys[i]);
+    ck_free(snap->keys);
+    pthread_mutex_destroy(&snap->lock);
+    ck_free(snap);
+    s->snapshot = NULL;
+}
+
+int store_lock(store_t *s) {
+    if (!s->snapshot) return 0;
+    pthread_mutex_lock(&s->snapshot->lock);
+    return 1;
+}
+
+void store_unlock(store_t *s, int locked) {
+    if (locked) pthread_mutex_unlock(&s->snapshot->lock);
 }
 
 int store_is_expired(store_entry_t *e) {
@@ -51,48 +630,90 @@ int store_is_expired(store_entry_t *e) {
     return now_ms() >= e->expire_at;
 }
 
-/* lazy expiration: check and delete if expired, return NULL if so */
-static store_entry_t *check_expiry(store_t *s, const char *key) {
+uint8_t store_lfu_counter(store_t *s, store_entry_t *e) {
+    if (s->lfu_decay_time <= 0) return e->lfu_counter;
+
+    int64_t idle_min = (now_ms() - e->last_access) / 60000;
+    int64_t periods = idle_min / s->lfu_decay_time;
+    if (periods <= 0) return e->lfu_counter;
+    return periods >= e->lfu_counter ? 0 : (uint8_t)(e->lfu_counter - periods);
+}
+
+static void touch_entry(store_t *s, store_entry_t *e) {
+    if (store_policy_is_lfu(s->policy)) {
+        /* decay first: it is measured from the previous access */
+        e->lfu_counter = lfu_log_incr(s, store_lfu_counter(s, e));
+    }
+    e->last_access = now_ms();
+    if (s->policy == CK_EVICT_ALLKEYS_LRU_EXACT) list_move_to_head(&s->lru, &e->lru);
+}
+
+store_entry_t *store_random_volatile(store_t *s) {
+    if (s->volatile_count == 0) return NULL;
+    return s->volatile_keys[(size_t)rand() % s->volatile_count];
+}
+
+/* lazy expiration: delete key if it has expired, else its entry as is */
+static store_entry_t *find_live(store_t *s, const char *key) {
     store_entry_t *e = (store_entry_t *)ht_get(s->data, key);
     if (!e) return NULL;
 
     if (store_is_expired(e)) {
-        ht_delete(s->data, key);
+        store_key_removed(s, key);
+        delete_key(s, key, 1);
+        s->expired_keys++;
         return NULL;
     }
+    return e;
+}
 
-    e->last_access = now_ms();
+/* find_live, counting as an access for LRU/LFU */
+static store_entry_t *check_expiry(store_t *s, const char *key) {
+    store_entry_t *e = find_live(s, key);
+    if (e) touch_entry(s, e);
+    return e;
+}
+
+/* TinyLFU sees each client access of a key once, whatever the command:
+ * reads in lookup_read(), writes at the top of their entry point. misses
+ * count too: a key asked for often is worth admitting */
+static void record_access(store_t *s, const char *key) {
+    if (s->admission) tinylfu_record(s->admission, key);
+}
+
+/* check_expiry for the read commands, counted in keyspace_hits/misses */
+static store_entry_t *lookup_read(store_t *s, const char *key) {
+    record_access(s, key);
+    store_entry_t *e = check_expiry(s, key);
+    if (e) s->keyspace_hits++;
+    else s->keyspace_misses++;
     return e;
 }
 
 int store_set(store_t *s, const char *key, const char *value) {
-    store_entry_t *e = ck_malloc(sizeof(store_entry_t));
-    e->type = CK_STRING;
+    record_access(s, key);
+    store_entry_t *e = new_entry(CK_STRING);
     e->str = ck_strdup(value);
-    e->expire_at = 0;
-    e->last_access = now_ms();
-    e->mem_usage = sizeof(store_entry_t) + strlen(value) + 1 + strlen(key) + 1;
 
-    ck_mem_track_alloc(e->mem_usage);
-    ht_set(s->data, key, e);
+    insert_entry(s, key, e);
     return 0;
 }
 
-int store_set_int(store_t *s, const char *key, int64_t value) {
-    store_entry_t *e = ck_malloc(sizeof(store_entry_t));
-    e->type = CK_INT;
+static void set_int(store_t *s, const char *key, int64_t value) {
+    store_entry_t *e = new_entry(CK_INT);
     e->integer = value;
-    e->expire_at = 0;
-    e->last_access = now_ms();
-    e->mem_usage = sizeof(store_entry_t) + strlen(key) + 1;
 
-    ck_mem_track_alloc(e->mem_usage);
-    ht_set(s->data, key, e);
+    insert_entry(s, key, e);
+}
+
+int store_set_int(store_t *s, const char *key, int64_t value) {
+    record_access(s, key);
+    set_int(s, key, value);
     return 0;
 }
 
 const char *store_get(store_t *s, const char *key) {
-    store_entry_t *e = check_expiry(s, key);
+    store_entry_t *e = lookup_read(s, key);
     if (!e) return NULL;
     if (e->type != CK_STRING) return NULL;
     return e->str;
@@ -113,15 +734,27 @@ int store_get_int(store_t *s, const char *key, int64_t *out) {
 }
 
 store_entry_t *store_get_entry(store_t *s, const char *key) {
-    return check_expiry(s, key);
+    return lookup_read(s, key);
+}
+
+store_entry_t *store_peek(store_t *s, const char *key) {
+    return find_live(s, key);
+}
+
+void store_key_removed(store_t *s, const char *key) {
+    if (s->on_removed) s->on_removed(key, s->on_removed_arg);
 }
 
 int store_del(store_t *s, const char *key) {
-    return ht_delete(s->data, key);
+    return delete_key(s, key, 0);
+}
+
+int store_unlink(store_t *s, const char *key) {
+    return delete_key(s, key, 1);
 }
 
 int store_exists(store_t *s, const char *key) {
-    store_entry_t *e = check_expiry(s, key);
+    store_entry_t *e = lookup_read(s, key);
     return e != NULL;
 }
 
@@ -132,21 +765,22 @@ ck_type_t store_type(store_t *s, const char *key) {
 }
 
 int store_expire(store_t *s, const char *key, int64_t seconds) {
+    return store_expire_at(s, key, now_ms() + seconds * 1000);
+}
+
+int store_expire_at(store_t *s, const char *key, int64_t when_ms) {
     store_entry_t *e = check_expiry(s, key);
     if (!e) return 0;
-    e->expire_at = now_ms() + seconds * 1000;
+    snapshot_preimage(s, key, e);
+    set_expire_at(s, e, when_ms);
+    delta_mark(s, key, e);
     return 1;
 }
 
 int64_t store_ttl(store_t *s, const char *key) {
-    store_entry_t *e = (store_entry_t *)ht_get(s->data, key);
+    store_entry_t *e = find_live(s, key);
     if (!e) return -2; /* key not found */
 
-    if (store_is_expired(e)) {
-        ht_delete(s->data, key);
-        return -2;
-    }
-
     if (e->expire_at == 0) return -1; /* no expiry */
 
     int64_t remaining = (e->expire_at - now_ms()) / 1000;
@@ -156,7 +790,9 @@ int64_t store_ttl(store_t *s, const char *key) {
 int store_persist(store_t *s, const char *key) {
     store_entry_t *e = check_expiry(s, key);
     if (!e) return 0;
-    e->expire_at = 0;
+    snapshot_preimage(s, key, e);
+    set_expire_at(s, e, 0);
+    delta_mark(s, key, e);
     return 1;
 }
 
@@ -168,80 +804,69 @@ static store_entry_t *ensure_list(store_t *s, const char *key) {
         return e;
     }
 
-    e = ck_malloc(sizeof(store_entry_t));
-    e->type = CK_LIST;
-    e->list = list_create(free);
-    e->expire_at = 0;
-    e->last_access = now_ms();
-    e->mem_usage = sizeof(store_entry_t) + sizeof(list_t) + strlen(key) + 1;
+    e = new_entry(CK_LIST);
+    e->list = list_create(ck_free);
 
-    ck_mem_track_alloc(e->mem_usage);
-    ht_set(s->data, key, e);
+    insert_entry(s, key, e);
     return e;
 }
 
 int store_lpush(store_t *s, const char *key, const char *value) {
+    record_access(s, key);
     store_entry_t *e = ensure_list(s, key);
     if (!e) return -1;
-    char *v = ck_strdup(value);
-    size_t added = strlen(value) + 1 + sizeof(list_node_t);
-    e->mem_usage += added;
-    ck_mem_track_alloc(added);
-    list_lpush(e->list, v);
+    snapshot_preimage(s, key, e);
+    list_lpush(e->list, ck_strdup(value));
+    delta_mark(s, key, e);
     return (int)list_length(e->list);
 }
 
 int store_rpush(store_t *s, const char *key, const char *value) {
+    record_access(s, key);
     store_entry_t *e = ensure_list(s, key);
     if (!e) return -1;
-    char *v = ck_strdup(value);
-    size_t added = strlen(value) + 1 + sizeof(list_node_t);
-    e->mem_usage += added;
-    ck_mem_track_alloc(added);
-    list_rpush(e->list, v);
+    snapshot_preimage(s, key, e);
+    list_rpush(e->list, ck_strdup(value));
+    delta_mark(s, key, e);
     return (int)list_length(e->list);
 }
 
 char *store_lpop(store_t *s, const char *key) {
+    record_access(s, key);
     store_entry_t *e = check_expiry(s, key);
     if (!e || e->type != CK_LIST) return NULL;
+    snapshot_preimage(s, key, e);
     char *v = (char *)list_lpop(e->list);
-    if (v) {
-        size_t freed = strlen(v) + 1 + sizeof(list_node_t);
-        e->mem_usage -= freed;
-        ck_mem_track_free(freed);
-    }
+    delta_mark(s, key, e);
     /* auto-delete empty list keys */
     if (list_length(e->list) == 0) {
-        ht_delete(s->data, key);
+        delete_key(s, key, 0);
     }
     return v;
 }
 
 char *store_rpop(store_t *s, const char *key) {
+    record_access(s, key);
     store_entry_t *e = check_expiry(s, key);
     if (!e || e->type != CK_LIST) return NULL;
+    snapshot_preimage(s, key, e);
     char *v = (char *)list_rpop(e->list);
-    if (v) {
-        size_t freed = strlen(v) + 1 + sizeof(list_node_t);
-        e->mem_usage -= freed;
-        ck_mem_track_free(freed);
-    }
+    delta_mark(s, key, e);
     if (list_length(e->list) == 0) {
-        ht_delete(s->data, key);
+        delete_key(s, key, 0);
     }
     return v;
 }
 
 int store_lrange(store_t *s, const char *key, int start, int stop,
                  char **out, int max_out) {
-    store_entry_t *e = check_expiry(s, key);
+    store_entry_t *e = lookup_read(s, key);
     if (!e || e->type != CK_LIST) return 0;
     return list_range(e->list, start, stop, (void **)out, max_out);
 }
 
 int store_llen(store_t *s, const char *key) {
-    store_entry_t *e = check_expiry(s, key);
+    store_entry_t *e = lookup_read(s, key);
     if (!e || e->type != CK_LIST) return 0;
     return (int)list_length(e->list);
 }
@@ -254,53 +879,46 @@ static store_entry_t *ensure_hash(store_t *s, const char *key) {
         return e;
     }
 
-    e = ck_malloc(sizeof(store_entry_t));
-    e->type = CK_HASH;
-    e->hash = ht_create(16, free);
-    e->expire_at = 0;
-    e->last_access = now_ms();
-    e->mem_usage = sizeof(store_entry_t) + sizeof(hashtable_t) + strlen(key) + 1;
+    e = new_entry(CK_HASH);
+    e->hash = ht_create(16, ck_free);
 
-    ck_mem_track_alloc(e->mem_usage);
-    ht_set(s->data, key, e);
+    insert_entry(s, key, e);
     return e;
 }
 
 int store_hset(store_t *s, const char *key, const char *field, const char *value) {
+    record_access(s, key);
     store_entry_t *e = ensure_hash(s, key);
     if (!e) return -1;
 
-    int is_new = !ht_exists(e->hash, field);
-    char *v = ck_strdup(value);
-    ht_set(e->hash, field, v);
-
-    if (is_new) {
-        size_t added = strlen(field) + 1 + strlen(value) + 1;
-        e->mem_usage += added;
-        ck_mem_track_alloc(added);
-    }
-    return is_new ? 1 : 0;
+    snapshot_preimage(s, key, e);
+    delta_mark(s, key, e);
+    return ht_set(e->hash, field, ck_strdup(value));
 }
 
 char *store_hget(store_t *s, const char *key, const char *field) {
-    store_entry_t *e = check_expiry(s, key);
+    store_entry_t *e = lookup_read(s, key);
     if (!e || e->type != CK_HASH) return NULL;
     return (char *)ht_get(e->hash, field);
 }
 
 int store_hdel(store_t *s, const char *key, const char *field) {
+    record_access(s, key);
     store_entry_t *e = check_expiry(s, key);
     if (!e || e->type != CK_HASH) return 0;
+    if (!ht_exists(e->hash, field)) return 0;
+    snapshot_preimage(s, key, e);
     int deleted = ht_delete(e->hash, field);
+    if (deleted) delta_mark(s, key, e);
 
     if (deleted && ht_count(e->hash) == 0) {
-        ht_delete(s->data, key);
+        delete_key(s, key, 0);
     }
     return deleted;
 }
 
 int store_hgetall(store_t *s, const char *key, char ***fields, char ***values, int *count) {
-    store_entry_t *e = check_expiry(s, key);
+    store_entry_t *e = lookup_read(s, key);
     if (!e || e->type != CK_HASH) {
         *count = 0;
         return 0;
@@ -326,11 +944,14 @@ int store_hgetall(store_t *s, const char *key, char ***fields, char ***values, i
     return 0;
 }
 
-int store_incr(store_t *s, const char *key, int64_t *result) {
+/* update the counter in place so the entry keeps its TTL and no second
+ * entry gets allocated; a numeric string is converted to CK_INT */
+static int incr_by(store_t *s, const char *key, int64_t delta, int64_t *result) {
+    record_access(s, key);
     store_entry_t *e = check_expiry(s, key);
     if (!e) {
-        store_set_int(s, key, 1);
-        *result = 1;
+        set_int(s, key, delta);
+        *result = delta;
         return 0;
     }
 
@@ -343,42 +964,84 @@ int store_incr(store_t *s, const char *key, int64_t *result) {
         return -1;
     }
 
-    val++;
-    store_set_int(s, key, val);
+    snapshot_preimage(s, key, e);
+    if (e->type == CK_STRING) {
+        free_str(e);
+        e->type = CK_INT;
+    }
+
+    val += delta;
+    e->integer = val;
+    delta_mark(s, key, e);
     *result = val;
     return 0;
 }
 
-int store_decr(store_t *s, const char *key, int64_t *result) {
-    store_entry_t *e = check_expiry(s, key);
-    if (!e) {
-        store_set_int(s, key, -1);
-        *result = -1;
-        return 0;
-    }
-
-    int64_t val;
-    if (e->type == CK_INT) {
-        val = e->integer;
-    } else if (e->type == CK_STRING) {
-        if (ck_str_to_int64(e->str, &val) != 0) return -1;
-    } else {
-        return -1;
-    }
+int store_incr(store_t *s, const char *key, int64_t *result) {
+    return incr_by(s, key, 1, result);
+}
 
-    val--;
-    store_set_int(s, key, val);
-    *result = val;
-    return 0;
+int store_decr(store_t *s, const char *key, int64_t *result) {
+    return incr_by(s, key, -1, result);
 }
 
 size_t store_dbsize(store_t *s) {
     return ht_count(s->data);
 }
 
+/* a flush can't be expressed as a delta; the next snapshot has to be a
+ * full one */
+static void delta_flushed(store_t *s) {
+    if (!s->delta_keys) return;
+    ht_destroy(s->delta_keys);
+    s->delta_keys = ht_create(64, NULL);
+    s->delta_flush_epoch = s->delta_epoch;
+}
+
+/* a running snapshot still reads the keyspace a flush drops, so it takes
+ * the table over instead. returns whether it did */
+static int snapshot_keep(store_t *s, hashtable_t *old) {
+    store_snapshot_t *snap = s->snapshot;
+    if (!snap || snap->table != old) return 0;
+    snap->own_table = 1;
+    return 1;
+}
+
 void store_flushdb(store_t *s) {
-    ht_destroy(s->data);
+    hashtable_t *old = s->data;
+    if (!snapshot_keep(s, old)) ht_destroy(old);
     s->data = ht_create(64, free_entry);
+    memset(&s->lru, 0, sizeof(s->lru));
+    if (s->slots) memset(s->slots, 0, sizeof(list_t) * CK_CLUSTER_SLOTS);
+    volatile_reset(s);
+    evict_pool_reset(s);
+    s->newcomer = NULL;
+    delta_flushed(s);
+}
+
+void store_flushdb_async(store_t *s) {
+    hashtable_t *old = s->data;
+    s->data = ht_create(64, free_entry);
+    memset(&s->lru, 0, sizeof(s->lru));
+    if (s->slots) memset(s->slots, 0, sizeof(list_t) * CK_CLUSTER_SLOTS);
+    volatile_reset(s);
+    evict_pool_reset(s);
+    s->newcomer = NULL;
+    delta_flushed(s);
+    if (!snapshot_keep(s, old)) lazyfree_submit(free_table, old, table_memory(old));
+}
+
+size_t store_memory_usage(store_t *s, const char *key, size_t samples) {
+    store_entry_t *e = check_expiry(s, key);
+    if (!e) return 0;
+
+    return sizeof(ht_entry_t) + ck_malloc_size((void *)e->key) + entry_memory(e, samples);
+}
+
+size_t store_overhead(store_t *s) {
+    size_t total = ck_malloc_size(s) + ht_mem_overhead(s->data);
+    if (s->admission) total += tinylfu_memory(s->admission);
+    return total;
 }
 
 int store_keys(store_t *s, const char *pattern, char ***out, int *count) {
@@ -417,10 +1080,12 @@ int store_expire_cycle(store_t *s, int sample_size) {
 
         store_entry_t *e = (store_entry_t *)ht_get(s->data, key);
         if (e && store_is_expired(e)) {
-            /* need to copy key since ht_delete will free it */
+            /* need to copy key since delete_key will free it */
             char *key_copy = ck_strdup(key);
-            ht_delete(s->data, key_copy);
-            free(key_copy);
+            store_key_removed(s, key_copy);
+            delete_key(s, key_copy, 1);
+            ck_free(key_copy);
+            s->expired_keys++;
             expired++;
         }
     }
@@ -3,6 +3,7 @@
 
 #include "hashtable.h"
 #include "list.h"
+#include "tinylfu.h"
 #include <stdint.h>
 #include <stddef.h>
 
@@ -13,8 +14,54 @@ typedef enum {
     CK_HASH
 } ck_type_t;
 
+/* what eviction_run() picks when maxmemory is exceeded */
+typedef enum {
+    CK_EVICT_ALLKEYS_LRU,        /* approximate: oldest of a random sample */
+    CK_EVICT_ALLKEYS_LRU_EXACT,  /* tail of a recency list kept on every access */
+    CK_EVICT_ALLKEYS_LFU,        /* least frequently used of a random sample */
+    CK_EVICT_VOLATILE_LFU,       /* same, sampling only keys with a TTL */
+    CK_EVICT_ALLKEYS_RANDOM,     /* any random key */
+    CK_EVICT_VOLATILE_LRU,       /* oldest of a random sample of keys with a TTL */
+    CK_EVICT_VOLATILE_TTL,       /* soonest to expire of the same sample */
+    CK_EVICT_NOEVICTION          /* never evict; writes fail with OOM instead */
+} ck_evict_policy_t;
+
+#define CK_MAXMEMORY_SAMPLES   5   /* keys sampled per eviction */
+#define CK_EVICTION_TENACITY   10  /* 0-100, see eviction_time_limit_us() */
+#define CK_LFU_INIT_VAL        5   /* counter of a new key, so it isn't evicted first */
+#define CK_LFU_LOG_FACTOR      10
+#define CK_LFU_DECAY_TIME      1   /* minutes per decrement of an idle key */
+
+#define store_policy_is_lfu(p) \
+    ((p) == CK_EVICT_ALLKEYS_LFU || (p) == CK_EVICT_VOLATILE_LFU)
+#define store_policy_is_volatile(p) \
+    ((p) == CK_EVICT_VOLATILE_LFU || (p) == CK_EVICT_VOLATILE_LRU || \
+     (p) == CK_EVICT_VOLATILE_TTL)
+
+/* cluster mode: keys map to this many hash slots (see store_key_slot) */
+#define CK_CLUSTER_SLOTS 16384
+
+#define CK_EVPOOL_SIZE      16
+#define CK_EVPOOL_KEY_SIZE  255
+
+/* an eviction candidate kept between evictions. the key is copied, into
+ * the slot's own buffer when it fits, because the entry may be gone by
+ * the time the candidate is picked. candidates are small so the pool can
+ * be shifted cheaply; the buffers travel with them */
+typedef struct {
+    uint64_t score;      /* higher = better victim */
+    const void *entry;   /* only compared, to skip duplicates cheaply */
+    char *key;           /* NULL = free slot; `cached` or a heap copy */
+    char *cached;        /* CK_EVPOOL_KEY_SIZE + 1 bytes in store_t */
+} store_evict_candidate_t;
+
+
 typedef struct {
     ck_type_t type;
+    uint8_t lfu_counter;   /* logarithmic access frequency, LFU policies only */
+    uint8_t str_mapped;    /* str points into a snapshot mapping (fmap.h) */
+    uint8_t delta_dirty;   /* already recorded in store_t.delta_keys this epoch */
+    uint8_t snap_bit;      /* equals store_t.snap_bit once a running snapshot has it */
     union {
         char *str;
         int64_t integer;
@@ -22,25 +69,160 @@ typedef struct {
         hashtable_t *hash;
     };
     int64_t expire_at;  /* absolute ms timestamp, 0 = no expiry */
-    int64_t last_access; /* for LRU */
-    size_t mem_usage;    /* approximate memory footprint */
+    int64_t last_access; /* for LRU; LFU decay is measured from it too */
+    const char *key;     /* the keyspace table's copy of this entry's key */
+    list_node_t lru;     /* recency list link, only used in exact LRU mode */
+    list_node_t slot_node; /* in store_t.slots in cluster mode; value holds the slot */
+    size_t volatile_idx; /* slot in store_t.volatile_keys while expire_at != 0 */
 } store_entry_t;
 
+typedef struct store_snapshot store_snapshot_t;
+
+/* told of a key the store removed on its own, before it is freed */
+typedef void (*store_removed_fn)(const char *key, void *arg);
+
 typedef struct {
     hashtable_t *data;
     size_t maxmemory;     /* 0 = unlimited */
+    ck_evict_policy_t policy;
+    list_t lru;           /* intrusive, most recently used at the head */
+    int lfu_log_factor;   /* higher = more hits needed to grow the counter */
+    int lfu_decay_time;   /* minutes; 0 = counters never decay */
+
+    /* every entry with a TTL, for sampling by volatile-* policies */
+    store_entry_t **volatile_keys;
+    size_t volatile_count;
+    size_t volatile_cap;
+
+    /* sampled eviction: best candidates seen so far, by ascending score */
+    int maxmemory_samples;
+    store_evict_candidate_t evict_pool[CK_EVPOOL_SIZE];
+    char evict_pool_keys[CK_EVPOOL_SIZE][CK_EVPOOL_KEY_SIZE + 1];
+    uint64_t evicted_keys;
+
+    /* lookups by read commands, and keys removed for their TTL */
+    uint64_t keyspace_hits;
+    uint64_t keyspace_misses;
+    uint64_t expired_keys;
+
+    /* budgeted eviction: above maxmemory, each pass runs for a time slice
+     * and the server cron carries on; above maxmemory_hard it runs to
+     * completion */
+    int eviction_tenacity;
+    size_t maxmemory_hard;         /* 0 = no hard limit */
+    int eviction_in_progress;      /* last pass ran out of time */
+    uint64_t eviction_time_exceeded;
+
+    /* optional TinyLFU admission: every client access of a key (read or
+     * write) is recorded once; the newest key is kept only if it is more popular than the victim */
+    tinylfu_t *admission;          /* NULL = admit everything */
+    store_entry_t *newcomer;       /* newest key, until it has been judged */
+    uint64_t admission_rejected;
+
+    int64_t bulk_clock;            /* between store_bulk_begin/end, else 0 */
+
+    /* delta snapshots: every key written or deleted, mapped to the epoch
+     * it last changed in. NULL while not tracking */
+    hashtable_t *delta_keys;
+    uint64_t delta_epoch;
+    uint64_t delta_flush_epoch;    /* epoch of a pending FLUSHDB, 0 = none */
+
+    /* cluster mode: the keys of each hash slot, intrusive like lru, so a
+     * slot can be counted and walked without scanning the keyspace. NULL
+     * while off */
+    list_t *slots;
+
+    /* a snapshot being written by another thread, NULL if none */
+    store_snapshot_t *snapshot;
+    uint8_t snap_bit;
+
+    /* every key evicted, refused admission or expired goes through
+     * store_key_removed(), so it can be logged as a deletion. NULL if
+     * nobody listens */
+    store_removed_fn on_removed;
+    void *on_removed_arg;
 } store_t;
 
 store_t *store_create(void);
 void store_destroy(store_t *store);
 
+/* switching to exact LRU threads every existing key into the recency
+ * list, ordered by last access */
+void store_set_policy(store_t *s, ck_evict_policy_t policy);
+
+/* turn the TinyLFU admission filter on or off; off drops its history */
+void store_set_admission(store_t *s, int enabled);
+
+/* hash slot of a key: CRC16 of the key, or only of what is between its
+ * first { and the } after it when that isn't empty (a hash tag, to keep
+ * related keys together), mod CK_CLUSTER_SLOTS */
+unsigned store_key_slot(const char *key);
+/* index every key by hash slot (cluster mode) or stop; turning it on
+ * threads the existing keys in */
+void store_slot_index(store_t *s, int enabled);
+size_t store_slot_count(store_t *s, unsigned slot);
+/* up to max keys of a slot (caller frees returned array and strings) */
+int store_slot_keys(store_t *s, unsigned slot, size_t max, char ***out, int *count);
+
+/* bulk loading (snapshot restore). begin presizes the keyspace for `keys`
+ * more and reads the clock once for all of them into s->bulk_clock.
+ * store_entry_new builds a detached entry with an empty value of `type`
+ * for the caller to fill in: e->str (taken over), e->integer,
+ * list_rpush(e->list, ...) or ht_replace_owned(e->hash, ...); a hash is
+ * presized for `elements` fields. it doesn't touch the store, so decoder
+ * threads can build entries while the loading thread inserts them.
+ * store_bulk_insert then takes over `key` (ck_malloc'd) and the entry.
+ * expire_at is absolute ms, 0 for none */
+void store_bulk_begin(store_t *s, size_t keys);
+store_entry_t *store_entry_new(ck_type_t type, size_t elements, int64_t now);
+void store_entry_free(store_entry_t *e);
+void store_bulk_insert(store_t *s, char *key, store_entry_t *e, int64_t expire_at);
+void store_bulk_end(store_t *s);
+
+/* change tracking for delta snapshots. while on, every key that is
+ * written or deleted outside of bulk loading is recorded with the current
+ * epoch; an entry's delta_dirty flag makes repeated writes to it free.
+ * store_delta_cut closes the epoch for a snapshot and returns it, so what
+ * changes afterwards belongs to the next one. once that snapshot is on
+ * disk, store_delta_commit forgets the keys it covered */
+void store_delta_track(store_t *s, int enabled);
+uint64_t store_delta_cut(store_t *s);
+void store_delta_commit(store_t *s, uint64_t cut);
+size_t store_delta_count(store_t *s);
+
+/* snapshots written by another thread while this one keeps serving.
+ * begin marks every key, or with keys set only those keys, as part of
+ * the snapshot; the snapshot thread then visits them in batches with
+ * store_snapshot_next. before the main thread changes or deletes an
+ * entry the snapshot hasn't visited yet, it hands the current value to
+ * preimage and counts it as visited, so the snapshot sees each key as it
+ * was at the start and nothing added later. a FLUSHDB leaves the old
+ * keyspace to the snapshot. while one runs, both threads use the store
+ * only between store_lock and store_unlock. keys (ck_malloc'd) are taken
+ * over; end is called by the main thread once the other one is done */
+typedef void (*store_visit_fn)(void *arg, const char *key, const store_entry_t *e);
+void store_snapshot_begin(store_t *s, char **keys, size_t n, store_visit_fn preimage, void *arg);
+size_t store_snapshot_next(store_t *s, store_visit_fn visit, void *arg, size_t max);
+void store_snapshot_end(store_t *s);
+/* no-ops without a snapshot; returns whether it locked, to pass to unlock */
+int store_lock(store_t *s);
+void store_unlock(store_t *s, int locked);
+
 /* basic ops */
 int store_set(store_t *s, const char *key, const char *value);
 int store_set_int(store_t *s, const char *key, int64_t value);
 const char *store_get(store_t *s, const char *key);
 int store_get_int(store_t *s, const char *key, int64_t *out);
 store_entry_t *store_get_entry(store_t *s, const char *key);
+/* the entry if the key exists and hasn't expired, for the server's own
+ * lookups: not an access, not counted in the keyspace stats */
+store_entry_t *store_peek(store_t *s, const char *key);
 int store_del(store_t *s, const char *key);
+/* passes key to on_removed; for deletions not asked for by a command,
+ * made just before them */
+void store_key_removed(store_t *s, const char *key);
+/* like store_del, but big values are freed on the lazyfree thread */
+int store_unlink(store_t *s, const char *key);
 int store_exists(store_t *s, const char *key);
 
 /* type check */
@@ -48,6 +230,8 @@ ck_type_t store_type(store_t *s, const char *key);
 
 /* TTL */
 int store_expire(store_t *s, const char *key, int64_t seconds);
+/* absolute unix time in ms */
+int store_expire_at(store_t *s, const char *key, int64_t when_ms);
 int64_t store_ttl(store_t *s, const char *key);
 int store_persist(store_t *s, const char *key);
 
@@ -73,10 +257,25 @@ int store_decr(store_t *s, const char *key, int64_t *result);
 /* db ops */
 size_t store_dbsize(store_t *s);
 void store_flushdb(store_t *s);
+/* swap in an empty keyspace and free the old one in the background */
+void store_flushdb_async(store_t *s);
+
+/* allocator bytes held by key and its value, including its slot in the
+ * keyspace table. containers average `samples` elements (0 = all) */
+size_t store_memory_usage(store_t *s, const char *key, size_t samples);
+
+/* bytes held by the keyspace table itself, excluding keys and values */
+size_t store_overhead(store_t *s);
 
 /* collect matching keys (caller frees returned array and strings) */
 int store_keys(store_t *s, const char *pattern, char ***out, int *count);
 
+/* LFU counter after applying decay for the time since last access */
+uint8_t store_lfu_counter(store_t *s, store_entry_t *e);
+
+/* uniformly random key with a TTL, NULL if there is none */
+store_entry_t *store_random_volatile(store_t *s);
+
 /* passive expiration check */
 int store_is_expired(store_entry_t *e);
 
@@ -0,0 +1,152 @@
+#include "tinylfu.h"
+#include "util.h"
+#include <string.h>
+
+#define ROWS            4
+#define COUNTER_MAX     15
+#define DOOR_BITS       16   /* doorkeeper bits per sketch column */
+#define SAMPLE_FACTOR   10   /* window = SAMPLE_FACTOR * width accesses */
+
+/* 64-bit FNV-1a with a final mix, so both halves are usable as hashes */
+static uint64_t hash64(const char *key) {
+    uint64_t h = 1469598103934665603ULL;
+    for (const char *p = key; *p; p++) {
+        h ^= (uint8_t)*p;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* i-th probe position out of `size` (a power of two), by double hashing */
+static size_t probe(uint64_t h, int i, size_t size) {
+    uint32_t h1 = (uint32_t)h;
+    uint32_t h2 = (uint32_t)(h >> 32) | 1;
+    return (size_t)(h1 + (uint32_t)i * h2) & (size - 1);
+}
+
+static size_t counter_words(size_t width) {
+    return ROWS * width / 16;
+}
+
+static size_t door_words(size_t width) {
+    return width * DOOR_BITS / 64;
+}
+
+static void alloc_tables(tinylfu_t *t, size_t width) {
+    t->width = width;
+    t->counters = ck_calloc(counter_words(width), sizeof(uint64_t));
+    t->doorkeeper = ck_calloc(door_words(width), sizeof(uint64_t));
+    t->samples = 0;
+    t->sample_size = SAMPLE_FACTOR * width;
+}
+
+static size_t round_width(size_t width) {
+    size_t w = CK_TINYLFU_MIN_WIDTH;
+    while (w < width && w < CK_TINYLFU_MAX_WIDTH) w <<= 1;
+    return w;
+}
+
+tinylfu_t *tinylfu_create(size_t width) {
+    tinylfu_t *t = ck_malloc(sizeof(tinylfu_t));
+    alloc_tables(t, round_width(width));
+    t->resets = 0;
+    return t;
+}
+
+void tinylfu_destroy(tinylfu_t *t) {
+    if (!t) return;
+    ck_free(t->counters);
+    ck_free(t->doorkeeper);
+    ck_free(t);
+}
+
+static unsigned counter_get(tinylfu_t *t, int row, size_t col) {
+    size_t idx = (size_t)row * t->width + col;
+    return (unsigned)(t->counters[idx / 16] >> ((idx % 16) * 4)) & 0xf;
+}
+
+static void counter_incr(tinylfu_t *t, int row, size_t col) {
+    size_t idx = (size_t)row * t->width + col;
+    unsigned shift = (unsigned)(idx % 16) * 4;
+    if (((t->counters[idx / 16] >> shift) & 0xf) < COUNTER_MAX) {
+        t->counters[idx / 16] += (uint64_t)1 << shift;
+    }
+}
+
+static unsigned sketch_min(tinylfu_t *t, uint64_t h) {
+    unsigned min = COUNTER_MAX;
+    for (int r = 0; r < ROWS; r++) {
+        unsigned c = counter_get(t, r, probe(h, r, t->width));
+        if (c < min) min = c;
+    }
+    return min;
+}
+
+static int door_contains(tinylfu_t *t, uint64_t h) {
+    size_t bits = t->width * DOOR_BITS;
+    for (int i = 0; i < 3; i++) {
+        size_t b = probe(h, i + ROWS, bits);
+        if (!(t->doorkeeper[b / 64] & ((uint64_t)1 << (b % 64)))) return 0;
+    }
+    return 1;
+}
+
+/* returns whether h was (probably) already in the doorkeeper */
+static int door_put(tinylfu_t *t, uint64_t h) {
+    size_t bits = t->width * DOOR_BITS;
+    int present = 1;
+    for (int i = 0; i < 3; i++) {
+        size_t b = probe(h, i + ROWS, bits);
+        uint64_t mask = (uint64_t)1 << (b % 64);
+        if (!(t->doorkeeper[b / 64] & mask)) {
+            present = 0;
+            t->doorkeeper[b / 64] |= mask;
+        }
+    }
+    return present;
+}
+
+/* halve every counter at once: shift each word and drop the bit that
+ * crossed into the neighbouring counter */
+static void reset(tinylfu_t *t) {
+    size_t n = counter_words(t->width);
+    for (size_t i = 0; i < n; i++) {
+        t->counters[i] = (t->counters[i] >> 1) & 0x7777777777777777ULL;
+    }
+    memset(t->doorkeeper, 0, door_words(t->width) * sizeof(uint64_t));
+    t->samples /= 2;
+    t->resets++;
+}
+
+void tinylfu_record(tinylfu_t *t, const char *key) {
+    uint64_t h = hash64(key);
+    if (door_put(t, h)) {
+        /* conservative update: only the smallest counters grow, which
+         * keeps collisions from inflating the estimate */
+        unsigned min = sketch_min(t, h);
+        for (int r = 0; r < ROWS; r++) {
+            size_t col = probe(h, r, t->width);
+            if (counter_get(t, r, col) == min) counter_incr(t, r, col);
+        }
+    }
+    if (++t->samples >= t->sample_size) reset(t);
+}
+
+unsigned tinylfu_estimate(tinylfu_t *t, const char *key) {
+    uint64_t h = hash64(key);
+    return sketch_min(t, h) + (unsigned)door_contains(t, h);
+}
+
+void tinylfu_ensure_capacity(tinylfu_t *t, size_t keys) {
+    if (keys <= t->width || t->width >= CK_TINYLFU_MAX_WIDTH) return;
+    ck_free(t->counters);
+    ck_free(t->doorkeeper);
+    alloc_tables(t, round_width(keys));
+}
+
+size_t tinylfu_memory(tinylfu_t *t) {
+    return ck_malloc_size(t) + ck_malloc_size(t->counters) + ck_malloc_size(t->doorkeeper);
+}
@@ -0,0 +1,44 @@
+#ifndef CK_TINYLFU_H
+#define CK_TINYLFU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* W-TinyLFU admission: approximate access frequencies over a sliding
+ * window, so a newcomer can be compared against the key it would evict.
+ *
+ * a Count-Min sketch of 4-bit counters (4 rows) holds the frequencies; a
+ * doorkeeper bloom filter absorbs the first access of every key, so
+ * one-hit wonders never reach the sketch. after 10 accesses per counter
+ * all counters are halved and the doorkeeper cleared, which ages out old
+ * popularity. */
+
+#define CK_TINYLFU_MIN_WIDTH 1024
+#define CK_TINYLFU_MAX_WIDTH (1 << 24)
+
+typedef struct tinylfu {
+    uint64_t *counters;   /* 4 rows of `width` 4-bit counters, 16 per word */
+    uint64_t *doorkeeper; /* bloom filter, 16 bits per counter column */
+    size_t width;         /* power of two */
+    size_t samples;       /* recorded since the last halving */
+    size_t sample_size;   /* halve when samples reaches this */
+    uint64_t resets;
+} tinylfu_t;
+
+/* width is rounded up to a power of two, at least CK_TINYLFU_MIN_WIDTH */
+tinylfu_t *tinylfu_create(size_t width);
+void tinylfu_destroy(tinylfu_t *t);
+
+/* count one access to key */
+void tinylfu_record(tinylfu_t *t, const char *key);
+
+/* estimated accesses to key in the current window */
+unsigned tinylfu_estimate(tinylfu_t *t, const char *key);
+
+/* widen the sketch to track about `keys` distinct keys. growing starts a
+ * fresh window, so it is only done when the keyspace outgrows it */
+void tinylfu_ensure_capacity(tinylfu_t *t, size_t keys);
+
+size_t tinylfu_memory(tinylfu_t *t);
+
+#endif
@@ -4,9 +4,47 @@
 #include <string.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <stdatomic.h>
+
+#if defined(__APPLE__)
+#include <malloc/malloc.h>
+#include <unistd.h>
+#define ck_usable_size(p) malloc_size(p)
+#elif defined(_WIN32)
+#include <malloc.h>
+#define ck_usable_size(p) _msize(p)
+#else
+#include <malloc.h>
+#include <unistd.h>
+#define ck_usable_size(p) malloc_usable_size(p)
+#endif
 
 static ck_log_level_t g_log_level = CK_LOG_INFO;
-static size_t g_mem_used = 0;
+
+/* atomic because the lazyfree thread releases memory concurrently */
+static atomic_size_t g_mem_used;
+static atomic_size_t g_mem_peak;
+
+static void mem_account_alloc(void *p) {
+    size_t bytes = ck_usable_size(p);
+    size_t used = atomic_fetch_add_explicit(&g_mem_used, bytes, memory_order_relaxed) + bytes;
+    size_t peak = atomic_load_explicit(&g_mem_peak, memory_order_relaxed);
+    while (used > peak &&
+           !atomic_compare_exchange_weak_explicit(&g_mem_peak, &peak, used,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+    }
+}
+
+static void mem_account_free(size_t bytes) {
+    size_t used = atomic_load_explicit(&g_mem_used, memory_order_relaxed);
+    size_t next;
+    do {
+        next = bytes > used ? 0 : used - bytes;
+    } while (!atomic_compare_exchange_weak_explicit(&g_mem_used, &used, next,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed));
+}
 
 void *ck_malloc(size_t size) {
     void *p = malloc(size);
@@ -14,6 +52,7 @@ void *ck_malloc(size_t size) {
         fprintf(stderr, "fatal: out of memory allocating %zu bytes\n", size);
         abort();
     }
+    if (p) mem_account_alloc(p);
     return p;
 }
 
@@ -23,18 +62,32 @@ void *ck_calloc(size_t nmemb, size_t size) {
         fprintf(stderr, "fatal: out of memory allocating %zu bytes\n", nmemb * size);
         abort();
     }
+    if (p) mem_account_alloc(p);
     return p;
 }
 
 void *ck_realloc(void *ptr, size_t size) {
+    size_t old = ptr ? ck_usable_size(ptr) : 0;
     void *p = realloc(ptr, size);
     if (!p && size > 0) {
         fprintf(stderr, "fatal: out of memory reallocating %zu bytes\n", size);
         abort();
     }
+    mem_account_free(old);
+    if (p) mem_account_alloc(p);
     return p;
 }
 
+void ck_free(void *ptr) {
+    if (!ptr) return;
+    mem_account_free(ck_usable_size(ptr));
+    free(ptr);
+}
+
+size_t ck_malloc_size(void *ptr) {
+    return ptr ? ck_usable_size(ptr) : 0;
+}
+
 char *ck_strdup(const char *s) {
     if (!s) return NULL;
     size_t len = strlen(s);
@@ -90,6 +143,18 @@ int64_t ck_time_ms(void) {
     return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
+int64_t ck_time_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t ck_wall_time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 /* simple glob matching supporting * and ? */
 int ck_glob_match(const char *pattern, const char *string) {
     while (*pattern && *string) {
@@ -130,18 +195,218 @@ int ck_str_to_int64(const char *s, int64_t *out) {
     return 0;
 }
 
-void ck_mem_track_alloc(size_t bytes) {
-    g_mem_used += bytes;
+/* CRC-32C (Castagnoli, reflected polynomial 0x82F63B78), one table lookup
+ * per byte */
+static const uint32_t crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--) crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+/* SSE4.2 has a CRC-32C instruction: 8 bytes per step instead of one
+ * table lookup per byte. picked at run time, so the binary still runs on
+ * CPUs without it */
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define HAVE_CRC32C_HW 1
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len && ((uintptr_t)p & 7)) {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#if defined(__x86_64__)
+    uint64_t c = crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = _mm_crc32_u64(c, v);
+    }
+    crc = (uint32_t)c;
+#endif
+    for (; len >= 4; len -= 4, p += 4) {
+        uint32_t v;
+        memcpy(&v, p, 4);
+        crc = _mm_crc32_u32(crc, v);
+    }
+    while (len--) crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+
+static int crc32c_hw_supported(void) {
+    return __builtin_cpu_supports("sse4.2") != 0;
+}
+#endif
+
+uint32_t ck_crc32c(uint32_t crc, const void *buf, size_t len) {
+#ifdef HAVE_CRC32C_HW
+    if (crc32c_hw_supported()) return ~crc32c_hw(~crc, buf, len);
+#endif
+    return ~crc32c_sw(~crc, buf, len);
+}
+
+int ck_crc32c_hw(void) {
+#ifdef HAVE_CRC32C_HW
+    return crc32c_hw_supported();
+#else
+    return 0;
+#endif
+}
+
+/* CRC-16/XMODEM (polynomial 0x1021), the one cluster hash slots use */
+static const uint16_t crc16_table[256] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+uint16_t ck_crc16(const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    uint16_t crc = 0;
+    while (len--) crc = (uint16_t)((crc << 8) ^ crc16_table[((crc >> 8) ^ *p++) & 0xff]);
+    return crc;
 }
 
-void ck_mem_track_free(size_t bytes) {
-    if (bytes > g_mem_used) {
-        g_mem_used = 0;
-    } else {
-        g_mem_used -= bytes;
+const char *ck_hash_tag(const char *key, size_t *len) {
+    *len = strlen(key);
+    const char *open = memchr(key, '{', *len);
+    if (open) {
+        const char *close = memchr(open + 1, '}', *len - (size_t)(open + 1 - key));
+        if (close && close > open + 1) {
+            *len = (size_t)(close - open - 1);
+            return open + 1;
+        }
     }
+    return key;
+}
+
+int ck_cpu_count(void) {
+#if defined(_WIN32)
+    return 1;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
 }
 
 size_t ck_mem_used(void) {
-    return g_mem_used;
+    return atomic_load_explicit(&g_mem_used, memory_order_relaxed);
+}
+
+size_t ck_mem_peak(void) {
+    return atomic_load_explicit(&g_mem_peak, memory_order_relaxed);
+}
+
+#if defined(__linux__)
+size_t ck_mem_rss(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+
+    unsigned long size, resident;
+    int n = fscanf(f, "%lu %lu", &size, &resident);
+    fclose(f);
+    if (n != 2) return 0;
+
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+size_t ck_mem_private_dirty(void) {
+    /* smaps_rollup (Linux 4.14+) is one line per field instead of one
+     * block per mapping */
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) f = fopen("/proc/self/smaps", "r");
+    if (!f) return 0;
+
+    char line[256];
+    size_t total = 0;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long kb;
+        if (sscanf(line, "Private_Dirty: %lu kB", &kb) == 1) total += (size_t)kb * 1024;
+    }
+    fclose(f);
+    return total;
+}
+#else
+size_t ck_mem_rss(void) {
+    return 0;
+}
+
+size_t ck_mem_private_dirty(void) {
+    return 0;
 }
+#endif
@@ -5,12 +5,18 @@
 #include <stdint.h>
 #include <time.h>
 
-/* memory wrappers that abort on failure */
+/* memory wrappers that abort on failure. every block is accounted by the
+ * allocator's usable size, so anything allocated here must be released
+ * with ck_free() */
 void *ck_malloc(size_t size);
 void *ck_calloc(size_t nmemb, size_t size);
 void *ck_realloc(void *ptr, size_t size);
 char *ck_strdup(const char *s);
 char *ck_strndup(const char *s, size_t n);
+void ck_free(void *ptr);
+
+/* bytes the allocator actually reserved for ptr (>= requested size) */
+size_t ck_malloc_size(void *ptr);
 
 /* logging */
 typedef enum {
@@ -24,15 +30,39 @@ void ck_log_set_level(ck_log_level_t level);
 void ck_log(ck_log_level_t level, const char *fmt, ...);
 
 /* time helpers */
-int64_t ck_time_ms(void);
+int64_t ck_time_ms(void);       /* monotonic, for measuring intervals */
+int64_t ck_time_us(void);       /* monotonic, for time budgets */
+int64_t ck_wall_time_ms(void);  /* unix time, for expiry and access times */
 
 /* string helpers */
 int ck_glob_match(const char *pattern, const char *string);
 int ck_str_to_int64(const char *s, int64_t *out);
 
+/* CRC-32C of buf, continuing from crc (0 to start). uses the SSE4.2
+ * instruction when the CPU has it */
+uint32_t ck_crc32c(uint32_t crc, const void *buf, size_t len);
+int ck_crc32c_hw(void);
+
+/* CRC-16/XMODEM of buf, as cluster hash slots use it */
+uint16_t ck_crc16(const void *buf, size_t len);
+
+/* the part of a key that decides where it lives (its cluster slot, its
+ * proxy backend): what is between the first { and the next }, if that
+ * is not empty, else the whole key. sets *len */
+const char *ck_hash_tag(const char *key, size_t *len);
+
+/* online CPUs, at least 1 */
+int ck_cpu_count(void);
+
 /* memory tracking */
-void ck_mem_track_alloc(size_t bytes);
-void ck_mem_track_free(size_t bytes);
 size_t ck_mem_used(void);
+size_t ck_mem_peak(void);
+
+/* resident set size of the process, 0 if the platform can't tell */
+size_t ck_mem_rss(void);
+
+/* bytes of dirty pages not shared with any other process. in a forked
+ * child this is what copy-on-write has duplicated so far */
+size_t ck_mem_private_dirty(void);
 
 #endif
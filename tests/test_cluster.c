@@ -0,0 +1,364 @@
+#include "cluster.h"
+#include "command.h"
+#include "store.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static int n_fail;
+
+static void ok(int cond, const char *msg) {
+    if (!cond) {
+        fprintf(stderr, "FAIL: %s\n", msg);
+        n_fail++;
+    }
+}
+
+/* run a command and return its reply (ck_malloc'd) */
+static char *run(command_ctx_t *ctx, int argc, const char **argv) {
+    resp_buf_t req, reply;
+    resp_buf_init(&req);
+    resp_buf_init(&reply);
+    resp_write_array_header(&req, argc);
+    for (int i = 0; i < argc; i++) {
+        resp_write_bulk_string(&req, argv[i], strlen(argv[i]));
+    }
+
+    resp_parser_t p;
+    resp_parser_init(&p);
+    resp_parser_feed(&p, req.buf, req.len);
+    resp_value_t *cmd;
+    if (resp_parse(&p, &cmd) == 1) {
+        command_dispatch(ctx, cmd, &reply);
+        resp_value_free(cmd);
+    }
+    resp_parser_destroy(&p);
+    resp_buf_destroy(&req);
+    char *out = ck_strndup(reply.buf, reply.len);
+    resp_buf_destroy(&reply);
+    return out;
+}
+
+/* does the reply to a command start with want */
+#define REPLY(ctx, want, ...) reply_is(ctx, want, \
+    (int)(sizeof((const char *[]){ __VA_ARGS__ }) / sizeof(const char *)), \
+    (const char *[]){ __VA_ARGS__ })
+
+static int reply_is(command_ctx_t *ctx, const char *want, int argc, const char **argv) {
+    char *reply = run(ctx, argc, argv);
+    int same = strncmp(reply, want, strlen(want)) == 0;
+    if (!same) fprintf(stderr, "  %s: got %s", argv[0], reply);
+    ck_free(reply);
+    return same;
+}
+
+static void test_key_slot(void) {
+    ok(ck_crc16("123456789", 9) == 0x31C3, "crc16 check value");
+    ok(store_key_slot("foo") == 12182, "slot of foo");
+    ok(store_key_slot("bar") == 5061, "slot of bar");
+    ok(store_key_slot("{user1000}.following") == store_key_slot("{user1000}.followers"),
+       "hash tags share a slot");
+    ok(store_key_slot("{user1000}.following") == store_key_slot("user1000"),
+       "only the tag is hashed");
+    ok(store_key_slot("foo{}{bar}") != store_key_slot("bar"), "an empty tag hashes the key");
+    ok(store_key_slot("foo{{bar}}zap") == store_key_slot("{bar"), "first { to the next }");
+    ok(store_key_slot("foo{bar") != store_key_slot("bar"), "an unclosed tag hashes the key");
+}
+
+static void test_slot_index(void) {
+    store_t *s = store_create();
+    store_set(s, "before", "x");
+    store_slot_index(s, 1);
+    unsigned slot = store_key_slot("{t}");
+    ok(store_slot_count(s, store_key_slot("before")) == 1, "existing keys indexed");
+
+    char key[32];
+    for (int i = 0; i < 10; i++) {
+        snprintf(key, sizeof(key), "{t}:%d", i);
+        store_set(s, key, "v");
+    }
+    store_rpush(s, "{t}:list", "a");
+    ok(store_slot_count(s, slot) == 11, "keys counted by slot");
+    store_del(s, "{t}:0");
+    store_unlink(s, "{t}:1");
+    store_expire_at(s, "{t}:2", 1);
+    ok(store_get(s, "{t}:2") == NULL, "expired");
+    ok(store_slot_count(s, slot) == 8, "deleted and expired keys leave their slot");
+
+    char **keys;
+    int count;
+    store_slot_keys(s, slot, 3, &keys, &count);
+    ok(count == 3, "keys listed up to the limit");
+    for (int i = 0; i < count; i++) {
+        ok(store_key_slot(keys[i]) == slot, "listed key is in the slot");
+        ck_free(keys[i]);
+    }
+    ck_free(keys);
+
+    store_flushdb(s);
+    ok(store_slot_count(s, slot) == 0, "flush empties the slots");
+    store_set(s, "{t}:again", "v");
+    ok(store_slot_count(s, slot) == 1, "indexed after a flush");
+    store_slot_index(s, 0);
+    store_destroy(s);
+}
+
+static void test_routing(void) {
+    const char *conf = "build/test_cluster_nodes.conf";
+    remove(conf);
+    store_t *s = store_create();
+    command_ctx_t ctx = { .store = s };
+
+    ok(REPLY(&ctx, "-ERR This instance has cluster support disabled", "CLUSTER", "INFO"),
+       "CLUSTER needs cluster mode");
+    ok(REPLY(&ctx, ":12182", "CLUSTER", "KEYSLOT", "foo"), "KEYSLOT always works");
+
+    cluster_set_enabled(s, 1);
+    cluster_set_config_file(conf);
+    cluster_init(s, 7001);
+    ok(REPLY(&ctx, "-CLUSTERDOWN", "GET", "foo"), "unassigned slot");
+    ok(REPLY(&ctx, "+OK", "CLUSTER", "ADDSLOTSRANGE", "0", "8191"), "ADDSLOTSRANGE");
+    ok(REPLY(&ctx, "-ERR Slot 100 is already busy", "CLUSTER", "ADDSLOTS", "100"),
+       "slot already ours");
+    ok(REPLY(&ctx, "+OK", "CLUSTER", "SETSLOT", "8192-16383", "NODE", "127.0.0.1:7002"),
+       "the rest is another node's");
+    ok(REPLY(&ctx, "-ERR Unknown node", "CLUSTER", "SETSLOT", "1", "MIGRATING", "nowhere"),
+       "node address checked");
+
+    ok(REPLY(&ctx, "+OK", "SET", "bar", "1"), "own slot served");
+    ok(REPLY(&ctx, "-MOVED 12182 127.0.0.1:7002", "SET", "foo", "1"), "MOVED");
+    ok(REPLY(&ctx, "-MOVED 12182 127.0.0.1:7002", "GET", "foo"), "reads redirected too");
+    ok(REPLY(&ctx, "-CROSSSLOT", "DEL", "bar", "foo"), "keys in two slots");
+    ok(REPLY(&ctx, ":1", "EXISTS", "bar", "{bar}x"), "keys in one slot");
+    ok(REPLY(&ctx, "+PONG", "PING"), "keyless commands served");
+    ok(REPLY(&ctx, ":1", "CLUSTER", "COUNTKEYSINSLOT", "5061"), "COUNTKEYSINSLOT");
+    ok(REPLY(&ctx, "*1\r\n$3\r\nbar\r\n", "CLUSTER", "GETKEYSINSLOT", "5061", "10"),
+       "GETKEYSINSLOT");
+    ok(REPLY(&ctx, "*2\r\n*3\r\n:0\r\n:8191\r\n*2\r\n$9\r\n127.0.0.1\r\n:7001\r\n"
+                   "*3\r\n:8192\r\n:16383\r\n*2\r\n$9\r\n127.0.0.1\r\n:7002\r\n",
+             "CLUSTER", "SLOTS"), "SLOTS");
+
+    /* bar's slot moving out: what is still here is served, the rest asked
+     * of the target */
+    ok(REPLY(&ctx, "-ERR Can't assign hashslot 5061", "CLUSTER", "SETSLOT", "5061", "NODE",
+             "127.0.0.1:7002"), "keys keep a slot here");
+    ok(REPLY(&ctx, "+OK", "CLUSTER", "SETSLOT", "5061", "MIGRATING", "127.0.0.1:7002"),
+       "MIGRATING");
+    ok(REPLY(&ctx, "$1\r\n1", "GET", "bar"), "key not yet moved is served");
+    ok(REPLY(&ctx, "-ASK 5061 127.0.0.1:7002", "GET", "{bar}x"), "moved key asked");
+    ok(REPLY(&ctx, "-ASK 5061 127.0.0.1:7002", "SET", "{bar}new", "1"), "new key asked");
+    ok(REPLY(&ctx, "-TRYAGAIN", "DEL", "bar", "{bar}x"), "keys on both sides");
+
+    /* foo's slot moving in: served after ASKING, for one command */
+    ok(REPLY(&ctx, "+OK", "CLUSTER", "SETSLOT", "12182", "IMPORTING", "127.0.0.1:7002"),
+       "IMPORTING");
+    ok(REPLY(&ctx, "-MOVED", "SET", "foo", "1"), "importing slot needs ASKING");
+    ok(REPLY(&ctx, "+OK", "ASKING"), "ASKING");
+    ok(REPLY(&ctx, "+OK", "SET", "foo", "1"), "served after ASKING");
+    ok(REPLY(&ctx, "-MOVED", "GET", "foo"), "ASKING is for one command");
+    ok(REPLY(&ctx, "+OK", "ASKING") && REPLY(&ctx, "$1\r\n1", "GET", "foo"),
+       "imported key readable after ASKING");
+
+    /* the slot map survives a restart */
+    cluster_init(s, 7001);
+    ok(REPLY(&ctx, "-ASK 5061", "GET", "{bar}x"), "migrating state reloaded");
+    ok(REPLY(&ctx, "-MOVED 12182", "GET", "foo"), "owner reloaded");
+    ok(REPLY(&ctx, "+OK", "ASKING") && REPLY(&ctx, "$1\r\n1", "GET", "foo"),
+       "importing state reloaded");
+    char *info = run(&ctx, 2, (const char *[]){ "CLUSTER", "INFO" });
+    ok(strstr(info, "cluster_state:ok") && strstr(info, "cluster_my_slots:8192") &&
+       strstr(info, "cluster_slots_moving:2") && strstr(info, "cluster_myself:127.0.0.1:7001"),
+       "CLUSTER INFO");
+    ck_free(info);
+
+    /* done: the source gives bar's slot away, the target takes foo's */
+    store_del(s, "bar");
+    ok(REPLY(&ctx, "+OK", "CLUSTER", "SETSLOT", "5061", "NODE", "127.0.0.1:7002") &&
+       REPLY(&ctx, "+OK", "CLUSTER", "SETSLOT", "12182", "NODE", "127.0.0.1:7001"),
+       "migrations finished");
+    ok(REPLY(&ctx, "-MOVED 5061 127.0.0.1:7002", "GET", "bar"), "slot given away");
+    ok(REPLY(&ctx, "$1\r\n1", "GET", "foo"), "slot taken over");
+
+    /* writes replayed from the log or the primary aren't redirected */
+    ctx.replaying = 1;
+    ok(REPLY(&ctx, "+OK", "SET", "bar", "2"), "replay not routed");
+    ctx.replaying = 0;
+
+    ok(REPLY(&ctx, "+OK", "CLUSTER", "DELSLOTS", "12182"), "DELSLOTS");
+    ok(REPLY(&ctx, "-CLUSTERDOWN", "GET", "foo"), "slot unassigned");
+    ok(REPLY(&ctx, "-ERR 'cluster-enabled' can't be changed at runtime", "CONFIG", "SET",
+             "cluster-enabled", "no"), "cluster-enabled fixed at runtime");
+
+    cluster_set_enabled(s, 0);
+    cluster_init(s, 7001);
+    store_destroy(s);
+    remove(conf);
+}
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* a MIGRATE target: records what it is sent, answers +OK to every command
+ * and `exists` to EXISTS */
+typedef struct {
+    int lfd;
+    int exists;
+    resp_buf_t got;
+} target_t;
+
+static void *target_main(void *arg) {
+    target_t *t = arg;
+    int fd = accept(t->lfd, NULL, NULL);
+    if (fd < 0) return NULL;
+    resp_parser_t p;
+    resp_parser_init(&p);
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        resp_buf_append(&t->got, buf, (size_t)n);
+        resp_parser_feed(&p, buf, (size_t)n);
+        resp_value_t *cmd;
+        while (resp_parse(&p, &cmd) == 1) {
+            char reply[32];
+            if (strcmp(cmd->array.elements[0]->str, "EXISTS") == 0) {
+                snprintf(reply, sizeof(reply), ":%d\r\n", t->exists);
+            } else {
+                snprintf(reply, sizeof(reply), "+OK\r\n");
+            }
+            send(fd, reply, strlen(reply), 0);
+            resp_value_free(cmd);
+        }
+    }
+    resp_parser_destroy(&p);
+    close(fd);
+    return NULL;
+}
+
+static int target_start(target_t *t, pthread_t *tid, int exists) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    t->lfd = socket(AF_INET, SOCK_STREAM, 0);
+    t->exists = exists;
+    resp_buf_init(&t->got);
+    if (bind(t->lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(t->lfd, 1) != 0 ||
+        getsockname(t->lfd, (struct sockaddr *)&addr, &alen) != 0) {
+        return -1;
+    }
+    pthread_create(tid, NULL, target_main, t);
+    return ntohs(addr.sin_port);
+}
+
+/* what it got stays in t->got, for the caller to free */
+static void target_stop(target_t *t, pthread_t tid) {
+    shutdown(t->lfd, SHUT_RDWR);
+    pthread_join(tid, NULL);
+    close(t->lfd);
+}
+
+/* needle in the first n bytes of p */
+static const char *find(const char *p, size_t n, const char *needle) {
+    size_t k = strlen(needle);
+    for (size_t i = 0; i + k <= n; i++) {
+        if (memcmp(p + i, needle, k) == 0) return p + i;
+    }
+    return NULL;
+}
+
+static void test_migrate(void) {
+    store_t *s = store_create();
+    command_ctx_t ctx = { .store = s };
+    store_set(s, "str", "hello");
+    store_rpush(s, "list", "a");
+    store_rpush(s, "list", "b");
+    store_hset(s, "hash", "f", "v");
+    store_expire(s, "str", 100);
+
+    target_t t;
+    pthread_t tid;
+    int port = target_start(&t, &tid, 0);
+    ok(port > 0, "target listening");
+    char portstr[16];
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    ok(REPLY(&ctx, "+OK", "MIGRATE", "127.0.0.1", portstr, "", "0", "1000", "KEYS", "str",
+             "list", "hash", "missing"), "MIGRATE");
+    target_stop(&t, tid);
+    ok(store_dbsize(s) == 0, "migrated keys deleted");
+
+    /* the target was sent the commands that rebuild them */
+    store_t *dst = store_create();
+    command_ctx_t dctx = { .store = dst };
+    resp_parser_t p;
+    resp_parser_init(&p);
+    resp_parser_feed(&p, t.got.buf, t.got.len);
+    resp_value_t *cmd;
+    resp_buf_t reply;
+    resp_buf_init(&reply);
+    while (resp_parse(&p, &cmd) == 1) {
+        command_dispatch(&dctx, cmd, &reply);
+        resp_value_free(cmd);
+    }
+    ok(reply.len > 0 && reply.buf[0] != '-' && !find(reply.buf, reply.len, "\r\n-"),
+       "target accepted every command");
+    ok(t.got.len > 16 && memcmp(t.got.buf, "*1\r\n$6\r\nASKING\r\n", 16) == 0,
+       "each command after ASKING");
+    resp_buf_destroy(&reply);
+    resp_parser_destroy(&p);
+    resp_buf_destroy(&t.got);
+    const char *v = store_get(dst, "str");
+    ok(v && strcmp(v, "hello") == 0, "string moved");
+    int64_t ttl = store_ttl(dst, "str");
+    ok(ttl > 90 && ttl <= 100, "expiry moved");
+    ok(store_llen(dst, "list") == 2, "list moved");
+    const char *f = store_hget(dst, "hash", "f");
+    ok(f && strcmp(f, "v") == 0, "hash moved");
+    store_destroy(dst);
+
+    /* all or nothing when the target already has one */
+    store_set(s, "str", "again");
+    port = target_start(&t, &tid, 1);
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    ok(REPLY(&ctx, "-BUSYKEY", "MIGRATE", "127.0.0.1", portstr, "str", "0", "1000"),
+       "BUSYKEY");
+    target_stop(&t, tid);
+    resp_buf_destroy(&t.got);
+    ok(store_exists(s, "str"), "key kept on failure");
+
+    /* REPLACE deletes first; COPY keeps the local key */
+    port = target_start(&t, &tid, 1);
+    snprintf(portstr, sizeof(portstr), "%d", port);
+    ok(REPLY(&ctx, "+OK", "MIGRATE", "127.0.0.1", portstr, "str", "0", "1000", "COPY",
+             "REPLACE"), "MIGRATE COPY REPLACE");
+    target_stop(&t, tid);
+    ok(!find(t.got.buf, t.got.len, "EXISTS") && find(t.got.buf, t.got.len, "DEL"),
+       "REPLACE deletes instead of checking");
+    resp_buf_destroy(&t.got);
+    ok(store_exists(s, "str"), "COPY keeps the key");
+
+    ok(REPLY(&ctx, "+NOKEY", "MIGRATE", "127.0.0.1", portstr, "missing", "0", "1000"),
+       "NOKEY");
+    ok(REPLY(&ctx, "-IOERR", "MIGRATE", "127.0.0.1", portstr, "str", "0", "200"),
+       "unreachable target");
+    ok(REPLY(&ctx, "-ERR DB index", "MIGRATE", "127.0.0.1", portstr, "str", "1", "200"),
+       "only db 0");
+    store_destroy(s);
+}
+#endif
+
+int test_cluster_run(void) {
+    n_fail = 0;
+    test_key_slot();
+    test_slot_index();
+    test_routing();
+#ifndef _WIN32
+    test_migrate();
+#endif
+    return n_fail;
+}
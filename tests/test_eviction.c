@@ -0,0 +1,460 @@
+#include "store.h"
+#include "config.h"
+#include "eviction.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static int n_fail;
+
+static void ok(int cond, const char *msg) {
+    if (!cond) {
+        fprintf(stderr, "FAIL: %s\n", msg);
+        n_fail++;
+    }
+}
+
+#define TRACE_LEN  50000
+#define TRACE_KEYS 2000
+#define HOT_KEYS   200
+
+void test_eviction_exact_order(void) {
+    store_t *s = store_create();
+    store_set_policy(s, CK_EVICT_ALLKEYS_LRU_EXACT);
+    store_set(s, "a", "1");
+    store_set(s, "b", "2");
+    store_set(s, "c", "3");
+    ok(store_get(s, "a") != NULL, "touch a");
+
+    s->maxmemory = ck_mem_used();
+    store_set(s, "d", "4");
+    ok(eviction_check(s) >= 1, "evicted after crossing maxmemory");
+    ok(store_get_entry(s, "b") == NULL, "least recently used key evicted");
+    ok(store_get_entry(s, "a") != NULL, "recently touched key kept");
+    ok(store_get_entry(s, "d") != NULL, "new key kept");
+    store_destroy(s);
+}
+
+void test_eviction_policy_switch(void) {
+    store_t *s = store_create();
+    for (int i = 0; i < 100; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "k%d", i);
+        store_set(s, key, "v");
+    }
+    store_set_policy(s, CK_EVICT_ALLKEYS_LRU_EXACT);
+    ok(list_length(&s->lru) == 100, "switching to exact LRU links every key");
+    store_del(s, "k5");
+    ok(list_length(&s->lru) == 99, "delete unlinks from recency list");
+    store_flushdb(s);
+    ok(list_length(&s->lru) == 0 && s->lru.head == NULL, "flushdb resets recency list");
+    store_destroy(s);
+}
+
+/* replay a trace as a read-through cache: a miss is followed by a SET */
+static double replay(const int *trace, ck_evict_policy_t policy, int admission,
+                     size_t budget) {
+    store_t *s = store_create();
+    store_set_policy(s, policy);
+    store_set_admission(s, admission);
+    s->maxmemory = ck_mem_used() + budget;
+
+    int hits = 0;
+    char key[16];
+    for (int i = 0; i < TRACE_LEN; i++) {
+        snprintf(key, sizeof(key), "key:%d", trace[i]);
+        if (store_get(s, key)) {
+            hits++;
+        } else {
+            store_set(s, key, "0123456789abcdef");
+            eviction_check(s);
+        }
+    }
+    store_destroy(s);
+    return (double)hits / TRACE_LEN;
+}
+
+/* 90% of accesses go to 10% of the keys */
+void test_eviction_hit_ratio(void) {
+    int *trace = ck_malloc(sizeof(int) * TRACE_LEN);
+    srand(42);
+    for (int i = 0; i < TRACE_LEN; i++) {
+        trace[i] = rand() % 10 < 9 ? rand() % HOT_KEYS : rand() % TRACE_KEYS;
+    }
+
+    /* size the cache to hold roughly 1.5x the hot set */
+    store_t *probe = store_create();
+    size_t base = ck_mem_used();
+    for (int i = 0; i < 100; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "key:%d", i);
+        store_set(probe, key, "0123456789abcdef");
+    }
+    size_t per_key = (ck_mem_used() - base) / 100;
+    store_destroy(probe);
+    size_t budget = per_key * HOT_KEYS * 3 / 2;
+
+    double sampled = replay(trace, CK_EVICT_ALLKEYS_LRU, 0, budget);
+    double exact = replay(trace, CK_EVICT_ALLKEYS_LRU_EXACT, 0, budget);
+    double lfu = replay(trace, CK_EVICT_ALLKEYS_LFU, 0, budget);
+    double admitted = replay(trace, CK_EVICT_ALLKEYS_LRU, 1, budget);
+    printf("skewed trace hit ratio: allkeys-lru %.3f, allkeys-lru-exact %.3f, "
+           "allkeys-lfu %.3f, allkeys-lru+tinylfu %.3f\n", sampled, exact, lfu, admitted);
+    ok(exact >= sampled, "exact LRU hit ratio at least sampled LRU");
+    ok(exact > 0.8, "exact LRU keeps the hot set");
+    ok(admitted > sampled, "tinylfu admission beats plain sampled LRU");
+
+    ck_free(trace);
+}
+
+void test_eviction_lfu_counter(void) {
+    store_t *s = store_create();
+    store_set_policy(s, CK_EVICT_ALLKEYS_LFU);
+    store_set(s, "k", "v");
+    store_entry_t *e = store_get_entry(s, "k");
+    for (int i = 0; i < 1000; i++) store_get(s, "k");
+    uint8_t c = store_lfu_counter(s, e);
+    ok(c > CK_LFU_INIT_VAL + 5 && c < 64, "lfu counter grows logarithmically");
+
+    e->last_access -= 3 * 60 * 1000;
+    ok(store_lfu_counter(s, e) == c - 3, "lfu counter decays one per idle minute");
+    s->lfu_decay_time = 0;
+    ok(store_lfu_counter(s, e) == c, "decay time 0 disables decay");
+
+    store_set(s, "k", "w");
+    e = ht_get(s->data, "k");
+    ok(e->lfu_counter >= c, "overwrite keeps the counter");
+    store_destroy(s);
+}
+
+/* hot keys with many hits (reads, or with `overwrite` SETs) survive a
+ * one-off scan under LFU */
+static int hot_keys_after_scan(ck_evict_policy_t policy, int admission, int overwrite) {
+    store_t *s = store_create();
+    store_set_policy(s, policy);
+    store_set_admission(s, admission);
+    char key[16];
+    for (int i = 0; i < 50; i++) {
+        snprintf(key, sizeof(key), "hot:%d", i);
+        store_set(s, key, "v");
+        for (int j = 0; j < 50; j++) {
+            if (overwrite) store_set(s, key, "v");
+            else store_get(s, key);
+        }
+    }
+    /* room for a few hundred scan keys, so samples mostly see scan keys */
+    s->maxmemory = ck_mem_used() + 32768;
+    for (int i = 0; i < 500; i++) {
+        snprintf(key, sizeof(key), "scan:%d", i);
+        store_set(s, key, "v");
+        eviction_check(s);
+    }
+    int kept = 0;
+    for (int i = 0; i < 50; i++) {
+        snprintf(key, sizeof(key), "hot:%d", i);
+        if (ht_get(s->data, key)) kept++;
+    }
+    store_destroy(s);
+    return kept;
+}
+
+void test_eviction_lfu_scan(void) {
+    int lfu = hot_keys_after_scan(CK_EVICT_ALLKEYS_LFU, 0, 0);
+    int lru = hot_keys_after_scan(CK_EVICT_ALLKEYS_LRU_EXACT, 0, 0);
+    int admitted = hot_keys_after_scan(CK_EVICT_ALLKEYS_LRU_EXACT, 1, 0);
+    int written = hot_keys_after_scan(CK_EVICT_ALLKEYS_LFU, 0, 1);
+    ok(lfu >= 45, "allkeys-lfu keeps hot keys through a scan");
+    ok(written >= 45, "keys kept hot by SETs alone survive it too");
+    ok(lru < lfu, "exact LRU loses hot keys to the scan");
+    ok(admitted == 50, "tinylfu admission keeps every hot key out of the scan's way");
+}
+
+void test_eviction_tinylfu_sketch(void) {
+    tinylfu_t *t = tinylfu_create(0);
+    ok(t->width == CK_TINYLFU_MIN_WIDTH, "sketch has a minimum width");
+    ok(tinylfu_estimate(t, "k") == 0, "unseen key");
+    tinylfu_record(t, "k");
+    ok(tinylfu_estimate(t, "k") == 1, "first access only reaches the doorkeeper");
+    for (int i = 0; i < 4; i++) tinylfu_record(t, "k");
+    ok(tinylfu_estimate(t, "k") == 5, "later accesses are counted");
+    for (int i = 0; i < 40; i++) tinylfu_record(t, "k");
+    ok(tinylfu_estimate(t, "k") == 16, "counters saturate at 15");
+
+    /* fill the window with other keys: counters halve, doorkeeper clears */
+    char key[16];
+    size_t n = t->sample_size - t->samples;
+    for (size_t i = 0; i < n; i++) {
+        snprintf(key, sizeof(key), "o:%zu", i % 64);
+        tinylfu_record(t, key);
+    }
+    ok(t->resets == 1, "window reset after sample_size accesses");
+    ok(tinylfu_estimate(t, "k") == 7, "counter halved, doorkeeper cleared");
+
+    tinylfu_ensure_capacity(t, 5000);
+    ok(t->width == 8192, "sketch widens with the keyspace");
+    tinylfu_destroy(t);
+}
+
+/* the sketch sees each client access of a key once, whatever the
+ * command; the server's own lookups aren't accesses */
+void test_eviction_tinylfu_accesses(void) {
+    store_t *s = store_create();
+    store_set_admission(s, 1);
+    int64_t n;
+    for (int i = 0; i < 4; i++) {
+        store_set(s, "set", "v");
+        store_set(s, "ex", "v");
+        store_expire(s, "ex", 100);
+        store_lpush(s, "list", "v");
+        store_hset(s, "hash", "f", "v");
+        store_incr(s, "n", &n);
+        store_get(s, "read");
+    }
+    tinylfu_t *t = s->admission;
+    unsigned est = tinylfu_estimate(t, "set");
+    ok(est == 4, "four writes counted four times");
+    ok(tinylfu_estimate(t, "ex") == est, "SET EX counts like SET");
+    ok(tinylfu_estimate(t, "list") == est && tinylfu_estimate(t, "hash") == est &&
+       tinylfu_estimate(t, "n") == est, "new lists, hashes and counters count like SET");
+    ok(tinylfu_estimate(t, "read") == est, "reads (and misses) count the same");
+
+    store_set(s, "set", "w");
+    ok(tinylfu_estimate(t, "set") == est + 1, "an overwrite counts once");
+    store_peek(s, "set");
+    store_ttl(s, "set");
+    store_expire(s, "set", 10);
+    store_persist(s, "set");
+    ok(tinylfu_estimate(t, "set") == est + 1, "internal lookups don't count");
+    store_destroy(s);
+}
+
+static void check_volatile_policy(ck_evict_policy_t policy) {
+    store_t *s = store_create();
+    store_set_policy(s, policy);
+    char key[16];
+    for (int i = 0; i < 20; i++) {
+        snprintf(key, sizeof(key), "p:%d", i);
+        store_set(s, key, "v");
+        snprintf(key, sizeof(key), "t:%d", i);
+        store_set(s, key, "v");
+        store_expire(s, key, 100);
+    }
+    ok(s->volatile_count == 20, "volatile index tracks keys with a TTL");
+    store_persist(s, "t:0");
+    store_del(s, "t:1");
+    store_set(s, "t:2", "overwritten");
+    ok(s->volatile_count == 17, "persist/del/overwrite leave the volatile index");
+
+    s->maxmemory = 1;
+    eviction_check(s);
+    ok(s->volatile_count == 0, "volatile-* evicts every key with a TTL");
+    ok(store_dbsize(s) == 22, "keys without a TTL are never evicted");
+    ok(eviction_over_limit(s), "still over the limit with nothing left to evict");
+    store_destroy(s);
+}
+
+void test_eviction_volatile(void) {
+    check_volatile_policy(CK_EVICT_VOLATILE_LFU);
+    check_volatile_policy(CK_EVICT_VOLATILE_LRU);
+    check_volatile_policy(CK_EVICT_VOLATILE_TTL);
+}
+
+void test_eviction_volatile_ttl(void) {
+    store_t *s = store_create();
+    store_set_policy(s, CK_EVICT_VOLATILE_TTL);
+    s->maxmemory_samples = 64;
+    char key[16];
+    for (int i = 0; i < 10; i++) {
+        snprintf(key, sizeof(key), "t:%d", i);
+        store_set(s, key, "v");
+        store_expire(s, key, 100 + i);
+    }
+    ok(eviction_run(s) == 1, "volatile-ttl evicts");
+    ok(store_get_entry(s, "t:0") == NULL, "soonest-expiring key goes first");
+    ok(eviction_run(s) == 1 && store_get_entry(s, "t:1") == NULL, "then the next soonest");
+    ok(s->evicted_keys == 2, "evictions are counted");
+    store_destroy(s);
+}
+
+void test_eviction_noeviction(void) {
+    store_t *s = store_create();
+    store_set_policy(s, CK_EVICT_NOEVICTION);
+    store_set(s, "a", "1");
+    s->maxmemory = 1;
+    ok(eviction_check(s) == 0, "noeviction never evicts");
+    ok(store_dbsize(s) == 1, "key kept");
+    ok(eviction_over_limit(s), "over limit is reported for OOM");
+    s->maxmemory = 0;
+    ok(!eviction_over_limit(s), "no limit without maxmemory");
+    store_destroy(s);
+}
+
+/* candidates deleted after being pooled are skipped, not resurrected */
+void test_eviction_pool_stale(void) {
+    store_t *s = store_create();
+    char key[16];
+    for (int i = 0; i < 64; i++) {
+        snprintf(key, sizeof(key), "k:%d", i);
+        store_set(s, key, "v");
+    }
+    ok(eviction_run(s) == 1, "sampled eviction");
+    int pooled = 0;
+    for (int i = 0; i < CK_EVPOOL_SIZE; i++) {
+        if (!s->evict_pool[i].key) continue;
+        pooled++;
+        store_del(s, s->evict_pool[i].key);
+    }
+    ok(pooled > 0, "pool keeps candidates between evictions");
+    size_t before = store_dbsize(s);
+    ok(eviction_run(s) == 1, "eviction with only stale candidates");
+    ok(store_dbsize(s) == before - 1, "exactly one live key evicted");
+
+    store_set_policy(s, CK_EVICT_ALLKEYS_RANDOM);
+    ok(eviction_run(s) == 1 && store_dbsize(s) == before - 2, "allkeys-random evicts");
+    store_destroy(s);
+}
+
+/* keys longer than the pool's inline buffer are copied to the heap */
+void test_eviction_pool_long_keys(void) {
+    store_t *s = store_create();
+    char key[400];
+    memset(key, 'x', sizeof(key) - 8);
+    for (int i = 0; i < 8; i++) {
+        snprintf(key + sizeof(key) - 8, 8, "%d", i);
+        store_set(s, key, "v");
+    }
+    s->maxmemory = 1;
+    ok(eviction_check(s) == 8, "long keys evicted");
+    store_destroy(s);
+}
+
+void test_eviction_budget(void) {
+    ok(eviction_time_limit_us(0) == 0 && eviction_time_limit_us(10) == 500,
+       "time limit grows 50us per tenacity step up to 10");
+    ok(eviction_time_limit_us(20) > 2000 && eviction_time_limit_us(20) < 2100,
+       "then 15% per step");
+    ok(eviction_time_limit_us(100) < 0, "tenacity 100 is unlimited");
+
+    size_t base = ck_mem_used();
+    store_t *s = store_create();
+    char key[16];
+    for (int i = 0; i < 4000; i++) {
+        snprintf(key, sizeof(key), "k:%d", i);
+        store_set(s, key, "v");
+    }
+    size_t used = ck_mem_used() - base;
+
+    s->eviction_tenacity = 0;
+    s->maxmemory = base + used / 8;
+    ok(eviction_perform(s) == CK_EVICT_RUNNING, "out of time with memory still over");
+    ok(store_dbsize(s) == 4000 - 16, "tenacity 0 evicts a single batch");
+    ok(s->eviction_in_progress && s->eviction_time_exceeded == 1, "running eviction is flagged");
+
+    s->maxmemory_hard = base + used / 2;
+    eviction_perform(s);
+    ok(ck_mem_used() <= s->maxmemory_hard, "time limit ignored above the hard limit");
+    ok(ck_mem_used() > s->maxmemory, "but not below it");
+
+    for (int i = 0; i < 1000 && s->eviction_in_progress; i++) eviction_cron(s);
+    ok(!s->eviction_in_progress && ck_mem_used() <= s->maxmemory, "cron finishes the eviction");
+    store_destroy(s);
+}
+
+void test_eviction_deferred_shrink(void) {
+    size_t base = ck_mem_used();
+    store_t *s = store_create();
+    char key[16];
+    for (int i = 0; i < 4000; i++) {
+        snprintf(key, sizeof(key), "k:%d", i);
+        store_set(s, key, "v");
+    }
+    size_t cap = ht_capacity(s->data);
+    s->maxmemory = base + (ck_mem_used() - base) / 10;
+    ok(eviction_check(s) > 3000, "evicted most keys");
+    ok(ht_capacity(s->data) == cap, "no table shrink while evicting");
+    eviction_cron(s);
+    ok(ht_capacity(s->data) < cap, "cron shrinks the table afterwards");
+    ok(!s->data->shrink_paused, "shrink resumed");
+    store_destroy(s);
+}
+
+static void count_removed(const char *key, void *arg) {
+    (void)key;
+    (*(int *)arg)++;
+}
+
+/* keys the store drops by itself are reported, so they can be logged */
+void test_eviction_removed_hook(void) {
+    store_t *s = store_create();
+    int removed = 0;
+    s->on_removed = count_removed;
+    s->on_removed_arg = &removed;
+    char key[16];
+    for (int i = 0; i < 8; i++) {
+        snprintf(key, sizeof(key), "k:%d", i);
+        store_set(s, key, "v");
+    }
+    store_del(s, "k:0");
+    ok(removed == 0, "deletions by a command aren't reported");
+
+    store_expire_at(s, "k:1", ck_wall_time_ms() - 1);
+    store_expire_at(s, "k:2", ck_wall_time_ms() - 1);
+    store_get(s, "k:1");
+    ok(removed == 1, "lazy expiry reported");
+    store_ttl(s, "k:2");
+    ok(removed == 2, "expiry through TTL reported");
+    ok(eviction_run(s) == 1 && removed == 3, "eviction reported");
+
+    store_set_admission(s, 1);
+    for (int i = 3; i < 8; i++) {
+        snprintf(key, sizeof(key), "k:%d", i);
+        for (int j = 0; j < 20; j++) store_get(s, key);
+    }
+    store_set(s, "new", "v");
+    ok(eviction_run(s) == 1 && s->admission_rejected == 1, "newcomer refused");
+    ok(removed == 4, "refused newcomer reported");
+    store_destroy(s);
+}
+
+/* maxmemory sizes: a sign or a value that doesn't fit is an error, not
+ * a limit nobody asked for */
+void test_eviction_maxmemory_parse(void) {
+    store_t *s = store_create();
+    command_ctx_t ctx = { .store = s };
+    char err[128];
+    ok(config_set(&ctx, "maxmemory", "64mb", err, sizeof(err)) == 0 &&
+       s->maxmemory == 64u * 1024 * 1024, "maxmemory with suffix");
+    ok(config_set(&ctx, "maxmemory", "-1", err, sizeof(err)) != 0, "negative maxmemory refused");
+    ok(config_set(&ctx, "maxmemory", " -1kb", err, sizeof(err)) != 0, "negative after space");
+    ok(config_set(&ctx, "maxmemory", "+5", err, sizeof(err)) != 0, "sign refused");
+    ok(config_set(&ctx, "maxmemory", "18446744073709551616", err, sizeof(err)) != 0,
+       "out of range refused");
+    ok(config_set(&ctx, "maxmemory", "17179869184gb", err, sizeof(err)) != 0,
+       "overflowing suffix refused");
+    ok(s->maxmemory == 64u * 1024 * 1024, "refused values leave maxmemory");
+    ok(config_set(&ctx, "maxmemory", "0", err, sizeof(err)) == 0 && s->maxmemory == 0,
+       "maxmemory off");
+    store_destroy(s);
+}
+
+int test_eviction_run(void) {
+    n_fail = 0;
+    test_eviction_exact_order();
+    test_eviction_policy_switch();
+    test_eviction_hit_ratio();
+    test_eviction_lfu_counter();
+    test_eviction_lfu_scan();
+    test_eviction_tinylfu_sketch();
+    test_eviction_tinylfu_accesses();
+    test_eviction_volatile();
+    test_eviction_volatile_ttl();
+    test_eviction_noeviction();
+    test_eviction_pool_stale();
+    test_eviction_pool_long_keys();
+    test_eviction_budget();
+    test_eviction_deferred_shrink();
+    test_eviction_removed_hook();
+    test_eviction_maxmemory_parse();
+    return n_fail;
+}
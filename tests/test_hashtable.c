@@ -40,5 +40,22 @@ int test_hashtable_run(void) {
     ok(ht_count(ht) == 101, "count after 100 inserts");
 
     ht_destroy(ht);
+
+    /* presized table: no resize while filling, keys taken over */
+    ht = ht_create(16, NULL);
+    ht_reserve(ht, 1000);
+    size_t cap = ht_capacity(ht);
+    ok(cap >= 1000 / 0.7, "reserve capacity");
+    for (int i = 0; i < 1000; i++) {
+        char key[16];
+        snprintf(key, sizeof(key), "key%d", i);
+        ht_replace_owned(ht, ck_strdup(key), NULL, NULL, NULL);
+    }
+    ok(ht_capacity(ht) == cap && ht_count(ht) == 1000, "no resize after reserve");
+    const char *stored = ht_get_key(ht, "key7");
+    const char *again;
+    ok(ht_replace_owned(ht, ck_strdup("key7"), NULL, NULL, &again) == 0 && again == stored,
+       "owned duplicate keeps the stored key");
+    ht_destroy(ht);
     return n_fail;
 }
@@ -0,0 +1,84 @@
+#include "lz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int n_fail;
+
+static void ok(int cond, const char *msg) {
+    if (!cond) {
+        fprintf(stderr, "FAIL: %s\n", msg);
+        n_fail++;
+    }
+}
+
+static int round_trip(const uint8_t *in, size_t n, int level, size_t *zlen) {
+    uint8_t *z = malloc(lz_bound(n));
+    uint8_t *out = malloc(n + 1);
+    *zlen = lz_compress(in, n, z, lz_bound(n), level);
+    int same = *zlen > 0 && lz_decompress(z, *zlen, out, n) == 0 && memcmp(in, out, n) == 0;
+    free(z);
+    free(out);
+    return same;
+}
+
+int test_lz_run(void) {
+    n_fail = 0;
+    size_t n = 256 * 1024, zlen;
+
+    /* repetitive JSON-ish text */
+    uint8_t *text = malloc(n);
+    size_t pos = 0;
+    for (int i = 0; pos < n; i++) {
+        char rec[96];
+        int len = snprintf(rec, sizeof(rec), "{\"id\":%d,\"name\":\"user%d\",\"active\":true},", i,
+                           i % 100);
+        for (int j = 0; j < len && pos < n; j++) text[pos++] = (uint8_t)rec[j];
+    }
+    for (int level = CK_LZ_MIN_LEVEL; level <= CK_LZ_MAX_LEVEL; level++) {
+        ok(round_trip(text, n, level, &zlen), "text round trip");
+        ok(zlen < n / 3, "text compresses");
+    }
+
+    /* long runs: overlapping matches and long lengths */
+    uint8_t *runs = calloc(n, 1);
+    memset(runs + n / 2, 'x', n / 4);
+    ok(round_trip(runs, n, 1, &zlen) && zlen < 2048, "runs round trip");
+
+    /* random bytes don't shrink; a tight cap makes compress give up */
+    uint8_t *rnd = malloc(n);
+    uint32_t x = 12345;
+    for (size_t i = 0; i < n; i++) {
+        x = x * 1103515245 + 12345;
+        rnd[i] = (uint8_t)(x >> 16);
+    }
+    ok(round_trip(rnd, n, 5, &zlen), "random round trip");
+    uint8_t *z = malloc(lz_bound(n));
+    ok(lz_compress(rnd, n, z, n - n / 16, 5) == 0, "incompressible gives up");
+
+    /* tiny and empty inputs */
+    ok(round_trip((const uint8_t *)"abc", 3, 1, &zlen), "tiny round trip");
+    uint8_t none[1];
+    ok(lz_compress(text, 0, z, 16, 1) == 1 && lz_decompress(z, 1, none, 0) == 0, "empty");
+
+    /* damaged input is refused, never overruns */
+    uint8_t *out = malloc(n);
+    zlen = lz_compress(text, n, z, lz_bound(n), 1);
+    ok(lz_decompress(z, zlen, out, n - 1) != 0, "wrong size refused");
+    ok(lz_decompress(z, zlen / 2, out, n) != 0, "truncated refused");
+    int refused = 0;
+    for (int i = 0; i < 64; i++) {
+        uint8_t saved = z[i * 7];
+        z[i * 7] ^= 0x5a;
+        if (lz_decompress(z, zlen, out, n) != 0 || memcmp(out, text, n) != 0) refused++;
+        z[i * 7] = saved;
+    }
+    ok(refused > 0, "damage detected");
+
+    free(out);
+    free(z);
+    free(rnd);
+    free(runs);
+    free(text);
+    return n_fail;
+}
@@ -1,9 +1,15 @@
 #include "store.h"
 #include "persistence.h"
+#include "aof.h"
+#include "child.h"
+#include "fmap.h"
+#include "hashtable.h"
 #include "util.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
 
 static int n_fail;
 
@@ -14,6 +20,1006 @@ static void ok(int cond, const char *msg) {
     }
 }
 
+static int wait_child(child_result_t *res) {
+    struct timespec ts = { 0, 10 * 1000 * 1000 };
+    for (int i = 0; i < 1000; i++) {
+        if (child_poll(res)) return 1;
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
+/* BGSAVE writes the store as it was at fork time, not what the parent
+ * changes afterwards */
+static void test_bgsave(void) {
+    const char *path = "build/test_bgsave.ckdb";
+    store_t *s = store_create();
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        store_set(s, key, "value");
+    }
+
+    ok(persistence_bgsave(s, path) == 0, "bgsave started");
+    ok(child_active() && child_type() == CK_CHILD_RDB, "child running");
+    ok(persistence_bgsave(s, path) == -1, "second bgsave refused");
+    store_set(s, "after-fork", "x");
+
+    child_result_t res;
+    ok(wait_child(&res), "child exited");
+    ok(res.type == CK_CHILD_RDB && res.ok, "child saved");
+    ok(!child_active(), "no child after reaping");
+    persistence_bgsave_done(res.ok, res.cow_bytes, res.duration_ms);
+    ok(persistence_last_bgsave_ok(), "bgsave status ok");
+    ok(persistence_lastsave() > 0, "lastsave set");
+    store_destroy(s);
+
+    s = store_create();
+    ok(persistence_load(s, path) == 0, "load bgsave");
+    ok(store_dbsize(s) == 1000, "bgsave dbsize");
+    ok(store_get(s, "key:999") != NULL, "bgsave key");
+    ok(store_get(s, "after-fork") == NULL, "bgsave is point-in-time");
+    store_destroy(s);
+    remove(path);
+}
+
+static void test_resize_guard(void) {
+    hashtable_t *ht = ht_create(16, NULL);
+    char key[32];
+    ht_set_resize_allowed(0);
+    for (int i = 0; i < 13; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        ht_set(ht, key, NULL);
+    }
+    ok(ht_capacity(ht) == 16, "no grow at 0.8 load while disallowed");
+    for (int i = 13; i < 16; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        ht_set(ht, key, NULL);
+    }
+    ok(ht_capacity(ht) == 32, "forced grow near full");
+    for (int i = 0; i < 15; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        ht_delete(ht, key);
+    }
+    ok(ht_capacity(ht) == 32, "no shrink while disallowed");
+    ht_set_resize_allowed(1);
+    ok(ht_shrink_if_needed(ht) && ht_capacity(ht) < 32, "shrink once allowed");
+    ht_destroy(ht);
+}
+
+static void run(command_ctx_t *ctx, int argc, const char **argv) {
+    resp_buf_t req, reply;
+    resp_buf_init(&req);
+    resp_buf_init(&reply);
+    resp_write_array_header(&req, argc);
+    for (int i = 0; i < argc; i++) {
+        resp_write_bulk_string(&req, argv[i], strlen(argv[i]));
+    }
+
+    resp_parser_t p;
+    resp_parser_init(&p);
+    resp_parser_feed(&p, req.buf, req.len);
+    resp_value_t *cmd;
+    if (resp_parse(&p, &cmd) == 1) {
+        command_dispatch(ctx, cmd, &reply);
+        resp_value_free(cmd);
+    }
+    resp_parser_destroy(&p);
+    resp_buf_destroy(&req);
+    resp_buf_destroy(&reply);
+}
+
+#define RUN(ctx, ...) do { \
+    const char *argv_[] = { __VA_ARGS__ }; \
+    run(ctx, (int)(sizeof(argv_) / sizeof(argv_[0])), argv_); \
+} while (0)
+
+static long file_size(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fclose(f);
+    return n;
+}
+
+static int file_contains(const char *path, const char *needle) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+    char buf[4096];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    return strstr(buf, needle) != NULL;
+}
+
+/* after a base, saves only append what changed; a load applies the
+ * deltas in order, drops a torn one at the end, and a big enough pile of
+ * them is merged into a new base */
+static void test_delta(void) {
+    const char *path = "build/test_delta.ckdb";
+    const char *dpath = "build/test_delta.ckdb.delta";
+    remove(path);
+    remove(dpath);
+    store_t *s = store_create();
+    persistence_set_delta(s, 1);
+    persistence_set_delta_compact_percentage(0);
+
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        store_set(s, key, "value");
+    }
+    store_set_int(s, "n", 1);
+    store_rpush(s, "list", "a");
+    store_hset(s, "hash", "f1", "v1");
+    ok(store_delta_count(s) == 1003, "new keys tracked");
+    ok(persistence_save(s, path) == 0, "delta base save");
+    long base = file_size(path);
+    ok(file_size(dpath) == CK_RDB_DELTA_HEADER, "empty delta file");
+    ok(persistence_base_size() == (uint64_t)base, "base size");
+    ok(store_delta_count(s) == 0, "base clears tracking");
+
+    store_set(s, "key:1", "changed");
+    store_set(s, "key:1", "changed twice");
+    store_del(s, "key:2");
+    store_expire(s, "key:3", 1000);
+    int64_t n;
+    store_incr(s, "n", &n);
+    store_rpush(s, "list", "b");
+    store_hset(s, "hash", "f2", "v2");
+    store_set(s, "new", "x");
+    store_get(s, "key:4");
+    ok(store_delta_count(s) == 7, "changed keys tracked once");
+    ok(persistence_save(s, path) == 0, "delta save");
+    long first = file_size(dpath);
+    ok(file_size(path) == base, "base untouched");
+    ok(first > CK_RDB_DELTA_HEADER && first < base / 4, "delta is small");
+
+    store_del(s, "new");
+    store_set(s, "key:2", "back");
+    ok(persistence_save(s, path) == 0, "second delta save");
+    long second = file_size(dpath);
+    ok(second > first, "delta appended");
+
+    /* a torn record at the end is ignored, then cut off */
+    FILE *f = fopen(dpath, "ab");
+    const uint8_t torn[] = { CK_RDB_OPCODE_DELTA, 1, 2, 3 };
+    fwrite(torn, 1, sizeof(torn), f);
+    fclose(f);
+
+    store_t *l = store_create();
+    ok(persistence_load(l, path) == 0, "delta load");
+    ok(store_dbsize(l) == store_dbsize(s), "delta dbsize");
+    const char *v = store_get(l, "key:1");
+    ok(v && strcmp(v, "changed twice") == 0, "delta overwrite");
+    v = store_get(l, "key:2");
+    ok(v && strcmp(v, "back") == 0, "delta recreate");
+    ok(store_get(l, "new") == NULL, "delta delete");
+    ok(store_ttl(l, "key:3") > 900, "delta ttl");
+    ok(store_get_int(l, "n", &n) == 0 && n == 2, "delta incr");
+    ok(store_llen(l, "list") == 2, "delta list");
+    ok(store_hget(l, "hash", "f2") != NULL, "delta hash");
+    ok(persistence_delta_size() == (uint64_t)second, "torn record not counted");
+    store_destroy(l);
+
+    /* the second save here lands where the torn record was */
+    store_set(s, "key:5", "after torn");
+    ok(persistence_save(s, path) == 0, "delta after torn");
+    l = store_create();
+    ok(persistence_load(l, path) == 0, "load after torn");
+    v = store_get(l, "key:5");
+    ok(v && strcmp(v, "after torn") == 0, "delta after torn applied");
+    store_destroy(l);
+
+    /* a damaged record stops the replay there */
+    long third = file_size(dpath);
+    f = fopen(dpath, "r+b");
+    fseek(f, third - 3, SEEK_SET);
+    fputc(0xAA, f);
+    fclose(f);
+    l = store_create();
+    ok(persistence_load(l, path) == 0, "load damaged delta");
+    v = store_get(l, "key:5");
+    ok(v && strcmp(v, "value") == 0, "damaged delta dropped");
+    v = store_get(l, "key:2");
+    ok(v && strcmp(v, "back") == 0, "earlier deltas kept");
+    store_destroy(l);
+
+    /* FLUSHDB can't be a delta */
+    store_set(s, "key:5", "again");
+    ok(persistence_save(s, path) == 0, "delta over damaged one");
+    store_flushdb(s);
+    store_set(s, "only", "1");
+    ok(persistence_save(s, path) == 0, "save after flush");
+    ok(file_size(dpath) == CK_RDB_DELTA_HEADER, "flush writes a base");
+
+    /* compaction: deltas past the percentage make the next save a base */
+    persistence_set_delta_compact_percentage(1);
+    for (int i = 0; i < 50; i++) {
+        snprintf(key, sizeof(key), "more:%d", i);
+        store_set(s, key, "value value value");
+    }
+    ok(persistence_save(s, path) == 0, "delta before compaction");
+    ok(file_size(dpath) > CK_RDB_DELTA_HEADER, "delta written");
+    store_set(s, "last", "1");
+    ok(persistence_save(s, path) == 0, "compacting save");
+    ok(file_size(dpath) == CK_RDB_DELTA_HEADER, "compacted into a base");
+    l = store_create();
+    ok(persistence_load(l, path) == 0 && store_dbsize(l) == 52, "compacted load");
+    store_destroy(l);
+
+    /* a BGSAVE delta keeps what changed while the child ran */
+    store_set(s, "bg", "1");
+    ok(persistence_bgsave(s, path) == 0, "delta bgsave");
+    store_set(s, "bg2", "2");
+    child_result_t res;
+    ok(wait_child(&res) && res.ok, "delta child saved");
+    persistence_bgsave_done(res.ok, res.cow_bytes, res.duration_ms);
+    ok(store_delta_count(s) == 1, "write after fork still pending");
+    l = store_create();
+    ok(persistence_load(l, path) == 0, "load bgsave delta");
+    ok(store_get(l, "bg") != NULL && store_get(l, "bg2") == NULL, "bgsave delta point-in-time");
+    store_destroy(l);
+
+    /* a delta file from another base is ignored */
+    persistence_set_delta(s, 0);
+    ok(persistence_save(s, path) == 0, "full save with deltas off");
+    ok(file_size(dpath) == -1, "delta file removed");
+    persistence_set_delta_compact_percentage(100);
+    store_destroy(s);
+    remove(path);
+}
+
+/* a delta left next to a newer base (a crash after the rename) doesn't
+ * apply to it, even when the two bases are the same size and were saved
+ * in the same second */
+static void test_delta_stale(void) {
+    const char *path = "build/test_delta_stale.ckdb";
+    const char *dpath = "build/test_delta_stale.ckdb.delta";
+    remove(path);
+    remove(dpath);
+    store_t *s = store_create();
+    persistence_set_delta(s, 1);
+    persistence_set_delta_compact_percentage(0);
+    store_set(s, "k", "aaaa");
+    ok(persistence_save(s, path) == 0, "stale: base save");
+    store_set(s, "k", "bbbb");
+    ok(persistence_save(s, path) == 0, "stale: delta save");
+
+    char old[4096];
+    FILE *f = fopen(dpath, "rb");
+    size_t n = f ? fread(old, 1, sizeof(old), f) : 0;
+    if (f) fclose(f);
+    ok(n > CK_RDB_DELTA_HEADER && memcmp(old, CK_RDB_DELTA_MAGIC, 8) == 0, "stale: delta written");
+
+    /* same content as the first base, so the same size */
+    long base = file_size(path);
+    store_set(s, "k", "aaaa");
+    persistence_set_delta_compact_percentage(1);
+    ok(persistence_save(s, path) == 0 && file_size(path) == base, "stale: new base");
+    f = fopen(dpath, "wb");
+    if (f) {
+        fwrite(old, 1, n, f);
+        fclose(f);
+    }
+
+    store_t *l = store_create();
+    ok(persistence_load(l, path) == 0, "stale: load");
+    const char *v = store_get(l, "k");
+    ok(v && strcmp(v, "aaaa") == 0, "stale delta ignored");
+    ok(file_size(dpath) == CK_RDB_DELTA_HEADER, "stale delta replaced");
+    store_destroy(l);
+
+    persistence_set_delta(s, 0);
+    persistence_set_delta_compact_percentage(100);
+    store_destroy(s);
+    remove(path);
+    remove(dpath);
+}
+
+static void wait_thread_save(store_t *s, const char *path) {
+    struct timespec ts = { 0, 1000 * 1000 };
+    for (int i = 0; i < 10000 && persistence_bgsave_in_progress(); i++) {
+        persistence_cron(s, path);
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void test_thread_bgsave(void) {
+    const char *path = "build/test_thread.ckdb";
+    const char *dpath = "build/test_thread.ckdb.delta";
+    remove(path);
+    remove(dpath);
+    store_t *s = store_create();
+    persistence_set_bgsave_method(CK_RDB_BGSAVE_THREAD);
+    persistence_set_delta(s, 1);
+    persistence_set_delta_compact_percentage(0);
+
+    char key[32], val[32];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        snprintf(val, sizeof(val), "v:%d", i);
+        store_set(s, key, val);
+    }
+    store_set_int(s, "n", 5);
+    store_rpush(s, "list", "a");
+    store_rpush(s, "list", "b");
+    store_hset(s, "hash", "f", "v");
+
+    ok(persistence_bgsave(s, path) == 0, "thread bgsave started");
+    ok(persistence_bgsave_in_progress(), "thread bgsave in progress");
+    ok(persistence_bgsave(s, path) == -1, "second bgsave refused");
+    ok(persistence_save(s, path) == -1, "save refused during thread bgsave");
+
+    /* whatever the thread hasn't written yet must come out as it was */
+    int locked = store_lock(s);
+    ok(locked, "store locked for the snapshot");
+    for (int i = 0; i < 20000; i += 7) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        store_set(s, key, "changed");
+    }
+    for (int i = 1; i < 20000; i += 11) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        store_del(s, key);
+    }
+    int64_t n;
+    store_incr(s, "n", &n);
+    store_rpush(s, "list", "c");
+    ck_free(store_lpop(s, "list"));
+    store_hset(s, "hash", "f2", "v2");
+    store_expire(s, "key:2", 1000);
+    store_set(s, "new", "x");
+    store_unlock(s, locked);
+
+    locked = store_lock(s);
+    store_flushdb(s);
+    store_set(s, "post", "flush");
+    store_unlock(s, locked);
+
+    wait_thread_save(s, path);
+    ok(!persistence_bgsave_in_progress(), "thread bgsave finished");
+    ok(persistence_last_bgsave_ok(), "thread bgsave ok");
+    ok(persistence_last_preimage_bytes() > 0, "pre-images taken");
+
+    store_t *l = store_create();
+    ok(persistence_load(l, path) == 0, "load thread snapshot");
+    ok(store_dbsize(l) == 20003, "thread snapshot dbsize");
+    const char *v = store_get(l, "key:7");
+    ok(v && strcmp(v, "v:7") == 0, "thread snapshot keeps overwritten value");
+    v = store_get(l, "key:12");
+    ok(v && strcmp(v, "v:12") == 0, "thread snapshot keeps deleted key");
+    ok(store_ttl(l, "key:2") == -1, "thread snapshot keeps old ttl");
+    ok(store_get_int(l, "n", &n) == 0 && n == 5, "thread snapshot keeps old int");
+    char *items[4];
+    ok(store_lrange(l, "list", 0, -1, items, 4) == 2 && strcmp(items[0], "a") == 0 &&
+       strcmp(items[1], "b") == 0, "thread snapshot keeps old list");
+    ok(store_hget(l, "hash", "f2") == NULL, "thread snapshot keeps old hash");
+    ok(store_get(l, "new") == NULL && store_get(l, "post") == NULL,
+       "thread snapshot has no later keys");
+    store_destroy(l);
+
+    /* the flush makes the next save a full one, then a delta */
+    ok(persistence_bgsave(s, path) == 0, "thread bgsave after flush");
+    wait_thread_save(s, path);
+    ok(persistence_last_bgsave_ok(), "full thread bgsave after flush");
+    store_set(s, "d1", "1");
+    store_set(s, "post", "changed");
+    ok(persistence_bgsave(s, path) == 0, "thread delta bgsave");
+    locked = store_lock(s);
+    store_set(s, "d1", "later");
+    store_del(s, "post");
+    store_set(s, "d2", "later");
+    store_unlock(s, locked);
+    wait_thread_save(s, path);
+    ok(persistence_last_bgsave_ok(), "thread delta bgsave ok");
+    ok(file_size(dpath) > CK_RDB_DELTA_HEADER, "thread delta written");
+
+    l = store_create();
+    ok(persistence_load(l, path) == 0, "load thread delta");
+    ok(store_dbsize(l) == 2, "thread delta dbsize");
+    v = store_get(l, "d1");
+    ok(v && strcmp(v, "1") == 0, "thread delta point-in-time");
+    v = store_get(l, "post");
+    ok(v && strcmp(v, "changed") == 0, "thread delta keeps deleted key");
+    store_destroy(l);
+
+    persistence_set_delta(s, 0);
+    persistence_set_delta_compact_percentage(100);
+    persistence_set_bgsave_method(CK_RDB_BGSAVE_FORK);
+    store_destroy(s);
+    remove(path);
+    remove(dpath);
+}
+
+/* while a child exists tables only grow when nearly full */
+
+/* write commands count the keys they change; a save point starts a
+ * BGSAVE once enough of them have built up, and only then */
+static void test_save_points(void) {
+    const char *path = "build/test_savepoint.ckdb";
+    store_t *s = store_create();
+    command_ctx_t ctx = { .store = s, .rdb_filename = path };
+    char buf[128];
+
+    ok(persistence_set_save_points("900 1 300 10") == 0, "save points set");
+    persistence_save_points(buf, sizeof(buf));
+    ok(strcmp(buf, "900 1 300 10") == 0, "save points read back");
+    ok(persistence_set_save_points("900") == -1, "save point needs changes");
+    ok(persistence_set_save_points("0 1") == -1, "save point needs seconds");
+    ok(persistence_set_save_points("60 1x") == -1, "save point garbage");
+    persistence_save_points(buf, sizeof(buf));
+    ok(strcmp(buf, "900 1 300 10") == 0, "invalid spec keeps points");
+
+    persistence_reset_dirty();
+    RUN(&ctx, "SET", "a", "1");
+    RUN(&ctx, "SET", "b", "2");
+    RUN(&ctx, "DEL", "a", "missing");
+    RUN(&ctx, "GET", "b");
+    RUN(&ctx, "LPUSH", "b", "wrongtype");
+    ok(persistence_dirty() == 3, "dirty counts changed keys");
+
+    /* not due yet, and nothing happens without writes */
+    ok(persistence_set_save_points("1 3") == 0, "short save point");
+    persistence_cron(s, path);
+    ok(!child_active(), "save point not due");
+    ok(persistence_save(s, path) == 0 && persistence_dirty() == 0, "save clears dirty");
+    ok(persistence_last_save_duration_ms() >= 0, "save duration");
+
+    struct timespec ts = { 1, 50 * 1000 * 1000 };
+    nanosleep(&ts, NULL);
+    persistence_cron(s, path);
+    ok(!child_active(), "idle instance not saved");
+
+    RUN(&ctx, "SET", "c", "3");
+    RUN(&ctx, "SET", "d", "4");
+    RUN(&ctx, "INCR", "n");
+    persistence_cron(s, path);
+    ok(child_type() == CK_CHILD_RDB, "save point started bgsave");
+    RUN(&ctx, "SET", "e", "5");
+
+    child_result_t res;
+    ok(wait_child(&res) && res.ok, "save point child saved");
+    persistence_bgsave_done(res.ok, res.cow_bytes, res.duration_ms);
+    ok(persistence_dirty() == 1, "writes after fork stay dirty");
+    persistence_cron(s, path);
+    ok(!child_active(), "save point clock restarted");
+
+    ok(persistence_set_save_points("") == 0, "save points off");
+    persistence_save_points(buf, sizeof(buf));
+    ok(buf[0] == '\0', "no save points");
+    persistence_reset_dirty();
+
+    /* a client can't make SAVE write somewhere else */
+    RUN(&ctx, "CONFIG", "SET", "rdb", "build/elsewhere.ckdb");
+    ok(strcmp(ctx.rdb_filename, path) == 0, "rdb not changed at runtime");
+    store_destroy(s);
+    remove(path);
+}
+
+/* writes go to the log and a replay rebuilds the same dataset */
+static void test_aof(void) {
+    const char *path = "build/test.aof";
+    remove(path);
+    store_t *s = store_create();
+    command_ctx_t ctx = { .store = s };
+
+    aof_set_filename(path);
+    aof_set_fsync(CK_AOF_FSYNC_ALWAYS);
+    aof_set_appendonly(s, 1);
+    ok(aof_start(s) == 0 && aof_enabled(), "aof started");
+
+    RUN(&ctx, "SET", "str", "hello");
+    RUN(&ctx, "SET", "gone", "x");
+    RUN(&ctx, "DEL", "gone");
+    RUN(&ctx, "INCR", "counter");
+    RUN(&ctx, "INCR", "counter");
+    RUN(&ctx, "RPUSH", "list", "a");
+    RUN(&ctx, "RPUSH", "list", "b");
+    RUN(&ctx, "HSET", "hash", "f", "v");
+    RUN(&ctx, "SET", "tmp", "t", "EX", "100");
+    RUN(&ctx, "EXPIRE", "str", "200");
+    RUN(&ctx, "GET", "str");
+    RUN(&ctx, "LPUSH", "str", "wrongtype");
+    ok(aof_buffer_length() > 0, "writes buffered until flush");
+
+    uint64_t fsyncs = aof_fsync_count();
+    ok(aof_flush() == 0, "aof flush");
+    ok(aof_fsync_count() == fsyncs + 1, "one fsync for the whole batch");
+    ok(aof_buffer_length() == 0, "buffer written");
+    aof_stop();
+
+    ok(!file_contains(path, "EXPIRE\r\n"), "relative EXPIRE not logged");
+    ok(file_contains(path, "PEXPIREAT"), "expiry logged as PEXPIREAT");
+    ok(!file_contains(path, "GET"), "reads not logged");
+    ok(!file_contains(path, "wrongtype"), "failed writes not logged");
+    store_destroy(s);
+
+    s = store_create();
+    ctx.store = s;
+    ok(aof_load(&ctx, path) == 11, "replayed 11 commands");
+    ok(store_dbsize(s) == 5, "aof dbsize");
+    const char *v = store_get(s, "str");
+    ok(v && strcmp(v, "hello") == 0, "aof string");
+    int64_t n;
+    ok(store_get_int(s, "counter", &n) == 0 && n == 2, "aof counter");
+    ok(store_llen(s, "list") == 2, "aof list");
+    v = store_hget(s, "hash", "f");
+    ok(v && strcmp(v, "v") == 0, "aof hash");
+    ok(store_ttl(s, "tmp") > 90 && store_ttl(s, "tmp") <= 100, "aof SET EX ttl");
+    ok(store_ttl(s, "str") > 190 && store_ttl(s, "str") <= 200, "aof EXPIRE ttl");
+
+    /* a crash mid-append leaves half a command at the end */
+    long good = file_size(path);
+    FILE *f = fopen(path, "ab");
+    fputs("*3\r\n$3\r\nSET\r\n$1\r\nz", f);
+    fclose(f);
+    store_destroy(s);
+    s = store_create();
+    ctx.store = s;
+    ok(aof_load(&ctx, path) == 11, "truncated tail ignored");
+    ok(file_size(path) == good, "truncated tail cut from the file");
+    store_destroy(s);
+
+    /* turning the log on with data already loaded starts it from that */
+    remove(path);
+    s = store_create();
+    ctx.store = s;
+    store_set(s, "a", "1");
+    store_rpush(s, "l", "x");
+    store_expire(s, "a", 50);
+    ok(aof_start(s) == 0, "aof restarted");
+    aof_stop();
+    store_destroy(s);
+    s = store_create();
+    ctx.store = s;
+    ok(aof_load(&ctx, path) > 0, "load seeded aof");
+    ok(store_dbsize(s) == 2 && store_ttl(s, "a") > 0, "seeded dataset");
+    store_destroy(s);
+
+    aof_set_appendonly(NULL, 0);
+    remove(path);
+}
+
+/* a rewrite compacts the log, keeps writes made while the child ran, and
+ * replays to the same dataset */
+static void test_aof_rewrite(void) {
+    const char *path = "build/test_rewrite.aof";
+    remove(path);
+    store_t *s = store_create();
+    command_ctx_t ctx = { .store = s };
+    char num[32];
+
+    aof_set_filename(path);
+    aof_set_fsync(CK_AOF_FSYNC_NO);
+    aof_set_appendonly(s, 1);
+    aof_start(s);
+    for (int i = 0; i < 500; i++) {
+        snprintf(num, sizeof(num), "%d", i);
+        RUN(&ctx, "SET", "counter", num);
+        RUN(&ctx, "RPUSH", "list", num);
+    }
+    RUN(&ctx, "SET", "ttl", "t", "EX", "100");
+    aof_flush();
+    long before = file_size(path);
+    size_t idle = aof_memory();
+
+    ok(aof_rewrite_start(s) == 0, "rewrite started");
+    ok(aof_rewrite_start(s) == -1, "one rewrite at a time");
+    RUN(&ctx, "SET", "during", "rewrite");
+    RUN(&ctx, "DEL", "counter");
+    aof_flush();
+    size_t during = aof_memory();
+    ok(during > idle, "rewrite buffer counted as AOF memory");
+
+    child_result_t res;
+    ok(wait_child(&res) && res.type == CK_CHILD_AOF && res.ok, "rewrite child done");
+    aof_rewrite_done(res.ok, res.cow_bytes, res.duration_ms);
+    ok(aof_last_rewrite_ok() && !aof_rewrite_in_progress(), "rewrite installed");
+    ok(file_size(path) < before / 2, "rewritten log is smaller");
+    ok(aof_base_size() == (size_t)file_size(path), "base size reset");
+    ok(file_contains(path, CK_RDB_MAGIC), "log starts with a snapshot");
+    ok(aof_memory() < during, "rewrite buffer given back");
+
+    RUN(&ctx, "SET", "after", "swap");
+    aof_stop();
+    ok(aof_memory() == 0, "AOF memory all given back");
+    store_destroy(s);
+
+    s = store_create();
+    ctx.store = s;
+    ok(aof_load(&ctx, path) == 3, "tail replayed after preamble");
+    ok(store_llen(s, "list") == 500, "rewrite list");
+    ok(store_get(s, "counter") == NULL, "delete during rewrite kept");
+    ok(store_get(s, "during") != NULL, "write during rewrite kept");
+    ok(store_get(s, "after") != NULL, "write after swap kept");
+    ok(store_ttl(s, "ttl") > 90, "rewrite ttl");
+
+    /* growth past the percentage starts a rewrite from the cron */
+    aof_set_rewrite_min_size(1);
+    aof_set_rewrite_percentage(100);
+    aof_start(s);
+    aof_cron(s);
+    ok(!aof_rewrite_in_progress(), "no rewrite before growth");
+    for (int i = 0; i < 200; i++) {
+        snprintf(num, sizeof(num), "%d", i);
+        RUN(&ctx, "RPUSH", "list", num);
+    }
+    aof_flush();
+    aof_cron(s);
+    ok(aof_rewrite_in_progress(), "automatic rewrite on growth");
+    ok(wait_child(&res) && res.ok, "automatic rewrite done");
+    aof_rewrite_done(res.ok, res.cow_bytes, res.duration_ms);
+    aof_stop();
+    store_destroy(s);
+
+    aof_set_rewrite_min_size(64 * 1024 * 1024);
+    aof_set_appendonly(NULL, 0);
+    remove(path);
+}
+
+/* keys the server drops by itself are logged as deletions, so a replay
+ * (which never evicts) doesn't bring them back */
+static void test_aof_removed(void) {
+    const char *path = "build/test.aof";
+    remove(path);
+    store_t *s = store_create();
+    command_ctx_t ctx = { .store = s };
+    s->on_removed = command_key_removed;
+    s->on_removed_arg = &ctx;
+
+    aof_set_filename(path);
+    aof_set_fsync(CK_AOF_FSYNC_NO);
+    aof_set_appendonly(s, 1);
+    aof_start(s);
+
+    char key[16];
+    for (int i = 0; i < 20; i++) {
+        snprintf(key, sizeof(key), "k:%d", i);
+        RUN(&ctx, "SET", key, "v");
+    }
+    RUN(&ctx, "SET", "tmp", "t");
+    RUN(&ctx, "PEXPIREAT", "tmp", "1");
+    RUN(&ctx, "GET", "tmp");
+    ok(s->expired_keys == 1, "key expired on access");
+
+    s->maxmemory = 1;
+    s->eviction_tenacity = 100;
+    RUN(&ctx, "DBSIZE");
+    ok(s->evicted_keys == 20 && store_dbsize(s) == 0, "every key evicted");
+    aof_flush();
+    aof_stop();
+    ok(file_contains(path, "UNLINK\r\n$3\r\ntmp"), "expiry logged");
+    ok(file_contains(path, "UNLINK\r\n$4\r\nk:"), "evictions logged");
+    store_destroy(s);
+
+    s = store_create();
+    ctx.store = s;
+    ok(aof_load(&ctx, path) == 43, "replayed sets and deletions");
+    ok(store_dbsize(s) == 0, "evicted and expired keys stay gone");
+    store_destroy(s);
+
+    aof_set_appendonly(NULL, 0);
+    remove(path);
+}
+
+/* round trip across the writer's buffer boundary, with negative
+ * integers and TTLs */
+static void test_format(void) {
+    const char *path = "build/test_format.ckdb";
+    store_t *s = store_create();
+    size_t big_len = 700 * 1024;
+    char *big = malloc(big_len + 1);
+    for (size_t i = 0; i < big_len; i++) big[i] = (char)('a' + i % 26);
+    big[big_len] = '\0';
+
+    store_set(s, "big", big);
+    store_set_int(s, "neg", -123456789);
+    store_set_int(s, "min", INT64_MIN);
+    char key[32];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "k%d", i);
+        store_set(s, key, key);
+    }
+    store_expire_at(s, "k7", ck_wall_time_ms() + 60000);
+    store_set(s, "dead", "x");
+    store_expire_at(s, "dead", ck_wall_time_ms() - 1);
+    ok(persistence_save(s, path) == 0, "format save");
+    store_destroy(s);
+
+    FILE *f = fopen(path, "rb");
+    unsigned char hdr[12];
+    ok(f && fread(hdr, 1, 12, f) == 12 && hdr[8] == CK_RDB_VERSION && hdr[9] == 0,
+       "format little-endian version");
+    if (f) fclose(f);
+
+    s = store_create();
+    ok(persistence_load(s, path) == 0, "format load");
+    ok(store_dbsize(s) == 20003, "format dbsize skips expired");
+    const char *v = store_get(s, "big");
+    ok(v && strlen(v) == big_len && memcmp(v, big, big_len) == 0, "format large value");
+    int64_t n;
+    ok(store_get_int(s, "neg", &n) == 0 && n == -123456789, "format negative int");
+    ok(store_get_int(s, "min", &n) == 0 && n == INT64_MIN, "format INT64_MIN");
+    ok(store_ttl(s, "k7") > 50 && store_ttl(s, "k19999") == -1, "format ttl");
+    store_destroy(s);
+    free(big);
+    remove(path);
+}
+
+/* many chunks decoded on several threads, a damaged chunk dropped on
+ * its own, a missing index and a snapshot embedded in a stream */
+static void test_chunks(void) {
+    const char *path = "build/test_chunks.ckdb";
+    store_t *s = store_create();
+    char key[32], val[96];
+    for (int i = 0; i < 50000; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        snprintf(val, sizeof(val), "value-%d-%060d", i, i);
+        store_set(s, key, val);
+    }
+    for (int i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "list:%d", i);
+        for (int j = 0; j < 20; j++) store_rpush(s, key, "element");
+        snprintf(key, sizeof(key), "hash:%d", i);
+        for (int j = 0; j < 20; j++) {
+            snprintf(val, sizeof(val), "f%d", j);
+            store_hset(s, key, val, "v");
+        }
+    }
+    store_expire_at(s, "key:7", ck_wall_time_ms() + 60000);
+    ok(persistence_save(s, path) == 0, "chunked save");
+    size_t total = store_dbsize(s);
+    store_destroy(s);
+
+    long size = file_size(path);
+    ok(size > 4 * CK_RDB_CHUNK_SIZE, "several chunks");
+    FILE *f = fopen(path, "rb");
+    char magic[8];
+    ok(f && fseek(f, -8, SEEK_END) == 0 && fread(magic, 1, 8, f) == 8 &&
+       memcmp(magic, CK_RDB_INDEX_MAGIC, 8) == 0, "index trailer");
+    if (f) fclose(f);
+
+    int threads[] = { 1, 4 };
+    for (int t = 0; t < 2; t++) {
+        persistence_set_load_threads(threads[t]);
+        s = store_create();
+        ok(persistence_load(s, path) == 0, "chunked load");
+        ok(store_dbsize(s) == total, "chunked dbsize");
+        const char *v = store_get(s, "key:49999");
+        snprintf(val, sizeof(val), "value-%d-%060d", 49999, 49999);
+        ok(v && strcmp(v, val) == 0, "chunked value");
+        store_entry_t *e = store_get_entry(s, "hash:0");
+        ok(store_llen(s, "list:199") == 20 && e && ht_count(e->hash) == 20,
+           "chunked list/hash");
+        ok(store_ttl(s, "key:7") > 50, "chunked ttl");
+        store_destroy(s);
+    }
+
+    /* flip a byte in the middle: only that chunk is lost */
+    f = fopen(path, "r+b");
+    fseek(f, size / 2, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, size / 2, SEEK_SET);
+    fputc(c ^ 0xff, f);
+    fclose(f);
+    s = store_create();
+    ok(persistence_load(s, path) == 0, "damaged load");
+    ok(store_dbsize(s) < total && store_dbsize(s) > total / 2, "damaged chunk dropped");
+    store_destroy(s);
+    f = fopen(path, "r+b");
+    fseek(f, size / 2, SEEK_SET);
+    fputc(c, f);
+
+    /* without the index the chunks are found by following their frames */
+    fseek(f, -8, SEEK_END);
+    fputc('X', f);
+    fclose(f);
+    s = store_create();
+    ok(persistence_load(s, path) == 0 && store_dbsize(s) == total, "load without index");
+    store_destroy(s);
+
+    /* embedded: the stream is left right after the snapshot */
+    f = fopen(path, "ab");
+    fputs("tail", f);
+    fclose(f);
+    f = fopen(path, "rb");
+    s = store_create();
+    ok(persistence_read(s, f) == (int)total, "stream read");
+    char tail[8] = { 0 };
+    ok(fread(tail, 1, 8, f) == 4 && strcmp(tail, "tail") == 0, "stream position");
+    fclose(f);
+    store_destroy(s);
+
+    persistence_set_load_threads(0);
+    remove(path);
+}
+
+/* large values stay in the mapped file until they're dropped */
+static void test_mapped(void) {
+    const char *path = "build/test_mapped.ckdb";
+    size_t len = CK_RDB_MAP_MIN_VALUE + 100;
+    char *big = malloc(len + 1);
+    store_t *s = store_create();
+    char key[32];
+    for (int i = 0; i < 40; i++) {
+        memset(big, 'a' + i % 26, len);
+        big[len] = '\0';
+        snprintf(key, sizeof(key), "big:%d", i);
+        store_set(s, key, big);
+    }
+    store_set(s, "small", "x");
+    ok(persistence_save(s, path) == 0, "mapped save");
+    store_destroy(s);
+
+    s = store_create();
+    ok(persistence_load(s, path) == 0, "mapped load");
+    int mapped = 0, intact = 1;
+    for (int i = 0; i < 40; i++) {
+        snprintf(key, sizeof(key), "big:%d", i);
+        store_entry_t *e = store_get_entry(s, key);
+        if (e && e->str_mapped) mapped++;
+        memset(big, 'a' + i % 26, len);
+        if (!e || strlen(e->str) != len || memcmp(e->str, big, len) != 0) intact = 0;
+    }
+    ok(mapped > 30, "large values mapped");
+    ok(intact, "mapped values terminated in place");
+    ok(fmap_mapped_bytes() > 0, "mapping kept");
+    ok(store_memory_usage(s, "big:0", 0) > len, "mapped memory usage");
+
+    /* overwriting or deleting drops the reference */
+    store_set(s, "big:0", "new");
+    store_del(s, "big:1");
+    ok(strcmp(store_get(s, "big:0"), "new") == 0, "mapped value replaced");
+    store_destroy(s);
+    ok(fmap_mapped_bytes() == 0, "mapping released");
+    free(big);
+    remove(path);
+}
+
+/* compressed chunks: smaller file, same data through the mapped and the
+ * stream reader, and a damaged chunk is still caught */
+static void test_compression(void) {
+    const char *path = "build/test_lz.ckdb";
+    store_t *s = store_create();
+    char key[32], val[256];
+    for (int i = 0; i < 30000; i++) {
+        snprintf(key, sizeof(key), "doc:%d", i);
+        snprintf(val, sizeof(val), "{\"id\":%d,\"type\":\"user\",\"tags\":[\"a\",\"b\"],"
+                 "\"profile\":{\"active\":true,\"plan\":\"free\"}}", i);
+        store_set(s, key, val);
+    }
+    size_t total = store_dbsize(s);
+    ok(persistence_save(s, path) == 0, "uncompressed save");
+    long plain = file_size(path);
+    persistence_set_compression(1);
+    ok(persistence_save(s, path) == 0, "compressed save");
+    persistence_set_compression(0);
+    long packed = file_size(path);
+    store_destroy(s);
+    ok(packed > 0 && packed < plain / 3, "compressed file smaller");
+
+    s = store_create();
+    ok(persistence_load(s, path) == 0 && store_dbsize(s) == total, "compressed load");
+    const char *v = store_get(s, "doc:29999");
+    ok(v && strstr(v, "\"id\":29999,") != NULL, "compressed value");
+    store_destroy(s);
+
+    FILE *f = fopen(path, "rb");
+    s = store_create();
+    ok(f && persistence_read(s, f) == (int)total, "compressed stream read");
+    if (f) fclose(f);
+    store_destroy(s);
+
+    f = fopen(path, "r+b");
+    fseek(f, packed / 2, SEEK_SET);
+    int c = fgetc(f);
+    fseek(f, packed / 2, SEEK_SET);
+    fputc(c ^ 0xff, f);
+    fclose(f);
+    s = store_create();
+    ok(persistence_load(s, path) == 0 && store_dbsize(s) < total && store_dbsize(s) > 0,
+       "damaged compressed chunk dropped");
+    store_destroy(s);
+    remove(path);
+}
+
+/* version 3 files (chunks, no compression) still load */
+static void test_format_v3(void) {
+    const char *path = "build/test_v3.ckdb";
+    static const unsigned char entries[] = {
+        CK_RDB_TYPE_STRING, 1, 's', 5, 'h', 'e', 'l', 'l', 'o',
+        CK_RDB_TYPE_INT, 1, 'i', 3,
+    };
+    uint32_t crc = ck_crc32c(0, entries, sizeof(entries));
+    unsigned char crc_le[4] = { (unsigned char)crc, (unsigned char)(crc >> 8),
+                                (unsigned char)(crc >> 16), (unsigned char)(crc >> 24) };
+    static const unsigned char header[] = {
+        'C', 'A', 'C', 'H', 'E', 'K', 'I', 'T', 3, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 2, 0,
+        CK_RDB_OPCODE_CHUNK, 2, sizeof(entries),
+    };
+    /* entries after the 22 byte header and 7 byte frame, index after EOF */
+    unsigned char index[] = { 1, 29, sizeof(entries), 2 };
+    unsigned char trailer[8] = { 29 + sizeof(entries) + 1 };
+
+    FILE *f = fopen(path, "wb");
+    fwrite(header, 1, sizeof(header), f);
+    fwrite(crc_le, 1, 4, f);
+    fwrite(entries, 1, sizeof(entries), f);
+    fputc(CK_RDB_EOF, f);
+    fwrite(index, 1, sizeof(index), f);
+    fwrite(crc_le, 1, 4, f);
+    fwrite(trailer, 1, 8, f);
+    fwrite(CK_RDB_INDEX_MAGIC, 1, 8, f);
+    fclose(f);
+
+    store_t *s = store_create();
+    ok(persistence_load(s, path) == 0, "v3 load");
+    const char *v = store_get(s, "s");
+    int64_t n;
+    ok(v && strcmp(v, "hello") == 0 && store_get_int(s, "i", &n) == 0 && n == -2,
+       "v3 values");
+    store_destroy(s);
+    remove(path);
+}
+
+/* version 2 files (no chunks) still load */
+static void test_format_v2(void) {
+    const char *path = "build/test_v2.ckdb";
+    static const unsigned char v2[] = {
+        'C', 'A', 'C', 'H', 'E', 'K', 'I', 'T', 2, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0,             /* saved_at */
+        2, 0,                               /* keys, encodings */
+        CK_RDB_TYPE_STRING, 1, 's', 5, 'h', 'e', 'l', 'l', 'o',
+        CK_RDB_TYPE_INT, 1, 'i', 3,         /* zigzag(-2) */
+        CK_RDB_EOF
+    };
+    FILE *f = fopen(path, "wb");
+    fwrite(v2, 1, sizeof(v2), f);
+    fclose(f);
+
+    store_t *s = store_create();
+    ok(persistence_load(s, path) == 0, "v2 load");
+    const char *v = store_get(s, "s");
+    ok(v && strcmp(v, "hello") == 0, "v2 string");
+    int64_t n;
+    ok(store_get_int(s, "i", &n) == 0 && n == -2, "v2 int");
+    store_destroy(s);
+    remove(path);
+}
+
+/* version 1 files written before the format change still load */
+static void test_format_v1(void) {
+    const char *path = "build/test_v1.ckdb";
+    FILE *f = fopen(path, "wb");
+    uint32_t version = 1, len;
+    uint64_t ts = 0;
+    int64_t ttl = 0, ival = 42;
+    fwrite(CK_RDB_MAGIC, 1, 8, f);
+    fwrite(&version, 4, 1, f);
+    fwrite(&ts, 8, 1, f);
+    fputc(CK_RDB_TYPE_STRING, f);
+    len = 1; fwrite(&len, 4, 1, f); fwrite("s", 1, 1, f);
+    len = 5; fwrite(&len, 4, 1, f); fwrite("hello", 1, 5, f);
+    fwrite(&ttl, 8, 1, f);
+    fputc(CK_RDB_TYPE_INT, f);
+    len = 1; fwrite(&len, 4, 1, f); fwrite("i", 1, 1, f);
+    fwrite(&ival, 8, 1, f);
+    fwrite(&ttl, 8, 1, f);
+    fputc(CK_RDB_EOF, f);
+    fclose(f);
+
+    store_t *s = store_create();
+    ok(persistence_load(s, path) == 0, "v1 load");
+    const char *v = store_get(s, "s");
+    ok(v && strcmp(v, "hello") == 0, "v1 string");
+    int64_t n;
+    ok(store_get_int(s, "i", &n) == 0 && n == 42, "v1 int");
+    store_destroy(s);
+    remove(path);
+}
+
 int test_persistence_run(void) {
     n_fail = 0;
     const char *path = "build/test_save.ckdb";
@@ -40,5 +1046,22 @@ int test_persistence_run(void) {
     store_destroy(s);
 
     remove(path);
+
+    test_format();
+    test_chunks();
+    test_mapped();
+    test_compression();
+    test_format_v3();
+    test_format_v2();
+    test_format_v1();
+    test_bgsave();
+    test_save_points();
+    test_delta();
+    test_delta_stale();
+    test_thread_bgsave();
+    test_resize_guard();
+    test_aof();
+    test_aof_rewrite();
+    test_aof_removed();
     return n_fail;
 }
@@ -0,0 +1,552 @@
+#include "replication.h"
+#include "persistence.h"
+#include "child.h"
+#include "store.h"
+#include "util.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static int n_fail;
+
+static void ok(int cond, const char *msg) {
+    if (!cond) {
+        fprintf(stderr, "FAIL: %s\n", msg);
+        n_fail++;
+    }
+}
+
+/* run a command and return its reply (ck_malloc'd) */
+static char *run(command_ctx_t *ctx, int argc, const char **argv) {
+    resp_buf_t req, reply;
+    resp_buf_init(&req);
+    resp_buf_init(&reply);
+    resp_write_array_header(&req, argc);
+    for (int i = 0; i < argc; i++) {
+        resp_write_bulk_string(&req, argv[i], strlen(argv[i]));
+    }
+
+    resp_parser_t p;
+    resp_parser_init(&p);
+    resp_parser_feed(&p, req.buf, req.len);
+    resp_value_t *cmd;
+    if (resp_parse(&p, &cmd) == 1) {
+        command_dispatch(ctx, cmd, &reply);
+        resp_value_free(cmd);
+    }
+    resp_parser_destroy(&p);
+    resp_buf_destroy(&req);
+    char *out = ck_strndup(reply.buf, reply.len);
+    resp_buf_destroy(&reply);
+    return out;
+}
+
+#define RUN(ctx, ...) do { \
+    const char *argv_[] = { __VA_ARGS__ }; \
+    ck_free(run(ctx, (int)(sizeof(argv_) / sizeof(argv_[0])), argv_)); \
+} while (0)
+
+/* one turn of the event loop, as far as replication is concerned */
+static void pump(command_ctx_t *ctx) {
+    child_result_t res;
+    if (child_poll(&res) && res.type == CK_CHILD_RDB) {
+        persistence_bgsave_done(res.ok, res.cow_bytes, res.duration_ms);
+    }
+    persistence_cron(ctx->store, ctx->rdb_filename);
+    repl_cron();
+
+    fd_set rd, wr;
+    FD_ZERO(&rd);
+    FD_ZERO(&wr);
+    int max_fd = repl_fdset(&rd, &wr, -1);
+    struct timeval tv = { 0, 5000 };
+    if (max_fd >= 0 && select(max_fd + 1, &rd, &wr, NULL, &tv) > 0) {
+        repl_handle(&rd, &wr);
+    }
+}
+
+/* everything the other end has sent so far */
+static void drain(int fd, resp_buf_t *into) {
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+        resp_buf_append(into, buf, (size_t)n);
+    }
+}
+
+static void send_all(int fd, const char *p, size_t n) {
+    while (n > 0) {
+        ssize_t w = send(fd, p, n, 0);
+        if (w <= 0) return;
+        p += w;
+        n -= (size_t)w;
+    }
+}
+
+/* needle in the first n bytes of p, which may hold NULs */
+static const char *find(const char *p, size_t n, const char *needle) {
+    size_t k = strlen(needle);
+    for (size_t i = 0; i + k <= n; i++) {
+        if (memcmp(p + i, needle, k) == 0) return p + i;
+    }
+    return NULL;
+}
+
+static void psync(int fd, const char *id, const char *offset) {
+    resp_buf_t req;
+    resp_buf_init(&req);
+    resp_write_array_header(&req, 3);
+    resp_write_bulk_string(&req, "PSYNC", 5);
+    resp_write_bulk_string(&req, id, strlen(id));
+    resp_write_bulk_string(&req, offset, strlen(offset));
+    resp_parser_t p;
+    resp_parser_init(&p);
+    resp_parser_feed(&p, req.buf, req.len);
+    resp_value_t *cmd;
+    if (resp_parse(&p, &cmd) == 1) {
+        ok(repl_takes_over(cmd), "PSYNC takes the connection over");
+        repl_attach_replica(fd, cmd);
+        resp_value_free(cmd);
+    }
+    resp_parser_destroy(&p);
+    resp_buf_destroy(&req);
+}
+
+/* a replica gets a snapshot and then the writes made during and after
+ * it; one that comes back with an offset the backlog still has gets only
+ * what it missed */
+static void test_primary(void) {
+    const char *path = "build/test_repl_primary.ckdb";
+    const char *copy = "build/test_repl_copy.ckdb";
+    remove(path);
+    store_t *s = store_create();
+    command_ctx_t ctx = { .store = s, .rdb_filename = path };
+    repl_init(&ctx);
+    repl_set_diskless(0);
+    persistence_set_bgsave_method(CK_RDB_BGSAVE_THREAD);
+
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        store_set(s, key, "before");
+    }
+
+    int sv[2];
+    ok(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair");
+    psync(sv[0], "?", "-1");
+    ok(repl_offset() == 0, "offset 0 before any write");
+    ok(repl_memory() > repl_backlog_size(), "backlog and replica counted as replication memory");
+    RUN(&ctx, "SET", "during", "sync");
+    RUN(&ctx, "EXPIRE", "key:1", "100");
+
+    resp_buf_t got;
+    resp_buf_init(&got);
+    char id[CK_REPL_ID_LEN + 1] = "";
+    unsigned long long at = 1;
+    long long size = -1;
+    const char *body = NULL;
+    for (int i = 0; i < 2000; i++) {
+        pump(&ctx);
+        drain(sv[1], &got);
+        resp_buf_append(&got, "", 1);
+        got.len--;
+        /* newlines keep the link alive until the snapshot is ready */
+        char *dollar = strchr(got.buf, '$');
+        if (dollar && sscanf(got.buf, "+FULLRESYNC %40s %llu", id, &at) == 2 &&
+            sscanf(dollar + 1, "%lld", &size) == 1 && strstr(dollar, "\r\n")) {
+            body = strstr(dollar, "\r\n") + 2;
+            size_t sent = (size_t)(body - got.buf) + (size_t)size;
+            if (sent <= got.len && got.len - sent == repl_offset() && repl_offset() > 0) break;
+        }
+    }
+    ok(strcmp(id, repl_id()) == 0 && at == 0, "full resync from offset 0");
+    ok(size > 0 && body != NULL, "snapshot sent");
+
+    if (size > 0 && body) {
+        FILE *f = fopen(copy, "wb");
+        fwrite(body, 1, (size_t)size, f);
+        fclose(f);
+        store_t *r = store_create();
+        ok(persistence_load(r, copy) == 0, "snapshot loads");
+        ok(store_dbsize(r) == 1000, "snapshot has the dataset");
+        store_destroy(r);
+        remove(copy);
+
+        const char *stream = body + size;
+        ok(strstr(stream, "during") != NULL, "write during the sync streamed");
+        ok(strstr(stream, "PEXPIREAT") != NULL, "expiry streamed as absolute");
+        ok(repl_offset() == (uint64_t)(got.buf + got.len - stream), "offset counts the stream");
+    }
+
+    /* the replica goes away and comes back */
+    close(sv[1]);
+    for (int i = 0; i < 10; i++) pump(&ctx);
+    uint64_t seen = repl_offset();
+    RUN(&ctx, "SET", "missed", "1");
+    RUN(&ctx, "GET", "missed");
+    RUN(&ctx, "DEL", "key:2");
+    ok(repl_offset() > seen, "writes advance the offset");
+
+    char offset[24];
+    snprintf(offset, sizeof(offset), "%llu", (unsigned long long)seen);
+    ok(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair again");
+    psync(sv[0], repl_id(), offset);
+    got.len = 0;
+    for (int i = 0; i < 50 && got.len < 60; i++) {
+        pump(&ctx);
+        drain(sv[1], &got);
+    }
+    resp_buf_append(&got, "", 1);
+    char expect[64];
+    snprintf(expect, sizeof(expect), "+CONTINUE %s\r\n", repl_id());
+    ok(strncmp(got.buf, expect, strlen(expect)) == 0, "partial resync");
+    ok(strstr(got.buf, "missed") && strstr(got.buf, "key:2") && !strstr(got.buf, "during"),
+       "only what was missed is resent");
+    ok(!strstr(got.buf, "GET"), "reads aren't streamed");
+    close(sv[1]);
+
+    /* an ID from another history, or an offset the backlog no longer has,
+     * means a full resync */
+    ok(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair third");
+    psync(sv[0], "0000000000000000000000000000000000000000", offset);
+    got.len = 0;
+    for (int i = 0; i < 2000 && !memchr(got.buf, '$', got.len); i++) {
+        pump(&ctx);
+        drain(sv[1], &got);
+    }
+    ok(got.len > 12 && strncmp(got.buf, "+FULLRESYNC ", 12) == 0, "unknown ID gets a full resync");
+    close(sv[1]);
+    for (int i = 0; i < 2000 && persistence_bgsave_in_progress(); i++) pump(&ctx);
+
+    resp_buf_destroy(&got);
+    repl_stop();
+    ok(repl_memory() == 0, "replication memory all given back");
+    repl_set_diskless(1);
+    persistence_set_bgsave_method(CK_RDB_BGSAVE_FORK);
+    store_destroy(s);
+    remove(path);
+}
+
+/* diskless: replicas that ask within the delay share one snapshot, sent
+ * between $EOF:<mark> and the mark without touching the file */
+static void test_primary_diskless(ck_rdb_bgsave_method_t method) {
+    const char *path = "build/test_repl_diskless.ckdb";
+    remove(path);
+    store_t *s = store_create();
+    command_ctx_t ctx = { .store = s, .rdb_filename = path };
+    repl_init(&ctx);
+    persistence_set_bgsave_method(method);
+    repl_set_diskless_delay(60);
+
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        store_set(s, key, "before");
+    }
+
+    int a[2], b[2];
+    ok(socketpair(AF_UNIX, SOCK_STREAM, 0, a) == 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, b) == 0,
+       "socketpairs");
+    psync(a[0], "?", "-1");
+    pump(&ctx);
+    ok(!persistence_bgsave_in_progress(), "the delay holds the snapshot back");
+    psync(b[0], "?", "-1");
+    repl_set_diskless_delay(0);
+    pump(&ctx);
+    ok(persistence_bgsave_in_progress(), "then one starts");
+    RUN(&ctx, "SET", "during", "sync");
+
+    resp_buf_t got[2];
+    const char *body[2] = { NULL, NULL };
+    const char *end[2] = { NULL, NULL };
+    char mark[CK_REPL_ID_LEN + 1] = "";
+    for (int k = 0; k < 2; k++) resp_buf_init(&got[k]);
+    for (int i = 0; i < 4000 && !(end[0] && end[1]); i++) {
+        pump(&ctx);
+        for (int k = 0; k < 2; k++) {
+            drain(k ? b[1] : a[1], &got[k]);
+            resp_buf_append(&got[k], "", 1);
+            got[k].len--;
+            const char *eof = strstr(got[k].buf, "$EOF:");
+            if (!eof || end[k] || !strstr(eof, "\r\n")) continue;
+            memcpy(mark, eof + 5, CK_REPL_ID_LEN);
+            mark[CK_REPL_ID_LEN] = '\0';
+            body[k] = strstr(eof, "\r\n") + 2;
+            /* the mark may only be all there once the stream is behind it */
+            const char *m = find(body[k], got[k].len - (size_t)(body[k] - got[k].buf), mark);
+            if (m && strstr(m, "during")) end[k] = m;
+        }
+    }
+    ok(end[0] && end[1], "both replicas got the snapshot and the mark");
+    ok(strncmp(got[0].buf, "+FULLRESYNC ", 12) == 0, "full resync");
+
+    if (end[0] && end[1]) {
+        size_t len = (size_t)(end[0] - body[0]);
+        ok(len == (size_t)(end[1] - body[1]) && memcmp(body[0], body[1], len) == 0,
+           "one snapshot shared");
+        store_t *r = store_create();
+        persistence_stream_t *st = persistence_stream_begin(r);
+        int done = 0;
+        ok(persistence_stream_feed(st, body[0], len, &done) == (int64_t)len && done,
+           "snapshot streams in");
+        ok(persistence_stream_end(st) == 1000 && store_dbsize(r) == 1000,
+           "snapshot has the dataset");
+        store_destroy(r);
+        ok(strstr(end[0] + CK_REPL_ID_LEN, "during") != NULL, "write during the sync streamed");
+    }
+    FILE *f = fopen(path, "rb");
+    ok(f == NULL, "no snapshot file written");
+    if (f) fclose(f);
+
+    for (int i = 0; i < 4000 && persistence_bgsave_in_progress(); i++) pump(&ctx);
+    for (int k = 0; k < 2; k++) resp_buf_destroy(&got[k]);
+    close(a[1]);
+    close(b[1]);
+    repl_stop();
+    ok(repl_memory() == 0, "diskless replicas' memory given back");
+    repl_set_diskless_delay(CK_REPL_DEFAULT_DISKLESS_DELAY);
+    persistence_set_bgsave_method(CK_RDB_BGSAVE_FORK);
+    store_destroy(s);
+    remove(path);
+}
+
+/* the replica side against a scripted primary: handshake, snapshot,
+ * stream, then read-only until REPLICAOF NO ONE */
+static void test_replica(void) {
+    const char *path = "build/test_repl_replica.ckdb";
+    const char *snap = "build/test_repl_snap.ckdb";
+    remove(path);
+
+    store_t *src = store_create();
+    store_set(src, "from", "primary");
+    store_set_int(src, "n", 41);
+    ok(persistence_save(src, snap) == 0, "primary snapshot");
+    store_destroy(src);
+    FILE *f = fopen(snap, "rb");
+    char snapshot[4096];
+    size_t snap_len = f ? fread(snapshot, 1, sizeof(snapshot), f) : 0;
+    if (f) fclose(f);
+    remove(snap);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    ok(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(lfd, 1) == 0 &&
+       getsockname(lfd, (struct sockaddr *)&addr, &alen) == 0, "fake primary listening");
+
+    store_t *s = store_create();
+    store_set(s, "stale", "x");
+    command_ctx_t ctx = { .store = s, .rdb_filename = path };
+    repl_init(&ctx);
+    char port[16];
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+    char *reply = run(&ctx, 3, (const char *[]){ "REPLICAOF", "127.0.0.1", port });
+    ok(strcmp(reply, "+OK\r\n") == 0, "REPLICAOF");
+    ck_free(reply);
+    ok(repl_is_replica(), "is a replica");
+
+    pump(&ctx);
+    int fd = accept(lfd, NULL, NULL);
+    ok(fd >= 0, "replica connected");
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    resp_buf_t got;
+    resp_buf_init(&got);
+    for (int i = 0; i < 200; i++) {
+        pump(&ctx);
+        drain(fd, &got);
+        resp_buf_append(&got, "", 1);
+        got.len--;
+        if (strstr(got.buf, "PSYNC")) break;
+    }
+    ok(strstr(got.buf, "PING") && strstr(got.buf, "listening-port"), "handshake");
+    ok(strstr(got.buf, "$1\r\n?\r\n$2\r\n-1\r\n") != NULL, "asks for a full sync");
+
+    const char *id = "0123456789abcdef0123456789abcdef01234567";
+    char head[128];
+    int n = snprintf(head, sizeof(head), "+PONG\r\n+OK\r\n+FULLRESYNC %s 100\r\n\n\n$%zu\r\n",
+                     id, snap_len);
+    const char *stream = "*3\r\n$3\r\nSET\r\n$5\r\nafter\r\n$4\r\nsync\r\n"
+                         "*2\r\n$4\r\nINCR\r\n$1\r\nn\r\n";
+    send_all(fd, head, (size_t)n);
+    send_all(fd, snapshot, snap_len);
+    send_all(fd, stream, strlen(stream));
+    for (int i = 0; i < 200 && !store_get(s, "after"); i++) pump(&ctx);
+
+    ok(store_get(s, "stale") == NULL, "old dataset replaced");
+    const char *v = store_get(s, "from");
+    ok(v && strcmp(v, "primary") == 0, "snapshot loaded");
+    v = store_get(s, "after");
+    ok(v && strcmp(v, "sync") == 0, "stream applied");
+    int64_t num;
+    ok(store_get_int(s, "n", &num) == 0 && num == 42, "stream applied in order");
+    ok(repl_offset() == 100 + strlen(stream), "offset follows the stream");
+    f = fopen(path, "rb");
+    ok(f != NULL, "snapshot kept as our own");
+    if (f) fclose(f);
+
+    reply = run(&ctx, 3, (const char *[]){ "SET", "mine", "x" });
+    ok(strncmp(reply, "-READONLY", 9) == 0, "client writes refused");
+    ck_free(reply);
+    reply = run(&ctx, 2, (const char *[]){ "GET", "from" });
+    ok(strcmp(reply, "$7\r\nprimary\r\n") == 0, "reads served");
+    ck_free(reply);
+
+    got.len = 0;
+    for (int i = 0; i < 50 && !strstr(got.buf, "ACK"); i++) {
+        pump(&ctx);
+        drain(fd, &got);
+        resp_buf_append(&got, "", 1);
+        got.len--;
+    }
+    ok(strstr(got.buf, "ACK") != NULL, "offset acknowledged");
+
+    reply = run(&ctx, 3, (const char *[]){ "REPLICAOF", "NO", "ONE" });
+    ok(strcmp(reply, "+OK\r\n") == 0 && !repl_is_replica(), "REPLICAOF NO ONE");
+    ck_free(reply);
+    ok(strcmp(repl_id(), id) != 0, "new history after promotion");
+    RUN(&ctx, "SET", "mine", "x");
+    ok(store_get(s, "mine") != NULL, "writable after promotion");
+
+    resp_buf_destroy(&got);
+    close(fd);
+    close(lfd);
+    repl_stop();
+    store_destroy(s);
+    remove(path);
+}
+
+/* a diskless snapshot is loaded as it arrives; clients get -LOADING
+ * until all of it is in */
+static void test_replica_diskless(void) {
+    const char *path = "build/test_repl_dlreplica.ckdb";
+    const char *snap = "build/test_repl_dlsnap.ckdb";
+    remove(path);
+
+    store_t *src = store_create();
+    char key[32];
+    for (int i = 0; i < 500; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        store_set(src, key, "from the primary");
+    }
+    ok(persistence_save(src, snap) == 0, "primary snapshot");
+    store_destroy(src);
+    FILE *f = fopen(snap, "rb");
+    static char snapshot[65536];
+    size_t snap_len = f ? fread(snapshot, 1, sizeof(snapshot), f) : 0;
+    if (f) fclose(f);
+    remove(snap);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t alen = sizeof(addr);
+    ok(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0 && listen(lfd, 1) == 0 &&
+       getsockname(lfd, (struct sockaddr *)&addr, &alen) == 0, "fake primary listening");
+
+    store_t *s = store_create();
+    store_set(s, "stale", "x");
+    command_ctx_t ctx = { .store = s, .rdb_filename = path };
+    repl_init(&ctx);
+    char port[16];
+    snprintf(port, sizeof(port), "%d", ntohs(addr.sin_port));
+    RUN(&ctx, "REPLICAOF", "127.0.0.1", port);
+    pump(&ctx);
+    int fd = accept(lfd, NULL, NULL);
+    ok(fd >= 0, "replica connected");
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    resp_buf_t got;
+    resp_buf_init(&got);
+    for (int i = 0; i < 200 && !find(got.buf, got.len, "PSYNC"); i++) {
+        pump(&ctx);
+        drain(fd, &got);
+    }
+
+    const char *id = "0123456789abcdef0123456789abcdef01234567";
+    const char *mark = "fedcba9876543210fedcba9876543210fedcba98";
+    char head[160];
+    int n = snprintf(head, sizeof(head), "+PONG\r\n+OK\r\n+FULLRESYNC %s 7\r\n$EOF:%s\r\n",
+                     id, mark);
+    send_all(fd, head, (size_t)n);
+    send_all(fd, snapshot, snap_len / 2);
+    for (int i = 0; i < 50 && !repl_loading(); i++) pump(&ctx);
+    ok(repl_loading(), "loading");
+    ok(store_get(s, "stale") == NULL, "old dataset dropped");
+    char *reply = run(&ctx, 2, (const char *[]){ "GET", "key:1" });
+    ok(strncmp(reply, "-LOADING", 8) == 0, "reads refused while loading");
+    ck_free(reply);
+    reply = run(&ctx, 1, (const char *[]){ "PING" });
+    ok(strcmp(reply, "+PONG\r\n") == 0, "PING served while loading");
+    ck_free(reply);
+
+    const char *stream = "*3\r\n$3\r\nSET\r\n$5\r\nafter\r\n$4\r\nsync\r\n";
+    send_all(fd, snapshot + snap_len / 2, snap_len - snap_len / 2);
+    send_all(fd, mark, strlen(mark));
+    send_all(fd, stream, strlen(stream));
+    for (int i = 0; i < 200 && !store_get(s, "after"); i++) pump(&ctx);
+
+    ok(!repl_loading(), "loaded");
+    ok(store_dbsize(s) == 501, "snapshot and stream applied");
+    const char *v = store_get(s, "key:499");
+    ok(v && strcmp(v, "from the primary") == 0, "snapshot loaded");
+    ok(repl_offset() == 7 + strlen(stream), "offset follows the stream");
+    f = fopen(path, "rb");
+    ok(f == NULL, "nothing written to disk");
+    if (f) fclose(f);
+
+    /* a link lost mid-load leaves no partial dataset behind */
+    RUN(&ctx, "REPLICAOF", "NO", "ONE");
+    close(fd);
+    got.len = 0;
+    RUN(&ctx, "REPLICAOF", "127.0.0.1", port);
+    pump(&ctx);
+    fd = accept(lfd, NULL, NULL);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    for (int i = 0; i < 200 && !find(got.buf, got.len, "PSYNC"); i++) {
+        pump(&ctx);
+        drain(fd, &got);
+    }
+    send_all(fd, head, (size_t)n);
+    send_all(fd, snapshot, snap_len - 1);
+    for (int i = 0; i < 50 && !repl_loading(); i++) pump(&ctx);
+    close(fd);
+    for (int i = 0; i < 50 && repl_loading(); i++) pump(&ctx);
+    ok(!repl_loading() && store_dbsize(s) == 0, "partial load dropped");
+
+    resp_buf_destroy(&got);
+    close(lfd);
+    repl_stop();
+    store_destroy(s);
+    remove(path);
+}
+
+int test_replication_run(void) {
+    n_fail = 0;
+    test_primary();
+    test_primary_diskless(CK_RDB_BGSAVE_FORK);
+    test_primary_diskless(CK_RDB_BGSAVE_THREAD);
+    test_replica();
+    test_replica_diskless();
+    return n_fail;
+}
+
+#else
+
+int test_replication_run(void) {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,68 @@
+#include "ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int n_fail;
+
+static void ok(int cond, const char *msg) {
+    if (!cond) {
+        fprintf(stderr, "FAIL: %s\n", msg);
+        n_fail++;
+    }
+}
+
+int test_ring_run(void) {
+    n_fail = 0;
+    const char *nodes[] = { "10.0.0.1:6380", "10.0.0.2:6380", "10.0.0.3:6380", "10.0.0.4:6380" };
+    int n_keys = 40000;
+    char key[32];
+
+    /* keys spread evenly over three nodes */
+    ring_t *three = ring_create(nodes, 3, CK_RING_DEFAULT_VNODES);
+    int count[3] = { 0 };
+    int *before = malloc(sizeof(int) * (size_t)n_keys);
+    for (int i = 0; i < n_keys; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        before[i] = ring_lookup(three, key);
+        if (before[i] >= 0 && before[i] < 3) count[before[i]]++;
+    }
+    for (int b = 0; b < 3; b++) {
+        ok(count[b] > n_keys / 3 * 8 / 10 && count[b] < n_keys / 3 * 12 / 10,
+           "within 20% of an even share");
+    }
+
+    /* a fourth node takes about a quarter, and only from the others */
+    ring_t *four = ring_create(nodes, 4, CK_RING_DEFAULT_VNODES);
+    int moved = 0, stray = 0;
+    for (int i = 0; i < n_keys; i++) {
+        snprintf(key, sizeof(key), "key:%d", i);
+        int now = ring_lookup(four, key);
+        if (now != before[i]) {
+            moved++;
+            stray += now != 3;
+        }
+    }
+    ok(stray == 0, "keys only move to the new node");
+    ok(moved > n_keys / 5 && moved < n_keys * 3 / 10, "about 1/4 of the keys move");
+
+    /* the same ring on any proxy, and hash tags keep keys together */
+    ring_t *again = ring_create(nodes, 3, CK_RING_DEFAULT_VNODES);
+    ok(ring_lookup(again, "key:17") == before[17], "placement is deterministic");
+    ok(ring_lookup(three, "{user1000}.following") == ring_lookup(three, "{user1000}.followers") &&
+       ring_lookup(three, "{user1000}.following") == ring_lookup(three, "user1000"),
+       "hash tags share a node");
+
+    ring_t *one = ring_create(nodes, 1, 1);
+    ok(ring_lookup(one, "anything") == 0, "a single node owns everything");
+    ring_t *none = ring_create(nodes, 0, CK_RING_DEFAULT_VNODES);
+    ok(ring_lookup(none, "anything") == -1, "no nodes");
+
+    ring_destroy(three);
+    ring_destroy(four);
+    ring_destroy(again);
+    ring_destroy(one);
+    ring_destroy(none);
+    free(before);
+    return n_fail;
+}
@@ -5,15 +5,25 @@ extern int test_store_run(void);
 extern int test_protocol_run(void);
 extern int test_hashtable_run(void);
 extern int test_list_run(void);
+extern int test_lz_run(void);
 extern int test_persistence_run(void);
+extern int test_eviction_run(void);
+extern int test_replication_run(void);
+extern int test_cluster_run(void);
+extern int test_ring_run(void);
 
 int main(void) {
     int fail = 0;
     fail += test_hashtable_run();
     fail += test_list_run();
+    fail += test_lz_run();
     fail += test_store_run();
     fail += test_protocol_run();
     fail += test_persistence_run();
+    fail += test_eviction_run();
+    fail += test_replication_run();
+    fail += test_cluster_run();
+    fail += test_ring_run();
     if (fail > 0) {
         fprintf(stderr, "%d test(s) failed\n", fail);
         return 1;
@@ -1,4 +1,5 @@
 #include "store.h"
+#include "lazyfree.h"
 #include "util.h"
 #include <stdio.h>
 #include <string.h>
@@ -58,7 +59,89 @@ void test_store_list(void) {
     }
     char *p = store_lpop(s, "l");
     ok(p != NULL && strcmp(p, "b") == 0, "lpop");
-    free(p);
+    ck_free(p);
+    store_destroy(s);
+}
+
+void test_store_memory(void) {
+    store_t *s = store_create();
+    size_t base = ck_mem_used();
+
+    store_set(s, "k", "value");
+    ok(ck_mem_used() > base, "set grows used memory");
+    ok(store_memory_usage(s, "k", 0) > strlen("value"), "memory usage of key");
+    ok(store_memory_usage(s, "missing", 0) == 0, "memory usage of missing key");
+
+    char big[1024];
+    memset(big, 'x', sizeof(big) - 1);
+    big[sizeof(big) - 1] = '\0';
+    store_hset(s, "h", "f", "small");
+    size_t before = ck_mem_used();
+    store_hset(s, "h", "f", big);
+    ok(ck_mem_used() >= before + sizeof(big) - 64, "hset overwrite accounts new value");
+    store_hset(s, "h", "f", "small");
+    ok(ck_mem_used() == before, "hset overwrite releases old value");
+
+    int64_t out;
+    store_expire(s, "k", 100);
+    store_set(s, "k", "7");
+    store_expire(s, "k", 100);
+    ok(store_incr(s, "k", &out) == 0 && out == 8, "incr numeric string");
+    ok(store_ttl(s, "k") > 0, "incr keeps ttl");
+
+    store_del(s, "k");
+    store_del(s, "h");
+    /* the keyspace table may also shrink, so used can drop below base */
+    ok(ck_mem_used() <= base, "del releases key memory");
+    store_destroy(s);
+}
+
+void test_store_lazyfree(void) {
+    ok(lazyfree_start() == 0, "lazyfree start");
+    store_t *s = store_create();
+    size_t base = ck_mem_used();
+
+    for (int i = 0; i < CK_LAZYFREE_THRESHOLD * 4; i++) {
+        store_rpush(s, "big", "element");
+        store_rpush(s, "big2", "element");
+    }
+    store_rpush(s, "small", "element");
+    size_t freed = lazyfree_freed_objects();
+
+    ok(store_unlink(s, "small") == 1, "unlink small");
+    ok(store_unlink(s, "big") == 1, "unlink big");
+    ok(store_get_entry(s, "big") == NULL, "unlinked key is gone");
+    store_set(s, "big2", "overwritten");
+    lazyfree_wait();
+    ok(lazyfree_freed_objects() == freed + 2, "big values freed in background");
+    ok(lazyfree_pending_objects() == 0 && lazyfree_pending_memory() == 0, "nothing pending");
+
+    store_flushdb_async(s);
+    ok(store_dbsize(s) == 0, "flushdb async empties keyspace");
+    lazyfree_wait();
+    ok(ck_mem_used() <= base, "flushdb async releases memory");
+
+    store_destroy(s);
+    lazyfree_stop();
+}
+
+void test_store_stats(void) {
+    store_t *s = store_create();
+    store_set(s, "k", "v");
+    store_set(s, "gone", "v");
+    int64_t n;
+    store_incr(s, "counter", &n);
+    ok(s->keyspace_hits == 0 && s->keyspace_misses == 0, "writes are not lookups");
+
+    ok(store_get(s, "k") != NULL, "get k");
+    ok(store_exists(s, "k") == 1, "exists k");
+    ok(store_get(s, "missing") == NULL, "get missing");
+    ok(store_llen(s, "missing") == 0, "llen missing");
+    ok(s->keyspace_hits == 2 && s->keyspace_misses == 2, "hits and misses counted");
+
+    store_expire_at(s, "gone", 1);
+    ok(store_get_entry(s, "gone") == NULL, "expired key is gone");
+    ok(s->expired_keys == 1 && s->keyspace_misses == 3, "expired key counts as a miss");
     store_destroy(s);
 }
 
@@ -67,5 +150,8 @@ int test_store_run(void) {
     test_store_basic();
     test_store_int();
     test_store_list();
+    test_store_memory();
+    test_store_lazyfree();
+    test_store_stats();
     return n_fail;
 }